@@ -0,0 +1,192 @@
+//*****************************************************************************
+// Libdeskcap: A high-performance desktop capture library
+//
+// Copyright (C) 2014 Lucas Murray <lucas@polyflare.com>
+// All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation; either version 2 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//*****************************************************************************
+
+#ifndef COMMON_ATOMICOPS_H
+#define COMMON_ATOMICOPS_H
+
+#include "stlincludes.h"
+#ifdef OS_WIN
+#include <intrin.h>
+#endif
+
+//=============================================================================
+// Interprocess atomic operations
+//
+// We cannot use `std::atomic` or Boost's atomics for data that is placed in
+// shared memory as their size and alignment is not guaranteed to be the same
+// between 32- and 64-bit processes. Instead we operate on plain fixed-size
+// integers. Loads have acquire semantics, stores have release semantics and
+// all read-modify-write operations are full barriers.
+//
+// WARNING: The target address must be naturally aligned or the operations
+// will not be atomic!
+
+inline uint32_t atomicLoad32(volatile uint32_t *ptr)
+{
+#ifdef OS_WIN
+	// MSVC gives volatile reads acquire semantics
+	return *ptr;
+#else
+	return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+#endif
+}
+
+inline void atomicStore32(volatile uint32_t *ptr, uint32_t val)
+{
+#ifdef OS_WIN
+	// MSVC gives volatile writes release semantics
+	*ptr = val;
+#else
+	__atomic_store_n(ptr, val, __ATOMIC_RELEASE);
+#endif
+}
+
+/// <summary>
+/// Sets `*ptr` to `desired` only if it currently equals `expected`.
+/// </summary>
+/// <returns>True if the value was exchanged</returns>
+inline bool atomicCas32(
+	volatile uint32_t *ptr, uint32_t expected, uint32_t desired)
+{
+#ifdef OS_WIN
+	return (uint32_t)_InterlockedCompareExchange(
+		(volatile long *)ptr, (long)desired, (long)expected) == expected;
+#else
+	return __atomic_compare_exchange_n(
+		ptr, &expected, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+#endif
+}
+
+/// <returns>The value before the addition</returns>
+inline uint32_t atomicFetchAdd32(volatile uint32_t *ptr, uint32_t val)
+{
+#ifdef OS_WIN
+	return (uint32_t)_InterlockedExchangeAdd(
+		(volatile long *)ptr, (long)val);
+#else
+	return __atomic_fetch_add(ptr, val, __ATOMIC_SEQ_CST);
+#endif
+}
+
+/// <returns>The value before the operation</returns>
+inline uint32_t atomicFetchAnd32(volatile uint32_t *ptr, uint32_t val)
+{
+#ifdef OS_WIN
+	return (uint32_t)_InterlockedAnd((volatile long *)ptr, (long)val);
+#else
+	return __atomic_fetch_and(ptr, val, __ATOMIC_SEQ_CST);
+#endif
+}
+
+/// <returns>The value before the operation</returns>
+inline uint32_t atomicFetchOr32(volatile uint32_t *ptr, uint32_t val)
+{
+#ifdef OS_WIN
+	return (uint32_t)_InterlockedOr((volatile long *)ptr, (long)val);
+#else
+	return __atomic_fetch_or(ptr, val, __ATOMIC_SEQ_CST);
+#endif
+}
+
+inline uint64_t atomicLoad64(volatile uint64_t *ptr)
+{
+#if defined(OS_WIN) && defined(IS32)
+	// 64-bit reads are not atomic on 32-bit x86 so abuse a compare-exchange
+	// that never actually modifies the value
+	return (uint64_t)_InterlockedCompareExchange64(
+		(volatile __int64 *)ptr, 0, 0);
+#elif defined(OS_WIN)
+	return *ptr;
+#else
+	return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+#endif
+}
+
+/// <summary>
+/// Sets `*ptr` to `desired` only if it currently equals `expected`.
+/// </summary>
+/// <returns>True if the value was exchanged</returns>
+inline bool atomicCas64(
+	volatile uint64_t *ptr, uint64_t expected, uint64_t desired)
+{
+#ifdef OS_WIN
+	return (uint64_t)_InterlockedCompareExchange64(
+		(volatile __int64 *)ptr, (__int64)desired, (__int64)expected)
+		== expected;
+#else
+	return __atomic_compare_exchange_n(
+		ptr, &expected, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+#endif
+}
+
+inline void atomicStore64(volatile uint64_t *ptr, uint64_t val)
+{
+#if defined(OS_WIN) && defined(IS32)
+	uint64_t prev = atomicLoad64(ptr);
+	while(!atomicCas64(ptr, prev, val))
+		prev = atomicLoad64(ptr);
+#elif defined(OS_WIN)
+	*ptr = val;
+#else
+	__atomic_store_n(ptr, val, __ATOMIC_RELEASE);
+#endif
+}
+
+/// <returns>The value before the addition</returns>
+inline uint64_t atomicFetchAdd64(volatile uint64_t *ptr, uint64_t val)
+{
+#if defined(OS_WIN) && defined(IS32)
+	uint64_t prev = atomicLoad64(ptr);
+	while(!atomicCas64(ptr, prev, prev + val))
+		prev = atomicLoad64(ptr);
+	return prev;
+#elif defined(OS_WIN)
+	return (uint64_t)_InterlockedExchangeAdd64(
+		(volatile __int64 *)ptr, (__int64)val);
+#else
+	return __atomic_fetch_add(ptr, val, __ATOMIC_SEQ_CST);
+#endif
+}
+
+/// <summary>
+/// Full memory barrier. Prevents loads that follow the barrier from being
+/// reordered before stores that precede it which acquire and release
+/// semantics alone do not guarantee.
+/// </summary>
+inline void atomicFence()
+{
+#ifdef OS_WIN
+	_ReadWriteBarrier();
+	_mm_mfence();
+#else
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+#endif
+}
+
+/// <summary>
+/// Hints to the CPU that we are inside of a spin-wait loop.
+/// </summary>
+inline void cpuRelax()
+{
+#ifdef OS_WIN
+	_mm_pause();
+#elif defined(__i386__) || defined(__x86_64__)
+	__builtin_ia32_pause();
+#endif
+}
+
+#endif // COMMON_ATOMICOPS_H
@@ -0,0 +1,268 @@
+//*****************************************************************************
+// Libdeskcap: A high-performance desktop capture library
+//
+// Copyright (C) 2014 Lucas Murray <lucas@polyflare.com>
+// All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation; either version 2 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//*****************************************************************************
+
+#include "captureclock.h"
+#include "stlhelpers.h"
+
+// Calibration errors larger than this step the clock instead of slewing it
+const int64_t MAX_SLEW_ERROR_USEC = 100000; // 100 msec
+
+// Calibration errors are corrected over this duration
+const int64_t SLEW_USEC = 10000000; // 10 sec
+
+// Calibration points must be at least this far apart before the rate of the
+// external clock is measured
+const uint64_t MIN_RATE_SPAN_USEC = 1000000; // 1 sec
+
+/// <summary>
+/// Returns `val * ppb / 10^9` without overflowing for any time that fits in
+/// a 64-bit integer with a rate adjustment of up to `MAX_RATE_ADJ_PPB`.
+/// </summary>
+static int64_t scalePpb(int64_t val, int32_t ppb)
+{
+	int64_t secs = val / 1000000000LL;
+	int64_t rem = val % 1000000000LL;
+	return secs * (int64_t)ppb + rem * (int64_t)ppb / 1000000000LL;
+}
+
+/// <summary>
+/// Returns the capture time of the monotonic time `monoUsec` in the domain
+/// `state`. Times before capture time zero are clamped to zero.
+/// </summary>
+uint64_t CaptureClock::mapToClock(
+	const CaptureClockState &state, uint64_t monoUsec)
+{
+	int64_t delta = (int64_t)(monoUsec - state.monoAnchorUsec);
+	int64_t clock = (int64_t)state.clockAnchorUsec + delta +
+		scalePpb(delta, state.rateAdjPpb);
+	if(clock < 0)
+		return 0;
+	return (uint64_t)clock;
+}
+
+/// <summary>
+/// Returns the monotonic time of the capture time `clockUsec` in the domain
+/// `state`. This is the inverse of `mapToClock()` to within a few
+/// microseconds.
+/// </summary>
+uint64_t CaptureClock::mapToMonotonic(
+	const CaptureClockState &state, uint64_t clockUsec)
+{
+	int64_t delta = (int64_t)(clockUsec - state.clockAnchorUsec);
+	int64_t mono = (int64_t)state.monoAnchorUsec + delta -
+		scalePpb(delta, state.rateAdjPpb);
+	if(mono < 0)
+		return 0;
+	return (uint64_t)mono;
+}
+
+CaptureClock::CaptureClock(MainSharedSegment *shm)
+	: m_shm(shm)
+	, m_isCalibrated(false)
+	, m_calibMonoUsec(0)
+	, m_calibRefUsec(0)
+{
+}
+
+CaptureClock::~CaptureClock()
+{
+}
+
+/// <summary>
+/// Creates the capture clock domain with capture time zero at the current
+/// instant and makes us the process that calibrates it. If another main
+/// application already created a domain then its mapping is kept unmodified
+/// so that timestamps that are already in flight remain valid. We only take
+/// ownership of an existing domain if its owner has stopped refreshing it.
+/// </summary>
+/// <returns>True if the domain exists</returns>
+bool CaptureClock::createDomain()
+{
+	if(m_shm == NULL)
+		return false;
+	CaptureClockState state;
+	if(!m_shm->readCaptureClock(&state)) {
+		state.monoAnchorUsec = getMonotonicUsec();
+		state.clockAnchorUsec = 0;
+		state.rateAdjPpb = 0;
+		state.generation = 0;
+	}
+	m_shm->publishCaptureClock(state); // Fails if owned by another process
+	m_isCalibrated = false;
+	return hasDomain();
+}
+
+/// <summary>
+/// Keeps our ownership of the domain alive or takes over the domain if its
+/// owner has stopped refreshing it. The mapping itself is never modified.
+/// Must be called regularly, such as every video frame, by every process
+/// that created the domain.
+/// </summary>
+/// <returns>True if we own the domain</returns>
+bool CaptureClock::heartbeat()
+{
+	CaptureClockState state;
+	if(m_shm == NULL || !m_shm->readCaptureClock(&state))
+		return false;
+	uint64_t now = getMonotonicUsec();
+	if(state.procId == getProcessId()) {
+		// Only refresh a few times per staleness period
+		if(now < state.updatedUsec + CaptureClockState::STALE_USEC / 4)
+			return true;
+	} else {
+		if(now < state.updatedUsec + CaptureClockState::STALE_USEC)
+			return false; // Owner is still alive
+
+		// The new owner measures the external clock from scratch
+		m_isCalibrated = false;
+	}
+	return m_shm->publishCaptureClock(state);
+}
+
+bool CaptureClock::hasDomain()
+{
+	CaptureClockState state;
+	if(m_shm == NULL)
+		return false;
+	return m_shm->readCaptureClock(&state);
+}
+
+/// <summary>
+/// Returns the current capture time in microseconds.
+/// </summary>
+uint64_t CaptureClock::now()
+{
+	return fromMonotonic(getMonotonicUsec());
+}
+
+/// <summary>
+/// Converts a `getMonotonicUsec()` time of any process to capture time.
+/// </summary>
+uint64_t CaptureClock::fromMonotonic(uint64_t monoUsec)
+{
+	CaptureClockState state;
+	if(m_shm == NULL || !m_shm->readCaptureClock(&state))
+		return monoUsec;
+	return mapToClock(state, monoUsec);
+}
+
+/// <summary>
+/// Converts a capture time to a `getMonotonicUsec()` time.
+/// </summary>
+uint64_t CaptureClock::toMonotonic(uint64_t clockUsec)
+{
+	CaptureClockState state;
+	if(m_shm == NULL || !m_shm->readCaptureClock(&state))
+		return clockUsec;
+	return mapToMonotonic(state, clockUsec);
+}
+
+/// <summary>
+/// Returns a counter that is incremented every time that the capture clock
+/// is stepped. Timestamps from different generations cannot be compared.
+/// </summary>
+uint32_t CaptureClock::getGeneration()
+{
+	CaptureClockState state;
+	if(m_shm == NULL || !m_shm->readCaptureClock(&state))
+		return 0;
+	return state.generation;
+}
+
+/// <summary>
+/// Returns how much faster the capture clock runs than the monotonic clock
+/// in parts per billion.
+/// </summary>
+int32_t CaptureClock::getRateAdjPpb()
+{
+	CaptureClockState state;
+	if(m_shm == NULL || !m_shm->readCaptureClock(&state))
+		return 0;
+	return state.rateAdjPpb;
+}
+
+/// <summary>
+/// Steers the capture clock towards an external clock that currently reads
+/// `refUsec`. See `calibrateAt()`.
+/// </summary>
+bool CaptureClock::calibrate(uint64_t refUsec)
+{
+	return calibrateAt(getMonotonicUsec(), refUsec);
+}
+
+/// <summary>
+/// Steers the capture clock towards an external clock, such as the audio
+/// clock of the main application, that read `refUsec` at the monotonic time
+/// `monoUsec`. Does nothing unless we own the domain, see `heartbeat()`.
+/// Should be called regularly with recent measurements.
+///
+/// The first calibration steps the capture clock to the external clock.
+/// Afterwards the rate of the external clock is measured from the first
+/// calibration point and the remaining error is slewed away over
+/// `SLEW_USEC` so that the capture clock never jumps. Errors larger than
+/// `MAX_SLEW_ERROR_USEC` step the clock again.
+/// </summary>
+/// <returns>True if the capture clock was stepped</returns>
+bool CaptureClock::calibrateAt(uint64_t monoUsec, uint64_t refUsec)
+{
+	CaptureClockState state;
+	if(m_shm == NULL || !m_shm->readCaptureClock(&state))
+		return false;
+	if(state.procId != getProcessId())
+		m_isCalibrated = false; // Never calibrated this domain ourselves
+
+	// Re-anchor the mapping at this instant so that the capture clock is
+	// continuous when the rate changes
+	uint64_t clockUsec = mapToClock(state, monoUsec);
+	state.monoAnchorUsec = monoUsec;
+	state.clockAnchorUsec = clockUsec;
+
+	int64_t err = (int64_t)(refUsec - clockUsec);
+	bool stepped = false;
+	if(!m_isCalibrated || err > MAX_SLEW_ERROR_USEC ||
+		err < -MAX_SLEW_ERROR_USEC)
+	{
+		// Step to the external clock and forget its measured rate
+		state.clockAnchorUsec = refUsec;
+		state.generation++;
+		stepped = true;
+	} else {
+		// Run at the measured rate of the external clock plus a correction
+		// that removes the remaining error over the slew period
+		int64_t rate = state.rateAdjPpb;
+		uint64_t span = monoUsec - m_calibMonoUsec;
+		if(monoUsec > m_calibMonoUsec && span >= MIN_RATE_SPAN_USEC) {
+			int64_t refSpan = (int64_t)(refUsec - m_calibRefUsec);
+			rate = (refSpan - (int64_t)span) * 1000000000LL /
+				(int64_t)span;
+		}
+		rate += err * 1000000000LL / SLEW_USEC;
+		if(rate > MAX_RATE_ADJ_PPB)
+			rate = MAX_RATE_ADJ_PPB;
+		if(rate < -MAX_RATE_ADJ_PPB)
+			rate = -MAX_RATE_ADJ_PPB;
+		state.rateAdjPpb = (int32_t)rate;
+	}
+	if(!m_shm->publishCaptureClock(state))
+		return false; // Another process owns the domain
+	if(stepped) {
+		m_isCalibrated = true;
+		m_calibMonoUsec = monoUsec;
+		m_calibRefUsec = refUsec;
+	}
+	return stepped;
+}
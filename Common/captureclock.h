@@ -0,0 +1,77 @@
+//*****************************************************************************
+// Libdeskcap: A high-performance desktop capture library
+//
+// Copyright (C) 2014 Lucas Murray <lucas@polyflare.com>
+// All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation; either version 2 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//*****************************************************************************
+
+#ifndef COMMON_CAPTURECLOCK_H
+#define COMMON_CAPTURECLOCK_H
+
+#include "stlincludes.h"
+#include "mainsharedsegment.h"
+
+//=============================================================================
+/// <summary>
+/// The clock that every frame timestamp is in so that the main application
+/// can compare the timestamps from every hooked process against its own
+/// clock. The domain is anchored in the `MainSharedSegment` and each process
+/// maps its own reading of the system-wide monotonic clock through the
+/// shared offset and rate. Capture time zero is when the main application
+/// created the domain unless it has been calibrated against another clock.
+///
+/// Only the main application creates and calibrates the domain. If several
+/// instances are running then the first one owns the domain and the others
+/// share it, another instance takes over once the owner stops calling
+/// `heartbeat()`. If the domain doesn't exist then the capture clock is the
+/// monotonic clock.
+/// </summary>
+class CaptureClock
+{
+public: // Constants ----------------------------------------------------------
+	// Maximum rate adjustment that calibration can apply (1000 ppm)
+	static const int32_t MAX_RATE_ADJ_PPB = 1000000;
+
+private: // Members -----------------------------------------------------------
+	MainSharedSegment *	m_shm;
+
+	// Calibration against an external clock
+	bool				m_isCalibrated;
+	uint64_t			m_calibMonoUsec; // First calibration point
+	uint64_t			m_calibRefUsec;
+
+public: // Static methods -----------------------------------------------------
+	static uint64_t	mapToClock(
+		const CaptureClockState &state, uint64_t monoUsec);
+	static uint64_t	mapToMonotonic(
+		const CaptureClockState &state, uint64_t clockUsec);
+
+public: // Constructor/destructor ---------------------------------------------
+	CaptureClock(MainSharedSegment *shm);
+	virtual ~CaptureClock();
+
+public: // Methods ------------------------------------------------------------
+	bool		createDomain();
+	bool		heartbeat();
+	bool		hasDomain();
+	uint64_t	now();
+	uint64_t	fromMonotonic(uint64_t monoUsec);
+	uint64_t	toMonotonic(uint64_t clockUsec);
+	uint32_t	getGeneration();
+	int32_t		getRateAdjPpb();
+	bool		calibrate(uint64_t refUsec);
+	bool		calibrateAt(uint64_t monoUsec, uint64_t refUsec);
+};
+//=============================================================================
+
+#endif // COMMON_CAPTURECLOCK_H
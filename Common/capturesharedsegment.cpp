@@ -16,13 +16,16 @@
 //*****************************************************************************
 
 #include "capturesharedsegment.h"
+#include "atomicops.h"
+#include "doorbell.h"
 #include "managedsharedmemory.h"
+#include "pixelconvert.h"
 #include "stlhelpers.h"
 
 /// <summary>
 /// Creates a new manager assuming that the the shared segment already exists.
 /// </summary>
-CaptureSharedSegment::CaptureSharedSegment(uint name, uint size)
+CaptureSharedSegment::CaptureSharedSegment(uint name, uint64_t size)
 	: m_shm(NULL)
 	, m_isValid(false)
 	, m_isCollision(false)
@@ -31,68 +34,135 @@ CaptureSharedSegment::CaptureSharedSegment(uint name, uint size)
 	, m_segmentSize(size)
 
 	// Data
-	, m_lock(NULL)
+	, m_exists(NULL)
 	, m_captureType(NULL)
-	, m_width(NULL)
-	, m_height(NULL)
+	, m_maxWidth(NULL)
+	, m_maxHeight(NULL)
 	, m_extraData(NULL)
 	, m_numFrames(NULL)
-	, m_frameUsed(NULL)
-	, m_timestamps(NULL)
+	, m_layout(NULL)
+	, m_ring(NULL)
+	, m_readers(NULL)
+	, m_doorbellState(NULL)
+	, m_slots(NULL)
+	, m_tileMaps(NULL)
 	, m_dataStart(NULL)
+	, m_doorbell(NULL)
+	, m_isReader(false)
+	, m_readerIndex(-1)
+	, m_readerGeneration(0)
+	, m_numRegistrations(0)
 {
 	try {
-		string nameStr = stringf("MishiraSHM-%u", m_segmentName);
-		m_shm = new ManagedSharedMemory(nameStr.data(), m_segmentSize);
-
-		// Add a version number to the very beginning of the shared segment so
-		// that we can detect when we've upgraded Mishira on OS's that have
-		// persistent shared segments.
-		uchar *version = m_shm->unserialize<uchar>();
-		if(*version > 1) {
-			m_errorReason = "Unknown version number";
-			return;
-		}
-		*version = 1;
+		string shmName = getShmName();
+		m_shm = new ManagedSharedMemory(
+			shmName.empty() ? NULL : shmName.data(), m_segmentSize,
+			getMemoryPolicy(m_segmentSize));
+		unserializeExisting();
+	} catch(interprocess_exception &ex) {
+		m_errorReason = string(ex.what());
+	}
+}
 
-		// Get the addresses of our shared objects
-		m_lock = m_shm->unserialize<interprocess_mutex>();
-		m_exists = m_shm->unserialize<uchar>();
-		if(m_exists == NULL || *m_exists == 0) {
-			// Shared segment doesn't already exist, cannot continue
-			m_errorReason = "Capture SHM doesn't already exist";
-			m_isCollision = true;
-			return;
-		}
-		m_captureType = m_shm->unserialize<uchar>();
-		m_width = m_shm->unserialize<uint32_t>();
-		m_height = m_shm->unserialize<uint32_t>();
-		switch(getCaptureType()) {
-		case RawPixelsShmType:
-			m_extraData = m_shm->unserialize<RawPixelsExtraData>();
-			break;
-		default:
-		case SharedTextureShmType:
-			// Nothing
-			break;
-		}
-		m_numFrames = m_shm->unserialize<uint32_t>();
-		m_frameUsed = m_shm->unserialize<uchar>(*m_numFrames);
-		m_timestamps = m_shm->unserialize<uint64_t>(*m_numFrames);
-		m_dataStart = m_shm->getAllocation(m_shm->getUnserializeOffset(),
-			getFrameDataSize() * getNumFrames(), NULL);
+#ifdef OS_LINUX
+/// <summary>
+/// Creates a new manager for an existing segment from a file descriptor that
+/// was received from the producer with `ManagedSharedMemory::receiveFd()`.
+/// Takes ownership of `fd`.
+/// </summary>
+CaptureSharedSegment::CaptureSharedSegment(int fd)
+	: m_shm(NULL)
+	, m_isValid(false)
+	, m_isCollision(false)
+	, m_errorReason()
+	, m_segmentName(ANONYMOUS_NAME)
+	, m_segmentSize(0) // Calculated below
 
-		m_isValid = true;
+	// Data
+	, m_exists(NULL)
+	, m_captureType(NULL)
+	, m_maxWidth(NULL)
+	, m_maxHeight(NULL)
+	, m_extraData(NULL)
+	, m_numFrames(NULL)
+	, m_layout(NULL)
+	, m_ring(NULL)
+	, m_readers(NULL)
+	, m_doorbellState(NULL)
+	, m_slots(NULL)
+	, m_tileMaps(NULL)
+	, m_dataStart(NULL)
+	, m_doorbell(NULL)
+	, m_isReader(false)
+	, m_readerIndex(-1)
+	, m_readerGeneration(0)
+	, m_numRegistrations(0)
+{
+	try {
+		m_shm = new ManagedSharedMemory(fd);
+		m_segmentSize = m_shm->getSize();
+		unserializeExisting();
 	} catch(interprocess_exception &ex) {
 		m_errorReason = string(ex.what());
 	}
 }
+#endif
+
+/// <summary>
+/// Gets the addresses of all our shared objects in a segment that was
+/// previously constructed by the producer.
+/// </summary>
+void CaptureSharedSegment::unserializeExisting()
+{
+	// Add a version number to the very beginning of the shared segment so
+	// that we can detect when we've upgraded Mishira on OS's that have
+	// persistent shared segments.
+	uchar *version = m_shm->unserialize<uchar>();
+	if(*version != 0 && *version != LAYOUT_VERSION) {
+		m_errorReason = "Unknown version number";
+		return;
+	}
+	*version = LAYOUT_VERSION;
+
+	// Get the addresses of our shared objects
+	m_exists = m_shm->unserialize<uchar>();
+	if(m_exists == NULL || *m_exists == 0) {
+		// Shared segment doesn't already exist, cannot continue
+		m_errorReason = "Capture SHM doesn't already exist";
+		m_isCollision = true;
+		return;
+	}
+	m_captureType = m_shm->unserialize<uchar>();
+	m_maxWidth = m_shm->unserialize<uint32_t>();
+	m_maxHeight = m_shm->unserialize<uint32_t>();
+	switch(getCaptureType()) {
+	case RawPixelsShmType:
+		m_extraData = m_shm->unserialize<RawPixelsExtraData>();
+		break;
+	default:
+	case SharedTextureShmType:
+		// Nothing
+		break;
+	}
+	m_numFrames = m_shm->unserialize<uint32_t>();
+	if(!unserializeRing(NULL))
+		return; // Error reason already set
+
+	// We are a consumer of an existing segment
+	m_isReader = true;
+	if(!registerReader()) {
+		m_errorReason = "Capture SHM has too many readers";
+		return;
+	}
+
+	m_isValid = true;
+}
 
 /// <summary>
 /// Constructs a new shared segment that contains raw pixel data.
 /// </summary>
 CaptureSharedSegment::CaptureSharedSegment(
-	uint name, uint width, uint height, uint numFrames,
+	uint name, uint maxWidth, uint maxHeight, uint numFrames,
 	const RawPixelsExtraData &extra)
 	: m_shm(NULL)
 	, m_isValid(false)
@@ -102,24 +172,33 @@ CaptureSharedSegment::CaptureSharedSegment(
 	, m_segmentSize(0) // Calculated below
 
 	// Data
-	, m_lock(NULL)
+	, m_exists(NULL)
 	, m_captureType(NULL)
-	, m_width(NULL)
-	, m_height(NULL)
+	, m_maxWidth(NULL)
+	, m_maxHeight(NULL)
 	, m_extraData(NULL)
 	, m_numFrames(NULL)
-	, m_frameUsed(NULL)
-	, m_timestamps(NULL)
+	, m_layout(NULL)
+	, m_ring(NULL)
+	, m_readers(NULL)
+	, m_doorbellState(NULL)
+	, m_slots(NULL)
+	, m_tileMaps(NULL)
 	, m_dataStart(NULL)
+	, m_doorbell(NULL)
+	, m_isReader(false)
+	, m_readerIndex(-1)
+	, m_readerGeneration(0)
+	, m_numRegistrations(0)
 {
-	constructNew(name, width, height, numFrames, &extra);
+	constructNew(name, maxWidth, maxHeight, numFrames, &extra);
 }
 
 /// <summary>
 /// Constructs a new shared segment that contains shared DX10 texture data.
 /// </summary>
 CaptureSharedSegment::CaptureSharedSegment(
-	uint name, uint width, uint height, uint numFrames,
+	uint name, uint maxWidth, uint maxHeight, uint numFrames,
 	const SharedTextureExtraData &extra)
 	: m_shm(NULL)
 	, m_isValid(false)
@@ -129,45 +208,54 @@ CaptureSharedSegment::CaptureSharedSegment(
 	, m_segmentSize(0) // Calculated below
 
 	// Data
-	, m_lock(NULL)
+	, m_exists(NULL)
 	, m_captureType(NULL)
-	, m_width(NULL)
-	, m_height(NULL)
+	, m_maxWidth(NULL)
+	, m_maxHeight(NULL)
 	, m_extraData(NULL)
 	, m_numFrames(NULL)
-	, m_frameUsed(NULL)
-	, m_timestamps(NULL)
+	, m_layout(NULL)
+	, m_ring(NULL)
+	, m_readers(NULL)
+	, m_doorbellState(NULL)
+	, m_slots(NULL)
+	, m_tileMaps(NULL)
 	, m_dataStart(NULL)
+	, m_doorbell(NULL)
+	, m_isReader(false)
+	, m_readerIndex(-1)
+	, m_readerGeneration(0)
+	, m_numRegistrations(0)
 {
-	constructNew(name, width, height, numFrames, NULL);
+	constructNew(name, maxWidth, maxHeight, numFrames, NULL);
 }
 
 void CaptureSharedSegment::constructNew(
-	uint name, uint width, uint height, uint numFrames,
+	uint name, uint maxWidth, uint maxHeight, uint numFrames,
 	const RawPixelsExtraData *extra)
 {
-	// Calculate the segment size. WARNING: This is only a rough estimate.
-	if(extra != NULL)
-		m_segmentSize = 16 * 1024 + numFrames * width * height * extra->bpp;
-	else
-		m_segmentSize = 16 * 1024 + numFrames * sizeof(uint32_t);
+	// Calculate the exact segment size
+	Layout layout;
+	calcLayout(maxWidth, maxHeight, numFrames, extra, &layout);
+	m_segmentSize = layout.segmentSize;
 
 	try {
-		string nameStr = stringf("MishiraSHM-%u", m_segmentName);
-		m_shm = new ManagedSharedMemory(nameStr.data(), m_segmentSize);
+		string shmName = getShmName();
+		m_shm = new ManagedSharedMemory(
+			shmName.empty() ? NULL : shmName.data(), m_segmentSize,
+			getMemoryPolicy(m_segmentSize));
 
 		// Add a version number to the very beginning of the shared segment so
 		// that we can detect when we've upgraded Mishira on OS's that have
 		// persistent shared segments.
 		uchar *version = m_shm->unserialize<uchar>();
-		if(*version > 1) {
+		if(*version != 0 && *version != LAYOUT_VERSION) {
 			m_errorReason = "Unknown version number";
 			return;
 		}
-		*version = 1;
+		*version = LAYOUT_VERSION;
 
 		// Get the addresses of our shared objects
-		m_lock = m_shm->unserialize<interprocess_mutex>();
 		m_exists = m_shm->unserialize<uchar>();
 		if(m_exists == NULL || *m_exists != 0) {
 			// Shared segment already exists, cannot continue
@@ -177,10 +265,10 @@ void CaptureSharedSegment::constructNew(
 		}
 		*m_exists = 1;
 		m_captureType = m_shm->unserialize<uchar>();
-		m_width = m_shm->unserialize<uint32_t>();
-		*m_width = width;
-		m_height = m_shm->unserialize<uint32_t>();
-		*m_height = height;
+		m_maxWidth = m_shm->unserialize<uint32_t>();
+		*m_maxWidth = maxWidth;
+		m_maxHeight = m_shm->unserialize<uint32_t>();
+		*m_maxHeight = maxHeight;
 		if(extra != NULL) {
 			*m_captureType = RawPixelsShmType;
 			m_extraData = m_shm->unserialize<RawPixelsExtraData>();
@@ -189,10 +277,8 @@ void CaptureSharedSegment::constructNew(
 			*m_captureType = SharedTextureShmType;
 		m_numFrames = m_shm->unserialize<uint32_t>();
 		*m_numFrames = numFrames;
-		m_frameUsed = m_shm->unserialize<uchar>(*m_numFrames);
-		m_timestamps = m_shm->unserialize<uint64_t>(*m_numFrames);
-		m_dataStart = m_shm->getAllocation(m_shm->getUnserializeOffset(),
-			getFrameDataSize() * getNumFrames(), NULL);
+		if(!unserializeRing(&layout))
+			return; // Error reason already set
 
 		m_isValid = true;
 	} catch(interprocess_exception &ex) {
@@ -202,6 +288,14 @@ void CaptureSharedSegment::constructNew(
 
 CaptureSharedSegment::~CaptureSharedSegment()
 {
+	// Return all of our frames to the producer immediately instead of making
+	// it wait for us to time out
+	unregisterReader();
+
+	if(m_doorbell != NULL)
+		delete m_doorbell;
+	m_doorbell = NULL;
+
 	// Free the shared memory segment manager. Note that this doesn't actually
 	// delete the segment as it's persistent.
 	if(m_shm != NULL)
@@ -214,25 +308,86 @@ CaptureSharedSegment::~CaptureSharedSegment()
 /// </summary>
 void CaptureSharedSegment::remove()
 {
-#ifdef OS_WIN
-	// Windows automatically deletes once the segment is no longer referenced
-#else
-#error Unimplemented.
+	if(m_shm == NULL)
+		return;
+	string name = getShmName();
+	if(name.empty())
+		return; // Anonymous segments are never persistent
+	ManagedSharedMemory::remove(name.data());
+}
+
+/// <summary>
+/// Returns true once every page of a large segment has been faulted in. See
+/// `ManagedSharedMemory::PrefaultPolicy`.
+/// </summary>
+bool CaptureSharedSegment::isPrefaultComplete() const
+{
+	if(m_shm == NULL)
+		return true;
+	return m_shm->isPrefaultComplete();
+}
+
+uint64_t CaptureSharedSegment::getPrefaultPageFaults() const
+{
+	if(m_shm == NULL)
+		return 0;
+	return m_shm->getPrefaultPageFaults();
+}
+
+#ifdef OS_LINUX
+/// <summary>
+/// Sends the file descriptor of this segment to the consumer over the
+/// connected Unix domain socket `sock`. This is the only way for another
+/// process to open an anonymous segment.
+/// </summary>
+bool CaptureSharedSegment::sendFd(int sock) const
+{
+	if(m_shm == NULL)
+		return false;
+	return ManagedSharedMemory::sendFd(sock, m_shm->getFd());
+}
 #endif
+
+/// <summary>
+/// Returns the width or height that a raw pixel segment should be created
+/// with in order to hold frames of the specified size. Some headroom is added
+/// so that resizing the window a little doesn't require a new segment.
+/// </summary>
+uint CaptureSharedSegment::calcCapacity(uint size)
+{
+	uint64_t capacity = (uint64_t)size * CAPACITY_HEADROOM_NUM /
+		CAPACITY_HEADROOM_DENOM;
+	capacity = alignUp(capacity, CAPACITY_ALIGNMENT);
+	if(capacity > 0xFFFFFFFFULL)
+		return size; // Should never happen
+	return (uint)capacity;
 }
 
-void CaptureSharedSegment::lock()
+/// <summary>
+/// Selects the memory policy for a segment of the specified size. Small
+/// segments are not worth the overhead of a prefault thread. We never lock
+/// segments into memory automatically as most systems limit how much memory
+/// a process can lock.
+/// </summary>
+uint CaptureSharedSegment::getMemoryPolicy(uint64_t segmentSize)
 {
-	if(m_lock == NULL)
-		return;
-	m_lock->lock();
+	if(segmentSize < LARGE_SEGMENT_SIZE)
+		return 0;
+	return ManagedSharedMemory::HugePagesPolicy |
+		ManagedSharedMemory::PrefaultPolicy;
 }
 
-void CaptureSharedSegment::unlock()
+/// <summary>
+/// Returns the name that the segment has in the operating system or an empty
+/// string if the segment is anonymous.
+/// </summary>
+string CaptureSharedSegment::getShmName() const
 {
-	if(m_lock == NULL)
-		return;
-	m_lock->unlock();
+#ifdef OS_LINUX
+	if(m_segmentName == ANONYMOUS_NAME)
+		return string();
+#endif
+	return stringf("MishiraSHM-%u", m_segmentName);
 }
 
 ShmCaptureType CaptureSharedSegment::getCaptureType()
@@ -242,18 +397,27 @@ ShmCaptureType CaptureSharedSegment::getCaptureType()
 	return (ShmCaptureType)(*m_captureType);
 }
 
-uint CaptureSharedSegment::getWidth()
+uint CaptureSharedSegment::getMaxWidth()
 {
-	if(m_width == NULL)
+	if(m_maxWidth == NULL)
 		return 0;
-	return *m_width;
+	return *m_maxWidth;
 }
 
-uint CaptureSharedSegment::getHeight()
+uint CaptureSharedSegment::getMaxHeight()
 {
-	if(m_height == NULL)
+	if(m_maxHeight == NULL)
 		return 0;
-	return *m_height;
+	return *m_maxHeight;
+}
+
+/// <summary>
+/// Returns true if a frame of the specified size can be stored in this
+/// segment.
+/// </summary>
+bool CaptureSharedSegment::canFitFrame(uint width, uint height)
+{
+	return width <= getMaxWidth() && height <= getMaxHeight();
 }
 
 CaptureSharedSegment::RawPixelsExtraData *
@@ -271,117 +435,1118 @@ uint CaptureSharedSegment::getNumFrames()
 	return *m_numFrames;
 }
 
-bool CaptureSharedSegment::isFrameUsed(uint frameNum)
+CaptureSharedSegment::FrameState CaptureSharedSegment::getFrameState(
+	uint frameNum)
 {
-	if(m_numFrames == NULL || m_frameUsed == NULL)
-		return false;
+	FrameSlot *slot = getSlot(frameNum);
+	if(slot == NULL)
+		return FreeFrameState;
+	return (FrameState)atomicLoad32(&slot->state);
+}
+
+uint64_t CaptureSharedSegment::getFrameTimestamp(uint frameNum)
+{
+	FrameSlot *slot = getSlot(frameNum);
+	if(slot == NULL)
+		return 0;
+	return slot->timestamp;
+}
+
+/// <summary>
+/// Returns the width in pixels of the specified frame. Only valid once the
+/// frame has been queued by the producer.
+/// </summary>
+uint CaptureSharedSegment::getFrameWidth(uint frameNum)
+{
+	FrameSlot *slot = getSlot(frameNum);
+	if(slot == NULL)
+		return 0;
+	return slot->width;
+}
+
+uint CaptureSharedSegment::getFrameHeight(uint frameNum)
+{
+	FrameSlot *slot = getSlot(frameNum);
+	if(slot == NULL)
+		return 0;
+	return slot->height;
+}
+
+/// <summary>
+/// Returns the size in pixels of the window that the specified frame was
+/// captured from. This differs from the frame size if the producer
+/// downscaled the frame. Only valid once the frame has been queued by the
+/// producer.
+/// </summary>
+uint CaptureSharedSegment::getFrameSourceWidth(uint frameNum)
+{
+	FrameSlot *slot = getSlot(frameNum);
+	if(slot == NULL)
+		return 0;
+	if(slot->srcWidth == 0)
+		return slot->width;
+	return slot->srcWidth;
+}
+
+uint CaptureSharedSegment::getFrameSourceHeight(uint frameNum)
+{
+	FrameSlot *slot = getSlot(frameNum);
+	if(slot == NULL)
+		return 0;
+	if(slot->srcHeight == 0)
+		return slot->height;
+	return slot->srcHeight;
+}
+
+/// <summary>
+/// Returns the row stride in bytes of the raw pixel data in the specified
+/// frame. Only valid once the frame has been queued by the producer.
+/// </summary>
+uint CaptureSharedSegment::getFrameStride(uint frameNum)
+{
+	FrameSlot *slot = getSlot(frameNum);
+	if(slot == NULL)
+		return 0;
+	return slot->stride;
+}
+
+/// <summary>
+/// Returns the `RawPixelFormat` of the specified frame which is the format of
+/// the segment unless the producer wrote the frame in a planar or compressed
+/// format. Only valid once the frame has been queued by the producer.
+/// </summary>
+uint32_t CaptureSharedSegment::getFrameFormat(uint frameNum)
+{
+	FrameSlot *slot = getSlot(frameNum);
+	if(slot == NULL)
+		return UnknownPixelFormat;
+	if(slot->format != 0)
+		return slot->format;
+	RawPixelsExtraData *extra = getRawPixelsExtraDataPtr();
+	if(extra == NULL)
+		return UnknownPixelFormat;
+	return extra->format;
+}
+
+/// <summary>
+/// Returns the `YuvColorSpace` of the specified frame. Only meaningful if the
+/// frame is in a planar YUV format.
+/// </summary>
+uint32_t CaptureSharedSegment::getFrameColorSpace(uint frameNum)
+{
+	FrameSlot *slot = getSlot(frameNum);
+	if(slot == NULL)
+		return BT601LimitedColorSpace;
+	return slot->colorSpace;
+}
+
+/// <summary>
+/// Returns a pointer to the first row of a plane of the specified frame.
+/// Frames in the format of the segment only have a single plane which is
+/// identical to `getFrameDataPtr()`. Only valid once the frame has been
+/// queued by the producer.
+/// </summary>
+/// <returns>NULL if the plane doesn't exist</returns>
+void *CaptureSharedSegment::getFramePlanePtr(uint frameNum, uint plane)
+{
+	FrameSlot *slot = getSlot(frameNum);
+	uchar *data = (uchar *)getFrameDataPtr(frameNum);
+	if(slot == NULL || data == NULL || plane >= MAX_PLANES)
+		return NULL;
+	if(slot->format == 0)
+		return (plane == 0 ? data : NULL);
+	uint64_t stride = slot->planeStrides[plane];
+	uint64_t rows = getPixelFormatPlaneRows(slot->format, plane, slot->height);
+	if(stride == 0 || rows == 0 ||
+		slot->planeOffsets[plane] + stride * rows > getFrameDataSize())
+	{
+		return NULL;
+	}
+	return data + slot->planeOffsets[plane];
+}
+
+/// <summary>
+/// Returns the row stride in bytes of a plane of the specified frame.
+/// </summary>
+/// <returns>Zero if the plane doesn't exist</returns>
+uint CaptureSharedSegment::getFramePlaneStride(uint frameNum, uint plane)
+{
+	FrameSlot *slot = getSlot(frameNum);
+	if(slot == NULL || plane >= MAX_PLANES)
+		return 0;
+	if(slot->format == 0)
+		return (plane == 0 ? slot->stride : 0);
+	return slot->planeStrides[plane];
+}
+
+/// <summary>
+/// Returns the size in bytes of the encoded data of a frame that is in the
+/// `CompressedBGRAPixelFormat` format. The data begins at
+/// `getFrameDataPtr()` and must be decoded with `decodeFrame()`.
+/// </summary>
+/// <returns>Zero if the frame isn't compressed</returns>
+uint CaptureSharedSegment::getFrameCompressedSize(uint frameNum)
+{
+	FrameSlot *slot = getSlot(frameNum);
+	if(slot == NULL || slot->format != CompressedBGRAPixelFormat)
+		return 0;
+	if(slot->compressedSize > getFrameDataSize())
+		return 0; // Should never happen
+	return slot->compressedSize;
+}
+
+/// <summary>
+/// Returns the largest row stride in bytes that the producer can use when
+/// writing raw pixel data.
+/// </summary>
+uint CaptureSharedSegment::getMaxFrameStride()
+{
+	if(m_layout == NULL)
+		return 0;
+	return m_layout->maxStride;
+}
+
+/// <summary>
+/// For raw pixels the data is the actual pixel data while for shared textures
+/// it is a shared texture handle only. Raw pixel data is always aligned to
+/// `FRAME_ALIGNMENT` bytes.
+/// </summary>
+void *CaptureSharedSegment::getFrameDataPtr(uint frameNum)
+{
+	if(m_numFrames == NULL || m_dataStart == NULL)
+		return NULL;
 	if(frameNum >= *m_numFrames)
-		return false;
-	return (m_frameUsed[frameNum] != 0 ? true : false);
+		return NULL;
+	return (void *)((uintptr_t)m_dataStart +
+		(uintptr_t)(getFrameDataSize() * frameNum));
+}
+
+/// <summary>
+/// Returns the distance in bytes between the data of each frame. This
+/// includes any padding that is required for alignment.
+/// </summary>
+uint64_t CaptureSharedSegment::getFrameDataSize()
+{
+	if(m_layout == NULL)
+		return 0;
+	return m_layout->frameDataSize;
+}
+
+/// <summary>
+/// Returns true if every pixel of the frame must be treated as changed.
+/// </summary>
+bool CaptureSharedSegment::isFrameFullyDirty(uint frameNum)
+{
+	FrameSlot *slot = getSlot(frameNum);
+	if(slot == NULL)
+		return true;
+	return slot->numDirtyRects == FULL_FRAME_DIRTY;
+}
+
+/// <summary>
+/// Returns the rectangles of the frame that differ from the previous frame
+/// that the producer published. Zero rectangles means that the frame is
+/// identical to the previous one. Only valid if `isFrameFullyDirty()` returns
+/// false.
+/// </summary>
+/// <returns>The number of rectangles in `rectsOut`</returns>
+uint CaptureSharedSegment::getFrameDirtyRects(
+	uint frameNum, const DirtyRect **rectsOut)
+{
+	FrameSlot *slot = getSlot(frameNum);
+	if(rectsOut != NULL)
+		*rectsOut = (slot != NULL ? slot->dirtyRects : NULL);
+	if(slot == NULL || slot->numDirtyRects == FULL_FRAME_DIRTY)
+		return 0;
+	return slot->numDirtyRects;
+}
+
+/// <summary>
+/// Returns the number of tiles in each row of a changed tile map. The tile
+/// grid is based on the capacity of the segment instead of the frame size so
+/// tiles to the right of or below the frame are never marked as changed.
+/// </summary>
+uint CaptureSharedSegment::getTilesPerRow()
+{
+	return (getMaxWidth() + TILE_SIZE - 1) / TILE_SIZE;
+}
+
+/// <summary>
+/// Returns the size in bytes of each changed tile map.
+/// </summary>
+uint CaptureSharedSegment::getTileMapSize()
+{
+	if(m_layout == NULL)
+		return 0;
+	return m_layout->tileMapSize;
+}
+
+/// <summary>
+/// Returns a bitmap of the `TILE_SIZE` by `TILE_SIZE` pixel tiles of the
+/// frame that differ from the previous frame that the producer published.
+/// This is more precise than `getFrameDirtyRects()` which merges the tiles
+/// into a small number of rectangles. Bit `y * getTilesPerRow() + x` is set
+/// if tile (x, y) changed, see `isTileChanged()`. Tiles are relative to the
+/// top-left of the frame data. Only valid if `isFrameFullyDirty()` returns
+/// false.
+/// </summary>
+/// <returns>NULL if the producer didn't provide a map for this frame</returns>
+const uchar *CaptureSharedSegment::getFrameChangedTiles(uint frameNum)
+{
+	FrameSlot *slot = getSlot(frameNum);
+	if(slot == NULL || m_tileMaps == NULL)
+		return NULL;
+	if(slot->hasTileMap == 0 || slot->numDirtyRects == FULL_FRAME_DIRTY)
+		return NULL;
+	return &m_tileMaps[(uint64_t)frameNum * m_layout->tileMapSize];
+}
+
+/// <summary>
+/// Returns the total number of raw pixel bytes that the producer has written
+/// to this segment.
+/// </summary>
+uint64_t CaptureSharedSegment::getBytesCopied()
+{
+	if(m_ring == NULL)
+		return 0;
+	return atomicLoad64(&m_ring->bytesCopied);
+}
+
+/// <summary>
+/// Returns the total number of raw pixel bytes that the producer didn't need
+/// to write to this segment as the frame slot already contained them.
+/// </summary>
+uint64_t CaptureSharedSegment::getBytesSaved()
+{
+	if(m_ring == NULL)
+		return 0;
+	return atomicLoad64(&m_ring->bytesSaved);
 }
 
-void CaptureSharedSegment::setFrameUsed(uint frameNum, bool used)
+/// <summary>
+/// Returns a counter that is incremented every time that a consumer
+/// registers as a reader, including consumers that register again after they
+/// were dropped. New readers have never seen the previous frame so producers
+/// that publish partial damage must publish a full frame whenever this
+/// changes.
+/// </summary>
+uint32_t CaptureSharedSegment::getNumReaderJoins()
 {
-	if(m_numFrames == NULL || m_frameUsed == NULL)
+	if(m_ring == NULL)
+		return 0;
+	return atomicLoad32(&m_ring->numReaderJoins);
+}
+
+//-----------------------------------------------------------------------------
+// Producer
+
+/// <summary>
+/// Claims the next frame slot in the ring for writing. Once the frame data has
+/// been written `publishFrame()` must be called to queue it for the consumers
+/// or `abortWriteFrame()` to return it unused. Calling this method again
+/// before either of those returns the same slot.
+/// </summary>
+/// <returns>-1 if all frames are queued</returns>
+int CaptureSharedSegment::beginWriteFrame()
+{
+	if(m_ring == NULL || m_slots == NULL)
+		return -1;
+	uint numFrames = getNumFrames();
+	if(numFrames == 0)
+		return -1;
+
+	// The write sequence is only ever modified by us. If a reader hasn't
+	// released the slot that we want yet then the ring is full unless that
+	// reader has stopped responding.
+	uint64_t writeSeq = atomicLoad64(&m_ring->writeSeqNum);
+	uint frameNum = (uint)(writeSeq % numFrames);
+	FrameSlot *slot = &m_slots[frameNum];
+	uint32_t state = atomicLoad32(&slot->state);
+	if(state == ReadyFrameState) {
+		clearInactiveReaders(slot);
+		uint32_t readerMask = atomicLoad32(&slot->readerMask);
+		if(readerMask != 0) {
+			evictStaleReaders(readerMask);
+			if(atomicLoad32(&slot->readerMask) != 0)
+				return -1;
+		}
+	} else if(state != FreeFrameState && state != WritingFrameState)
+		return -1; // Should never happen
+	slot->srcWidth = 0;
+	slot->srcHeight = 0;
+	slot->hasTileMap = 0;
+	slot->format = 0;
+	atomicStore32(&slot->state, WritingFrameState);
+	return (int)frameNum;
+}
+
+/// <summary>
+/// Records that a frame that was claimed with `beginWriteFrame()` was
+/// downscaled from a window of the specified size. Frames are assumed to be
+/// unscaled unless this is called before `publishFrame()`.
+/// </summary>
+void CaptureSharedSegment::setFrameSourceSize(
+	uint frameNum, uint width, uint height)
+{
+	FrameSlot *slot = getSlot(frameNum);
+	if(slot == NULL || atomicLoad32(&slot->state) != WritingFrameState)
 		return;
-	if(frameNum >= *m_numFrames)
+	slot->srcWidth = width;
+	slot->srcHeight = height;
+}
+
+/// <summary>
+/// Records that a frame that was claimed with `beginWriteFrame()` was written
+/// in the planar `format` instead of the format of the segment. `offsets`
+/// and `strides` describe each plane relative to `getFrameDataPtr()` and must
+/// have `MAX_PLANES` elements, unused planes must have a stride of zero.
+/// Every plane must fit within `getFrameDataSize()` bytes and have at least
+/// the strides that `calcPixelFormatPlanes()` returns, otherwise the frame is
+/// returned unpublished by `publishFrame()`. The `stride` that is passed to
+/// `publishFrame()` is ignored for planar frames.
+/// </summary>
+void CaptureSharedSegment::setFramePlanes(
+	uint frameNum, uint32_t format, uint32_t colorSpace,
+	const uint *offsets, const uint *strides)
+{
+	FrameSlot *slot = getSlot(frameNum);
+	if(slot == NULL || offsets == NULL || strides == NULL)
+		return;
+	if(atomicLoad32(&slot->state) != WritingFrameState)
 		return;
-	m_frameUsed[frameNum] = (used ? 1 : 0);
+	slot->format = format;
+	slot->colorSpace = colorSpace;
+	for(uint i = 0; i < MAX_PLANES; i++) {
+		slot->planeOffsets[i] = offsets[i];
+		slot->planeStrides[i] = strides[i];
+	}
 }
 
-uint64_t CaptureSharedSegment::getFrameTimestamp(uint frameNum)
+/// <summary>
+/// Records that a frame that was claimed with `beginWriteFrame()` contains
+/// `size` bytes of 8-bit BGRA pixels that were encoded with `encodeFrame()`
+/// instead of raw pixels in the format of the segment. The encoded frame must
+/// be the same size as the frame and `size` must not be larger than
+/// `getFrameDataSize()`, frames that are too large to compress should be
+/// written uncompressed instead. The `stride` that is passed to
+/// `publishFrame()` is ignored for compressed frames.
+/// </summary>
+void CaptureSharedSegment::setFrameCompressed(uint frameNum, uint size)
 {
-	if(m_numFrames == NULL || m_timestamps == NULL)
-		return false;
-	if(frameNum >= *m_numFrames)
-		return false;
-	return m_timestamps[frameNum];
+	FrameSlot *slot = getSlot(frameNum);
+	if(slot == NULL || size == 0 || size > getFrameDataSize())
+		return;
+	if(atomicLoad32(&slot->state) != WritingFrameState)
+		return;
+	slot->format = CompressedBGRAPixelFormat;
+	slot->colorSpace = 0;
+	slot->compressedSize = size;
+	for(uint i = 0; i < MAX_PLANES; i++) {
+		slot->planeOffsets[i] = 0;
+		slot->planeStrides[i] = 0;
+	}
 }
 
-void CaptureSharedSegment::setFrameTimestamp(uint frameNum, uint64_t timestamp)
+/// <summary>
+/// Attaches a changed tile map to a frame that was claimed with
+/// `beginWriteFrame()`. `tileMap` must be `getTileMapSize()` bytes and use
+/// the layout described in `getFrameChangedTiles()`. The dirty rectangles
+/// that are passed to `publishFrame()` must cover every changed tile.
+/// </summary>
+void CaptureSharedSegment::setFrameChangedTiles(
+	uint frameNum, const uchar *tileMap)
 {
-	if(m_numFrames == NULL || m_timestamps == NULL)
+	FrameSlot *slot = getSlot(frameNum);
+	if(slot == NULL || m_tileMaps == NULL || tileMap == NULL)
 		return;
-	if(frameNum >= *m_numFrames)
+	if(atomicLoad32(&slot->state) != WritingFrameState)
 		return;
-	m_timestamps[frameNum] = timestamp;
+	memcpy(&m_tileMaps[(uint64_t)frameNum * m_layout->tileMapSize], tileMap,
+		m_layout->tileMapSize);
+	slot->hasTileMap = 1;
 }
 
 /// <summary>
-/// For raw pixels the data is the actual pixel data while for shared textures
-/// it is a shared texture handle only.
+/// Adds to the copy statistics that consumers can read with
+/// `getBytesCopied()` and `getBytesSaved()`. Only the producer may call this.
 /// </summary>
-void *CaptureSharedSegment::getFrameDataPtr(uint frameNum)
+void CaptureSharedSegment::addCopyStats(
+	uint64_t bytesCopied, uint64_t bytesSaved)
 {
-	if(m_numFrames == NULL || m_dataStart == NULL)
+	if(m_ring == NULL)
+		return;
+	atomicStore64(&m_ring->bytesCopied,
+		atomicLoad64(&m_ring->bytesCopied) + bytesCopied);
+	atomicStore64(&m_ring->bytesSaved,
+		atomicLoad64(&m_ring->bytesSaved) + bytesSaved);
+}
+
+/// <summary>
+/// Queues a frame that was claimed with `beginWriteFrame()` for every active
+/// reader. `width` and `height` are the size of the frame which must not be
+/// zero and must fit within the capacity of the segment. `stride` is the row
+/// stride of raw pixel data which must not be larger than
+/// `getMaxFrameStride()` or smaller than a row of the frame, zero means that
+/// the rows are tightly packed. Frames with an invalid size or stride are
+/// returned unpublished as the consumers would read cropped or sheared
+/// pixels.
+///
+/// If `dirtyRects` is NULL then the entire frame is marked as changed,
+/// otherwise it lists the areas that differ from the previously published
+/// frame. The frame data itself must always be complete. If the producer
+/// fails to publish a frame then the damage of that frame must be included in
+/// the next one. More than `MAX_DIRTY_RECTS` rectangles falls back to a full
+/// frame.
+/// </summary>
+/// <returns>False if the frame was not published</returns>
+bool CaptureSharedSegment::publishFrame(
+	uint frameNum, uint64_t timestamp, uint width, uint height, uint stride,
+	const DirtyRect *dirtyRects, uint numDirtyRects)
+{
+	FrameSlot *slot = getSlot(frameNum);
+	if(slot == NULL || atomicLoad32(&slot->state) != WritingFrameState)
 		return false;
-	if(frameNum >= *m_numFrames)
+
+	// Frames can never be larger than our capacity
+	if(width == 0 || height == 0 || !canFitFrame(width, height)) {
+		abortWriteFrame(frameNum);
 		return false;
-	return (void *)((uint64_t)m_dataStart + getFrameDataSize() * frameNum);
+	}
+
+	// Raw pixel data is tightly packed unless the producer says otherwise
+	if(getCaptureType() == RawPixelsShmType && slot->format != 0) {
+		if(!isPlaneLayoutValid(slot, width, height)) {
+			abortWriteFrame(frameNum);
+			return false;
+		}
+		stride = slot->planeStrides[0];
+	} else if(getCaptureType() == RawPixelsShmType) {
+		uint rowSize = width * getRawPixelsExtraDataPtr()->bpp;
+		if(stride == 0)
+			stride = rowSize;
+		if(stride < rowSize || stride > getMaxFrameStride()) {
+			abortWriteFrame(frameNum);
+			return false;
+		}
+	} else
+		stride = 0;
+
+	uint64_t writeSeq = atomicLoad64(&m_ring->writeSeqNum);
+	slot->timestamp = timestamp;
+	slot->width = width;
+	slot->height = height;
+	slot->stride = stride;
+
+	// Clip the damage to the frame and discard empty rectangles
+	if(dirtyRects == NULL || numDirtyRects > MAX_DIRTY_RECTS)
+		slot->numDirtyRects = FULL_FRAME_DIRTY;
+	else {
+		uint numOut = 0;
+		for(uint i = 0; i < numDirtyRects; i++) {
+			const DirtyRect &rect = dirtyRects[i];
+			if(rect.x >= width || rect.y >= height)
+				continue;
+			DirtyRect &out = slot->dirtyRects[numOut];
+			out.x = rect.x;
+			out.y = rect.y;
+			out.width = rect.width;
+			if(out.width > width - rect.x)
+				out.width = width - rect.x;
+			out.height = rect.height;
+			if(out.height > height - rect.y)
+				out.height = height - rect.y;
+			if(out.width > 0 && out.height > 0)
+				numOut++;
+		}
+		slot->numDirtyRects = numOut;
+	}
+
+	// The sequence number must be visible before the reader mask as readers
+	// use it to detect that the slot was reused while they were testing it.
+	// See `isFramePinned()`. If there are no readers then the mask is empty
+	// and the slot can be reused immediately.
+	atomicStore64(&slot->seqNum, writeSeq);
+	atomicStore32(&slot->readerMask, getActiveReaderMask());
+
+	// A reader that unregistered after we read the active readers has
+	// already cleared its bit from every slot and would never release this
+	// frame. Readers that registered since then haven't read the write
+	// sequence number yet so they still receive this frame if we keep them.
+	clearInactiveReaders(slot);
+
+	// The slot must be marked as ready before the readers can see the new
+	// write sequence number
+	atomicStore32(&slot->state, ReadyFrameState);
+	atomicStore64(&m_ring->writeSeqNum, writeSeq + 1ULL);
+
+	// Wake up any readers that are waiting for a frame
+	if(m_doorbell != NULL)
+		m_doorbell->ring();
+	return true;
 }
 
 /// <summary>
-/// Calculates the size of each frame element in the data array.
+/// Returns true if every plane that was set with `setFramePlanes()` is at
+/// least as large as `calcPixelFormatPlanes()` requires for a `width` by
+/// `height` frame and fits within the frame data. Compressed frames are
+/// validated by `setFrameCompressed()` instead.
 /// </summary>
-uint CaptureSharedSegment::getFrameDataSize()
+bool CaptureSharedSegment::isPlaneLayoutValid(
+	const FrameSlot *slot, uint width, uint height)
 {
-	switch(getCaptureType()) {
-	default:
-		return 0;
-	case RawPixelsShmType:
-		return getWidth() * getHeight() * getRawPixelsExtraDataPtr()->bpp;
-	case SharedTextureShmType:
-		return sizeof(uint32_t); // sizeof(HANDLE) is always 32-bit
+	if(slot->format == CompressedBGRAPixelFormat)
+		return true;
+	uint minOffsets[MAX_PLANES];
+	uint minStrides[MAX_PLANES];
+	if(calcPixelFormatPlanes(
+		slot->format, width, height, minOffsets, minStrides) == 0)
+	{
+		return false; // Unknown format
+	}
+	if(slot->planeStrides[0] > getMaxFrameStride())
+		return false;
+	for(uint i = 0; i < MAX_PLANES; i++) {
+		uint64_t stride = slot->planeStrides[i];
+		uint64_t rows = getPixelFormatPlaneRows(slot->format, i, height);
+		if(rows == 0) {
+			if(stride != 0)
+				return false; // Plane doesn't exist in this format
+			continue;
+		}
+		if(stride < minStrides[i])
+			return false;
+		if(slot->planeOffsets[i] + stride * rows > getFrameDataSize())
+			return false;
 	}
-	// Should never be reached
-	return 0;
+	return true;
 }
 
 /// <summary>
-/// Returns the earliest used or unused frame depending on the `used` argument.
-/// If `minTime` is set then only frames that have a timestamp that's equal or
-/// greater to the specified time are included (Used to find the first frame
-/// after a certain time).
-///
-/// As hooks should never capture faster than the video framerate we don't
-/// actually care what the frame timestamps are when using them, we are only
-/// interested in the one with the lowest relative time.
+/// Returns a frame that was claimed with `beginWriteFrame()` without queuing
+/// it.
+/// </summary>
+void CaptureSharedSegment::abortWriteFrame(uint frameNum)
+{
+	FrameSlot *slot = getSlot(frameNum);
+	if(slot == NULL)
+		return;
+	atomicCas32(&slot->state, WritingFrameState, FreeFrameState);
+}
+
+//-----------------------------------------------------------------------------
+// Consumer
+
+/// <summary>
+/// Returns the earliest frame that is queued for us without modifying it.
+/// Frames that were published before we became a reader are skipped. As
+/// frames are always queued and released in order this is always the frame at
+/// our cursor.
 /// </summary>
-int CaptureSharedSegment::findEarliestFrame(bool used, uint64_t minTime)
+/// <returns>-1 if there are no queued frames</returns>
+int CaptureSharedSegment::findEarliestFrame()
 {
+	ReaderSlot *reader = getReader();
+	if(reader == NULL)
+		return -1;
+	uint numFrames = getNumFrames();
+	if(numFrames == 0)
+		return -1;
+	uint32_t readerBit = 1U << m_readerIndex;
+	uint64_t readSeq = atomicLoad64(&reader->readSeqNum);
+	uint64_t writeSeq = atomicLoad64(&m_ring->writeSeqNum);
 	int frameNum = -1;
-	uint64_t frameNumTime = UINT64_MAX;
-	for(uint i = 0; i < getNumFrames(); i++) {
-		if(isFrameUsed(i) == used) {
-			uint64_t curTime = getFrameTimestamp(i);
-			if(curTime >= minTime && curTime < frameNumTime) {
-				// This frame is the earliest so far
-				frameNum = i;
-				frameNumTime = curTime;
-			}
+	for(; readSeq < writeSeq; readSeq++) {
+		uint slotNum = (uint)(readSeq % numFrames);
+		if(isFramePinned(&m_slots[slotNum], readSeq, readerBit)) {
+			frameNum = (int)slotNum;
+			break;
 		}
 	}
+	atomicStore64(&reader->readSeqNum, readSeq);
 	return frameNum;
 }
 
 /// <summary>
-/// Helper method for finding the second earliest used frame.
+/// Returns the earliest queued frame so that it can be accessed. Frames that
+/// are queued for us can never be reused by the producer until we release
+/// them so this is identical to `findEarliestFrame()`. The frame remains
+/// queued until `releaseFrame()` is called.
+/// </summary>
+/// <returns>-1 if there are no queued frames</returns>
+int CaptureSharedSegment::acquireFrame()
+{
+	return findEarliestFrame();
+}
+
+/// <summary>
+/// Removes the earliest queued frame from our queue. The frame is returned to
+/// the producer once every other reader has also released it. Frames must be
+/// released in the order that they were queued so `frameNum` must be the
+/// frame returned by `findEarliestFrame()` or `acquireFrame()`.
+/// </summary>
+void CaptureSharedSegment::releaseFrame(uint frameNum)
+{
+	int earliest = findEarliestFrame();
+	if(earliest < 0 || earliest != (int)frameNum)
+		return; // Not the earliest frame
+	ReaderSlot *reader = &m_readers[m_readerIndex];
+	FrameSlot *slot = &m_slots[frameNum];
+
+	// We must not access the frame after clearing our bit
+	uint64_t readSeq = atomicLoad64(&reader->readSeqNum);
+	atomicFetchAnd32(&slot->readerMask, ~(1U << m_readerIndex));
+	atomicStore64(&reader->readSeqNum, readSeq + 1ULL);
+}
+
+/// <summary>
+/// Returns the queued frame whose timestamp is closest to `timestamp` without
+/// modifying anything. Only frames that have at least `numNewer` frames
+/// queued after them are considered. If two frames are equally close then
+/// the newer one is returned and a timestamp of zero always returns the
+/// newest frame that is considered. Use `releaseFramesBefore()` to skip to
+/// the returned frame.
 /// </summary>
-int CaptureSharedSegment::findSecondEarliestUsedFrame()
+/// <returns>-1 if there are no such frames</returns>
+int CaptureSharedSegment::findNearestFrame(uint64_t timestamp, uint numNewer)
 {
-	int frameNum = findEarliestFrame(true);
-	if(frameNum < 0)
+	if(findEarliestFrame() < 0)
+		return -1; // Also moves our cursor to the earliest queued frame
+	ReaderSlot *reader = &m_readers[m_readerIndex];
+	uint numFrames = getNumFrames();
+	uint32_t readerBit = 1U << m_readerIndex;
+	uint64_t readSeq = atomicLoad64(&reader->readSeqNum);
+	uint64_t writeSeq = atomicLoad64(&m_ring->writeSeqNum);
+	if(writeSeq - readSeq <= (uint64_t)numNewer)
 		return -1;
-	uint64_t time = getFrameTimestamp(frameNum);
-	return findEarliestFrame(true, time + 1ULL);
+
+	// Frames are queued in timestamp order so once the distance starts
+	// increasing every later frame is even further away
+	uint64_t endSeq = writeSeq - (uint64_t)numNewer;
+	int frameNum = -1;
+	uint64_t bestDist = 0;
+	for(uint64_t seq = readSeq; seq < endSeq; seq++) {
+		uint slotNum = (uint)(seq % numFrames);
+		FrameSlot *slot = &m_slots[slotNum];
+		if(!isFramePinned(slot, seq, readerBit))
+			continue;
+		uint64_t dist = 0;
+		if(timestamp != 0) {
+			dist = (slot->timestamp > timestamp ?
+				slot->timestamp - timestamp : timestamp - slot->timestamp);
+		}
+		if(frameNum >= 0 && dist > bestDist)
+			break;
+		frameNum = (int)slotNum;
+		bestDist = dist;
+	}
+	return frameNum;
+}
+
+/// <summary>
+/// Releases every frame that was queued before `frameNum` in a single pass so
+/// that a consumer that fell behind can skip straight to a newer frame
+/// without visiting the ones in between. `frameNum` remains queued and
+/// becomes the earliest frame. Does nothing if `frameNum` isn't queued for
+/// us.
+/// </summary>
+void CaptureSharedSegment::releaseFramesBefore(uint frameNum)
+{
+	if(findEarliestFrame() < 0)
+		return;
+	ReaderSlot *reader = &m_readers[m_readerIndex];
+	uint numFrames = getNumFrames();
+	if(frameNum >= numFrames)
+		return;
+	uint32_t readerBit = 1U << m_readerIndex;
+	uint64_t readSeq = atomicLoad64(&reader->readSeqNum);
+	uint64_t writeSeq = atomicLoad64(&m_ring->writeSeqNum);
+
+	// Every queued frame is in a different slot so the slot number is enough
+	// to determine the sequence number of the frame
+	uint readSlot = (uint)(readSeq % numFrames);
+	uint64_t targetSeq = readSeq +
+		(uint64_t)((frameNum + numFrames - readSlot) % numFrames);
+	if(targetSeq >= writeSeq ||
+		!isFramePinned(&m_slots[frameNum], targetSeq, readerBit))
+	{
+		return; // Not queued
+	}
+
+	// We must not access the frames after clearing our bits
+	for(uint64_t seq = readSeq; seq < targetSeq; seq++) {
+		FrameSlot *slot = &m_slots[(uint)(seq % numFrames)];
+		if(isFramePinned(slot, seq, readerBit))
+			atomicFetchAnd32(&slot->readerMask, ~readerBit);
+	}
+	atomicStore64(&reader->readSeqNum, targetSeq);
 }
 
-int CaptureSharedSegment::getNumUsedFrames()
+/// <summary>
+/// Releases every frame that is currently queued for us.
+/// </summary>
+void CaptureSharedSegment::releaseAllFrames()
 {
-	int numUsedFrames = 0;
-	for(uint i = 0; i < getNumFrames(); i++) {
-		if(isFrameUsed(i))
-			numUsedFrames++;
+	for(;;) {
+		int frameNum = findEarliestFrame();
+		if(frameNum < 0)
+			break;
+		releaseFrame(frameNum);
 	}
-	return numUsedFrames;
+}
+
+/// <summary>
+/// Returns the number of frames that have been queued by the producer but not
+/// yet released by us. This includes frames that are being read.
+/// </summary>
+int CaptureSharedSegment::getNumQueuedFrames()
+{
+	if(findEarliestFrame() < 0)
+		return 0;
+	uint64_t readSeq = atomicLoad64(&m_readers[m_readerIndex].readSeqNum);
+	uint64_t writeSeq = atomicLoad64(&m_ring->writeSeqNum);
+	if(readSeq >= writeSeq)
+		return 0;
+	return (int)(writeSeq - readSeq);
+}
+
+/// <summary>
+/// Blocks the calling thread until the producer has queued at least one frame
+/// or until `timeoutUsec` microseconds have passed. Returns immediately if a
+/// frame is already queued. Like every other consumer method this must only
+/// be called from the thread that reads frames from this object.
+/// </summary>
+/// <returns>True if there is a queued frame</returns>
+bool CaptureSharedSegment::waitForFrame(uint timeoutUsec)
+{
+	if(m_doorbell == NULL)
+		return findEarliestFrame() >= 0;
+
+	// The doorbell also rings for frames that aren't queued for us, such as
+	// those that were published just before we registered, so we keep
+	// waiting until the deadline
+	uint64_t deadline = getMonotonicUsec() + (uint64_t)timeoutUsec;
+	for(;;) {
+		// The generation must be read before testing for frames so that a
+		// frame that is published in between wakes us up immediately
+		uint32_t generation = m_doorbell->getGeneration();
+		if(findEarliestFrame() >= 0)
+			return true;
+		uint64_t now = getMonotonicUsec();
+		if(now >= deadline)
+			return false;
+		if(!m_doorbell->wait(generation, (uint)(deadline - now)))
+			return false; // Timed out
+	}
+}
+
+/// <summary>
+/// Sets how long a reader can go without looking for a frame before the
+/// producer is allowed to drop it. Applies to every reader of the segment.
+/// </summary>
+void CaptureSharedSegment::setReaderTimeout(uint64_t timeoutUsec)
+{
+	if(m_ring == NULL)
+		return;
+	atomicStore64(&m_ring->readerTimeoutUsec, timeoutUsec);
+}
+
+/// <summary>
+/// Returns the number of consumers that are currently reading frames.
+/// </summary>
+uint CaptureSharedSegment::getNumActiveReaders()
+{
+	uint32_t mask = getActiveReaderMask();
+	uint num = 0;
+	for(; mask != 0; mask &= mask - 1)
+		num++;
+	return num;
+}
+
+//-----------------------------------------------------------------------------
+// Private
+
+CaptureSharedSegment::FrameSlot *CaptureSharedSegment::getSlot(uint frameNum)
+{
+	if(m_numFrames == NULL || m_slots == NULL)
+		return NULL;
+	if(frameNum >= *m_numFrames)
+		return NULL;
+	return &m_slots[frameNum];
+}
+
+/// <summary>
+/// Returns true if `slot` contains the frame with the sequence number
+/// `seqNum` and that frame is still queued for the reader `readerBit`. Once
+/// this returns true the producer cannot reuse the slot until we release it.
+/// </summary>
+bool CaptureSharedSegment::isFramePinned(
+	FrameSlot *slot, uint64_t seqNum, uint32_t readerBit)
+{
+	if(atomicLoad32(&slot->state) != ReadyFrameState)
+		return false;
+
+	// If the producer reused the slot while we were testing it then either we
+	// see the old mask, which didn't contain our bit otherwise the slot could
+	// not have been reused, or we see the new mask in which case we also see
+	// the new sequence number as it's written first.
+	if(atomicLoad64(&slot->seqNum) != seqNum)
+		return false;
+	if((atomicLoad32(&slot->readerMask) & readerBit) == 0)
+		return false;
+	return atomicLoad64(&slot->seqNum) == seqNum;
+}
+
+/// <summary>
+/// Returns our reader slot and updates our heartbeat. If the producer dropped
+/// us since the last call then we register as a new reader which means that
+/// we will only receive frames that are published from now on, see
+/// `getNumRegistrations()`.
+/// </summary>
+CaptureSharedSegment::ReaderSlot *CaptureSharedSegment::getReader()
+{
+	if(!m_isReader || m_readers == NULL || m_slots == NULL)
+		return NULL;
+	if(m_readerIndex >= 0) {
+		ReaderSlot *reader = &m_readers[m_readerIndex];
+		if(atomicLoad32(&reader->state) == ActiveReaderState &&
+			atomicLoad32(&reader->generation) == m_readerGeneration)
+		{
+			atomicStore64(&reader->heartbeatUsec, getMonotonicUsec());
+			return reader;
+		}
+		m_readerIndex = -1; // We were dropped
+	}
+	if(!registerReader())
+		return NULL;
+	return &m_readers[m_readerIndex];
+}
+
+/// <summary>
+/// Claims an unused reader slot. Our cursor begins at the next frame that
+/// the producer will publish. The producer ignores the slot until our cursor
+/// is valid otherwise it could queue a frame for us that is before our
+/// cursor which we would never release.
+/// </summary>
+/// <returns>False if there are already `MAX_READERS` readers</returns>
+bool CaptureSharedSegment::registerReader()
+{
+	if(m_readers == NULL || m_ring == NULL)
+		return false;
+	for(uint i = 0; i < MAX_READERS; i++) {
+		ReaderSlot *reader = &m_readers[i];
+		if(!atomicCas32(
+			&reader->state, FreeReaderState, RegisteringReaderState))
+		{
+			continue;
+		}
+		m_readerGeneration = atomicFetchAdd32(&reader->generation, 1) + 1;
+		m_readerIndex = (int)i;
+		atomicStore32(&reader->processId, getProcessId());
+		atomicStore64(&reader->heartbeatUsec, getMonotonicUsec());
+		atomicStore64(&reader->readSeqNum,
+			atomicLoad64(&m_ring->writeSeqNum));
+		atomicStore32(&reader->state, ActiveReaderState);
+		atomicFetchAdd32(&m_ring->numReaderJoins, 1);
+		m_numRegistrations++;
+		return true;
+	}
+	return false;
+}
+
+void CaptureSharedSegment::unregisterReader()
+{
+	if(!m_isReader || m_readerIndex < 0 || m_readers == NULL)
+		return;
+	ReaderSlot *reader = &m_readers[m_readerIndex];
+	if(atomicLoad32(&reader->generation) == m_readerGeneration)
+		evictReader(m_readerIndex);
+	m_readerIndex = -1;
+}
+
+/// <summary>
+/// Removes a reader and releases every frame that is queued for it. Can be
+/// called by both the producer and the reader itself.
+/// </summary>
+void CaptureSharedSegment::evictReader(uint readerIndex)
+{
+	if(m_readers == NULL || m_slots == NULL || readerIndex >= MAX_READERS)
+		return;
+	ReaderSlot *reader = &m_readers[readerIndex];
+	if(!atomicCas32(&reader->state, ActiveReaderState, EvictingReaderState))
+		return; // Already removed
+
+	// The producer no longer adds the reader to new frames so we only need
+	// to clear the existing ones
+	uint32_t readerBit = 1U << readerIndex;
+	uint numFrames = getNumFrames();
+	for(uint i = 0; i < numFrames; i++)
+		atomicFetchAnd32(&m_slots[i].readerMask, ~readerBit);
+	atomicStore32(&reader->state, FreeReaderState);
+}
+
+/// <summary>
+/// Removes every reader in `readerMask` that hasn't looked for a frame within
+/// the reader timeout.
+/// </summary>
+void CaptureSharedSegment::evictStaleReaders(uint32_t readerMask)
+{
+	if(m_readers == NULL || m_ring == NULL)
+		return;
+	uint64_t timeoutUsec = atomicLoad64(&m_ring->readerTimeoutUsec);
+	if(timeoutUsec == 0)
+		timeoutUsec = DEFAULT_READER_TIMEOUT_USEC;
+	uint64_t now = getMonotonicUsec();
+	for(uint i = 0; i < MAX_READERS; i++) {
+		if((readerMask & (1U << i)) == 0)
+			continue;
+		uint64_t heartbeat = atomicLoad64(&m_readers[i].heartbeatUsec);
+		if(now > heartbeat && now - heartbeat > timeoutUsec)
+			evictReader(i);
+	}
+}
+
+/// <summary>
+/// Removes every reader that isn't active from the reader mask of `slot`.
+/// The producer can add a reader to a frame just as that reader unregisters
+/// and nothing else would ever remove it again.
+/// </summary>
+void CaptureSharedSegment::clearInactiveReaders(FrameSlot *slot)
+{
+	// Pairs with the state change in `evictReader()` so that either we see
+	// that the reader is no longer active or it sees our mask and clears it
+	atomicFence();
+	uint32_t inactive =
+		atomicLoad32(&slot->readerMask) & ~getActiveReaderMask();
+	if(inactive != 0)
+		atomicFetchAnd32(&slot->readerMask, ~inactive);
+}
+
+/// <summary>
+/// Returns a bitmask of every reader that is currently active.
+/// </summary>
+uint32_t CaptureSharedSegment::getActiveReaderMask()
+{
+	if(m_readers == NULL)
+		return 0;
+	uint32_t mask = 0;
+	for(uint i = 0; i < MAX_READERS; i++) {
+		if(atomicLoad32(&m_readers[i].state) == ActiveReaderState)
+			mask |= 1U << i;
+	}
+	return mask;
+}
+
+/// <summary>
+/// Unserializes the layout, frame ring and frame data. `m_numFrames` and the
+/// capture type must be valid before calling this method. If we are creating
+/// the segment then `newLayout` is the layout to write to it, otherwise it
+/// must be NULL.
+/// </summary>
+/// <returns>True if the layout is valid</returns>
+bool CaptureSharedSegment::unserializeRing(const Layout *newLayout)
+{
+	m_layout = m_shm->unserializeAligned<Layout>(1, 8);
+	if(m_layout == NULL) {
+		m_errorReason = "Capture SHM is too small";
+		return false;
+	}
+	if(newLayout != NULL)
+		*m_layout = *newLayout;
+	m_ring = m_shm->unserializeAligned<RingHeader>(1, CACHE_LINE_SIZE);
+	m_readers =
+		m_shm->unserializeAligned<ReaderSlot>(MAX_READERS, CACHE_LINE_SIZE);
+	m_doorbellState =
+		m_shm->unserializeAligned<DoorbellState>(1, CACHE_LINE_SIZE);
+	m_slots = m_shm->unserializeAligned<FrameSlot>(
+		*m_numFrames, CACHE_LINE_SIZE);
+	if(m_ring == NULL || m_readers == NULL || m_doorbellState == NULL ||
+		m_slots == NULL)
+	{
+		m_errorReason = "Capture SHM is too small";
+		return false;
+	}
+	if(m_layout->tileMapSize > 0) {
+		m_tileMaps = m_shm->unserializeAligned<uchar>(
+			*m_numFrames * m_layout->tileMapSize, 8);
+		if(m_tileMaps == NULL) {
+			m_errorReason = "Capture SHM is too small";
+			return false;
+		}
+	}
+	m_doorbell = new Doorbell(m_doorbellState, stringf("%u", m_segmentName));
+
+	// Make sure that the metadata doesn't overlap the frame data and that the
+	// frame data fits inside of the segment
+	uint64_t metaEnd = (uint64_t)m_shm->getUnserializeOffset() +
+		ManagedSharedMemory::ALLOCATION_OVERHEAD;
+	if(metaEnd > m_layout->dataOffset ||
+		m_layout->segmentSize > (uint64_t)m_shm->getSize())
+	{
+		m_errorReason = "Invalid capture SHM layout";
+		return false;
+	}
+
+	// The allocation marker of the frame data is located in the padding
+	// immediately before it
+	m_dataStart = m_shm->getAllocation(
+		m_layout->dataOffset - ManagedSharedMemory::ALLOCATION_OVERHEAD,
+		m_layout->frameDataSize * getNumFrames(), NULL);
+	if(m_dataStart == NULL) {
+		m_errorReason = "Invalid capture SHM layout";
+		return false;
+	}
+	return true;
+}
+
+/// <summary>
+/// Calculates the exact layout of a new segment. All metadata is placed in a
+/// block at the beginning of the segment that is followed by the frame data.
+/// </summary>
+void CaptureSharedSegment::calcLayout(
+	uint maxWidth, uint maxHeight, uint numFrames,
+	const RawPixelsExtraData *extra, Layout *layoutOut) const
+{
+	// Each raw pixel frame begins on a page boundary and has enough room for
+	// every row to be padded to the typical native pitch of a GPU. Shared
+	// textures only store a handle so keep them on separate cache lines.
+	if(extra != NULL) {
+		layoutOut->maxStride = (uint32_t)alignUp(
+			(uint64_t)maxWidth * (uint64_t)extra->bpp, ROW_STRIDE_ALIGNMENT);
+		layoutOut->frameDataSize = alignUp(
+			(uint64_t)layoutOut->maxStride * (uint64_t)maxHeight,
+			FRAME_ALIGNMENT);
+	} else {
+		layoutOut->maxStride = 0;
+		layoutOut->frameDataSize = CACHE_LINE_SIZE;
+	}
+
+	// Raw pixel frames also have a bitmap of the tiles that changed. The grid
+	// is based on the capacity so that it never changes.
+	layoutOut->tileMapSize = 0;
+	if(extra != NULL) {
+		uint64_t numTiles =
+			(uint64_t)((maxWidth + TILE_SIZE - 1) / TILE_SIZE) *
+			(uint64_t)((maxHeight + TILE_SIZE - 1) / TILE_SIZE);
+		layoutOut->tileMapSize = (uint32_t)alignUp((numTiles + 7) / 8, 8);
+	}
+
+	// All metadata apart from the slot array and tile maps has a small fixed
+	// size. The metadata size below includes generous room for the allocation
+	// markers and alignment padding and is verified in `unserializeRing()`.
+	const uint64_t METADATA_SIZE = 2048;
+	uint64_t metaSize = METADATA_SIZE +
+		(uint64_t)numFrames * (uint64_t)sizeof(FrameSlot) +
+		(uint64_t)numFrames * (uint64_t)layoutOut->tileMapSize;
+	layoutOut->dataOffset = alignUp(metaSize, FRAME_ALIGNMENT);
+	layoutOut->segmentSize = layoutOut->dataOffset +
+		(uint64_t)numFrames * layoutOut->frameDataSize;
+}
+
+/// <summary>
+/// Rounds `value` up to the next multiple of `alignment` which must be a power
+/// of two.
+/// </summary>
+uint64_t CaptureSharedSegment::alignUp(uint64_t value, uint64_t alignment)
+{
+	return (value + alignment - 1ULL) & ~(alignment - 1ULL);
 }
@@ -19,10 +19,10 @@
 #define COMMON_CAPTURESHAREDSEGMENT_H
 
 #include "stlincludes.h"
-#include <boost/interprocess/sync/interprocess_mutex.hpp>
-using namespace boost::interprocess;
 
+class Doorbell;
 class ManagedSharedMemory;
+struct DoorbellState;
 
 /// <summary>
 /// The format of each pixel in a pixel buffer. All values above 0x80000000 are
@@ -32,15 +32,35 @@ enum RawPixelFormat {
 	UnknownPixelFormat = 0,
 	BGRAPixelFormat,
 	BGRPixelFormat,
+	RGBAPixelFormat,
 	//ARGBPixelFormat,
-	//RGBAPixelFormat,
 	//RGBPixelFormat,
 
+	// Planar YUV 4:2:0 formats. Frames in these formats consist of multiple
+	// planes, see `CaptureSharedSegment::getFramePlanePtr()`.
+	NV12PixelFormat = 0x100, // 8-bit Y plane and an interleaved UV plane
+	I420PixelFormat, // 8-bit Y, U and V planes
+	P010PixelFormat, // NV12 with 16-bit samples, only the 10 MSBs are used
+
+	// 8-bit BGRA that was losslessly compressed with `encodeFrame()`, see
+	// `CaptureSharedSegment::setFrameCompressed()`.
+	CompressedBGRAPixelFormat = 0x200,
+
 	DXGIBeginPixelFormat = 0x80000000,
 
 	ForceUInt32PixelFormat = 0xFFFFFFFF // Used only to enlarge enum size
 };
 
+/// <summary>
+/// The colour matrix and range of planar YUV pixel data.
+/// </summary>
+enum YuvColorSpace {
+	BT601LimitedColorSpace = 0,
+	BT601FullColorSpace,
+	BT709LimitedColorSpace,
+	BT709FullColorSpace
+};
+
 enum ShmCaptureType {
 	RawPixelsShmType = 0,
 	SharedTextureShmType = 1
@@ -50,12 +70,119 @@ enum ShmCaptureType {
 /// <summary>
 /// Represents the shared memory segment for interprocess transfer of captured
 /// frame data.
+///
+/// Frames are passed from the hook (The producer) to one or more consumer
+/// processes through a ring of frame slots. Every consumer that opens an
+/// existing segment registers itself as a reader with its own read sequence
+/// number (Its cursor) and the producer marks each frame that it publishes
+/// with a bitmask of the readers that were active at that time. A reader
+/// releases a frame by clearing its bit and the producer only ever reuses a
+/// slot once its mask is empty, which means that all readers see the same
+/// frames without the producer having to copy them more than once and that
+/// nobody needs to take a shared lock in order to write or read a frame.
+///
+/// Readers update a heartbeat every time that they look for a frame. If the
+/// producer runs out of slots because a reader has stopped responding for
+/// longer than the reader timeout (E.g. it crashed) then that reader is
+/// dropped and its frames are reclaimed. A dropped reader automatically
+/// registers again the next time that it looks for a frame, consumers detect
+/// this with `getNumRegistrations()` and producers with
+/// `getNumReaderJoins()` so that the reader receives a full frame.
+///
+/// On Linux a segment can also be created anonymously by using the name
+/// `ANONYMOUS_NAME`. Anonymous segments never appear in /dev/shm and must be
+/// passed to the consumer with `sendFd()` and opened with the file descriptor
+/// constructor.
+///
+/// Large segments automatically use huge pages and are prefaulted in a
+/// background thread to prevent a latency spike on the first write to each
+/// frame. See `ManagedSharedMemory::MemoryPolicyFlags`.
+///
+/// The size of the segment is calculated exactly before it is created and the
+/// data of every frame begins on a page boundary so that it can be accessed
+/// with aligned SIMD and non-temporal instructions. Each raw pixel frame has
+/// room for rows of up to `getMaxFrameStride()` bytes so that producers can
+/// write at their native pitch, the actual stride of each frame is stored
+/// with the frame.
+///
+/// Raw pixel frames normally use the pixel format of the segment but the
+/// producer can instead write any individual frame in a planar YUV format
+/// such as NV12 for consumers that feed a video encoder. Each plane of such
+/// a frame is located within the frame's data, see `setFramePlanes()`. It
+/// can also losslessly compress individual BGRA frames which reduces the
+/// amount of memory that the consumer needs to read for screen content, see
+/// `setFrameCompressed()`.
+///
+/// Each frame can optionally describe which parts of it differ from the
+/// previously published frame with a list of dirty rectangles so that the
+/// consumer only needs to copy the parts that changed into its persistent
+/// texture. Producers that don't know what changed publish full frames.
+///
+/// The producer rings a doorbell every time that it publishes a frame so that
+/// a consumer thread can block in `waitForFrame()` instead of polling.
+///
+/// Each object that reads frames is a single reader of the ring and its
+/// reader state is not protected by any lock. Only one thread may call the
+/// consumer methods of an object, processes that read frames on several
+/// threads must open the segment once per thread.
+///
+/// The width and height of the segment are its capacity and every frame
+/// stores its own size which can be anything up to that capacity. Producers
+/// of raw pixel data should create segments with the capacity returned by
+/// `calcCapacity()` so that small changes to the size of the window, such as
+/// those that happen while the user is dragging its border, only require the
+/// segment to be recreated when they exceed the capacity. Consumers must
+/// treat a change in frame size as an ordinary frame.
 /// </summary>
 class CaptureSharedSegment
 {
+public: // Constants ----------------------------------------------------------
+	static const int LAYOUT_VERSION = 12;
+	static const uint64_t LARGE_SEGMENT_SIZE = 32 * 1024 * 1024;
+	static const uint CACHE_LINE_SIZE = 64;
+	static const uint FRAME_ALIGNMENT = 4096; // Raw pixel frame alignment
+	static const uint ROW_STRIDE_ALIGNMENT = 256; // Max native pitch padding
+	static const uint MAX_DIRTY_RECTS = 16;
+	static const uint32_t FULL_FRAME_DIRTY = 0xFFFFFFFF;
+	static const uint MAX_READERS = 4;
+	static const uint64_t DEFAULT_READER_TIMEOUT_USEC = 2000000ULL; // 2 sec
+	static const uint CAPACITY_HEADROOM_NUM = 5; // 125% of the initial size
+	static const uint CAPACITY_HEADROOM_DENOM = 4;
+	static const uint CAPACITY_ALIGNMENT = 64; // Pixels
+	static const uint TILE_SIZE = 64; // Pixels, see `getFrameChangedTiles()`
+	static const uint MAX_PLANES = 3;
+#ifdef OS_LINUX
+	static const uint ANONYMOUS_NAME = 0;
+#endif
+
 public: // Datatypes ----------------------------------------------------------
+	enum FrameState {
+		FreeFrameState = 0, // Owned by the producer, contains nothing
+		WritingFrameState, // Producer is writing to the frame
+		ReadyFrameState // Frame is queued until every reader releases it
+	};
+
+	enum ReaderState {
+		FreeReaderState = 0, // Reader slot is unused
+		ActiveReaderState, // Reader receives every published frame
+		EvictingReaderState, // Reader is being removed
+		RegisteringReaderState // Reader cursor isn't valid yet
+	};
+
+	// A rectangle in pixels relative to the top-left of the frame data
+	struct DirtyRect {
+		uint32_t	x;
+		uint32_t	y;
+		uint32_t	width;
+		uint32_t	height;
+
+		DirtyRect() : x(0), y(0), width(0), height(0) {};
+		DirtyRect(uint32_t x_, uint32_t y_, uint32_t w, uint32_t h)
+			: x(x_), y(y_), width(w), height(h) {};
+	};
+
 	struct RawPixelsExtraData {
-		uint32_t	format; // See `PixelFormat`
+		uint32_t	format; // See `RawPixelFormat`
 		uint32_t	bpp; // Bytes per pixel
 		uint8_t		isFlipped;
 
@@ -67,34 +194,123 @@ public: // Datatypes ----------------------------------------------------------
 		//SharedTextureExtraData() : unused(0) {};
 	};
 
+private: // Datatypes ---------------------------------------------------------
+	// WARNING: All datatypes must have the same size on both 32- and 64-bit
+	// systems as the memory could be shared between processes of different
+	// bitness!
+	struct FrameSlot {
+		uint32_t	state; // See `FrameState`, atomic
+		uint32_t	stride; // Row stride of raw pixel data in bytes
+		uint64_t	seqNum; // Sequence number of the frame in this slot
+		uint64_t	timestamp; // Capture time of the swap, see `CaptureClock`
+		uint32_t	width; // Size of the frame, never exceeds the capacity
+		uint32_t	height;
+		uint32_t	srcWidth; // Size before downscaling, zero if unscaled
+		uint32_t	srcHeight;
+		uint32_t	numDirtyRects; // `FULL_FRAME_DIRTY` if everything changed
+		uint32_t	readerMask; // Readers that haven't released it, atomic
+		uint32_t	hasTileMap; // Non-zero if the changed tile map is valid
+		uint32_t	format; // See `RawPixelFormat`, zero for the default
+		uint32_t	colorSpace; // See `YuvColorSpace`
+		uint32_t	planeOffsets[MAX_PLANES]; // Only if `format` is set
+		uint32_t	planeStrides[MAX_PLANES];
+		uint32_t	compressedSize; // Only if `format` is compressed
+		DirtyRect	dirtyRects[MAX_DIRTY_RECTS];
+
+		FrameSlot() : state(FreeFrameState), stride(0), seqNum(0)
+			, timestamp(0), width(0), height(0), srcWidth(0), srcHeight(0)
+			, numDirtyRects(FULL_FRAME_DIRTY), readerMask(0), hasTileMap(0)
+			, format(0), colorSpace(0), compressedSize(0)
+		{
+			for(uint i = 0; i < MAX_PLANES; i++) {
+				planeOffsets[i] = 0;
+				planeStrides[i] = 0;
+			}
+		};
+	};
+
+	// Describes where everything is located so that the consumer never needs
+	// to recalculate it
+	struct Layout {
+		uint64_t	segmentSize; // Exact size of the segment in bytes
+		uint64_t	dataOffset; // Offset of the first frame's data
+		uint64_t	frameDataSize; // Distance between each frame's data
+		uint32_t	maxStride; // Maximum row stride of raw pixel data
+		uint32_t	tileMapSize; // Size of each changed tile map in bytes
+
+		Layout() : segmentSize(0), dataOffset(0), frameDataSize(0)
+			, maxStride(0), tileMapSize(0) {};
+	};
+
+	struct RingHeader {
+		uint64_t	writeSeqNum; // Number of frames published, producer only
+		uint64_t	readerTimeoutUsec; // Zero for the default
+		uint64_t	bytesCopied; // Raw pixel bytes written, producer only
+		uint64_t	bytesSaved; // Unchanged bytes that weren't written
+		uint32_t	numReaderJoins; // Incremented by every registration
+		uint32_t	padding1;
+		uchar		padding2[24];
+
+		RingHeader() : writeSeqNum(0), readerTimeoutUsec(0), bytesCopied(0)
+			, bytesSaved(0), numReaderJoins(0), padding1(0) {};
+	};
+
+	// Each reader is modified by a different process so give each one its
+	// own cache line to prevent false sharing
+	struct ReaderSlot {
+		uint32_t	state; // See `ReaderState`, atomic
+		uint32_t	generation; // Incremented every time the slot is claimed
+		uint32_t	processId; // For debugging only
+		uint32_t	padding1;
+		uint64_t	readSeqNum; // Sequence number of the next frame to read
+		uint64_t	heartbeatUsec; // See `getMonotonicUsec()`
+		uchar		padding2[32];
+
+		ReaderSlot() : state(FreeReaderState), generation(0), processId(0)
+			, padding1(0), readSeqNum(0), heartbeatUsec(0) {};
+	};
+
 private: // Members -----------------------------------------------------------
 	ManagedSharedMemory *	m_shm;
 	bool					m_isValid;
 	bool					m_isCollision;
 	string					m_errorReason;
 	uint					m_segmentName;
-	uint					m_segmentSize;
+	uint64_t				m_segmentSize;
 
 	// Data
-	interprocess_mutex *	m_lock;
 	uchar *					m_exists; // Used to detect collisions
 	uchar *					m_captureType; // See `CaptureType`
-	uint32_t *				m_width;
-	uint32_t *				m_height;
+	uint32_t *				m_maxWidth; // Capacity
+	uint32_t *				m_maxHeight;
 	void *					m_extraData; // Variable-size, based on type
 	uint32_t *				m_numFrames;
-	uchar *					m_frameUsed; // Array
-	uint64_t *				m_timestamps; // Array
+	Layout *				m_layout;
+	RingHeader *			m_ring;
+	ReaderSlot *			m_readers; // Array
+	DoorbellState *			m_doorbellState;
+	FrameSlot *				m_slots; // Array
+	uchar *					m_tileMaps; // One per frame, raw pixels only
 	void *					m_dataStart; // Start of variable-size array
+	Doorbell *				m_doorbell;
+
+	// Consumer only
+	bool					m_isReader;
+	int						m_readerIndex;
+	uint32_t				m_readerGeneration;
+	uint					m_numRegistrations;
 
 public: // Constructor/destructor ---------------------------------------------
-	CaptureSharedSegment(uint name, uint size);
-	CaptureSharedSegment(uint name, uint width, uint height, uint numFrames,
-		const RawPixelsExtraData &extra);
-	CaptureSharedSegment(uint name, uint width, uint height, uint numFrames,
-		const SharedTextureExtraData &extra);
-	void constructNew(uint name, uint width, uint height, uint numFrames,
-		const RawPixelsExtraData *extra);
+	CaptureSharedSegment(uint name, uint64_t size);
+#ifdef OS_LINUX
+	explicit CaptureSharedSegment(int fd);
+#endif
+	CaptureSharedSegment(uint name, uint maxWidth, uint maxHeight,
+		uint numFrames, const RawPixelsExtraData &extra);
+	CaptureSharedSegment(uint name, uint maxWidth, uint maxHeight,
+		uint numFrames, const SharedTextureExtraData &extra);
+	void constructNew(uint name, uint maxWidth, uint maxHeight,
+		uint numFrames, const RawPixelsExtraData *extra);
 	virtual ~CaptureSharedSegment();
 
 public: // Methods ------------------------------------------------------------
@@ -102,35 +318,131 @@ public: // Methods ------------------------------------------------------------
 	bool				isCollision() const;
 	string				getErrorReason() const;
 	uint				getSegmentName() const;
-	uint				getSegmentSize() const;
+	uint64_t			getSegmentSize() const;
 	void				remove();
+	bool				isPrefaultComplete() const;
+	uint64_t			getPrefaultPageFaults() const;
+#ifdef OS_LINUX
+	bool				sendFd(int sock) const;
+#endif
+	static uint			calcCapacity(uint size);
 
-	void					lock();
-	void					unlock();
 	ShmCaptureType			getCaptureType();
-	uint					getWidth();
-	uint					getHeight();
+	uint					getMaxWidth();
+	uint					getMaxHeight();
+	bool					canFitFrame(uint width, uint height);
 	RawPixelsExtraData *	getRawPixelsExtraDataPtr();
 	uint					getNumFrames();
-	bool					isFrameUsed(uint frameNum);
-	void					setFrameUsed(uint frameNum, bool used);
+	FrameState				getFrameState(uint frameNum);
 	uint64_t				getFrameTimestamp(uint frameNum);
-	void					setFrameTimestamp(
-		uint frameNum, uint64_t timestamp);
+	uint					getFrameWidth(uint frameNum);
+	uint					getFrameHeight(uint frameNum);
+	uint					getFrameSourceWidth(uint frameNum);
+	uint					getFrameSourceHeight(uint frameNum);
+	uint					getFrameStride(uint frameNum);
+	uint32_t				getFrameFormat(uint frameNum);
+	uint32_t				getFrameColorSpace(uint frameNum);
+	void *					getFramePlanePtr(uint frameNum, uint plane);
+	uint					getFramePlaneStride(uint frameNum, uint plane);
+	uint					getFrameCompressedSize(uint frameNum);
+	uint					getMaxFrameStride();
 	void *					getFrameDataPtr(uint frameNum);
-	int						findEarliestFrame(bool used, uint64_t minTime = 0);
-	int						findSecondEarliestUsedFrame();
-	int						getNumUsedFrames();
+	uint64_t				getFrameDataSize();
+	bool					isFrameFullyDirty(uint frameNum);
+	uint					getFrameDirtyRects(
+		uint frameNum, const DirtyRect **rectsOut);
+	uint					getTilesPerRow();
+	uint					getTileMapSize();
+	const uchar *			getFrameChangedTiles(uint frameNum);
+	static bool				isTileChanged(
+		const uchar *tileMap, uint tilesPerRow, uint tileX, uint tileY);
+	uint64_t				getBytesCopied();
+	uint64_t				getBytesSaved();
+	uint32_t				getNumReaderJoins();
+
+	// Producer
+	int						beginWriteFrame();
+	void					setFrameSourceSize(
+		uint frameNum, uint width, uint height);
+	void					setFramePlanes(
+		uint frameNum, uint32_t format, uint32_t colorSpace,
+		const uint *offsets, const uint *strides);
+	void					setFrameCompressed(uint frameNum, uint size);
+	void					setFrameChangedTiles(
+		uint frameNum, const uchar *tileMap);
+	void					addCopyStats(
+		uint64_t bytesCopied, uint64_t bytesSaved);
+	bool					publishFrame(
+		uint frameNum, uint64_t timestamp, uint width, uint height,
+		uint stride = 0, const DirtyRect *dirtyRects = NULL,
+		uint numDirtyRects = 0);
+	void					abortWriteFrame(uint frameNum);
 
-	uint				getFrameDataSize();
+	// Consumer
+	int						findEarliestFrame();
+	int						acquireFrame();
+	void					releaseFrame(uint frameNum);
+	int						findNearestFrame(
+		uint64_t timestamp, uint numNewer = 0);
+	void					releaseFramesBefore(uint frameNum);
+	void					releaseAllFrames();
+	int						getNumQueuedFrames();
+	bool					waitForFrame(uint timeoutUsec);
+	void					setReaderTimeout(uint64_t timeoutUsec);
+	uint					getNumActiveReaders();
+	uint					getNumRegistrations() const;
+
+private:
+	static uint				getMemoryPolicy(uint64_t segmentSize);
+	static uint64_t			alignUp(uint64_t value, uint64_t alignment);
+	void					calcLayout(
+		uint maxWidth, uint maxHeight, uint numFrames,
+		const RawPixelsExtraData *extra, Layout *layoutOut) const;
+	string					getShmName() const;
+	void					unserializeExisting();
+	FrameSlot *				getSlot(uint frameNum);
+	bool					isFramePinned(
+		FrameSlot *slot, uint64_t seqNum, uint32_t readerBit);
+	bool					isPlaneLayoutValid(
+		const FrameSlot *slot, uint width, uint height);
+	ReaderSlot *			getReader();
+	bool					registerReader();
+	void					unregisterReader();
+	void					evictReader(uint readerIndex);
+	void					evictStaleReaders(uint32_t readerMask);
+	void					clearInactiveReaders(FrameSlot *slot);
+	uint32_t				getActiveReaderMask();
+	bool					unserializeRing(const Layout *newLayout);
 };
 //=============================================================================
 
+/// <summary>
+/// Returns true if a tile is marked as changed in a map that was returned by
+/// `getFrameChangedTiles()`.
+/// </summary>
+inline bool CaptureSharedSegment::isTileChanged(
+	const uchar *tileMap, uint tilesPerRow, uint tileX, uint tileY)
+{
+	uint bit = tileY * tilesPerRow + tileX;
+	return (tileMap[bit >> 3] & (1 << (bit & 7))) != 0;
+}
+
 inline bool CaptureSharedSegment::isValid() const
 {
 	return m_isValid;
 }
 
+/// <summary>
+/// Returns the number of times that we have registered as a reader of the
+/// ring. This changes whenever the producer dropped us and we registered
+/// again, which means that every frame that was queued for us before then was
+/// lost along with its damage.
+/// </summary>
+inline uint CaptureSharedSegment::getNumRegistrations() const
+{
+	return m_numRegistrations;
+}
+
 inline bool CaptureSharedSegment::isCollision() const
 {
 	return m_isCollision;
@@ -141,7 +453,7 @@ inline string CaptureSharedSegment::getErrorReason() const
 	return m_errorReason;
 }
 
-inline uint CaptureSharedSegment::getSegmentSize() const
+inline uint64_t CaptureSharedSegment::getSegmentSize() const
 {
 	return m_segmentSize;
 }
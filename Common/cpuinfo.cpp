@@ -0,0 +1,237 @@
+//*****************************************************************************
+// Libdeskcap: A high-performance desktop capture library
+//
+// Copyright (C) 2014 Lucas Murray <lucas@polyflare.com>
+// All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation; either version 2 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//*****************************************************************************
+
+#include "cpuinfo.h"
+#include "atomicops.h"
+#ifdef ARCH_X86
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+// The detected features are cached as CPUID is slow. Bit 31 is set once the
+// features have been detected. Racing threads always detect the same value.
+static const uint32_t FEATURES_DETECTED = 0x80000000;
+static volatile uint32_t s_cpuFeatures = 0;
+static volatile uint32_t s_cpuFeatureMask = 0xFFFFFFFF;
+
+// Size of the last level cache in KB, zero if it hasn't been detected yet.
+// Used when the CPU doesn't describe its caches.
+static const uint32_t DEFAULT_LLC_SIZE_KB = 4 * 1024;
+static volatile uint32_t s_llcSizeKb = 0;
+
+#ifdef ARCH_X86
+static void cpuid(int leaf, int subleaf, int regs[4])
+{
+#ifdef _MSC_VER
+	__cpuidex(regs, leaf, subleaf);
+#else
+	__cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+/// <summary>
+/// Returns the extended control register that says which register states the
+/// operating system saves on a context switch.
+/// </summary>
+static uint64_t xgetbv0()
+{
+#ifdef _MSC_VER
+	return (uint64_t)_xgetbv(0);
+#else
+	uint32_t eax, edx;
+	__asm__ __volatile__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+	return ((uint64_t)edx << 32) | (uint64_t)eax;
+#endif
+}
+#endif // ARCH_X86
+
+static uint32_t detectCpuFeatures()
+{
+	uint32_t features = 0;
+#ifdef ARCH_X86
+	int regs[4];
+	cpuid(0, 0, regs);
+	int maxLeaf = regs[0];
+	if(maxLeaf < 1)
+		return features;
+
+	cpuid(1, 0, regs);
+	int ecx1 = regs[2];
+	int edx1 = regs[3];
+	if(edx1 & (1 << 26))
+		features |= SSE2CpuFeature;
+	if(ecx1 & (1 << 9))
+		features |= SSSE3CpuFeature;
+	if(ecx1 & (1 << 19))
+		features |= SSE41CpuFeature;
+
+	// AVX requires the operating system to save the YMM registers and AVX-512
+	// also requires the opmask and ZMM registers to be saved
+	bool osYmm = false;
+	bool osZmm = false;
+	if((ecx1 & (1 << 27)) != 0) { // OSXSAVE
+		uint64_t xcr0 = xgetbv0();
+		osYmm = ((xcr0 & 0x06) == 0x06);
+		osZmm = osYmm && ((xcr0 & 0xE0) == 0xE0);
+	}
+	if(osYmm && (ecx1 & (1 << 28)))
+		features |= AVXCpuFeature;
+	if((features & AVXCpuFeature) && (ecx1 & (1 << 29)))
+		features |= F16CCpuFeature;
+	if(maxLeaf >= 7) {
+		cpuid(7, 0, regs);
+		int ebx7 = regs[1];
+		if((features & AVXCpuFeature) && (ebx7 & (1 << 5)))
+			features |= AVX2CpuFeature;
+		if(osZmm && (ebx7 & (1 << 16))) {
+			features |= AVX512FCpuFeature;
+			if(ebx7 & (1 << 30))
+				features |= AVX512BWCpuFeature;
+		}
+	}
+#endif // ARCH_X86
+	return features;
+}
+
+/// <summary>
+/// Returns the size of the largest data cache in KB or zero if the CPU doesn't
+/// describe its caches.
+/// </summary>
+static uint32_t detectLastLevelCacheSizeKb()
+{
+	uint32_t sizeKb = 0;
+#ifdef ARCH_X86
+	int regs[4];
+	cpuid(0, 0, regs);
+	int maxLeaf = regs[0];
+
+	// Intel's deterministic cache parameters. Every subleaf describes a single
+	// cache until the cache type is null. AMD uses the same format in leaf
+	// 0x8000001D but also reports the size in leaf 0x80000006 below.
+	if(maxLeaf >= 4) {
+		for(int i = 0; i < 16; i++) {
+			cpuid(4, i, regs);
+			int type = regs[0] & 0x1F;
+			if(type == 0)
+				break;
+			if(type == 2)
+				continue; // Instruction cache
+			uint64_t ways = (uint64_t)((regs[1] >> 22) & 0x3FF) + 1;
+			uint64_t partitions = (uint64_t)((regs[1] >> 12) & 0x3FF) + 1;
+			uint64_t lineSize = (uint64_t)(regs[1] & 0xFFF) + 1;
+			uint64_t sets = (uint64_t)(uint32_t)regs[2] + 1;
+			uint64_t size = ways * partitions * lineSize * sets / 1024ULL;
+			if(size > sizeKb)
+				sizeKb = (uint32_t)size;
+		}
+	}
+	if(sizeKb != 0)
+		return sizeKb;
+
+	// AMD's L2 size is in KB and L3 size is in 512KB units
+	cpuid(0x80000000, 0, regs);
+	if((uint32_t)regs[0] >= 0x80000006U) {
+		cpuid(0x80000006, 0, regs);
+		uint32_t l2Kb = ((uint32_t)regs[2] >> 16) & 0xFFFF;
+		uint32_t l3Kb = (((uint32_t)regs[3] >> 18) & 0x3FFF) * 512;
+		sizeKb = l2Kb;
+		if(l3Kb > sizeKb)
+			sizeKb = l3Kb;
+	}
+#endif // ARCH_X86
+	return sizeKb;
+}
+
+/// <summary>
+/// Returns a bitmask of `CpuFeature` values that are supported by the CPU
+/// that we are running on and that have not been disabled with
+/// `setCpuFeatureMask()`.
+/// </summary>
+uint getCpuFeatures()
+{
+	uint32_t features = atomicLoad32(&s_cpuFeatures);
+	if(!(features & FEATURES_DETECTED)) {
+		features = detectCpuFeatures() | FEATURES_DETECTED;
+		atomicStore32(&s_cpuFeatures, features);
+	}
+	return (uint)(features & ~FEATURES_DETECTED &
+		atomicLoad32(&s_cpuFeatureMask));
+}
+
+bool hasCpuFeature(CpuFeature feature)
+{
+	return (getCpuFeatures() & (uint)feature) != 0;
+}
+
+/// <summary>
+/// Hides every feature that is not in `mask` from `getCpuFeatures()`. Used
+/// for benchmarking and to work around buggy code paths. Pass `0xFFFFFFFF`
+/// to restore the default.
+/// </summary>
+void setCpuFeatureMask(uint mask)
+{
+	atomicStore32(&s_cpuFeatureMask, (uint32_t)mask);
+}
+
+/// <summary>
+/// Returns the supported features in a human-readable form for logging.
+/// </summary>
+string getCpuFeaturesString()
+{
+	uint features = getCpuFeatures();
+	string str;
+	if(features & SSE2CpuFeature)
+		str += " SSE2";
+	if(features & SSSE3CpuFeature)
+		str += " SSSE3";
+	if(features & SSE41CpuFeature)
+		str += " SSE4.1";
+	if(features & AVXCpuFeature)
+		str += " AVX";
+	if(features & AVX2CpuFeature)
+		str += " AVX2";
+	if(features & F16CCpuFeature)
+		str += " F16C";
+	if(features & AVX512FCpuFeature)
+		str += " AVX-512F";
+	if(features & AVX512BWCpuFeature)
+		str += " AVX-512BW";
+	if(str.empty())
+		return string("None");
+	return str.substr(1);
+}
+
+/// <summary>
+/// Returns the size of the last level cache in bytes. This is shared with
+/// every other core in the package so it is only a rough upper bound of how
+/// much data we can keep in the cache. If the CPU doesn't describe its caches
+/// then a conservative default is returned.
+/// </summary>
+size_t getLastLevelCacheSize()
+{
+	uint32_t sizeKb = atomicLoad32(&s_llcSizeKb);
+	if(sizeKb == 0) {
+		sizeKb = detectLastLevelCacheSizeKb();
+		if(sizeKb == 0)
+			sizeKb = DEFAULT_LLC_SIZE_KB;
+		atomicStore32(&s_llcSizeKb, sizeKb);
+	}
+	return (size_t)sizeKb * 1024;
+}
@@ -0,0 +1,47 @@
+//*****************************************************************************
+// Libdeskcap: A high-performance desktop capture library
+//
+// Copyright (C) 2014 Lucas Murray <lucas@polyflare.com>
+// All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation; either version 2 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//*****************************************************************************
+
+#ifndef COMMON_CPUINFO_H
+#define COMMON_CPUINFO_H
+
+#include "stlincludes.h"
+
+/// <summary>
+/// Instruction set extensions that optimized code paths can use. A feature is
+/// only reported if both the CPU and the operating system support it.
+/// </summary>
+enum CpuFeature {
+	SSE2CpuFeature = 0x0001,
+	SSSE3CpuFeature = 0x0002,
+	SSE41CpuFeature = 0x0004,
+	AVXCpuFeature = 0x0008,
+	AVX2CpuFeature = 0x0010,
+	AVX512FCpuFeature = 0x0020, // Foundation
+	AVX512BWCpuFeature = 0x0040, // Byte and word instructions
+	F16CCpuFeature = 0x0080 // Half-precision float conversion
+};
+
+//=============================================================================
+// Helper functions
+
+uint	getCpuFeatures();
+bool	hasCpuFeature(CpuFeature feature);
+void	setCpuFeatureMask(uint mask);
+string	getCpuFeaturesString();
+size_t	getLastLevelCacheSize();
+
+#endif // COMMON_CPUINFO_H
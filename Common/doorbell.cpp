@@ -0,0 +1,167 @@
+//*****************************************************************************
+// Libdeskcap: A high-performance desktop capture library
+//
+// Copyright (C) 2014 Lucas Murray <lucas@polyflare.com>
+// All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation; either version 2 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//*****************************************************************************
+
+#include "macros.h"
+#ifdef OS_WIN
+#include <windows.h>
+#elif defined(OS_LINUX)
+#include <climits>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#else
+#include <boost/thread/thread.hpp>
+#endif
+#include "doorbell.h"
+#include "atomicops.h"
+#include "stlhelpers.h"
+
+// Interval that is used to poll the generation counter on platforms that
+// don't have a native wait primitive
+const uint POLL_INTERVAL_USEC = 250;
+
+/// <summary>
+/// Creates a doorbell that uses the specified shared state. `name` must be
+/// unique to the shared state and is only used on operating systems that
+/// require a named kernel object in order to wait across processes.
+/// </summary>
+Doorbell::Doorbell(DoorbellState *state, const string &name)
+	: m_state(state)
+#ifdef OS_WIN
+	, m_semaphore(NULL)
+#endif
+{
+#ifdef OS_WIN
+	// Opens the existing semaphore if another process already created it. The
+	// count is never relied upon so it can safely saturate.
+	string semName = "LibdeskcapDoorbell-" + name;
+	m_semaphore = CreateSemaphoreA(NULL, 0, LONG_MAX, semName.data());
+#else
+	(void)name; // Futexes and polling don't need a kernel object name
+#endif
+}
+
+Doorbell::~Doorbell()
+{
+#ifdef OS_WIN
+	if(m_semaphore != NULL)
+		CloseHandle(m_semaphore);
+#endif
+}
+
+bool Doorbell::isValid() const
+{
+	if(m_state == NULL)
+		return false;
+#ifdef OS_WIN
+	if(m_semaphore == NULL)
+		return false;
+#endif
+	return true;
+}
+
+uint32_t Doorbell::getGeneration() const
+{
+	if(m_state == NULL)
+		return 0;
+	return atomicLoad32(&m_state->generation);
+}
+
+/// <summary>
+/// Increments the generation counter and wakes every thread that is waiting
+/// on the doorbell in any process.
+/// </summary>
+void Doorbell::ring()
+{
+	if(m_state == NULL)
+		return;
+	atomicFetchAdd32(&m_state->generation, 1);
+
+	// The fence pairs with the one in `wait()` so that either we see the
+	// waiter or the waiter sees the new generation
+	atomicFence();
+	uint32_t numWaiters = atomicLoad32(&m_state->numWaiters);
+	if(numWaiters == 0)
+		return; // Nobody to wake, don't enter the kernel
+
+#ifdef OS_WIN
+	if(m_semaphore != NULL)
+		ReleaseSemaphore(m_semaphore, (LONG)numWaiters, NULL);
+#elif defined(OS_LINUX)
+	syscall(SYS_futex, &m_state->generation, FUTEX_WAKE, INT_MAX,
+		NULL, NULL, 0);
+#endif
+}
+
+/// <summary>
+/// Blocks the calling thread until the generation counter differs from
+/// `generation` or until `timeoutUsec` microseconds have passed. Callers
+/// should read the generation with `getGeneration()` before testing the
+/// condition that they are waiting for to prevent missing a ring.
+/// </summary>
+/// <returns>True if the doorbell was rung</returns>
+bool Doorbell::wait(uint32_t generation, uint timeoutUsec)
+{
+	if(!isValid())
+		return false;
+	if(getGeneration() != generation)
+		return true;
+	if(timeoutUsec == 0)
+		return false;
+
+	atomicFetchAdd32(&m_state->numWaiters, 1);
+	atomicFence();
+
+	bool rung = false;
+	uint64_t deadline = getMonotonicUsec() + (uint64_t)timeoutUsec;
+	for(;;) {
+		if(getGeneration() != generation) {
+			rung = true;
+			break;
+		}
+		uint64_t now = getMonotonicUsec();
+		if(now >= deadline)
+			break;
+		uint64_t remaining = deadline - now;
+
+#ifdef OS_WIN
+		// Spurious wake ups caused by stale semaphore counts are harmless as
+		// we always test the generation again. Round the timeout up so that
+		// we never return before the deadline.
+		DWORD msec = (DWORD)((remaining + 999ULL) / 1000ULL);
+		WaitForSingleObject(m_semaphore, msec);
+#elif defined(OS_LINUX)
+		// The kernel only sleeps if the generation still matches which
+		// prevents a lost wake up between our test and the wait
+		struct timespec ts;
+		ts.tv_sec = (time_t)(remaining / 1000000ULL);
+		ts.tv_nsec = (long)((remaining % 1000000ULL) * 1000ULL);
+		syscall(SYS_futex, &m_state->generation, FUTEX_WAIT, generation,
+			&ts, NULL, 0);
+#else
+		// No native primitive, fall back to polling
+		uint64_t sleepUsec = POLL_INTERVAL_USEC;
+		if(remaining < sleepUsec)
+			sleepUsec = remaining;
+		boost::this_thread::sleep_for(boost::chrono::microseconds(sleepUsec));
+#endif
+	}
+
+	atomicFetchAdd32(&m_state->numWaiters, (uint32_t)-1);
+	return rung;
+}
@@ -0,0 +1,66 @@
+//*****************************************************************************
+// Libdeskcap: A high-performance desktop capture library
+//
+// Copyright (C) 2014 Lucas Murray <lucas@polyflare.com>
+// All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation; either version 2 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//*****************************************************************************
+
+#ifndef COMMON_DOORBELL_H
+#define COMMON_DOORBELL_H
+
+#include "stlincludes.h"
+
+// WARNING: All datatypes must have the same size on both 32- and 64-bit
+// systems as the memory could be shared between processes of different
+// bitness!
+struct DoorbellState {
+	uint32_t	generation; // Incremented every time the doorbell is rung
+	uint32_t	numWaiters; // Number of threads blocked in `wait()`
+
+	DoorbellState() : generation(0), numWaiters(0) {};
+};
+
+//=============================================================================
+/// <summary>
+/// An interprocess notification that lets a consumer block until a producer
+/// has something new for it instead of polling. The state lives in shared
+/// memory and contains a generation counter that is incremented every time
+/// the doorbell is rung which also allows consumers to cheaply test if
+/// anything has changed since they last looked.
+///
+/// On Linux waiting is implemented with a futex on the generation counter
+/// itself. On Windows a named semaphore is used that is only signalled when
+/// there is at least one waiter. Ringing the doorbell when nobody is waiting
+/// never enters the kernel.
+/// </summary>
+class Doorbell
+{
+private: // Members -----------------------------------------------------------
+	DoorbellState *	m_state;
+#ifdef OS_WIN
+	void *			m_semaphore; // HANDLE
+#endif
+
+public: // Constructor/destructor ---------------------------------------------
+	Doorbell(DoorbellState *state, const string &name);
+	virtual ~Doorbell();
+
+public: // Methods ------------------------------------------------------------
+	bool		isValid() const;
+	uint32_t	getGeneration() const;
+	void		ring();
+	bool		wait(uint32_t generation, uint timeoutUsec);
+};
+//=============================================================================
+
+#endif // COMMON_DOORBELL_H
@@ -0,0 +1,422 @@
+//*****************************************************************************
+// Libdeskcap: A high-performance desktop capture library
+//
+// Copyright (C) 2014 Lucas Murray <lucas@polyflare.com>
+// All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation; either version 2 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//*****************************************************************************
+
+#include "framecodec.h"
+#include "cpuinfo.h"
+#ifdef ARCH_X86
+#include <immintrin.h>
+#endif
+
+//=============================================================================
+// Stream format
+//
+// An encoded frame begins with a `FrameCodecHeader` which is followed by the
+// rows of the frame from top to bottom. Every row is a sequence of ops that
+// cover the row exactly, ops never continue into the next row. Each op begins
+// with a tag byte where the top two bits are the op and the bottom six bits
+// are the number of pixels minus one. A value of 63 means that the number of
+// pixels minus 64 follows as a little-endian base-128 varint.
+//
+// LITERAL:  The pixels follow as raw BGRA.
+// LEFT:     Repeats the pixel to the left. Invalid at the start of a row.
+// UP:       Copies the pixels from the row above. Invalid in the first row.
+//
+// All multi-byte header fields are little-endian. We only ever run on
+// little-endian CPUs so they are read and written directly.
+
+static const uint32_t FRAME_CODEC_MAGIC = 0x4643444C; // "LDCF"
+static const uint16_t FRAME_CODEC_VERSION = 1;
+
+static const uint LITERAL_OP = 0;
+static const uint LEFT_OP = 1;
+static const uint UP_OP = 2;
+
+static const uint SHORT_LENGTH_MAX = 63;
+static const uint EXTENDED_LENGTH = 63;
+
+// Each op costs at most 6 bytes. A run of 2 pixels is the shortest run that
+// always costs less than the literal pixels that it replaces even when it
+// splits a literal op in two which is what bounds the encoded size.
+static const uint MAX_OP_HEADER_SIZE = 6;
+static const uint MIN_RUN_LENGTH = 2;
+
+// WARNING: Stored on disk and in shared memory, the layout must never change
+struct FrameCodecHeader {
+	uint32_t	magic;
+	uint16_t	version;
+	uint16_t	flags; // Reserved, must be zero
+	uint32_t	width;
+	uint32_t	height;
+};
+
+/// <summary>
+/// Returns the index of the first pixel at or after `x` that is identical to
+/// the pixel to its left or the pixel above it. `up` is NULL for the first
+/// row.
+/// </summary>
+typedef uint (*ScanLiteralsFunc)(
+	const uchar *row, const uchar *up, uint x, uint width);
+
+/// <summary>
+/// Returns the number of leading pixels that are identical in `a` and `b`, up
+/// to `max`. `b` may overlap `a`.
+/// </summary>
+typedef uint (*CountEqualFunc)(const uchar *a, const uchar *b, uint max);
+
+static inline bool pixelEquals(const uchar *a, const uchar *b)
+{
+	return *(const uint32_t *)a == *(const uint32_t *)b;
+}
+
+//=============================================================================
+// Scalar kernels
+
+static uint scanLiteralsScalar(
+	const uchar *row, const uchar *up, uint x, uint width)
+{
+	for(; x < width; x++) {
+		const uchar *px = &row[x * 4];
+		if(x > 0 && pixelEquals(px, px - 4))
+			return x;
+		if(up != NULL && pixelEquals(px, &up[x * 4]))
+			return x;
+	}
+	return width;
+}
+
+static uint countEqualScalar(const uchar *a, const uchar *b, uint max)
+{
+	uint n = 0;
+	while(n < max && pixelEquals(&a[n * 4], &b[n * 4]))
+		n++;
+	return n;
+}
+
+//=============================================================================
+// SSE2 kernels. Pixels are compared four at a time as 32-bit elements.
+
+#ifdef ARCH_X86
+/// <summary>
+/// Returns the number of trailing set bits in the 4-bit `mask`.
+/// </summary>
+static inline uint countTrailingOnes4(int mask)
+{
+	uint n = 0;
+	while(mask & 1) {
+		n++;
+		mask >>= 1;
+	}
+	return n;
+}
+
+SIMD_TARGET("sse2")
+static inline int cmpPixels4(const uchar *a, const uchar *b)
+{
+	__m128i eq = _mm_cmpeq_epi32(
+		_mm_loadu_si128((const __m128i *)a),
+		_mm_loadu_si128((const __m128i *)b));
+	return _mm_movemask_ps(_mm_castsi128_ps(eq));
+}
+
+SIMD_TARGET("sse2")
+static uint scanLiteralsSSE2(
+	const uchar *row, const uchar *up, uint x, uint width)
+{
+	// The first pixel has no left neighbour
+	if(x == 0 && width > 0) {
+		if(up != NULL && pixelEquals(row, up))
+			return 0;
+		x = 1;
+	}
+	if(up == NULL) {
+		for(; x + 4 <= width; x += 4) {
+			const uchar *px = &row[x * 4];
+			int mask = cmpPixels4(px, px - 4);
+			if(mask != 0)
+				return x + countTrailingOnes4(~mask);
+		}
+	} else {
+		for(; x + 4 <= width; x += 4) {
+			const uchar *px = &row[x * 4];
+			__m128i cur = _mm_loadu_si128((const __m128i *)px);
+			__m128i eq = _mm_or_si128(
+				_mm_cmpeq_epi32(
+					cur, _mm_loadu_si128((const __m128i *)(px - 4))),
+				_mm_cmpeq_epi32(
+					cur, _mm_loadu_si128((const __m128i *)&up[x * 4])));
+			int mask = _mm_movemask_ps(_mm_castsi128_ps(eq));
+			if(mask != 0)
+				return x + countTrailingOnes4(~mask);
+		}
+	}
+	return scanLiteralsScalar(row, up, x, width);
+}
+
+SIMD_TARGET("sse2")
+static uint countEqualSSE2(const uchar *a, const uchar *b, uint max)
+{
+	uint n = 0;
+	for(; n + 8 <= max; n += 8) {
+		int mask = cmpPixels4(&a[n * 4], &b[n * 4]) |
+			(cmpPixels4(&a[n * 4 + 16], &b[n * 4 + 16]) << 4);
+		if(mask != 0xFF) {
+			while(mask & 1) {
+				n++;
+				mask >>= 1;
+			}
+			return n;
+		}
+	}
+	return n + countEqualScalar(&a[n * 4], &b[n * 4], max - n);
+}
+#endif // ARCH_X86
+
+//=============================================================================
+// Encoder
+
+static inline uchar *writeOp(uchar *out, uint op, uint length)
+{
+	if(length <= SHORT_LENGTH_MAX) {
+		*out++ = (uchar)((op << 6) | (length - 1));
+		return out;
+	}
+	*out++ = (uchar)((op << 6) | EXTENDED_LENGTH);
+	uint value = length - SHORT_LENGTH_MAX - 1;
+	while(value >= 0x80) {
+		*out++ = (uchar)(value | 0x80);
+		value >>= 7;
+	}
+	*out++ = (uchar)value;
+	return out;
+}
+
+static inline uchar *writeLiterals(uchar *out, const uchar *px, uint length)
+{
+	if(length == 0)
+		return out;
+	out = writeOp(out, LITERAL_OP, length);
+	memcpy(out, px, length * 4);
+	return out + length * 4;
+}
+
+/// <summary>
+/// Encodes a single row. The output buffer must have room for
+/// `width * 4 + MAX_OP_HEADER_SIZE` bytes.
+/// </summary>
+static uchar *encodeRow(
+	uchar *out, const uchar *row, const uchar *up, uint width,
+	ScanLiteralsFunc scanLiterals, CountEqualFunc countEqual)
+{
+	uint litStart = 0;
+	uint x = 0;
+	while(x < width) {
+		x = scanLiterals(row, up, x, width);
+		if(x >= width)
+			break;
+
+		// Use the longest run that starts here, the row above wins ties as
+		// it is the cheapest to decode
+		const uchar *px = &row[x * 4];
+		uint upLength = 0;
+		if(up != NULL)
+			upLength = countEqual(px, &up[x * 4], width - x);
+		uint leftLength = 0;
+		if(x > 0)
+			leftLength = countEqual(px, px - 4, width - x);
+		uint length = (upLength >= leftLength) ? upLength : leftLength;
+		if(length < MIN_RUN_LENGTH) {
+			x++;
+			continue;
+		}
+
+		out = writeLiterals(out, &row[litStart * 4], x - litStart);
+		out = writeOp(out, (upLength >= leftLength) ? UP_OP : LEFT_OP, length);
+		x += length;
+		litStart = x;
+	}
+	return writeLiterals(out, &row[litStart * 4], width - litStart);
+}
+
+/// <summary>
+/// Returns the largest possible size of an encoded frame of the specified
+/// size. Encoding never fails if the output buffer is at least this large.
+/// </summary>
+uint64_t calcFrameCodecBound(uint width, uint height)
+{
+	uint64_t rowBound = (uint64_t)width * 4ULL + MAX_OP_HEADER_SIZE;
+	return sizeof(FrameCodecHeader) + rowBound * (uint64_t)height;
+}
+
+/// <summary>
+/// Losslessly encodes a frame of 8-bit BGRA pixels. The alpha channel is
+/// preserved but is otherwise treated like any other channel.
+/// </summary>
+/// <returns>The size of the encoded frame or 0 if it didn't fit</returns>
+uint64_t encodeFrame(
+	void *dst, uint64_t dstSize, const void *src, uint srcStride,
+	uint width, uint height)
+{
+	if(dst == NULL || src == NULL || width == 0 || height == 0)
+		return 0;
+	if(dstSize < sizeof(FrameCodecHeader))
+		return 0;
+
+	ScanLiteralsFunc scanLiterals = &scanLiteralsScalar;
+	CountEqualFunc countEqual = &countEqualScalar;
+#ifdef ARCH_X86
+	if(getCpuFeatures() & SSE2CpuFeature) {
+		scanLiterals = &scanLiteralsSSE2;
+		countEqual = &countEqualSSE2;
+	}
+#endif
+
+	FrameCodecHeader header;
+	header.magic = FRAME_CODEC_MAGIC;
+	header.version = FRAME_CODEC_VERSION;
+	header.flags = 0;
+	header.width = width;
+	header.height = height;
+	uchar *out = (uchar *)dst;
+	memcpy(out, &header, sizeof(header));
+	out += sizeof(header);
+
+	// Only test the remaining space once per row as that is much cheaper
+	// than testing every op
+	const uchar *srcRow = (const uchar *)src;
+	const uchar *end = (uchar *)dst + dstSize;
+	uint64_t rowBound = (uint64_t)width * 4ULL + MAX_OP_HEADER_SIZE;
+	const uchar *up = NULL;
+	for(uint y = 0; y < height; y++) {
+		if((uint64_t)(end - out) < rowBound)
+			return 0;
+		out = encodeRow(out, srcRow, up, width, scanLiterals, countEqual);
+		up = srcRow;
+		srcRow += srcStride;
+	}
+	return (uint64_t)(out - (uchar *)dst);
+}
+
+//=============================================================================
+// Decoder
+
+/// <summary>
+/// Returns the dimensions of an encoded frame without decoding it.
+/// </summary>
+/// <returns>False if the data is not an encoded frame</returns>
+bool getEncodedFrameSize(
+	const void *src, uint64_t srcSize, uint *widthOut, uint *heightOut)
+{
+	if(src == NULL || srcSize < sizeof(FrameCodecHeader))
+		return false;
+	FrameCodecHeader header;
+	memcpy(&header, src, sizeof(header));
+	if(header.magic != FRAME_CODEC_MAGIC)
+		return false;
+	if(header.version != FRAME_CODEC_VERSION || header.flags != 0)
+		return false;
+	if(header.width == 0 || header.height == 0)
+		return false;
+	if(widthOut != NULL)
+		*widthOut = header.width;
+	if(heightOut != NULL)
+		*heightOut = header.height;
+	return true;
+}
+
+static inline void fillPixels(uchar *dst, const uchar *px, uint length)
+{
+	uint32_t value = *(const uint32_t *)px;
+	uint32_t *out = (uint32_t *)dst;
+	for(uint i = 0; i < length; i++)
+		out[i] = value;
+}
+
+/// <summary>
+/// Decodes a frame that was encoded with `encodeFrame()` into `dst`. The frame
+/// must not be larger than `maxWidth` by `maxHeight` pixels. The encoded data
+/// is fully validated so corrupt or malicious input can never write outside of
+/// the destination. The destination is left partially written if decoding
+/// fails.
+/// </summary>
+/// <returns>False if the data is invalid or the frame is too large</returns>
+bool decodeFrame(
+	void *dst, uint dstStride, uint maxWidth, uint maxHeight,
+	const void *src, uint64_t srcSize)
+{
+	uint width, height;
+	if(dst == NULL || !getEncodedFrameSize(src, srcSize, &width, &height))
+		return false;
+	if(width > maxWidth || height > maxHeight)
+		return false;
+	if((uint64_t)dstStride < (uint64_t)width * 4ULL)
+		return false;
+
+	const uchar *in = (const uchar *)src + sizeof(FrameCodecHeader);
+	const uchar *end = (const uchar *)src + srcSize;
+	uchar *row = (uchar *)dst;
+	for(uint y = 0; y < height; y++, row += dstStride) {
+		uint x = 0;
+		while(x < width) {
+			if(in >= end)
+				return false;
+			uint tag = *in++;
+			uint op = tag >> 6;
+			uint64_t length = (tag & 0x3F) + 1;
+			if((tag & 0x3F) == EXTENDED_LENGTH) {
+				uint64_t value = 0;
+				uint shift = 0;
+				for(;;) {
+					if(in >= end || shift > 28)
+						return false;
+					uint byte = *in++;
+					value |= (uint64_t)(byte & 0x7F) << shift;
+					shift += 7;
+					if((byte & 0x80) == 0)
+						break;
+				}
+				length = value + SHORT_LENGTH_MAX + 1;
+			}
+			if(length > width - x)
+				return false;
+
+			uchar *out = &row[x * 4];
+			uint numBytes = (uint)length * 4;
+			switch(op) {
+			case LITERAL_OP:
+				if((uint64_t)(end - in) < numBytes)
+					return false;
+				memcpy(out, in, numBytes);
+				in += numBytes;
+				break;
+			case LEFT_OP:
+				if(x == 0)
+					return false;
+				fillPixels(out, out - 4, (uint)length);
+				break;
+			case UP_OP:
+				if(y == 0)
+					return false;
+				memcpy(out, out - dstStride, numBytes);
+				break;
+			default:
+				return false; // Reserved
+			}
+			x += (uint)length;
+		}
+	}
+	return in == end;
+}
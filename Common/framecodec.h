@@ -0,0 +1,46 @@
+//*****************************************************************************
+// Libdeskcap: A high-performance desktop capture library
+//
+// Copyright (C) 2014 Lucas Murray <lucas@polyflare.com>
+// All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation; either version 2 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//*****************************************************************************
+
+#ifndef COMMON_FRAMECODEC_H
+#define COMMON_FRAMECODEC_H
+
+#include "stlincludes.h"
+
+//=============================================================================
+// A fast lossless codec for 8-bit BGRA frames that is designed for screen
+// content such as desktops and remote applications which mostly consist of
+// flat colours and repeated rows. Each row is encoded independently as a
+// sequence of runs of pixels that are identical to the pixel to their left,
+// runs of pixels that are identical to the row above and literal pixels.
+// There is no entropy coding so the ratio of noisy content such as games is
+// close to 1:1 but both encoding and decoding are bounded by memory
+// bandwidth. See framecodec.cpp for a description of the format.
+//
+// Encoded frames are self-describing and decoding validates everything so
+// the codec can safely be used for data that was read from disk.
+
+uint64_t	calcFrameCodecBound(uint width, uint height);
+uint64_t	encodeFrame(
+	void *dst, uint64_t dstSize, const void *src, uint srcStride,
+	uint width, uint height);
+bool		getEncodedFrameSize(
+	const void *src, uint64_t srcSize, uint *widthOut, uint *heightOut);
+bool		decodeFrame(
+	void *dst, uint dstStride, uint maxWidth, uint maxHeight,
+	const void *src, uint64_t srcSize);
+
+#endif // COMMON_FRAMECODEC_H
@@ -0,0 +1,628 @@
+//*****************************************************************************
+// Libdeskcap: A high-performance desktop capture library
+//
+// Copyright (C) 2014 Lucas Murray <lucas@polyflare.com>
+// All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation; either version 2 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//*****************************************************************************
+
+#include "framededup.h"
+#include "cpuinfo.h"
+#include "imghelpers.h"
+#ifdef ARCH_X86
+#include <emmintrin.h>
+#endif
+
+typedef CaptureSharedSegment::DirtyRect DirtyRect;
+
+// Hash constants. Every 16-byte chunk of a row is mixed with a different key
+// so that moving data within a row changes the hash and the accumulators are
+// scrambled after every row so that moving rows does too.
+static const uint64_t HASH_SEED[2] = {
+	0x243F6A8885A308D3ULL, 0x13198A2E03707344ULL };
+static const uint64_t HASH_KEY[2] = {
+	0x9E3779B185EBCA87ULL, 0xC2B2AE3D27D4EB4FULL };
+static const uint64_t HASH_KEY_STEP[2] = {
+	0x165667B19E3779F9ULL, 0x27D4EB2F165667C5ULL };
+static const uint64_t HASH_SCRAMBLE[2] = {
+	0xA4093822299F31D0ULL, 0x082EFA98EC4E6C89ULL };
+static const uint32_t HASH_PRIME = 0x9E3779B1U;
+
+struct TileCopyTask {
+	FrameDeduplicator *	dedup;
+	uint				slot;
+	uchar *				dst;
+	const uchar *		src;
+	uint				dstStride;
+	uint				srcStride;
+	uint				left; // Rectangle that is copied
+	uint				top;
+	uint				right;
+	uint				bottom;
+	uint				firstTileX; // Tiles that intersect the rectangle
+	uint				lastTileX;
+	uint				firstTileY;
+	bool				hashOnly; // Only compare to the previous frame
+};
+
+//=============================================================================
+// Hashing
+
+/// <summary>
+/// Accumulates a single row into `acc`. Only whole 16-byte chunks are
+/// processed, the caller handles the rest.
+/// </summary>
+typedef void (*HashRowFunc)(
+	uint64_t *acc, uint64_t *key, const uchar *src, uint numChunks);
+
+static inline uint64_t load64(const uchar *src)
+{
+	uint64_t ret;
+	memcpy(&ret, src, sizeof(ret));
+	return ret;
+}
+
+static void hashRowScalar(
+	uint64_t *acc, uint64_t *key, const uchar *src, uint numChunks)
+{
+	for(uint i = 0; i < numChunks; i++) {
+		for(int lane = 0; lane < 2; lane++) {
+			uint64_t data = load64(src + lane * 8);
+			uint64_t dk = data ^ key[lane];
+			acc[lane] += data + (dk & 0xFFFFFFFFULL) * (dk >> 32);
+			key[lane] += HASH_KEY_STEP[lane];
+		}
+		src += 16;
+	}
+}
+
+#ifdef ARCH_X86
+SIMD_TARGET("sse2")
+static void hashRowSSE2(
+	uint64_t *acc, uint64_t *key, const uchar *src, uint numChunks)
+{
+	__m128i a = _mm_loadu_si128((const __m128i *)acc);
+	__m128i k = _mm_loadu_si128((const __m128i *)key);
+	const __m128i step = _mm_loadu_si128((const __m128i *)HASH_KEY_STEP);
+	for(uint i = 0; i < numChunks; i++) {
+		__m128i data = _mm_loadu_si128((const __m128i *)src);
+		__m128i dk = _mm_xor_si128(data, k);
+		__m128i prod = _mm_mul_epu32(dk, _mm_srli_epi64(dk, 32));
+		a = _mm_add_epi64(a, _mm_add_epi64(data, prod));
+		k = _mm_add_epi64(k, step);
+		src += 16;
+	}
+	_mm_storeu_si128((__m128i *)acc, a);
+	_mm_storeu_si128((__m128i *)key, k);
+}
+#endif // ARCH_X86
+
+static HashRowFunc getHashRowFunc()
+{
+#ifdef ARCH_X86
+	if(getCpuFeatures() & SSE2CpuFeature)
+		return &hashRowSSE2;
+#endif // ARCH_X86
+	return &hashRowScalar;
+}
+
+static uint64_t hashRows(
+	HashRowFunc hashRow, const uchar *src, uint stride, uint widthBytes,
+	uint numRows)
+{
+	uint64_t acc[2] = { HASH_SEED[0], HASH_SEED[1] };
+	uint numChunks = widthBytes / 16;
+	uint tailBytes = widthBytes % 16;
+	for(uint y = 0; y < numRows; y++) {
+		uint64_t key[2] = { HASH_KEY[0], HASH_KEY[1] };
+		hashRow(acc, key, src, numChunks);
+		if(tailBytes > 0) {
+			// Pad the end of the row with zeros
+			uchar tail[16];
+			memset(tail, 0, sizeof(tail));
+			memcpy(tail, src + numChunks * 16, tailBytes);
+			hashRowScalar(acc, key, tail, 1);
+		}
+		for(int lane = 0; lane < 2; lane++) {
+			acc[lane] ^= acc[lane] >> 47;
+			acc[lane] ^= HASH_SCRAMBLE[lane];
+			acc[lane] *= HASH_PRIME;
+		}
+		src += stride;
+	}
+
+	// Final avalanche so that every input bit affects every output bit
+	uint64_t h = acc[0] + ((acc[1] << 31) | (acc[1] >> 33));
+	h ^= ((uint64_t)widthBytes << 32) | (uint64_t)numRows;
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDULL;
+	h ^= h >> 33;
+	h *= 0xC4CEB9FE1A85EC53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+/// <summary>
+/// Calculates a fast 64-bit hash of a block of image rows. The hash is only
+/// designed to detect changes between frames and is not cryptographically
+/// secure. The same data always results in the same hash regardless of the
+/// instruction set that was used.
+/// </summary>
+uint64_t imgHashRows(
+	const void *src, uint stride, uint widthBytes, uint numRows)
+{
+	return hashRows(getHashRowFunc(), (const uchar *)src, stride,
+		widthBytes, numRows);
+}
+
+//=============================================================================
+// FrameDeduplicator class
+
+FrameDeduplicator::FrameDeduplicator()
+	: m_width(0)
+	, m_height(0)
+	, m_bpp(0)
+	, m_numSlots(0)
+	, m_tilesX(0)
+	, m_tilesY(0)
+	, m_prevHashes()
+	, m_prevValid()
+	, m_slotHashes()
+	, m_slotValid()
+	, m_changed()
+	, m_bytesCopied(0)
+	, m_bytesSaved(0)
+	, m_numMostlyChanged(0)
+	, m_bypassLeft(0)
+{
+}
+
+FrameDeduplicator::~FrameDeduplicator()
+{
+}
+
+/// <summary>
+/// Forgets everything that we know about the frame slots. Must be called
+/// whenever the frame size or segment changes.
+/// </summary>
+void FrameDeduplicator::reset(
+	uint width, uint height, uint bpp, uint numSlots)
+{
+	const uint tileSize = CaptureSharedSegment::TILE_SIZE;
+	m_width = width;
+	m_height = height;
+	m_bpp = bpp;
+	m_numSlots = numSlots;
+	m_tilesX = (width + tileSize - 1) / tileSize;
+	m_tilesY = (height + tileSize - 1) / tileSize;
+	size_t numTiles = (size_t)m_tilesX * (size_t)m_tilesY;
+	m_prevHashes.assign(numTiles, 0);
+	m_prevValid.assign(numTiles, 0);
+	m_slotHashes.assign(numTiles * numSlots, 0);
+	m_slotValid.assign(numTiles * numSlots, 0);
+	m_changed.assign(numTiles, 0);
+	m_bytesCopied = 0;
+	m_bytesSaved = 0;
+	m_numMostlyChanged = 0;
+	m_bypassLeft = 0;
+}
+
+/// <summary>
+/// Marks the contents of a frame slot as unknown. Must be called whenever
+/// the slot is written to without using `copyFrame()`.
+/// </summary>
+void FrameDeduplicator::invalidateSlot(uint slot)
+{
+	if(slot >= m_numSlots)
+		return;
+	size_t numTiles = m_prevHashes.size();
+	memset(&m_slotValid[numTiles * slot], 0, numTiles);
+}
+
+/// <summary>
+/// Forgets the previously published frame so that every tile of the next
+/// frame is reported as changed.
+/// </summary>
+void FrameDeduplicator::invalidatePrevious()
+{
+	if(!m_prevValid.empty())
+		memset(&m_prevValid[0], 0, m_prevValid.size());
+}
+
+/// <summary>
+/// Records that the frame slot `slot` was written without `copyFrame()`
+/// while `isBypassing()` returned true. As the frame wasn't hashed the next
+/// frame that is copied is entirely changed.
+/// </summary>
+void FrameDeduplicator::bypassFrame(uint slot)
+{
+	invalidateSlot(slot);
+	invalidatePrevious();
+	if(m_bypassLeft > 0)
+		m_bypassLeft--;
+}
+
+/// <summary>
+/// Clips `rect` to the frame and returns its right and bottom edges.
+/// </summary>
+/// <returns>False if nothing remains</returns>
+bool FrameDeduplicator::clipRect(
+	const DirtyRect &rect, uint *rightOut, uint *bottomOut) const
+{
+	if(rect.width == 0 || rect.height == 0)
+		return false;
+	if(rect.x >= m_width || rect.y >= m_height)
+		return false;
+	*rightOut = rect.x + rect.width;
+	if(*rightOut > m_width)
+		*rightOut = m_width;
+	*bottomOut = rect.y + rect.height;
+	if(*bottomOut > m_height)
+		*bottomOut = m_height;
+	return true;
+}
+
+/// <summary>
+/// Tests if the area `rect` of a frame is identical to the same area of the
+/// frame that was last passed to `copyFrame()` without copying anything or
+/// modifying what we know about the frame slots. `src` points to the
+/// top-left pixel of `rect`. Hashing the frame costs about the same as
+/// copying it with `copyFrame()` so this should only be used while the
+/// content is expected to be static.
+/// </summary>
+bool FrameDeduplicator::isUnchanged(
+	const void *src, uint srcStride, const DirtyRect &rect)
+{
+	const uint tileSize = CaptureSharedSegment::TILE_SIZE;
+	uint right, bottom;
+	if(m_numSlots == 0 || !clipRect(rect, &right, &bottom))
+		return false;
+
+	TileCopyTask task;
+	task.dedup = this;
+	task.slot = 0;
+	task.dst = NULL;
+	task.src = (const uchar *)src;
+	task.dstStride = 0;
+	task.srcStride = srcStride;
+	task.left = rect.x;
+	task.top = rect.y;
+	task.right = right;
+	task.bottom = bottom;
+	task.firstTileX = rect.x / tileSize;
+	task.lastTileX = (right - 1) / tileSize;
+	task.firstTileY = rect.y / tileSize;
+	task.hashOnly = true;
+	uint numTileRows = (bottom - 1) / tileSize - task.firstTileY + 1;
+	size_t rowBytes = (size_t)(right - rect.x) * m_bpp * tileSize;
+	if(!m_changed.empty())
+		memset(&m_changed[0], 0, m_changed.size());
+	imgProcessRows(&processTileRows, &task, numTileRows, rowBytes);
+
+	bool unchanged = true;
+	for(size_t i = 0; i < m_changed.size(); i++) {
+		if(m_changed[i] != 0)
+			unchanged = false;
+		m_changed[i] = 0;
+	}
+	return unchanged;
+}
+
+/// <summary>
+/// Copies the area `rect` of a frame of the size that was passed to `reset()`
+/// into the frame slot `slot`. `dst` points to the top-left pixel of the slot
+/// and tiles are always relative to that pixel while `src` points to the
+/// top-left pixel of `rect`. Only the part of each tile that intersects
+/// `rect` is read and tiles that the slot already contains are skipped. Tiles
+/// that differ from the previous call are recorded for `writeTileMap()` and
+/// `calcDirtyRects()` which only ever report tiles that intersect `rect`.
+/// </summary>
+/// <returns>The number of tiles that changed</returns>
+uint FrameDeduplicator::copyFrame(
+	uint slot, void *dst, const void *src, uint dstStride, uint srcStride,
+	const DirtyRect &rect)
+{
+	const uint tileSize = CaptureSharedSegment::TILE_SIZE;
+	m_bytesCopied = 0;
+	m_bytesSaved = 0;
+	if(!m_changed.empty())
+		memset(&m_changed[0], 0, m_changed.size());
+	uint right, bottom;
+	if(slot >= m_numSlots || !clipRect(rect, &right, &bottom))
+		return 0;
+
+	TileCopyTask task;
+	task.dedup = this;
+	task.slot = slot;
+	task.dst = (uchar *)dst;
+	task.src = (const uchar *)src;
+	task.dstStride = dstStride;
+	task.srcStride = srcStride;
+	task.left = rect.x;
+	task.top = rect.y;
+	task.right = right;
+	task.bottom = bottom;
+	task.firstTileX = rect.x / tileSize;
+	task.lastTileX = (right - 1) / tileSize;
+	task.firstTileY = rect.y / tileSize;
+	task.hashOnly = false;
+	uint numTileRows = (bottom - 1) / tileSize - task.firstTileY + 1;
+	size_t rowBytes = (size_t)(right - rect.x) * m_bpp * tileSize;
+	imgProcessRows(&processTileRows, &task, numTileRows, rowBytes);
+
+	// Gather the results of every tile. Tiles are only written to by a single
+	// thread so this is done afterwards.
+	uint numChanged = 0;
+	uint numCompared = 0; // Tiles that the previous frame also had
+	uint numComparedChanged = 0;
+	for(uint ty = task.firstTileY; ty < task.firstTileY + numTileRows; ty++) {
+		uint y0 = ty * tileSize;
+		uint y1 = y0 + tileSize;
+		if(y0 < rect.y)
+			y0 = rect.y;
+		if(y1 > bottom)
+			y1 = bottom;
+		for(uint tx = task.firstTileX; tx <= task.lastTileX; tx++) {
+			uint x0 = tx * tileSize;
+			uint x1 = x0 + tileSize;
+			if(x0 < rect.x)
+				x0 = rect.x;
+			if(x1 > right)
+				x1 = right;
+			uint64_t tileBytes = (uint64_t)(x1 - x0) * m_bpp * (y1 - y0);
+			uchar result = m_changed[ty * m_tilesX + tx];
+			if(result & 2)
+				m_bytesCopied += tileBytes;
+			else
+				m_bytesSaved += tileBytes;
+			if(result & 1)
+				numChanged++;
+			if((result & 4) == 0) {
+				numCompared++;
+				if(result & 1)
+					numComparedChanged++;
+			}
+			m_changed[ty * m_tilesX + tx] = result & 1;
+		}
+	}
+
+	// Bypass hashing once it has stopped paying off. Frames that can't be
+	// compared to the previous one, such as the first frame after a bypass,
+	// don't tell us anything about the content.
+	if(numCompared > 0) {
+		if(numComparedChanged >= numCompared - numCompared / 8)
+			m_numMostlyChanged++;
+		else
+			m_numMostlyChanged = 0;
+		if(m_numMostlyChanged >= BYPASS_AFTER_FRAMES) {
+			// A single probe that is still mostly changed is enough to
+			// bypass again
+			m_numMostlyChanged = BYPASS_AFTER_FRAMES - 1;
+			m_bypassLeft = BYPASS_PROBE_FRAMES;
+		}
+	}
+	return numChanged;
+}
+
+/// <summary>
+/// Hashes and copies a range of tile rows for `copyFrame()`. The result of
+/// each tile is stored in `m_changed` where bit 0 means that the tile differs
+/// from the previous frame, bit 1 means that it was copied and bit 2 means
+/// that the previous frame didn't have the tile. If the task only hashes then
+/// just bit 0 is set and nothing that we know is modified.
+///
+/// Every tile of a row is hashed before anything is copied so that runs of
+/// adjacent tiles can be copied as a single span per pixel row. Copying each
+/// tile separately is several times slower as the writes are scattered.
+///
+/// Tiles on the edge of the rectangle are only partially hashed. The position
+/// of the hashed area within the tile is mixed into the hash as otherwise
+/// moving the rectangle over a solid colour would not change it.
+/// </summary>
+void FrameDeduplicator::processTileRows(
+	void *opaque, uint firstRow, uint numRows)
+{
+	const uint tileSize = CaptureSharedSegment::TILE_SIZE;
+	const TileCopyTask *task = (const TileCopyTask *)opaque;
+	FrameDeduplicator *dedup = task->dedup;
+	HashRowFunc hashRow = getHashRowFunc();
+	size_t numTiles = dedup->m_prevHashes.size();
+	uint64_t *slotHashes = &dedup->m_slotHashes[numTiles * task->slot];
+	uchar *slotValid = &dedup->m_slotValid[numTiles * task->slot];
+	uint bpp = dedup->m_bpp;
+
+	for(uint row = firstRow; row < firstRow + numRows; row++) {
+		uint ty = task->firstTileY + row;
+		uint y = ty * tileSize;
+		if(y < task->top)
+			y = task->top;
+		uint tileH = (ty + 1) * tileSize;
+		if(tileH > task->bottom)
+			tileH = task->bottom;
+		tileH -= y;
+		const uchar *srcRow =
+			task->src + (size_t)(y - task->top) * task->srcStride;
+		uchar *dstRow = task->dst + (size_t)y * task->dstStride;
+		uchar *changed = &dedup->m_changed[(size_t)ty * dedup->m_tilesX];
+		uint offY = y - ty * tileSize;
+
+		// Hash every tile and compare it to what we know
+		for(uint tx = task->firstTileX; tx <= task->lastTileX; tx++) {
+			uint x = tx * tileSize;
+			if(x < task->left)
+				x = task->left;
+			uint tileW = (tx + 1) * tileSize;
+			if(tileW > task->right)
+				tileW = task->right;
+			tileW -= x;
+			uint64_t hash = hashRows(
+				hashRow, srcRow + (size_t)(x - task->left) * bpp,
+				task->srcStride, tileW * bpp, tileH);
+			uint offX = x - tx * tileSize;
+			hash ^= (((uint64_t)offX << 32) | (uint64_t)offY) *
+				0x9E3779B97F4A7C15ULL;
+
+			size_t index = (size_t)ty * dedup->m_tilesX + tx;
+			if(task->hashOnly) {
+				changed[tx] = (!dedup->m_prevValid[index] ||
+					dedup->m_prevHashes[index] != hash) ? 1 : 0;
+				continue;
+			}
+			uchar result = 0;
+			if(!dedup->m_prevValid[index])
+				result |= 4;
+			if(!dedup->m_prevValid[index] ||
+				dedup->m_prevHashes[index] != hash)
+			{
+				result |= 1;
+				dedup->m_prevHashes[index] = hash;
+				dedup->m_prevValid[index] = 1;
+			}
+			if(!slotValid[index] || slotHashes[index] != hash) {
+				result |= 2;
+				slotHashes[index] = hash;
+				slotValid[index] = 1;
+			}
+			changed[tx] = result;
+		}
+
+		if(task->hashOnly)
+			continue;
+
+		// Copy every run of tiles that the slot doesn't contain. The tile row
+		// is usually still in the cache from hashing it.
+		uint tx = task->firstTileX;
+		while(tx <= task->lastTileX) {
+			if((changed[tx] & 2) == 0) {
+				tx++;
+				continue;
+			}
+			uint runStart = tx;
+			while(tx <= task->lastTileX && (changed[tx] & 2))
+				tx++;
+			uint x = runStart * tileSize;
+			if(x < task->left)
+				x = task->left;
+			uint right = tx * tileSize;
+			if(right > task->right)
+				right = task->right;
+			size_t dstOff = (size_t)x * bpp;
+			size_t srcOff = (size_t)(x - task->left) * bpp;
+			size_t spanBytes = (size_t)(right - x) * bpp;
+			for(uint i = 0; i < tileH; i++) {
+				memcpy(dstRow + (size_t)i * task->dstStride + dstOff,
+					srcRow + (size_t)i * task->srcStride + srcOff,
+					spanBytes);
+			}
+		}
+	}
+}
+
+/// <summary>
+/// Writes a bitmap of the tiles that changed in the last `copyFrame()` in
+/// the format that `CaptureSharedSegment::setFrameChangedTiles()` expects.
+/// </summary>
+void FrameDeduplicator::writeTileMap(
+	uchar *tileMap, uint size, uint tilesPerRow)
+{
+	if(tileMap == NULL)
+		return;
+	memset(tileMap, 0, size);
+	if(tilesPerRow < m_tilesX)
+		return; // Should never happen
+	for(uint ty = 0; ty < m_tilesY; ty++) {
+		for(uint tx = 0; tx < m_tilesX; tx++) {
+			if(!m_changed[ty * m_tilesX + tx])
+				continue;
+			uint bit = ty * tilesPerRow + tx;
+			if((bit >> 3) >= size)
+				return; // Should never happen
+			tileMap[bit >> 3] |= (uchar)(1 << (bit & 7));
+		}
+	}
+}
+
+/// <summary>
+/// Merges the tiles that changed in the last `copyFrame()` into at most
+/// `maxRects` rectangles. Horizontal runs of changed tiles are merged with
+/// identical runs in the row above. If there are too many rectangles then a
+/// single rectangle that covers every changed tile is returned instead.
+/// </summary>
+/// <returns>The number of rectangles in `rectsOut`</returns>
+uint FrameDeduplicator::calcDirtyRects(
+	DirtyRect *rectsOut, uint maxRects) const
+{
+	const uint tileSize = CaptureSharedSegment::TILE_SIZE;
+	if(rectsOut == NULL || maxRects == 0)
+		return 0;
+	uint numRects = 0;
+	bool overflow = false;
+	uint left = m_tilesX, top = m_tilesY, right = 0, bottom = 0; // Tiles
+	for(uint ty = 0; ty < m_tilesY; ty++) {
+		uint tx = 0;
+		while(tx < m_tilesX) {
+			if(!m_changed[ty * m_tilesX + tx]) {
+				tx++;
+				continue;
+			}
+			uint runStart = tx;
+			while(tx < m_tilesX && m_changed[ty * m_tilesX + tx])
+				tx++;
+			if(runStart < left)
+				left = runStart;
+			if(tx > right)
+				right = tx;
+			if(ty < top)
+				top = ty;
+			bottom = ty + 1;
+			if(overflow)
+				continue;
+
+			// Extend a rectangle that ends immediately above us
+			DirtyRect run(runStart * tileSize, ty * tileSize,
+				(tx - runStart) * tileSize, tileSize);
+			bool merged = false;
+			for(uint i = 0; i < numRects; i++) {
+				DirtyRect &r = rectsOut[i];
+				if(r.x == run.x && r.width == run.width &&
+					r.y + r.height == run.y)
+				{
+					r.height += tileSize;
+					merged = true;
+					break;
+				}
+			}
+			if(merged)
+				continue;
+			if(numRects >= maxRects) {
+				overflow = true;
+				continue;
+			}
+			rectsOut[numRects++] = run;
+		}
+	}
+	if(overflow) {
+		rectsOut[0] = DirtyRect(left * tileSize, top * tileSize,
+			(right - left) * tileSize, (bottom - top) * tileSize);
+		numRects = 1;
+	}
+
+	// Edge tiles can extend past the frame
+	for(uint i = 0; i < numRects; i++) {
+		DirtyRect &r = rectsOut[i];
+		if(r.x + r.width > m_width)
+			r.width = m_width - r.x;
+		if(r.y + r.height > m_height)
+			r.height = m_height - r.y;
+	}
+	return numRects;
+}
@@ -0,0 +1,132 @@
+//*****************************************************************************
+// Libdeskcap: A high-performance desktop capture library
+//
+// Copyright (C) 2014 Lucas Murray <lucas@polyflare.com>
+// All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation; either version 2 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//*****************************************************************************
+
+#ifndef COMMON_FRAMEDEDUP_H
+#define COMMON_FRAMEDEDUP_H
+
+#include "stlincludes.h"
+#include "capturesharedsegment.h"
+
+//=============================================================================
+// Helper functions
+
+uint64_t	imgHashRows(
+	const void *src, uint stride, uint widthBytes, uint numRows);
+
+//=============================================================================
+/// <summary>
+/// Copies raw pixel frames into the frame slots of a `CaptureSharedSegment`
+/// while skipping everything that the slot already contains. Frames are split
+/// into `CaptureSharedSegment::TILE_SIZE` square tiles and a 64-bit hash of
+/// every tile is calculated while it is copied. We remember the hashes of the
+/// contents of every slot so that only tiles that differ from what the slot
+/// held when it was last written are copied, as every published frame must be
+/// complete. The hashes of the previously published frame are also kept so
+/// that consumers can be told exactly which tiles changed.
+///
+/// Static content such as loading screens, paused games and idle desktops
+/// stops being copied entirely once every slot in the ring has been written
+/// once. Use `isUnchanged()` to test if a frame is identical to the previous
+/// one without claiming a slot for it.
+///
+/// Content where nearly everything changes every frame, such as most games,
+/// gains nothing from hashing so after `BYPASS_AFTER_FRAMES` such frames in
+/// a row `isBypassing()` tells the caller to copy frames directly instead.
+/// Every `BYPASS_PROBE_FRAMES` bypassed frames two frames are hashed again to
+/// test if the content has settled.
+/// </summary>
+class FrameDeduplicator
+{
+public: // Constants ----------------------------------------------------------
+	static const uint BYPASS_AFTER_FRAMES = 8;
+	static const uint BYPASS_PROBE_FRAMES = 120;
+
+private: // Members -----------------------------------------------------------
+	uint				m_width;
+	uint				m_height;
+	uint				m_bpp;
+	uint				m_numSlots;
+	uint				m_tilesX;
+	uint				m_tilesY;
+	vector<uint64_t>	m_prevHashes; // Most recently published frame
+	vector<uchar>		m_prevValid;
+	vector<uint64_t>	m_slotHashes; // Contents of each frame slot
+	vector<uchar>		m_slotValid;
+	vector<uchar>		m_changed; // Tiles changed by the last copy
+	uint64_t			m_bytesCopied; // Last copy only
+	uint64_t			m_bytesSaved;
+	uint				m_numMostlyChanged; // Consecutive frames
+	uint				m_bypassLeft; // Frames until we probe again
+
+public: // Constructor/destructor ---------------------------------------------
+	FrameDeduplicator();
+	virtual ~FrameDeduplicator();
+
+public: // Methods ------------------------------------------------------------
+	void		reset(uint width, uint height, uint bpp, uint numSlots);
+	void		invalidateSlot(uint slot);
+	void		invalidatePrevious();
+	bool		isBypassing() const;
+	void		bypassFrame(uint slot);
+	bool		isUnchanged(
+		const void *src, uint srcStride,
+		const CaptureSharedSegment::DirtyRect &rect);
+	uint		copyFrame(
+		uint slot, void *dst, const void *src, uint dstStride,
+		uint srcStride, const CaptureSharedSegment::DirtyRect &rect);
+	void		writeTileMap(uchar *tileMap, uint size, uint tilesPerRow);
+	uint		calcDirtyRects(
+		CaptureSharedSegment::DirtyRect *rectsOut, uint maxRects) const;
+	uint64_t	getBytesCopied() const;
+	uint64_t	getBytesSaved() const;
+
+private:
+	bool		clipRect(
+		const CaptureSharedSegment::DirtyRect &rect, uint *rightOut,
+		uint *bottomOut) const;
+	static void	processTileRows(void *opaque, uint firstRow, uint numRows);
+};
+//=============================================================================
+
+/// <summary>
+/// Returns true if the next frame should be copied without deduplication as
+/// nearly every tile of the recent frames changed. Frames that are copied
+/// this way must be reported with `bypassFrame()`.
+/// </summary>
+inline bool FrameDeduplicator::isBypassing() const
+{
+	return m_bypassLeft > 0;
+}
+
+/// <summary>
+/// Returns the number of bytes that the last `copyFrame()` wrote.
+/// </summary>
+inline uint64_t FrameDeduplicator::getBytesCopied() const
+{
+	return m_bytesCopied;
+}
+
+/// <summary>
+/// Returns the number of bytes that the last `copyFrame()` skipped as the
+/// slot already contained them.
+/// </summary>
+inline uint64_t FrameDeduplicator::getBytesSaved() const
+{
+	return m_bytesSaved;
+}
+
+#endif // COMMON_FRAMEDEDUP_H
@@ -0,0 +1,512 @@
+//*****************************************************************************
+// Libdeskcap: A high-performance desktop capture library
+//
+// Copyright (C) 2014 Lucas Murray <lucas@polyflare.com>
+// All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation; either version 2 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//*****************************************************************************
+
+#include "framepacer.h"
+#include <math.h>
+
+// Loop gains of the tick estimator. The frequency gain is chosen for a
+// critically damped response to a phase step.
+const double PHASE_GAIN = 0.1;
+const double FREQ_GAIN = PHASE_GAIN * PHASE_GAIN / (2.0 - PHASE_GAIN);
+
+// Weight of new samples in the exponentially weighted averages
+const double JITTER_WEIGHT = 1.0 / 16.0;
+const double SWAP_WEIGHT = 1.0 / 8.0;
+const double LATENCY_RISE_WEIGHT = 1.0 / 4.0;
+const double LATENCY_FALL_WEIGHT = 1.0 / 32.0;
+
+// The estimator relocks if a tick is further from the grid than this
+// fraction of the period or if more than `MAX_TICK_GAP` ticks were missed
+const double MAX_PHASE_ERROR = 0.5;
+const double MAX_TICK_GAP = 64.0;
+
+// Maximum difference between the estimated and nominal tick periods. Real
+// clocks are within a few hundred parts per million so anything more is
+// treated as measurement error.
+const double MAX_DRIFT = 0.02;
+
+// Number of consecutive ticks that are needed before the estimate is used
+const uint LOCK_TICKS = 8;
+
+// Swap intervals and capture latencies that are longer than this many
+// nominal periods are stalls and are not included in their averages
+const double MAX_SWAP_GAP = 4.0;
+
+// Applications that swap faster than this fraction of the tick period never
+// replace the frame of a tick as deferring already selects their freshest
+// swap
+const double MIN_REPLACE_SWAP_RATIO = 0.9;
+
+// Frames must be published at least this long before the tick
+const double MIN_READY_MARGIN_USEC = 500.0;
+
+// Target periods that are within this fraction of a whole number of ticks
+// are rounded to it
+const double SLOT_SNAP_RATIO = 0.01;
+
+// Our local tick grid starts this long before the first swap when the main
+// application doesn't publish its ticks
+const uint64_t LOCAL_ORIGIN_OFFSET_USEC = 5000;
+
+// Tolerance when converting between tick and frame slot numbers so that
+// rounding errors don't move a tick into the next slot
+const double SLOT_EPSILON = 1e-6;
+
+static uint64_t roundToUInt64(double val)
+{
+	if(val <= 0.0)
+		return 0;
+	return (uint64_t)floor(val + 0.5);
+}
+
+//=============================================================================
+// TickEstimator class
+
+TickEstimator::TickEstimator()
+	: m_nominalUsec(0.0)
+	, m_periodUsec(0.0)
+	, m_phaseUsec(0.0)
+	, m_errVar(0.0)
+	, m_tickNum(0)
+	, m_lastTickUsec(0)
+	, m_lockNum(0)
+	, m_numLockedTicks(0)
+	, m_numTicks(0)
+	, m_numMissedTicks(0)
+	, m_numRelocks(0)
+{
+}
+
+TickEstimator::~TickEstimator()
+{
+}
+
+/// <summary>
+/// Forgets every measured tick and prepares to measure ticks of the
+/// specified nominal period. Must be called whenever the video frequency of
+/// the main application changes.
+/// </summary>
+void TickEstimator::reset(uint64_t nominalPeriodNsec)
+{
+	m_nominalUsec = (double)nominalPeriodNsec / 1000.0;
+	m_periodUsec = m_nominalUsec;
+	m_phaseUsec = 0.0;
+	m_errVar = 0.0;
+	m_lastTickUsec = 0;
+	m_numLockedTicks = 0;
+	m_numTicks = 0;
+	m_numMissedTicks = 0;
+	m_numRelocks = 0;
+
+	// Tick and lock numbers are never reset so that hooks always notice
+}
+
+/// <summary>
+/// Adds a measured tick. `tickUsec` should be the time that the tick was
+/// scheduled for if it is known as that excludes most of the jitter.
+/// </summary>
+void TickEstimator::addTick(uint64_t tickUsec)
+{
+	if(m_nominalUsec <= 0.0)
+		return; // Not reset yet
+	m_numTicks++;
+	m_lastTickUsec = tickUsec;
+	double tick = (double)tickUsec;
+	if(m_numLockedTicks == 0) {
+		relock(tick);
+		return;
+	}
+
+	// Determine which tick this is. If the main application dropped any then
+	// the measured tick is more than a single period away.
+	double elapsed = tick - m_phaseUsec;
+	double n = floor(elapsed / m_periodUsec + 0.5);
+	if(n < 1.0)
+		n = 1.0;
+	if(n > MAX_TICK_GAP) {
+		relock(tick);
+		return;
+	}
+	double err = tick - (m_phaseUsec + n * m_periodUsec);
+	if(fabs(err) > m_periodUsec * MAX_PHASE_ERROR) {
+		relock(tick);
+		return;
+	}
+	m_tickNum += (uint64_t)n;
+	m_numMissedTicks += (uint64_t)n - 1;
+
+	// Update the phase and frequency of the loop
+	m_phaseUsec += n * m_periodUsec + PHASE_GAIN * err;
+	m_periodUsec += FREQ_GAIN * err / n;
+	double minPeriod = m_nominalUsec * (1.0 - MAX_DRIFT);
+	double maxPeriod = m_nominalUsec * (1.0 + MAX_DRIFT);
+	if(m_periodUsec < minPeriod)
+		m_periodUsec = minPeriod;
+	if(m_periodUsec > maxPeriod)
+		m_periodUsec = maxPeriod;
+
+	m_errVar += (err * err - m_errVar) * JITTER_WEIGHT;
+	m_numLockedTicks++;
+}
+
+/// <summary>
+/// Returns true if enough ticks have been measured for the estimate to be
+/// used.
+/// </summary>
+bool TickEstimator::isLocked() const
+{
+	return m_numLockedTicks >= LOCK_TICKS;
+}
+
+uint64_t TickEstimator::getNominalPeriodNsec() const
+{
+	return roundToUInt64(m_nominalUsec * 1000.0);
+}
+
+/// <summary>
+/// Returns the number of the most recently measured tick.
+/// </summary>
+uint64_t TickEstimator::getTickNum() const
+{
+	return m_tickNum;
+}
+
+/// <summary>
+/// Returns the estimated time of the tick that `getTickNum()` returns.
+/// </summary>
+uint64_t TickEstimator::getTickUsec() const
+{
+	return roundToUInt64(m_phaseUsec);
+}
+
+uint64_t TickEstimator::getPeriodNsec() const
+{
+	return roundToUInt64(m_periodUsec * 1000.0);
+}
+
+/// <summary>
+/// Returns the RMS difference between the measured and estimated ticks.
+/// </summary>
+uint TickEstimator::getJitterUsec() const
+{
+	return (uint)roundToUInt64(sqrt(m_errVar));
+}
+
+/// <summary>
+/// Returns how much longer the estimated tick period is than the nominal
+/// period in parts per million.
+/// </summary>
+int TickEstimator::getDriftPpm() const
+{
+	if(m_nominalUsec <= 0.0)
+		return 0;
+	double ppm = (m_periodUsec / m_nominalUsec - 1.0) * 1000000.0;
+	return (int)floor(ppm + 0.5);
+}
+
+/// <summary>
+/// Fills `out` with our current estimate so that it can be published with
+/// `MainSharedSegment::publishConsumerTicks()`.
+/// </summary>
+void TickEstimator::getState(ConsumerTickState *out) const
+{
+	if(out == NULL)
+		return;
+	out->lockNum = m_lockNum;
+	out->jitterUsec = getJitterUsec();
+	out->tickNum = m_tickNum;
+	out->tickUsec = getTickUsec();
+	out->periodNsec = getPeriodNsec();
+	out->updatedUsec = m_lastTickUsec;
+	out->driftPpm = getDriftPpm();
+}
+
+/// <summary>
+/// Restarts the loop at `tickUsec` keeping the estimated period.
+/// </summary>
+void TickEstimator::relock(double tickUsec)
+{
+	if(m_numTicks > 1)
+		m_numRelocks++;
+	m_tickNum++;
+	m_lockNum++;
+	m_phaseUsec = tickUsec;
+	m_errVar = 0.0;
+	m_numLockedTicks = 1;
+}
+
+//=============================================================================
+// CapturePacer class
+
+CapturePacer::CapturePacer()
+	: m_nominalUsec(0.0)
+	, m_targetUsec(0.0)
+	, m_latencyUsec(0.0)
+	, m_hasLatency(false)
+	, m_swapUsec(0.0)
+	, m_swapVar(0.0)
+	, m_hasSwapInterval(false)
+	, m_prevSwapUsec(0)
+	, m_isUsingConsumer(false)
+	, m_consumerProcId(0)
+	, m_consumerLockNum(0)
+	, m_hasLocalOrigin(false)
+	, m_localOriginUsec(0)
+	, m_hasSlot(false)
+	, m_lastSlot(0)
+	, m_isSlotReplaced(false)
+	, m_stats()
+{
+}
+
+CapturePacer::~CapturePacer()
+{
+}
+
+/// <summary>
+/// Forgets everything that we have measured. Must be called when we begin
+/// capturing.
+/// </summary>
+void CapturePacer::reset()
+{
+	m_latencyUsec = 0.0;
+	m_hasLatency = false;
+	m_swapUsec = 0.0;
+	m_swapVar = 0.0;
+	m_hasSwapInterval = false;
+	m_prevSwapUsec = 0;
+	m_isUsingConsumer = false;
+	m_consumerProcId = 0;
+	m_consumerLockNum = 0;
+	m_hasLocalOrigin = false;
+	m_localOriginUsec = 0;
+	m_hasSlot = false;
+	m_lastSlot = 0;
+	m_isSlotReplaced = false;
+	m_stats = FramePacingStats();
+}
+
+/// <summary>
+/// Sets the nominal tick period of the main application. This is only used
+/// when the main application doesn't publish its ticks.
+/// </summary>
+void CapturePacer::setNominalPeriod(uint64_t periodNsec)
+{
+	double usec = (double)periodNsec / 1000.0;
+	if(usec == m_nominalUsec)
+		return;
+	m_nominalUsec = usec;
+	m_hasLocalOrigin = false;
+	if(!m_isUsingConsumer)
+		resync();
+}
+
+/// <summary>
+/// Sets the period that the main application wants frames at. Zero or
+/// anything shorter than the tick period captures a frame for every tick.
+/// </summary>
+void CapturePacer::setTargetPeriod(uint64_t periodNsec)
+{
+	double usec = (double)periodNsec / 1000.0;
+	if(usec == m_targetUsec)
+		return;
+	m_targetUsec = usec;
+	resync(); // Slot numbers have a different meaning
+}
+
+/// <summary>
+/// Adds the measured time between a captured swap and its frame being
+/// published. The average rises quickly and falls slowly as being late
+/// costs an entire tick while being early only costs freshness.
+/// </summary>
+void CapturePacer::addCaptureLatency(uint64_t usec)
+{
+	double latency = (double)usec;
+	if(m_nominalUsec > 0.0 && latency > m_nominalUsec * MAX_SWAP_GAP)
+		return; // Application stalled or the capture clock was stepped
+	if(!m_hasLatency) {
+		m_latencyUsec = latency;
+		m_hasLatency = true;
+	} else if(latency > m_latencyUsec)
+		m_latencyUsec += (latency - m_latencyUsec) * LATENCY_RISE_WEIGHT;
+	else
+		m_latencyUsec += (latency - m_latencyUsec) * LATENCY_FALL_WEIGHT;
+	m_stats.latencyUsec = (uint)roundToUInt64(m_latencyUsec);
+}
+
+/// <summary>
+/// Called on every buffer swap of the hooked application. `ticks` is the
+/// tick state that the main application published or NULL if there is none.
+/// </summary>
+/// <returns>True if this swap should be captured</returns>
+bool CapturePacer::shouldCapture(
+	uint64_t nowUsec, const ConsumerTickState *ticks)
+{
+	m_stats.numSwaps++;
+	if(m_nominalUsec <= 0.0)
+		return false; // Main application isn't ticking
+	updateSwapInterval(nowUsec);
+
+	// Select the tick grid that we are pacing to. Tick numbers from
+	// different grids are unrelated so we must forget our previous capture
+	// whenever the grid changes.
+	bool useConsumer = (ticks != NULL && ticks->procId != 0 &&
+		ticks->periodNsec > 0 &&
+		nowUsec < ticks->updatedUsec + ConsumerTickState::STALE_USEC);
+	double phaseUsec, periodUsec, marginUsec;
+	int64_t baseSlot;
+	if(useConsumer) {
+		if(!m_isUsingConsumer || ticks->procId != m_consumerProcId ||
+			ticks->lockNum != m_consumerLockNum)
+		{
+			resync();
+			m_isUsingConsumer = true;
+			m_consumerProcId = ticks->procId;
+			m_consumerLockNum = ticks->lockNum;
+		}
+		phaseUsec = (double)ticks->tickUsec;
+		periodUsec = (double)ticks->periodNsec / 1000.0;
+		baseSlot = (int64_t)ticks->tickNum;
+		marginUsec = MIN_READY_MARGIN_USEC + 2.0 * (double)ticks->jitterUsec;
+		m_stats.consumerJitterUsec = ticks->jitterUsec;
+		m_stats.consumerDriftPpm = ticks->driftPpm;
+	} else {
+		if(m_isUsingConsumer || !m_hasLocalOrigin) {
+			// Start the grid slightly before this swap so that swap jitter
+			// doesn't move swaps between ticks
+			resync();
+			m_isUsingConsumer = false;
+			m_hasLocalOrigin = true;
+			m_localOriginUsec = nowUsec;
+			if(m_localOriginUsec > LOCAL_ORIGIN_OFFSET_USEC)
+				m_localOriginUsec -= LOCAL_ORIGIN_OFFSET_USEC;
+		}
+		phaseUsec = (double)m_localOriginUsec;
+		periodUsec = m_nominalUsec;
+		baseSlot = 0;
+		marginUsec = 0.0;
+	}
+	m_stats.isUsingConsumerTicks = m_isUsingConsumer;
+
+	// Find the first tick that this swap can be published before and the
+	// frame slot that it belongs to. The slot is due at its first tick. Our
+	// local grid has an arbitrary phase relative to the main application so
+	// there is no deadline to meet and we simply capture the first swap of
+	// every slot.
+	double readyUsec = (double)nowUsec;
+	if(m_isUsingConsumer)
+		readyUsec += m_latencyUsec + marginUsec;
+	double rel = floor((readyUsec - phaseUsec) / periodUsec);
+	double ticksPerSlot = getTicksPerSlot();
+	double slotPeriodUsec = periodUsec * ticksPerSlot;
+	double deadline = phaseUsec + (rel + 1.0) * periodUsec;
+	int64_t slot = baseSlot + (int64_t)rel + 1;
+	if(ticksPerSlot > 1.0) {
+		double slotNum =
+			floor((double)(slot - 1) / ticksPerSlot + SLOT_EPSILON) + 1.0;
+		double dueTick = ceil(slotNum * ticksPerSlot - SLOT_EPSILON);
+		deadline = phaseUsec + (dueTick - (double)baseSlot) * periodUsec;
+		slot = (int64_t)slotNum;
+	}
+	if(m_hasSlot && slot <= m_lastSlot) {
+		if(slot < m_lastSlot || !m_isUsingConsumer || m_isSlotReplaced ||
+			!m_hasSwapInterval ||
+			m_swapUsec < slotPeriodUsec * MIN_REPLACE_SWAP_RATIO)
+		{
+			return false; // Slot already has a frame
+		}
+
+		// The application swaps at about our slot rate so its swaps wander
+		// across slot boundaries and jitter made this one arrive earlier
+		// than expected. Replace the previous frame of the slot with this
+		// fresher one, but only once per slot.
+		m_isSlotReplaced = true;
+		m_stats.numReplaced++;
+		m_stats.numCaptured++;
+		return true;
+	}
+
+	// If the next swap is also expected to be ready in time then skip this
+	// one so that the slot receives the freshest possible frame
+	if(m_isUsingConsumer && m_hasSwapInterval) {
+		double nextUsec = readyUsec + m_swapUsec + 2.0 * sqrt(m_swapVar);
+		if(nextUsec < deadline) {
+			m_stats.numDeferred++;
+			return false;
+		}
+	}
+
+	// Slots that we skipped over are only our fault if the application is
+	// swapping fast enough to fill every slot
+	if(m_hasSlot && slot > m_lastSlot + 1 && m_hasSwapInterval &&
+		m_swapUsec < slotPeriodUsec)
+	{
+		m_stats.numMissedTicks += (uint64_t)(slot - m_lastSlot - 1);
+	}
+	m_lastSlot = slot;
+	m_hasSlot = true;
+	m_isSlotReplaced = false;
+	m_stats.numCaptured++;
+	return true;
+}
+
+/// <summary>
+/// Forgets our previous capture as the tick grid is about to change.
+/// </summary>
+void CapturePacer::resync()
+{
+	if(m_hasSlot)
+		m_stats.numResyncs++;
+	m_hasSlot = false;
+	m_lastSlot = 0;
+}
+
+/// <summary>
+/// Returns the number of ticks between frame slots which is always at least
+/// one and not necessarily a whole number.
+/// </summary>
+double CapturePacer::getTicksPerSlot() const
+{
+	if(m_targetUsec <= m_nominalUsec || m_nominalUsec <= 0.0)
+		return 1.0;
+	double ratio = m_targetUsec / m_nominalUsec;
+	double whole = floor(ratio + 0.5);
+	if(fabs(ratio - whole) <= whole * SLOT_SNAP_RATIO)
+		return whole;
+	return ratio;
+}
+
+void CapturePacer::updateSwapInterval(uint64_t nowUsec)
+{
+	uint64_t prevUsec = m_prevSwapUsec;
+	m_prevSwapUsec = nowUsec;
+	if(prevUsec == 0 || nowUsec <= prevUsec)
+		return;
+	double interval = (double)(nowUsec - prevUsec);
+	if(interval > m_nominalUsec * MAX_SWAP_GAP)
+		return; // Application stalled
+	if(!m_hasSwapInterval) {
+		m_swapUsec = interval;
+		m_swapVar = 0.0;
+		m_hasSwapInterval = true;
+	} else {
+		double diff = interval - m_swapUsec;
+		m_swapUsec += diff * SWAP_WEIGHT;
+		m_swapVar += (diff * diff - m_swapVar) * SWAP_WEIGHT;
+	}
+	m_stats.swapIntervalUsec = (uint)roundToUInt64(m_swapUsec);
+}
@@ -0,0 +1,182 @@
+//*****************************************************************************
+// Libdeskcap: A high-performance desktop capture library
+//
+// Copyright (C) 2014 Lucas Murray <lucas@polyflare.com>
+// All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation; either version 2 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//*****************************************************************************
+
+#ifndef COMMON_FRAMEPACER_H
+#define COMMON_FRAMEPACER_H
+
+#include "stlincludes.h"
+#include "mainsharedsegment.h"
+
+//=============================================================================
+// Statistics
+
+struct FramePacingStats {
+	uint64_t	numSwaps; // Buffer swaps seen by the hook
+	uint64_t	numCaptured;
+	uint64_t	numDeferred; // Swaps skipped for a fresher swap
+	uint64_t	numReplaced; // Captures that superseded an earlier capture
+	uint64_t	numMissedTicks; // Frame slots that we failed to capture for
+	uint64_t	numResyncs; // Tick grid changed while capturing
+	uint		latencyUsec; // Swap to publish
+	uint		swapIntervalUsec;
+	uint		consumerJitterUsec;
+	int			consumerDriftPpm;
+	bool		isUsingConsumerTicks;
+
+	FramePacingStats() : numSwaps(0), numCaptured(0), numDeferred(0)
+		, numReplaced(0), numMissedTicks(0), numResyncs(0), latencyUsec(0)
+		, swapIntervalUsec(0), consumerJitterUsec(0), consumerDriftPpm(0)
+		, isUsingConsumerTicks(false) {};
+};
+
+//=============================================================================
+/// <summary>
+/// Estimates when the main application ticks from the measured times of its
+/// video frame ticks. The measurements contain scheduling jitter and the
+/// ticks may be driven by a clock that drifts relative to ours so the phase
+/// and period of the tick grid are tracked with a second-order phase-locked
+/// loop. Ticks that the main application dropped are detected and skipped
+/// without disturbing the estimate. If a measured tick is too far from the
+/// grid then the loop relocks to it and the lock number is incremented so
+/// that hooks know that the tick numbers are no longer comparable.
+/// </summary>
+class TickEstimator
+{
+private: // Members -----------------------------------------------------------
+	double		m_nominalUsec;
+	double		m_periodUsec;
+	double		m_phaseUsec; // Estimated time of tick `m_tickNum`
+	double		m_errVar; // Mean squared error of measured ticks
+	uint64_t	m_tickNum;
+	uint64_t	m_lastTickUsec; // Last measured tick
+	uint32_t	m_lockNum;
+	uint		m_numLockedTicks; // Ticks since we last relocked
+	uint64_t	m_numTicks;
+	uint64_t	m_numMissedTicks;
+	uint64_t	m_numRelocks;
+
+public: // Constructor/destructor ---------------------------------------------
+	TickEstimator();
+	virtual ~TickEstimator();
+
+public: // Methods ------------------------------------------------------------
+	void		reset(uint64_t nominalPeriodNsec);
+	void		addTick(uint64_t tickUsec);
+	bool		isLocked() const;
+	uint64_t	getNominalPeriodNsec() const;
+	uint64_t	getTickNum() const;
+	uint64_t	getTickUsec() const;
+	uint64_t	getPeriodNsec() const;
+	uint		getJitterUsec() const;
+	int			getDriftPpm() const;
+	uint64_t	getNumTicks() const;
+	uint64_t	getNumMissedTicks() const;
+	uint64_t	getNumRelocks() const;
+	void		getState(ConsumerTickState *out) const;
+
+private:
+	void		relock(double tickUsec);
+};
+//=============================================================================
+
+inline uint64_t TickEstimator::getNumTicks() const
+{
+	return m_numTicks;
+}
+
+/// <summary>
+/// Returns the number of ticks that the main application skipped.
+/// </summary>
+inline uint64_t TickEstimator::getNumMissedTicks() const
+{
+	return m_numMissedTicks;
+}
+
+inline uint64_t TickEstimator::getNumRelocks() const
+{
+	return m_numRelocks;
+}
+
+//=============================================================================
+/// <summary>
+/// Decides which buffer swaps of a hooked application to capture so that the
+/// main application receives exactly one frame per tick and that frame is
+/// the newest one that could possibly be ready in time. Each swap is assigned
+/// to the first tick that its frame can be published before, taking our
+/// measured capture latency into account. A swap is skipped if its tick
+/// already has a frame or if the next swap is expected to also be ready
+/// before that tick.
+///
+/// If the main application only needs frames at a lower rate than it ticks
+/// at then a target period can be set. Frame slots are then spread across
+/// the ticks at that period, each slot being due at the first tick at or
+/// after its ideal time, and swaps are only captured for those slots.
+/// Periods that are within 1% of a whole number of ticks are rounded so that
+/// frames are evenly spaced.
+///
+/// If the main application publishes its ticks then they are used directly,
+/// otherwise we fall back to a local tick grid of the nominal period that
+/// starts slightly before the first swap. The phase of that grid is
+/// unrelated to the main application so there is no deadline to aim for and
+/// the first swap of every frame slot is captured.
+/// </summary>
+class CapturePacer
+{
+private: // Members -----------------------------------------------------------
+	double				m_nominalUsec;
+	double				m_targetUsec; // Zero to capture for every tick
+	double				m_latencyUsec;
+	bool				m_hasLatency;
+	double				m_swapUsec;
+	double				m_swapVar;
+	bool				m_hasSwapInterval;
+	uint64_t			m_prevSwapUsec;
+	bool				m_isUsingConsumer;
+	uint32_t			m_consumerProcId;
+	uint32_t			m_consumerLockNum;
+	bool				m_hasLocalOrigin;
+	uint64_t			m_localOriginUsec;
+	bool				m_hasSlot;
+	int64_t				m_lastSlot; // Frame slot of the last captured swap
+	bool				m_isSlotReplaced;
+	FramePacingStats	m_stats;
+
+public: // Constructor/destructor ---------------------------------------------
+	CapturePacer();
+	virtual ~CapturePacer();
+
+public: // Methods ------------------------------------------------------------
+	void	reset();
+	void	setNominalPeriod(uint64_t periodNsec);
+	void	setTargetPeriod(uint64_t periodNsec);
+	void	addCaptureLatency(uint64_t usec);
+	bool	shouldCapture(uint64_t nowUsec, const ConsumerTickState *ticks);
+	const FramePacingStats &	getStats() const;
+
+private:
+	void	resync();
+	double	getTicksPerSlot() const;
+	void	updateSwapInterval(uint64_t nowUsec);
+};
+//=============================================================================
+
+inline const FramePacingStats &CapturePacer::getStats() const
+{
+	return m_stats;
+}
+
+#endif // COMMON_FRAMEPACER_H
@@ -0,0 +1,581 @@
+//*****************************************************************************
+// Libdeskcap: A high-performance desktop capture library
+//
+// Copyright (C) 2014 Lucas Murray <lucas@polyflare.com>
+// All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation; either version 2 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//*****************************************************************************
+
+#include "framestager.h"
+#include "framecodec.h"
+#include "pixelconvert.h"
+#include <boost/thread.hpp>
+
+typedef CaptureSharedSegment::DirtyRect DirtyRect;
+
+// How long the worker blocks waiting for a new frame. This also limits how
+// long destroying the stager can take.
+static const uint FRAME_WAIT_USEC = 10000;
+
+// How long the worker waits for the owner to provide a buffer before it
+// tests if a newer frame has been queued
+static const uint BUFFER_WAIT_USEC = 2000;
+
+/// <summary>
+/// Marks every tile that intersects a rectangle of pixels as changed.
+/// </summary>
+static void markTiles(
+	uchar *tileMap, uint tilesPerRow, uint numTileRows, const DirtyRect &rect)
+{
+	const uint tileSize = CaptureSharedSegment::TILE_SIZE;
+	if(rect.width == 0 || rect.height == 0)
+		return;
+	uint left = rect.x / tileSize;
+	uint top = rect.y / tileSize;
+	uint right = (rect.x + rect.width + tileSize - 1) / tileSize;
+	uint bottom = (rect.y + rect.height + tileSize - 1) / tileSize;
+	if(right > tilesPerRow)
+		right = tilesPerRow;
+	if(bottom > numTileRows)
+		bottom = numTileRows;
+	for(uint ty = top; ty < bottom; ty++) {
+		for(uint tx = left; tx < right; tx++) {
+			uint bit = ty * tilesPerRow + tx;
+			tileMap[bit >> 3] |= (uchar)(1 << (bit & 7));
+		}
+	}
+}
+
+FrameStager::FrameStager(CaptureSharedSegment *capShm, uint numBuffers)
+	: m_capShm(capShm)
+	, m_numBuffers(numBuffers)
+	//, m_buffers() // Default constructors
+	, m_tilesPerRow(0)
+	, m_tileMapSize(0)
+	, m_srcIsFlipped(false)
+	, m_thread(NULL)
+	, m_mutex(new boost::mutex())
+	, m_cond(new boost::condition_variable())
+	, m_exiting(false)
+	, m_topDown(false)
+	, m_restage(true)
+	, m_roi()
+	, m_frameWidth(0)
+	, m_frameHeight(0)
+	, m_badFormat(0)
+	, m_numDecodeFailures(0)
+
+	// Only accessed by the worker thread
+	, m_heldFrameNum(-1)
+	, m_hasNewDamage(false)
+	, m_numRegistrations(0)
+	, m_damage()
+	, m_staleTiles()
+	, m_decoded()
+	, m_openRects()
+	, m_rowRects()
+{
+	if(m_numBuffers < 1)
+		m_numBuffers = 1;
+	if(m_numBuffers > MAX_BUFFERS)
+		m_numBuffers = MAX_BUFFERS;
+	m_roi.x = m_roi.y = m_roi.width = m_roi.height = 0;
+	if(m_capShm == NULL || !m_capShm->isValid() ||
+		m_capShm->getCaptureType() != RawPixelsShmType)
+	{
+		m_capShm = NULL;
+		return;
+	}
+	m_srcIsFlipped = (m_capShm->getRawPixelsExtraDataPtr()->isFlipped != 0);
+
+	// Our tile maps use the same layout as the maps of the segment but cover
+	// the entire capacity even if the producer doesn't provide maps
+	const uint tileSize = CaptureSharedSegment::TILE_SIZE;
+	m_tilesPerRow = m_capShm->getTilesPerRow();
+	uint numTileRows = (m_capShm->getMaxHeight() + tileSize - 1) / tileSize;
+	m_tileMapSize = (m_tilesPerRow * numTileRows + 7) / 8;
+	m_damage.resize(m_tileMapSize);
+	m_staleTiles.resize(m_tileMapSize);
+	for(uint i = 0; i < m_numBuffers; i++)
+		m_buffers[i].staleTiles.resize(m_tileMapSize, 0xFF);
+
+	m_thread = new boost::thread(&FrameStager::workerMain, this);
+}
+
+FrameStager::~FrameStager()
+{
+	if(m_thread != NULL) {
+		{
+			boost::mutex::scoped_lock lock(*m_mutex);
+			m_exiting = true;
+			m_cond->notify_all();
+		}
+		m_thread->join();
+		delete m_thread;
+	}
+	delete m_cond;
+	delete m_mutex;
+}
+
+/// <summary>
+/// Sets whether or not bottom-up frames should be flipped while staging. The
+/// orientation of each staged frame is returned by `takeFilledBuffer()`.
+/// </summary>
+void FrameStager::setTopDown(bool topDown)
+{
+	boost::mutex::scoped_lock lock(*m_mutex);
+	if(m_topDown == topDown)
+		return;
+	m_topDown = topDown;
+	if(m_srcIsFlipped) {
+		// Every buffer is in the wrong orientation
+		markAllStale();
+		m_restage = true;
+	}
+}
+
+/// <summary>
+/// Limits the copy of frames that are entirely changed to the specified
+/// rectangle of the frame data. An empty rectangle copies everything.
+/// </summary>
+void FrameStager::setRegionOfInterest(const DirtyRect &roi)
+{
+	boost::mutex::scoped_lock lock(*m_mutex);
+	m_roi = roi;
+}
+
+/// <summary>
+/// Returns the size of the newest frame that the stager has seen. Frames are
+/// only staged into buffers of the same size so the owner must provide
+/// buffers of this size.
+/// </summary>
+void FrameStager::getFrameSize(uint *widthOut, uint *heightOut)
+{
+	boost::mutex::scoped_lock lock(*m_mutex);
+	if(widthOut != NULL)
+		*widthOut = m_frameWidth;
+	if(heightOut != NULL)
+		*heightOut = m_frameHeight;
+}
+
+/// <summary>
+/// Returns the most recent frame format that couldn't be converted to BGRA.
+/// </summary>
+/// <returns>Zero if every frame could be converted</returns>
+uint32_t FrameStager::getUnsupportedFormat()
+{
+	boost::mutex::scoped_lock lock(*m_mutex);
+	return m_badFormat;
+}
+
+/// <summary>
+/// Returns the number of compressed frames that couldn't be decoded.
+/// </summary>
+uint FrameStager::getNumDecodeFailures()
+{
+	boost::mutex::scoped_lock lock(*m_mutex);
+	return m_numDecodeFailures;
+}
+
+/// <summary>
+/// Lets the stager write frames to a buffer of `width` by `height` BGRA
+/// pixels until the buffer is returned by `takeFilledBuffer()` or
+/// `revokeBuffers()`. The buffer must contain what it contained when it was
+/// last returned, a buffer that changes size is always completely filled.
+/// </summary>
+void FrameStager::provideBuffer(
+	uint index, void *data, uint stride, uint width, uint height)
+{
+	if(index >= m_numBuffers || data == NULL)
+		return;
+	boost::mutex::scoped_lock lock(*m_mutex);
+	Buffer *buf = &m_buffers[index];
+	if(buf->state != UnavailableBufferState)
+		return; // Already provided
+	if(buf->width != width || buf->height != height)
+		memset(&buf->staleTiles[0], 0xFF, m_tileMapSize);
+	buf->data = (uchar *)data;
+	buf->stride = stride;
+	buf->width = width;
+	buf->height = height;
+	buf->state = FreeBufferState;
+	m_cond->notify_all();
+}
+
+/// <summary>
+/// Returns the buffer that contains the newest staged frame to the owner.
+/// The owner must provide the buffer again before it can be reused.
+/// </summary>
+/// <returns>-1 if no new frame has been staged</returns>
+int FrameStager::takeFilledBuffer(StagedFrameInfo *infoOut)
+{
+	boost::mutex::scoped_lock lock(*m_mutex);
+	for(uint i = 0; i < m_numBuffers; i++) {
+		Buffer *buf = &m_buffers[i];
+		if(buf->state != FilledBufferState)
+			continue;
+		buf->state = UnavailableBufferState;
+		buf->data = NULL;
+		if(infoOut != NULL)
+			*infoOut = buf->info;
+		return (int)i;
+	}
+	return -1;
+}
+
+/// <summary>
+/// Returns every buffer to the owner, waiting for any copy into them to
+/// finish. The contents of the buffers are forgotten so the next frame that
+/// is staged into each one is complete.
+/// </summary>
+void FrameStager::revokeBuffers()
+{
+	boost::mutex::scoped_lock lock(*m_mutex);
+	for(;;) {
+		bool isWriting = false;
+		for(uint i = 0; i < m_numBuffers; i++) {
+			if(m_buffers[i].state == WritingBufferState)
+				isWriting = true;
+		}
+		if(!isWriting)
+			break;
+		m_cond->wait(lock);
+	}
+	for(uint i = 0; i < m_numBuffers; i++) {
+		Buffer *buf = &m_buffers[i];
+		buf->state = UnavailableBufferState;
+		buf->data = NULL;
+		buf->width = buf->height = 0;
+	}
+	markAllStale();
+	m_restage = true;
+}
+
+/// <summary>
+/// Marks every tile of every buffer as out of date. The mutex must be held.
+/// </summary>
+void FrameStager::markAllStale()
+{
+	for(uint i = 0; i < m_numBuffers; i++)
+		memset(&m_buffers[i].staleTiles[0], 0xFF, m_tileMapSize);
+}
+
+void FrameStager::workerMain()
+{
+	for(;;) {
+		bool restage;
+		{
+			boost::mutex::scoped_lock lock(*m_mutex);
+			if(m_exiting)
+				break;
+			restage = m_restage;
+		}
+
+		int frameNum = holdNewestFrame();
+		if(frameNum < 0) {
+			m_capShm->waitForFrame(FRAME_WAIT_USEC);
+			continue;
+		}
+		if(!m_hasNewDamage && !restage) {
+			// Identical to the frame that we staged last
+			m_capShm->releaseFrame(frameNum);
+			m_heldFrameNum = -1;
+			continue;
+		}
+		if(stageFrame(frameNum)) {
+			m_capShm->releaseFrame(frameNum);
+			m_heldFrameNum = -1;
+			continue;
+		}
+
+		// The frame remains held until a buffer of the right size is free
+		// or a newer frame replaces it
+		boost::mutex::scoped_lock lock(*m_mutex);
+		if(!m_exiting) {
+			m_cond->wait_for(
+				lock, boost::chrono::microseconds(BUFFER_WAIT_USEC));
+		}
+	}
+	if(m_heldFrameNum >= 0)
+		m_capShm->releaseFrame(m_heldFrameNum);
+	m_heldFrameNum = -1;
+}
+
+/// <summary>
+/// Releases every queued frame except for the newest one and adds the damage
+/// of every frame that we haven't seen before to our buffers.
+/// </summary>
+/// <returns>The newest frame or -1 if there are no queued frames</returns>
+int FrameStager::holdNewestFrame()
+{
+	for(;;) {
+		int frameNum = m_capShm->acquireFrame();
+		if(m_capShm->getNumRegistrations() != m_numRegistrations) {
+			// The producer dropped us and we registered again. The frame
+			// that we were holding is gone and the damage of every frame in
+			// between was lost so every buffer must be filled completely.
+			m_numRegistrations = m_capShm->getNumRegistrations();
+			m_heldFrameNum = -1;
+			m_hasNewDamage = true;
+			boost::mutex::scoped_lock lock(*m_mutex);
+			markAllStale();
+			m_restage = true;
+		}
+		if(frameNum < 0)
+			return -1;
+
+		// Frames are queued in order so the earliest frame remains the same
+		// until we release it
+		if(frameNum != m_heldFrameNum) {
+			m_heldFrameNum = frameNum;
+			if(accumulateDamage(frameNum))
+				m_hasNewDamage = true;
+			boost::mutex::scoped_lock lock(*m_mutex);
+			m_frameWidth = m_capShm->getFrameWidth(frameNum);
+			m_frameHeight = m_capShm->getFrameHeight(frameNum);
+		}
+		if(m_capShm->getNumQueuedFrames() <= 1)
+			return frameNum;
+		m_capShm->releaseFrame(frameNum);
+		m_heldFrameNum = -1;
+	}
+}
+
+/// <summary>
+/// Adds the damage of the specified frame to every buffer.
+/// </summary>
+/// <returns>True if anything changed</returns>
+bool FrameStager::accumulateDamage(uint frameNum)
+{
+	const uint tileSize = CaptureSharedSegment::TILE_SIZE;
+	uchar *damage = &m_damage[0];
+	uint numTileRows = (m_capShm->getMaxHeight() + tileSize - 1) / tileSize;
+	memset(damage, 0, m_tileMapSize);
+	const uchar *tiles = m_capShm->getFrameChangedTiles(frameNum);
+	if(m_capShm->isFrameFullyDirty(frameNum)) {
+		// There is no point copying anything outside of the region of
+		// interest as nobody will look at it
+		DirtyRect roi;
+		{
+			boost::mutex::scoped_lock lock(*m_mutex);
+			roi = m_roi;
+		}
+		if(roi.width == 0 || roi.height == 0)
+			memset(damage, 0xFF, m_tileMapSize);
+		else
+			markTiles(damage, m_tilesPerRow, numTileRows, roi);
+	} else if(tiles != NULL) {
+		// The changed tiles are exact so use them instead of the rectangles
+		memcpy(damage, tiles, m_tileMapSize);
+	} else {
+		const DirtyRect *rects = NULL;
+		uint numRects = m_capShm->getFrameDirtyRects(frameNum, &rects);
+		for(uint i = 0; i < numRects; i++)
+			markTiles(damage, m_tilesPerRow, numTileRows, rects[i]);
+	}
+
+	bool hasDamage = false;
+	for(uint i = 0; i < m_tileMapSize; i++) {
+		if(damage[i] != 0) {
+			hasDamage = true;
+			break;
+		}
+	}
+	if(!hasDamage)
+		return false;
+
+	boost::mutex::scoped_lock lock(*m_mutex);
+	for(uint i = 0; i < m_numBuffers; i++) {
+		uchar *stale = &m_buffers[i].staleTiles[0];
+		for(uint j = 0; j < m_tileMapSize; j++)
+			stale[j] |= damage[j];
+	}
+	return true;
+}
+
+/// <summary>
+/// Copies the out of date parts of a free buffer from the specified frame.
+/// </summary>
+/// <returns>False if the frame must be staged again later</returns>
+bool FrameStager::stageFrame(uint frameNum)
+{
+	// Our buffers are always BGRA so we can't use frames that the producer
+	// wrote in a planar format for somebody else. The damage remains in our
+	// buffers until a frame that we can use arrives.
+	uint32_t format = m_capShm->getFrameFormat(frameNum);
+	bool isCompressed = (format == CompressedBGRAPixelFormat);
+	if(!isCompressed && !canConvertPixelFormat(format, BGRAPixelFormat)) {
+		boost::mutex::scoped_lock lock(*m_mutex);
+		m_badFormat = format;
+		return true;
+	}
+
+	// Claim a free buffer of the same size as the frame and take its damage
+	uint width = m_capShm->getFrameWidth(frameNum);
+	uint height = m_capShm->getFrameHeight(frameNum);
+	Buffer *buf = NULL;
+	bool flip;
+	{
+		boost::mutex::scoped_lock lock(*m_mutex);
+		for(uint i = 0; i < m_numBuffers; i++) {
+			Buffer *b = &m_buffers[i];
+			if(b->state == FreeBufferState && b->width == width &&
+				b->height == height)
+			{
+				buf = b;
+				break;
+			}
+		}
+		if(buf == NULL)
+			return false;
+		buf->state = WritingBufferState;
+		memcpy(&m_staleTiles[0], &buf->staleTiles[0], m_tileMapSize);
+		memset(&buf->staleTiles[0], 0, m_tileMapSize);
+		flip = (m_srcIsFlipped && m_topDown);
+	}
+
+	// Compressed frames are decoded in full as runs can reference any
+	// earlier pixel of the frame
+	const uchar *src = (const uchar *)m_capShm->getFrameDataPtr(frameNum);
+	uint srcStride = m_capShm->getFrameStride(frameNum);
+	bool failed = false;
+	if(isCompressed) {
+		uint decWidth = 0, decHeight = 0;
+		uint size = m_capShm->getFrameCompressedSize(frameNum);
+		getEncodedFrameSize(src, size, &decWidth, &decHeight);
+		srcStride = width * 4;
+		m_decoded.resize((size_t)srcStride * (size_t)height);
+		if(decWidth != width || decHeight != height ||
+			!decodeFrame(&m_decoded[0], srcStride, width, height, src, size))
+		{
+			failed = true;
+		}
+		src = &m_decoded[0];
+		format = BGRAPixelFormat;
+	}
+	if(!failed)
+		copyStaleTiles(buf, src, srcStride, format, flip);
+
+	boost::mutex::scoped_lock lock(*m_mutex);
+	if(failed) {
+		// The damage remains pending like unsupported formats
+		uchar *stale = &buf->staleTiles[0];
+		for(uint i = 0; i < m_tileMapSize; i++)
+			stale[i] |= m_staleTiles[i];
+		buf->state = FreeBufferState;
+		m_numDecodeFailures++;
+		m_cond->notify_all();
+		return true;
+	}
+
+	// Only the newest filled buffer is ever taken by the owner
+	for(uint i = 0; i < m_numBuffers; i++) {
+		if(m_buffers[i].state == FilledBufferState)
+			m_buffers[i].state = FreeBufferState;
+	}
+	buf->state = FilledBufferState;
+	buf->info.timestamp = m_capShm->getFrameTimestamp(frameNum);
+	buf->info.srcWidth = m_capShm->getFrameSourceWidth(frameNum);
+	buf->info.srcHeight = m_capShm->getFrameSourceHeight(frameNum);
+	buf->info.isFlipped = (m_srcIsFlipped && !flip);
+	m_hasNewDamage = false;
+	m_restage = false;
+	m_cond->notify_all();
+	return true;
+}
+
+/// <summary>
+/// Copies every stale tile of `m_staleTiles` from a frame of the same size
+/// as the buffer. Runs of stale tiles that span the same columns of
+/// consecutive tile rows are merged so that a complete frame is copied with
+/// a single conversion.
+/// </summary>
+void FrameStager::copyStaleTiles(
+	Buffer *buf, const uchar *src, uint srcStride, uint32_t srcFormat,
+	bool flip)
+{
+	const uint tileSize = CaptureSharedSegment::TILE_SIZE;
+	const uchar *tiles = &m_staleTiles[0];
+	uint tilesPerRow = (buf->width + tileSize - 1) / tileSize;
+	uint numTileRows = (buf->height + tileSize - 1) / tileSize;
+	m_openRects.clear();
+	for(uint ty = 0; ty < numTileRows; ty++) {
+		m_rowRects.clear();
+		uint tx = 0;
+		while(tx < tilesPerRow) {
+			if(!CaptureSharedSegment::isTileChanged(
+				tiles, m_tilesPerRow, tx, ty))
+			{
+				tx++;
+				continue;
+			}
+			uint runStart = tx;
+			while(tx < tilesPerRow && CaptureSharedSegment::isTileChanged(
+				tiles, m_tilesPerRow, tx, ty))
+			{
+				tx++;
+			}
+			DirtyRect rect;
+			rect.x = runStart * tileSize;
+			rect.y = ty * tileSize;
+			rect.width = (tx - runStart) * tileSize;
+			rect.height = tileSize;
+			m_rowRects.push_back(rect);
+		}
+
+		// Extend the open rectangles if this row has identical runs
+		bool isSame = (m_rowRects.size() == m_openRects.size());
+		for(uint i = 0; isSame && i < m_rowRects.size(); i++) {
+			if(m_rowRects[i].x != m_openRects[i].x ||
+				m_rowRects[i].width != m_openRects[i].width)
+			{
+				isSame = false;
+			}
+		}
+		if(isSame) {
+			for(uint i = 0; i < m_openRects.size(); i++)
+				m_openRects[i].height += tileSize;
+		} else {
+			copyRects(m_openRects, buf, src, srcStride, srcFormat, flip);
+			m_openRects.swap(m_rowRects);
+		}
+	}
+	copyRects(m_openRects, buf, src, srcStride, srcFormat, flip);
+}
+
+void FrameStager::copyRects(
+	const vector<DirtyRect> &rects, Buffer *buf, const uchar *src,
+	uint srcStride, uint32_t srcFormat, bool flip)
+{
+	const uint dstBpp = 4;
+	uint srcBpp = getPixelFormatBpp(srcFormat);
+	for(uint i = 0; i < rects.size(); i++) {
+		// Tiles at the edge of the frame are partial
+		const DirtyRect &rect = rects[i];
+		uint width = rect.width;
+		if(width > buf->width - rect.x)
+			width = buf->width - rect.x;
+		uint height = rect.height;
+		if(height > buf->height - rect.y)
+			height = buf->height - rect.y;
+
+		// Tiles are in the coordinates of the frame data so they need to be
+		// mirrored when flipping
+		uint dstY = rect.y;
+		if(flip)
+			dstY = buf->height - rect.y - height;
+		uchar *dst = &buf->data[dstY * buf->stride + rect.x * dstBpp];
+		imgConvert(dst, &src[rect.y * srcStride + rect.x * srcBpp],
+			buf->stride, srcStride, width, height, srcFormat,
+			BGRAPixelFormat, flip);
+	}
+}
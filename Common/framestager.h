@@ -0,0 +1,148 @@
+//*****************************************************************************
+// Libdeskcap: A high-performance desktop capture library
+//
+// Copyright (C) 2014 Lucas Murray <lucas@polyflare.com>
+// All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation; either version 2 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//*****************************************************************************
+
+#ifndef COMMON_FRAMESTAGER_H
+#define COMMON_FRAMESTAGER_H
+
+#include "capturesharedsegment.h"
+
+namespace boost {
+class condition_variable;
+class mutex;
+class thread;
+}
+
+/// <summary>
+/// Describes the frame that was most recently staged into a buffer.
+/// </summary>
+struct StagedFrameInfo {
+	uint64_t	timestamp;
+	uint		srcWidth; // Size before downscaling, zero if unscaled
+	uint		srcHeight;
+	bool		isFlipped; // The buffer is bottom-up
+
+	StagedFrameInfo() : timestamp(0), srcWidth(0), srcHeight(0)
+		, isFlipped(false) {};
+};
+
+//=============================================================================
+/// <summary>
+/// Copies raw pixel frames from a `CaptureSharedSegment` into a small set of
+/// persistent BGRA buffers on a dedicated thread so that the thread that
+/// owns the buffers, usually a graphics thread that has mapped a texture for
+/// each one, never has to wait for a copy. The owner hands buffers to the
+/// stager with `provideBuffer()` and takes back the buffer that contains the
+/// newest frame with `takeFilledBuffer()`. Staging more frames than the
+/// owner takes simply reuses the buffer of the frame that was never taken.
+///
+/// The stager always skips to the newest queued frame. Each buffer remembers
+/// which tiles of it are out of date so only the parts of the frame that
+/// changed since the buffer was last filled are copied. Pixels are converted
+/// to BGRA, compressed frames are decoded and bottom-up frames are flipped
+/// if the owner requested top-down frames.
+///
+/// The stager becomes the only reader of the segment that is passed to it
+/// and the segment must outlive it.
+/// </summary>
+class FrameStager
+{
+public: // Constants ----------------------------------------------------------
+	static const uint MAX_BUFFERS = 3;
+
+private: // Datatypes ---------------------------------------------------------
+	enum BufferState {
+		UnavailableBufferState = 0, // Owned by the owner
+		FreeBufferState, // Can be filled by the worker
+		WritingBufferState, // Being filled by the worker
+		FilledBufferState // Contains a frame that the owner hasn't taken
+	};
+
+	struct Buffer {
+		BufferState		state;
+		uchar *			data;
+		uint			stride;
+		uint			width;
+		uint			height;
+		vector<uchar>	staleTiles; // See `getFrameChangedTiles()`
+		StagedFrameInfo	info;
+
+		Buffer() : state(UnavailableBufferState), data(NULL), stride(0)
+			, width(0), height(0), staleTiles(), info() {};
+	};
+
+private: // Members -----------------------------------------------------------
+	CaptureSharedSegment *		m_capShm;
+	uint						m_numBuffers;
+	Buffer						m_buffers[MAX_BUFFERS];
+	uint						m_tilesPerRow;
+	uint						m_tileMapSize;
+	bool						m_srcIsFlipped; // Frames are bottom-up
+	boost::thread *				m_thread;
+	boost::mutex *				m_mutex; // Protects everything below
+	boost::condition_variable *	m_cond;
+	bool						m_exiting;
+	bool						m_topDown;
+	bool						m_restage; // Stage even without new damage
+	CaptureSharedSegment::DirtyRect	m_roi;
+	uint						m_frameWidth; // Newest frame seen
+	uint						m_frameHeight;
+	uint32_t					m_badFormat;
+	uint						m_numDecodeFailures;
+
+	// Only accessed by the worker thread
+	int							m_heldFrameNum;
+	bool						m_hasNewDamage;
+	uint						m_numRegistrations; // Of the segment
+	vector<uchar>				m_damage;
+	vector<uchar>				m_staleTiles;
+	vector<uchar>				m_decoded;
+	vector<CaptureSharedSegment::DirtyRect>	m_openRects;
+	vector<CaptureSharedSegment::DirtyRect>	m_rowRects;
+
+public: // Constructor/destructor ---------------------------------------------
+	FrameStager(CaptureSharedSegment *capShm, uint numBuffers);
+	virtual ~FrameStager();
+
+public: // Methods ------------------------------------------------------------
+	void		setTopDown(bool topDown);
+	void		setRegionOfInterest(
+		const CaptureSharedSegment::DirtyRect &roi);
+	void		getFrameSize(uint *widthOut, uint *heightOut);
+	uint32_t	getUnsupportedFormat();
+	uint		getNumDecodeFailures();
+
+	void		provideBuffer(
+		uint index, void *data, uint stride, uint width, uint height);
+	int			takeFilledBuffer(StagedFrameInfo *infoOut);
+	void		revokeBuffers();
+
+private:
+	void		workerMain();
+	int			holdNewestFrame();
+	bool		accumulateDamage(uint frameNum);
+	void		markAllStale();
+	bool		stageFrame(uint frameNum);
+	void		copyStaleTiles(
+		Buffer *buf, const uchar *src, uint srcStride, uint32_t srcFormat,
+		bool flip);
+	void		copyRects(
+		const vector<CaptureSharedSegment::DirtyRect> &rects, Buffer *buf,
+		const uchar *src, uint srcStride, uint32_t srcFormat, bool flip);
+};
+//=============================================================================
+
+#endif // COMMON_FRAMESTAGER_H
@@ -16,31 +16,183 @@
 //*****************************************************************************
 
 #include "imghelpers.h"
+#include "atomicops.h"
+#include "memcopy.h"
+#ifdef ARCH_X86
+#include <immintrin.h>
+#endif
+
+// Copies smaller than this use regular stores as the destination will most
+// likely be read again while it is still in the cache. Large copies such as
+// entire frames would only evict everything else so we bypass the cache.
+static const size_t NT_COPY_THRESHOLD = 256 * 1024;
+
+// Images that are at least this large are split into row stripes across the
+// shared worker pool if it exists. Waking the workers costs tens of
+// microseconds so this must be well above the size that a single thread can
+// process in that time. Each stripe is never smaller than the minimum size.
+static const size_t DEFAULT_THREADING_THRESHOLD = 4 * 1024 * 1024;
+static const size_t MIN_STRIPE_BYTES = 256 * 1024;
+static volatile uint64_t s_threadingThreshold = DEFAULT_THREADING_THRESHOLD;
+
+struct ImgCopyTask {
+	uchar *			dst;
+	const uchar *	src;
+	uint			dstStride;
+	uint			srcStride;
+	size_t			rowSize;
+	uint			numRows;
+	bool			flip;
+	StreamCopyFunc	copyRow; // NULL to use regular stores
+};
+
+/// <summary>
+/// Copies a range of rows of an `imgDataCopy()` operation. Executes an
+/// `sfence` if non-temporal stores were used.
+/// </summary>
+static void copyImgRows(void *opaque, uint firstRow, uint numRows)
+{
+	const ImgCopyTask *task = (const ImgCopyTask *)opaque;
+
+	// Flipped images are written from the bottom row upwards
+	size_t dstRow = firstRow;
+	ptrdiff_t dstStep = (ptrdiff_t)task->dstStride;
+	if(task->flip) {
+		dstRow = task->numRows - 1 - firstRow;
+		dstStep = -dstStep;
+	}
+	uchar *dstChar = task->dst + (size_t)task->dstStride * dstRow;
+	const uchar *srcChar = task->src + (size_t)task->srcStride * firstRow;
+
+	// If the input and output buffers are exactly the same size then we can
+	// get away with a single copy operation. The padding at the end of the
+	// final row is not copied.
+	size_t rowSize = task->rowSize;
+	size_t rows = (size_t)numRows;
+	if(!task->flip && task->dstStride == task->srcStride &&
+		(size_t)task->dstStride >= rowSize)
+	{
+		rowSize += (size_t)task->dstStride * (rows - 1);
+		rows = 1;
+	}
+
+	StreamCopyFunc copyRow = task->copyRow;
+	if(copyRow == NULL) {
+		for(size_t i = 0; i < rows; i++) {
+			memcpy(dstChar, srcChar, rowSize);
+			dstChar += dstStep;
+			srcChar += task->srcStride;
+		}
+		return;
+	}
+
+	for(size_t i = 0; i < rows; i++) {
+#ifdef ARCH_X86
+		// The kernel prefetches ahead within the row but as rows are usually
+		// not contiguous we also need to prefetch the start of the next one
+		if(i + 1 < rows) {
+			const uchar *next = srcChar + task->srcStride;
+			uint prefetchSize = STREAM_PREFETCH_DISTANCE;
+			if(rowSize < prefetchSize)
+				prefetchSize = (uint)rowSize;
+			for(uint j = 0; j < prefetchSize; j += CACHE_LINE_SIZE)
+				_mm_prefetch((const char *)next + j, _MM_HINT_T0);
+		}
+#endif // ARCH_X86
+		copyRow(dstChar, srcChar, rowSize);
+		dstChar += dstStep;
+		srcChar += task->srcStride;
+	}
+
+	// Non-temporal stores are only ordered per thread
+	streamCopyFence();
+}
+
+//=============================================================================
+// Helper functions
 
 /// <summary>
 /// An optimized memory copy designed for 2D image transfer that takes into
 /// account the row strides of the input and output image buffers. `widthBytes`
 /// is the width in bytes (NumPixels * BytesPerPixel) while `heightRows` is the
 /// height in rows.
+///
+/// Large copies bypass the cache with non-temporal stores using the widest
+/// vector instructions that the CPU supports as the destination is usually a
+/// shared memory segment or texture that this thread never reads. Very large
+/// copies are also split into row stripes, see `imgProcessRows()`.
+///
+/// If `flip` is true then the rows are written to the destination in reverse
+/// order which converts between bottom-up and top-down images in the same
+/// pass.
 /// </summary>
 void imgDataCopy(
 	void *dst, void *src, uint dstStride, uint srcStride, int widthBytes,
-	int heightRows)
+	int heightRows, bool flip)
 {
 	if(widthBytes < 0 || heightRows < 0)
 		return; // Width and height must be positive!
-	if(dstStride == srcStride) {
-		// The input and output buffers are exactly the same size so we can get
-		// away with a single memory copy operation
-		memcpy(dst, src, dstStride * heightRows);
+	if(widthBytes == 0 || heightRows == 0)
+		return;
+	size_t rowSize = (size_t)widthBytes;
+	size_t numBytes = rowSize * (size_t)heightRows;
+
+	ImgCopyTask task;
+	task.dst = (uchar *)dst;
+	task.src = (const uchar *)src;
+	task.dstStride = dstStride;
+	task.srcStride = srcStride;
+	task.rowSize = rowSize;
+	task.numRows = (uint)heightRows;
+	task.flip = flip;
+	task.copyRow = NULL;
+
+	// Small copies are faster with regular stores
+	if(numBytes >= NT_COPY_THRESHOLD)
+		task.copyRow = getStreamCopyFunc();
+
+	imgProcessRows(&copyImgRows, &task, (uint)heightRows, rowSize);
+}
+
+/// <summary>
+/// Calls `func` for every row of an image. Images that are at least as large
+/// as the threshold set with `setImgThreadingThreshold()` are split into row
+/// stripes across the shared worker pool, smaller ones are processed on the
+/// calling thread. `rowBytes` is the amount of data that is processed per
+/// row and is only used to decide how to split the image.
+/// </summary>
+void imgProcessRows(
+	RowRangeFunc func, void *opaque, uint numRows, size_t rowBytes)
+{
+	if(func == NULL || numRows == 0)
+		return;
+
+	WorkerPool *pool = WorkerPool::getShared();
+	uint64_t threshold = atomicLoad64(&s_threadingThreshold);
+	uint64_t numBytes = (uint64_t)rowBytes * (uint64_t)numRows;
+	if(pool == NULL || threshold == 0 || numBytes < threshold ||
+		rowBytes == 0)
+	{
+		func(opaque, 0, numRows);
 		return;
 	}
-	// Copy each row separately
-	char *dstChar = (char *)dst;
-	char *srcChar = (char *)src;
-	for(int i = 0; i < heightRows; i++) {
-		memcpy(dstChar, srcChar, widthBytes);
-		dstChar += dstStride;
-		srcChar += srcStride;
-	}
+
+	size_t minStripeRows = (MIN_STRIPE_BYTES + rowBytes - 1) / rowBytes;
+	if(minStripeRows > numRows)
+		minStripeRows = numRows;
+	pool->runRows(func, opaque, numRows, (uint)minStripeRows);
+}
+
+size_t getImgThreadingThreshold()
+{
+	return (size_t)atomicLoad64(&s_threadingThreshold);
+}
+
+/// <summary>
+/// Sets the size in bytes at which image operations are split across the
+/// shared worker pool. Zero disables threading entirely.
+/// </summary>
+void setImgThreadingThreshold(size_t minBytes)
+{
+	atomicStore64(&s_threadingThreshold, (uint64_t)minBytes);
 }
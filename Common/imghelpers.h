@@ -19,12 +19,17 @@
 #define COMMON_IMGHELPERS_H
 
 #include "stlincludes.h"
+#include "workerpool.h"
 
 //=============================================================================
 // Helper functions
 
 void	imgDataCopy(
 	void *dst, void *src, uint dstStride, uint srcStride, int widthBytes,
-	int heightRows);
+	int heightRows, bool flip = false);
+void	imgProcessRows(
+	RowRangeFunc func, void *opaque, uint numRows, size_t rowBytes);
+size_t	getImgThreadingThreshold();
+void	setImgThreadingThreshold(size_t minBytes);
 
 #endif // COMMON_IMGHELPERS_H
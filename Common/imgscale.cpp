@@ -0,0 +1,472 @@
+//*****************************************************************************
+// Libdeskcap: A high-performance desktop capture library
+//
+// Copyright (C) 2014 Lucas Murray <lucas@polyflare.com>
+// All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation; either version 2 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//*****************************************************************************
+
+#include "imgscale.h"
+#include "cpuinfo.h"
+#include "imghelpers.h"
+#include "pixelconvert.h"
+#ifdef ARCH_X86
+#include <immintrin.h>
+#endif
+
+// Bilinear weights are 7-bit fixed point so that the weighted sums of both
+// passes fit in the signed 16-bit multiplies of `pmaddwd`
+static const uint BILINEAR_ONE = 128;
+static const uint BILINEAR_SHIFT = 14; // Both passes
+
+//=============================================================================
+// Sample positions
+
+/// <summary>
+/// Returns the box filter size if the source is an exact multiple of the
+/// destination in both directions.
+/// </summary>
+static bool calcBoxFactors(
+	uint srcWidth, uint srcHeight, uint dstWidth, uint dstHeight,
+	uint *fxOut, uint *fyOut)
+{
+	if(dstWidth == 0 || dstHeight == 0)
+		return false;
+	if(srcWidth % dstWidth != 0 || srcHeight % dstHeight != 0)
+		return false;
+	*fxOut = srcWidth / dstWidth;
+	*fyOut = srcHeight / dstHeight;
+	return true;
+}
+
+/// <summary>
+/// Calculates the source pixel and the weight of the pixel after it that
+/// destination pixel `i` samples. Pixel centres are aligned so that both
+/// images cover exactly the same area. The returned pixel is always followed
+/// by another one unless the source is a single pixel wide.
+/// </summary>
+static void calcBilinearPos(
+	uint i, uint srcSize, uint dstSize, uint *posOut, uint *weightOut)
+{
+	*posOut = 0;
+	*weightOut = 0;
+	if(srcSize < 2 || dstSize == 0)
+		return;
+
+	// Centre of the destination pixel in 16.16 fixed point source pixels
+	uint64_t centre = (((uint64_t)(2 * i + 1) * srcSize) << 16) /
+		(2ULL * dstSize);
+	uint64_t fixed = (centre > 32768ULL ? centre - 32768ULL : 0);
+	uint pos = (uint)(fixed >> 16);
+	uint weight = ((uint)(fixed & 0xFFFF) + 256) >> 9; // Round to 7 bits
+	if(weight >= BILINEAR_ONE) {
+		pos++;
+		weight = 0;
+	}
+	if(pos >= srcSize - 1) {
+		pos = srcSize - 2;
+		weight = BILINEAR_ONE;
+	}
+	*posOut = pos;
+	*weightOut = weight;
+}
+
+//=============================================================================
+// Kernels
+
+/// <summary>
+/// Averages each 2x2 block of pixels of two source rows into a single pixel.
+/// </summary>
+typedef void (*Box2x2RowFunc)(
+	uchar *dst, const uchar *row0, const uchar *row1, uint numPixels);
+
+/// <summary>
+/// Blends each pair of horizontally adjacent source pixels at `xPos` of two
+/// rows into a single pixel using the horizontal weights `xWeight` and the
+/// vertical weight `yWeight`.
+/// </summary>
+typedef void (*BilinearRowFunc)(
+	uchar *dst, const uchar *row0, const uchar *row1, const uint *xPos,
+	const uint *xWeight, uint numPixels, uint yWeight);
+
+static void box2x2RowScalar(
+	uchar *dst, const uchar *row0, const uchar *row1, uint numPixels)
+{
+	for(uint i = 0; i < numPixels; i++) {
+		for(int c = 0; c < 4; c++) {
+			uint sum = row0[c] + row0[c + 4] + row1[c] + row1[c + 4];
+			dst[c] = (uchar)((sum + 2) >> 2);
+		}
+		dst += 4;
+		row0 += 8;
+		row1 += 8;
+	}
+}
+
+/// <summary>
+/// Averages each `fx` by `fy` block of pixels into a single pixel.
+/// </summary>
+static void boxRowScalar(
+	uchar *dst, const uchar *src, uint srcStride, uint numPixels, uint fx,
+	uint fy)
+{
+	uint n = fx * fy;
+	for(uint i = 0; i < numPixels; i++) {
+		uint sum[4] = { 0, 0, 0, 0 };
+		const uchar *row = src;
+		for(uint y = 0; y < fy; y++) {
+			const uchar *px = row;
+			for(uint x = 0; x < fx; x++) {
+				sum[0] += px[0];
+				sum[1] += px[1];
+				sum[2] += px[2];
+				sum[3] += px[3];
+				px += 4;
+			}
+			row += srcStride;
+		}
+		for(int c = 0; c < 4; c++)
+			dst[c] = (uchar)((sum[c] + n / 2) / n);
+		dst += 4;
+		src += fx * 4;
+	}
+}
+
+static void bilinearRowScalar(
+	uchar *dst, const uchar *row0, const uchar *row1, const uint *xPos,
+	const uint *xWeight, uint numPixels, uint yWeight)
+{
+	const uint round = 1 << (BILINEAR_SHIFT - 1);
+	for(uint i = 0; i < numPixels; i++) {
+		const uchar *a = row0 + xPos[i] * 4;
+		const uchar *b = row1 + xPos[i] * 4;
+		uint wx = xWeight[i];
+		uint next = (wx > 0 ? 4 : 0); // Source may be a single pixel wide
+		for(int c = 0; c < 4; c++) {
+			uint top = a[c] * (BILINEAR_ONE - wx) + a[c + next] * wx;
+			uint bot = b[c] * (BILINEAR_ONE - wx) + b[c + next] * wx;
+			uint val = top * (BILINEAR_ONE - yWeight) + bot * yWeight;
+			dst[c] = (uchar)((val + round) >> BILINEAR_SHIFT);
+		}
+		dst += 4;
+	}
+}
+
+#ifdef ARCH_X86
+SIMD_TARGET("sse2")
+static void box2x2RowSSE2(
+	uchar *dst, const uchar *row0, const uchar *row1, uint numPixels)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i two = _mm_set1_epi16(2);
+	while(numPixels >= 4) {
+		__m128i sums[2];
+		for(int i = 0; i < 2; i++) {
+			// Vertical sums of four pixels in 16 bits
+			__m128i a = _mm_loadu_si128((const __m128i *)(row0 + i * 16));
+			__m128i b = _mm_loadu_si128((const __m128i *)(row1 + i * 16));
+			__m128i lo = _mm_add_epi16(
+				_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+			__m128i hi = _mm_add_epi16(
+				_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+
+			// Add horizontally adjacent pixels
+			sums[i] = _mm_add_epi16(
+				_mm_unpacklo_epi64(lo, hi), _mm_unpackhi_epi64(lo, hi));
+			sums[i] = _mm_srli_epi16(_mm_add_epi16(sums[i], two), 2);
+		}
+		_mm_storeu_si128(
+			(__m128i *)dst, _mm_packus_epi16(sums[0], sums[1]));
+		dst += 16;
+		row0 += 32;
+		row1 += 32;
+		numPixels -= 4;
+	}
+	box2x2RowScalar(dst, row0, row1, numPixels);
+}
+
+/// <summary>
+/// Requires that every sampled pixel is followed by another one.
+/// </summary>
+SIMD_TARGET("sse2")
+static void bilinearRowSSE2(
+	uchar *dst, const uchar *row0, const uchar *row1, const uint *xPos,
+	const uint *xWeight, uint numPixels, uint yWeight)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i round = _mm_set1_epi32(1 << (BILINEAR_SHIFT - 1));
+	const __m128i wy = _mm_set1_epi32(
+		(int)((yWeight << 16) | (BILINEAR_ONE - yWeight)));
+	for(uint i = 0; i < numPixels; i++) {
+		const uchar *a = row0 + xPos[i] * 4;
+		const uchar *b = row1 + xPos[i] * 4;
+		uint wx = xWeight[i];
+		__m128i wh = _mm_set1_epi32((int)((wx << 16) | (BILINEAR_ONE - wx)));
+
+		// Interleave the channels of the left and right pixels so that each
+		// multiply-add blends one channel
+		__m128i ta = _mm_loadl_epi64((const __m128i *)a);
+		__m128i tb = _mm_loadl_epi64((const __m128i *)b);
+		ta = _mm_unpacklo_epi8(
+			_mm_unpacklo_epi8(ta, _mm_srli_si128(ta, 4)), zero);
+		tb = _mm_unpacklo_epi8(
+			_mm_unpacklo_epi8(tb, _mm_srli_si128(tb, 4)), zero);
+		__m128i top = _mm_madd_epi16(ta, wh);
+		__m128i bot = _mm_madd_epi16(tb, wh);
+
+		// Same again vertically. The horizontal results fit in 15 bits.
+		__m128i tv = _mm_packs_epi32(top, bot);
+		tv = _mm_unpacklo_epi16(tv, _mm_srli_si128(tv, 8));
+		__m128i val = _mm_madd_epi16(tv, wy);
+		val = _mm_srli_epi32(_mm_add_epi32(val, round), BILINEAR_SHIFT);
+		val = _mm_packs_epi32(val, val);
+		val = _mm_packus_epi16(val, val);
+		*(int *)dst = _mm_cvtsi128_si32(val);
+		dst += 4;
+	}
+}
+#endif // ARCH_X86
+
+//=============================================================================
+// Helper functions
+
+struct ImgScaleTask {
+	uchar *			dst;
+	const uchar *	src;
+	uint			dstStride;
+	uint			srcStride;
+	ImgRect			dstRect;
+	ImgRect			srcRect;
+	uint			srcHeight;
+	uint			dstHeight;
+	uint			fx; // Box filter size, zero for bilinear
+	uint			fy;
+	Box2x2RowFunc	box2x2Row;
+	BilinearRowFunc	bilinearRow;
+	const uint *	xPos; // Relative to `srcRect`
+	const uint *	xWeight;
+};
+
+static void scaleImgRows(void *opaque, uint firstRow, uint numRows)
+{
+	const ImgScaleTask *task = (const ImgScaleTask *)opaque;
+	const ImgRect &dstRect = task->dstRect;
+	const ImgRect &srcRect = task->srcRect;
+	uchar *dst = task->dst + (size_t)task->dstStride * firstRow;
+	for(uint i = firstRow; i < firstRow + numRows; i++) {
+		uint dy = dstRect.y + i;
+		if(task->fx > 0) {
+			size_t srcY = dy * task->fy - srcRect.y;
+			size_t srcX = dstRect.x * task->fx - srcRect.x;
+			const uchar *src =
+				task->src + task->srcStride * srcY + srcX * 4;
+			if(task->fx == 2 && task->fy == 2) {
+				task->box2x2Row(
+					dst, src, src + task->srcStride, dstRect.width);
+			} else {
+				boxRowScalar(dst, src, task->srcStride, dstRect.width,
+					task->fx, task->fy);
+			}
+		} else {
+			uint pos, weight;
+			calcBilinearPos(dy, task->srcHeight, task->dstHeight, &pos,
+				&weight);
+			const uchar *row0 =
+				task->src + (size_t)task->srcStride * (pos - srcRect.y);
+			const uchar *row1 = row0;
+			if(weight > 0)
+				row1 += task->srcStride;
+			task->bilinearRow(dst, row0, row1, task->xPos, task->xWeight,
+				dstRect.width, weight);
+		}
+		dst += task->dstStride;
+	}
+}
+
+/// <summary>
+/// Returns true if `imgScale()` supports images of the specified format.
+/// Only formats with four 8-bit channels are supported as every channel is
+/// filtered identically.
+/// </summary>
+bool canScalePixelFormat(uint32_t format)
+{
+	return getPixelFormatBpp(format) == 4 &&
+		getPixelFormatChannelBits(format) == 8;
+}
+
+/// <summary>
+/// Returns true if scaling between the specified sizes uses a box filter
+/// which is both faster and has a higher quality than the bilinear filter
+/// that is used for everything else.
+/// </summary>
+bool isImgScaleBox(
+	uint srcWidth, uint srcHeight, uint dstWidth, uint dstHeight)
+{
+	uint fx, fy;
+	return calcBoxFactors(srcWidth, srcHeight, dstWidth, dstHeight, &fx, &fy);
+}
+
+/// <summary>
+/// Returns the smallest area of the source image that `imgScale()` reads in
+/// order to produce `dstRect` of the destination image.
+/// </summary>
+ImgRect imgScaleSrcRect(
+	uint srcWidth, uint srcHeight, uint dstWidth, uint dstHeight,
+	const ImgRect &dstRect)
+{
+	if(dstRect.width == 0 || dstRect.height == 0)
+		return ImgRect();
+	uint fx, fy;
+	if(calcBoxFactors(srcWidth, srcHeight, dstWidth, dstHeight, &fx, &fy)) {
+		return ImgRect(dstRect.x * fx, dstRect.y * fy, dstRect.width * fx,
+			dstRect.height * fy);
+	}
+
+	// Bilinear samples read the pixel after the sampled one as well
+	uint left, right, top, bottom, weight;
+	calcBilinearPos(dstRect.x, srcWidth, dstWidth, &left, &weight);
+	calcBilinearPos(dstRect.x + dstRect.width - 1, srcWidth, dstWidth,
+		&right, &weight);
+	calcBilinearPos(dstRect.y, srcHeight, dstHeight, &top, &weight);
+	calcBilinearPos(dstRect.y + dstRect.height - 1, srcHeight, dstHeight,
+		&bottom, &weight);
+	right += 2;
+	if(right > srcWidth)
+		right = srcWidth;
+	bottom += 2;
+	if(bottom > srcHeight)
+		bottom = srcHeight;
+	return ImgRect(left, top, right - left, bottom - top);
+}
+
+/// <summary>
+/// Returns the smallest area of the destination image that contains every
+/// pixel that `imgScale()` calculates using pixels inside of `srcRect`.
+/// </summary>
+ImgRect imgScaleDstRect(
+	uint srcWidth, uint srcHeight, uint dstWidth, uint dstHeight,
+	const ImgRect &srcRect)
+{
+	if(srcRect.width == 0 || srcRect.height == 0 || srcWidth == 0 ||
+		srcHeight == 0)
+	{
+		return ImgRect();
+	}
+	uint64_t left = (uint64_t)srcRect.x * dstWidth / srcWidth;
+	uint64_t top = (uint64_t)srcRect.y * dstHeight / srcHeight;
+	uint64_t right = ((uint64_t)(srcRect.x + srcRect.width) * dstWidth +
+		srcWidth - 1) / srcWidth;
+	uint64_t bottom = ((uint64_t)(srcRect.y + srcRect.height) * dstHeight +
+		srcHeight - 1) / srcHeight;
+
+	// Bilinear samples can reach one pixel further in each direction
+	if(!isImgScaleBox(srcWidth, srcHeight, dstWidth, dstHeight)) {
+		left = (left > 0 ? left - 1 : 0);
+		top = (top > 0 ? top - 1 : 0);
+		right++;
+		bottom++;
+	}
+	if(right > dstWidth)
+		right = dstWidth;
+	if(bottom > dstHeight)
+		bottom = dstHeight;
+	return ImgRect((uint)left, (uint)top, (uint)(right - left),
+		(uint)(bottom - top));
+}
+
+/// <summary>
+/// Resizes an entire image with four 8-bit channels per pixel, see
+/// `imgScale()` below.
+/// </summary>
+void imgScale(
+	void *dst, const void *src, uint dstStride, uint srcStride,
+	uint srcWidth, uint srcHeight, uint dstWidth, uint dstHeight)
+{
+	imgScale(dst, src, dstStride, srcStride, srcWidth, srcHeight, dstWidth,
+		dstHeight, ImgRect(0, 0, dstWidth, dstHeight),
+		ImgRect(0, 0, srcWidth, srcHeight));
+}
+
+/// <summary>
+/// Resizes an image with four 8-bit channels per pixel from `srcWidth` by
+/// `srcHeight` to `dstWidth` by `dstHeight` pixels. If the source is an exact
+/// multiple of the destination then every destination pixel is the average
+/// of the block of pixels that it covers, otherwise it is bilinearly
+/// interpolated. Bilinear filtering aliases when shrinking by more than 2x
+/// so callers should prefer integer ratios.
+///
+/// Only `dstRect` of the destination is calculated. `dst` points to its
+/// top-left pixel while `src` points to the top-left pixel of `srcRect` which
+/// must contain `imgScaleSrcRect(dstRect)`. Large images are split into row
+/// stripes, see `imgProcessRows()`.
+/// </summary>
+void imgScale(
+	void *dst, const void *src, uint dstStride, uint srcStride,
+	uint srcWidth, uint srcHeight, uint dstWidth, uint dstHeight,
+	const ImgRect &dstRect, const ImgRect &srcRect)
+{
+	if(dstRect.width == 0 || dstRect.height == 0)
+		return;
+	if(dstRect.x + dstRect.width > dstWidth ||
+		dstRect.y + dstRect.height > dstHeight)
+	{
+		return; // Outside of the destination
+	}
+	uint features = getCpuFeatures();
+
+	ImgScaleTask task;
+	task.dst = (uchar *)dst;
+	task.src = (const uchar *)src;
+	task.dstStride = dstStride;
+	task.srcStride = srcStride;
+	task.dstRect = dstRect;
+	task.srcRect = srcRect;
+	task.srcHeight = srcHeight;
+	task.dstHeight = dstHeight;
+	task.fx = 0;
+	task.fy = 0;
+	task.box2x2Row = &box2x2RowScalar;
+	task.bilinearRow = &bilinearRowScalar;
+	task.xPos = NULL;
+	task.xWeight = NULL;
+	size_t rowBytes = (size_t)srcRect.width * 4;
+
+	vector<uint> xPos;
+	vector<uint> xWeight;
+	if(calcBoxFactors(
+		srcWidth, srcHeight, dstWidth, dstHeight, &task.fx, &task.fy))
+	{
+#ifdef ARCH_X86
+		if(features & SSE2CpuFeature)
+			task.box2x2Row = &box2x2RowSSE2;
+#endif // ARCH_X86
+		rowBytes *= task.fy;
+	} else {
+		// Horizontal sample positions are the same for every row
+		xPos.resize(dstRect.width);
+		xWeight.resize(dstRect.width);
+		for(uint i = 0; i < dstRect.width; i++) {
+			calcBilinearPos(
+				dstRect.x + i, srcWidth, dstWidth, &xPos[i], &xWeight[i]);
+			xPos[i] -= srcRect.x;
+		}
+		task.xPos = &xPos[0];
+		task.xWeight = &xWeight[0];
+#ifdef ARCH_X86
+		if(srcWidth >= 2 && (features & SSE2CpuFeature))
+			task.bilinearRow = &bilinearRowSSE2;
+#endif // ARCH_X86
+		rowBytes *= 2;
+	}
+
+	imgProcessRows(&scaleImgRows, &task, dstRect.height, rowBytes);
+}
@@ -0,0 +1,47 @@
+//*****************************************************************************
+// Libdeskcap: A high-performance desktop capture library
+//
+// Copyright (C) 2014 Lucas Murray <lucas@polyflare.com>
+// All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation; either version 2 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//*****************************************************************************
+
+#ifndef COMMON_IMGSCALE_H
+#define COMMON_IMGSCALE_H
+
+#include "stlincludes.h"
+#include "capturesharedsegment.h"
+
+// A rectangle in pixels relative to the top-left of an image
+typedef CaptureSharedSegment::DirtyRect ImgRect;
+
+//=============================================================================
+// Helper functions
+
+bool	canScalePixelFormat(uint32_t format);
+bool	isImgScaleBox(
+	uint srcWidth, uint srcHeight, uint dstWidth, uint dstHeight);
+ImgRect	imgScaleSrcRect(
+	uint srcWidth, uint srcHeight, uint dstWidth, uint dstHeight,
+	const ImgRect &dstRect);
+ImgRect	imgScaleDstRect(
+	uint srcWidth, uint srcHeight, uint dstWidth, uint dstHeight,
+	const ImgRect &srcRect);
+void	imgScale(
+	void *dst, const void *src, uint dstStride, uint srcStride,
+	uint srcWidth, uint srcHeight, uint dstWidth, uint dstHeight);
+void	imgScale(
+	void *dst, const void *src, uint dstStride, uint srcStride,
+	uint srcWidth, uint srcHeight, uint dstWidth, uint dstHeight,
+	const ImgRect &dstRect, const ImgRect &srcRect);
+
+#endif // COMMON_IMGSCALE_H
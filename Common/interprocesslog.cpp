@@ -16,50 +16,219 @@
 //*****************************************************************************
 
 #include "interprocesslog.h"
+#include "atomicops.h"
 #include "stlhelpers.h"
-#ifdef OS_WIN
-#include <windows.h>
-#else
-#error Unsupported platform
-#endif
+
+//=============================================================================
+// Format string parsing
+
+enum FormatLength {
+	DefaultFormatLength = 0,
+	CharFormatLength, // hh
+	ShortFormatLength, // h
+	LongFormatLength, // l
+	LongLongFormatLength, // ll, I64
+	SizeFormatLength, // z, I
+	IntMaxFormatLength, // j
+	PtrDiffFormatLength, // t
+	LongDoubleFormatLength, // L
+	Int32FormatLength // I32
+};
+
+/// <summary>
+/// A single `printf()` conversion specification.
+/// </summary>
+struct FormatSpec {
+	string			flags; // Flags, width and precision without '*'s
+	bool			widthStar;
+	bool			precisionStar;
+	string			precision; // Including the '.' if it exists
+	FormatLength	length;
+	char			conversion; // 0 if unknown
+};
+
+/// <summary>
+/// Parses the conversion specification that begins immediately after a '%'.
+/// </summary>
+/// <returns>A pointer to the character after the specification</returns>
+static const char *parseFormatSpec(const char *p, FormatSpec *spec)
+{
+	spec->flags.clear();
+	spec->widthStar = false;
+	spec->precisionStar = false;
+	spec->precision.clear();
+	spec->length = DefaultFormatLength;
+	spec->conversion = 0;
+
+	// Flags and width
+	while(*p != 0 && strchr("-+ #0", *p) != NULL)
+		spec->flags += *p++;
+	if(*p == '*') {
+		spec->widthStar = true;
+		p++;
+	} else {
+		while(*p >= '0' && *p <= '9')
+			spec->flags += *p++;
+	}
+
+	// Precision
+	if(*p == '.') {
+		spec->precision += *p++;
+		if(*p == '*') {
+			spec->precisionStar = true;
+			p++;
+		} else {
+			while(*p >= '0' && *p <= '9')
+				spec->precision += *p++;
+		}
+	}
+
+	// Length modifier
+	switch(*p) {
+	case 'h':
+		p++;
+		spec->length = ShortFormatLength;
+		if(*p == 'h') {
+			p++;
+			spec->length = CharFormatLength;
+		}
+		break;
+	case 'l':
+		p++;
+		spec->length = LongFormatLength;
+		if(*p == 'l') {
+			p++;
+			spec->length = LongLongFormatLength;
+		}
+		break;
+	case 'z':
+		p++;
+		spec->length = SizeFormatLength;
+		break;
+	case 'j':
+		p++;
+		spec->length = IntMaxFormatLength;
+		break;
+	case 't':
+		p++;
+		spec->length = PtrDiffFormatLength;
+		break;
+	case 'L':
+		p++;
+		spec->length = LongDoubleFormatLength;
+		break;
+	case 'I': // Microsoft extensions
+		p++;
+		spec->length = SizeFormatLength;
+		if(p[0] == '6' && p[1] == '4') {
+			p += 2;
+			spec->length = LongLongFormatLength;
+		} else if(p[0] == '3' && p[1] == '2') {
+			p += 2;
+			spec->length = Int32FormatLength;
+		}
+		break;
+	default:
+		break;
+	}
+
+	// Conversion
+	if(*p != 0 && strchr("diuoxXcfFeEgGaAspn", *p) != NULL)
+		spec->conversion = *p++;
+	return p;
+}
+
+//=============================================================================
+// InterprocessLog class
 
 InterprocessLog::InterprocessLog()
-	: m_mutex()
+	: m_writePos(0)
+	//, m_numDropped() // Initialized below
+	, m_readPos(0)
+	, m_stallPos(0)
+	, m_stallTimestamp(0)
 	//, m_msgs() // Initialized below
-	, m_nextMsg(0)
 {
 	// Zero memory
+	memset(m_numDropped, 0, sizeof(m_numDropped));
+	memset(m_padding1, 0, sizeof(m_padding1));
+	memset(m_padding3, 0, sizeof(m_padding3));
 	memset(m_msgs, 0, sizeof(m_msgs));
+
+	// Each entry can be claimed by a writer once its sequence number equals
+	// the write position
+	for(int i = 0; i < NUM_MSGS; i++)
+		m_msgs[i].seq = (uint32_t)i;
 }
 
 /// <summary>
-/// Empties the log queue and returns its contents.
+/// Empties the log queue and returns its contents formatted as text. It is
+/// safe for multiple processes to call this at the same time although each
+/// message is only ever returned to one of them.
 /// </summary>
 vector<InterprocessLog::LogData> InterprocessLog::emptyLog()
 {
 	vector<LogData> ret;
-	m_mutex.lock();
-	if(m_nextMsg <= 0) {
-		// Log is already empty
-		m_mutex.unlock();
-		return ret;
-	}
-	ret.reserve(m_nextMsg);
-	for(int i = 0; i < m_nextMsg; i++) {
+	for(;;) {
+		uint32_t pos = atomicLoad32(&m_readPos);
+		LogEntry *entry = &m_msgs[pos & (NUM_MSGS - 1)];
+		uint32_t seq = atomicLoad32(&entry->seq);
+		int32_t diff = (int32_t)(seq - (pos + 1));
+		if(diff > 0)
+			continue; // Another consumer read the entry first
+		if(diff < 0) {
+			// The queue is either empty or the writer of the next entry
+			// hasn't finished yet. If it hasn't finished for a long time then
+			// it has probably crashed and we skip it.
+			if(atomicLoad32(&m_writePos) == pos)
+				break; // Queue is empty
+			uint64_t now = getMonotonicUsec();
+			if(atomicLoad32(&m_stallPos) != pos ||
+				atomicLoad64(&m_stallTimestamp) == 0)
+			{
+				atomicStore64(&m_stallTimestamp, now);
+				atomicStore32(&m_stallPos, pos);
+				break;
+			}
+			if(now - atomicLoad64(&m_stallTimestamp) < STALL_TIMEOUT_USEC)
+				break;
+		}
+
+		// Claim the entry
+		if(!atomicCas32(&m_readPos, pos, pos + 1))
+			continue; // Another consumer claimed it first
+		if(diff < 0) {
+			// Skip the stalled entry. If the writer finishes between our
+			// test above and now then we can still read it.
+			if(atomicCas32(&entry->seq, pos, pos + NUM_MSGS)) {
+				uint lvl = entry->lvl;
+				if(lvl >= NUM_LOG_LEVELS)
+					lvl = Critical;
+				atomicFetchAdd32(&m_numDropped[lvl], 1);
+				continue;
+			}
+		}
+
+		// Copy the message and return the entry to the writers
 		LogData data;
-		data.lvl = m_msgs[i].lvl;
-#pragma warning(push)
-#pragma warning(disable: 4996)
-		strncpy(data.cat, m_msgs[i].cat, sizeof(data.cat));
-		strncpy(data.msg, m_msgs[i].msg, sizeof(data.msg));
-#pragma warning(pop)
+		readEntry(entry, &data);
+		atomicStore32(&entry->seq, pos + NUM_MSGS);
 		ret.push_back(data);
 	}
-	m_nextMsg = 0;
-	m_mutex.unlock();
 	return ret;
 }
 
+/// <summary>
+/// Returns the number of messages of the specified level that have been
+/// dropped since the previous call as the queue was full.
+/// </summary>
+uint32_t InterprocessLog::takeNumDropped(LogLevel lvl)
+{
+	if(lvl < 0 || lvl >= NUM_LOG_LEVELS)
+		return 0;
+	return atomicFetchAnd32(&m_numDropped[lvl], 0);
+}
+
 /// <summary>
 /// Logs a message.
 /// </summary>
@@ -67,23 +236,23 @@ void InterprocessLog::log(LogLevel lvl, const string &cat, const string &msg)
 {
 #ifndef INTERPROCESS_NO_LOG
 
-	m_mutex.lock();
-	if(m_nextMsg >= NUM_MSGS) {
-		// Queue is full
-		m_mutex.unlock();
-		return;
-	}
-	LogData *data = &m_msgs[m_nextMsg];
-	data->lvl = lvl;
-#pragma warning(push)
-#pragma warning(disable: 4996)
-	strncpy(data->cat, cat.data(), sizeof(data->cat));
-	strncpy(data->msg, msg.data(), sizeof(data->msg));
-#pragma warning(pop)
-	data->cat[CAT_SIZE-1] = 0; // Just in case the string overflowed
-	data->msg[MSG_SIZE-1] = 0; // Just in case the string overflowed
-	m_nextMsg++;
-	m_mutex.unlock();
+	uint32_t pos;
+	LogEntry *entry = beginWrite(lvl, &pos);
+	if(entry == NULL)
+		return; // Queue is full
+	size_t catSize = cat.size();
+	if(catSize > CAT_SIZE - 1)
+		catSize = CAT_SIZE - 1;
+	memcpy(entry->cat, cat.data(), catSize);
+	entry->cat[catSize] = 0;
+	size_t msgSize = msg.size();
+	if(msgSize > DATA_SIZE - 1)
+		msgSize = DATA_SIZE - 1;
+	memcpy(entry->data, msg.data(), msgSize);
+	entry->data[msgSize] = 0;
+	entry->fmtSize = (uint16_t)(msgSize + 1);
+	entry->flags = LiteralFlag;
+	endWrite(entry, pos);
 
 #endif // INTERPROCESS_NO_LOG
 }
@@ -96,14 +265,8 @@ void InterprocessLog::log(LogLevel lvl, const string &msg)
 {
 #ifndef INTERPROCESS_NO_LOG
 
-#ifdef OS_WIN
-	DWORD procId = GetCurrentProcessId();
-	string cat = stringf("Hook:0x%X", procId);
-#else
-#error Unsupported platform
-#endif
-
-	log(lvl, cat, msg);
+	// An empty category is replaced with the process ID by the consumer
+	log(lvl, string(), msg);
 
 #endif // INTERPROCESS_NO_LOG
 }
@@ -120,3 +283,426 @@ void InterprocessLog::log(const string &msg)
 
 #endif // INTERPROCESS_NO_LOG
 }
+
+/// <summary>
+/// Logs a `printf()`-style message with an automatically determined category.
+/// The message is formatted by the consumer so this is much cheaper than
+/// calling `log()` with the result of `stringf()`. String arguments are copied
+/// immediately and are truncated to `MAX_STRING_ARG` characters.
+/// </summary>
+void InterprocessLog::logf(LogLevel lvl, const char *fmt, ...)
+{
+#ifndef INTERPROCESS_NO_LOG
+
+	va_list args;
+	va_start(args, fmt);
+	logv(lvl, fmt, args);
+	va_end(args);
+
+#endif // INTERPROCESS_NO_LOG
+}
+
+void InterprocessLog::logv(LogLevel lvl, const char *fmt, va_list args)
+{
+#ifndef INTERPROCESS_NO_LOG
+
+	if(fmt == NULL)
+		return;
+	uint32_t pos;
+	LogEntry *entry = beginWrite(lvl, &pos);
+	if(entry == NULL)
+		return; // Queue is full
+	entry->cat[0] = 0;
+
+	// Copy the format string. If it's truncated then only the arguments that
+	// are referenced by the part that we copied are encoded.
+	size_t fmtSize = strlen(fmt);
+	if(fmtSize > DATA_SIZE - 1)
+		fmtSize = DATA_SIZE - 1;
+	memcpy(entry->data, fmt, fmtSize);
+	entry->data[fmtSize] = 0;
+	entry->fmtSize = (uint16_t)(fmtSize + 1);
+
+	bool truncated = false;
+	uint argsSize = encodeArgs(entry->data, args,
+		&entry->data[entry->fmtSize], DATA_SIZE - entry->fmtSize,
+		&truncated);
+	entry->argsSize = (uint16_t)argsSize;
+	entry->flags = (truncated ? TruncatedFlag : 0);
+	endWrite(entry, pos);
+
+#endif // INTERPROCESS_NO_LOG
+}
+
+/// <summary>
+/// Claims the next entry in the queue. Every field apart from the category,
+/// data and flags is initialized.
+/// </summary>
+/// <returns>NULL if the queue is full</returns>
+InterprocessLog::LogEntry *InterprocessLog::beginWrite(
+	LogLevel lvl, uint32_t *posOut)
+{
+	if(lvl < 0 || lvl >= NUM_LOG_LEVELS)
+		lvl = Critical;
+	uint32_t pos = atomicLoad32(&m_writePos);
+	for(;;) {
+		LogEntry *entry = &m_msgs[pos & (NUM_MSGS - 1)];
+		uint32_t seq = atomicLoad32(&entry->seq);
+		int32_t diff = (int32_t)(seq - pos);
+		if(diff == 0) {
+			if(atomicCas32(&m_writePos, pos, pos + 1)) {
+				entry->processId = getProcessId();
+				entry->timestamp = getMonotonicUsec();
+				entry->lvl = (uint8_t)lvl;
+				entry->fmtSize = 0;
+				entry->argsSize = 0;
+				*posOut = pos;
+				return entry;
+			}
+		} else if(diff < 0) {
+			// The consumer hasn't read the entry from the previous lap yet
+			atomicFetchAdd32(&m_numDropped[lvl], 1);
+			return NULL;
+		}
+		pos = atomicLoad32(&m_writePos);
+	}
+	return NULL; // Should never happen
+}
+
+/// <summary>
+/// Makes a claimed entry visible to the consumer. If we took so long that the
+/// consumer skipped the entry then the message is lost and was already
+/// counted as dropped.
+/// </summary>
+void InterprocessLog::endWrite(LogEntry *entry, uint32_t pos)
+{
+	atomicCas32(&entry->seq, pos, pos + 1);
+}
+
+/// <summary>
+/// Encodes the arguments that are referenced by `fmt` into `out`. Each
+/// argument is stored as a one byte `ArgType` followed by either an 8 byte
+/// value or a 2 byte length and the characters of a string.
+/// </summary>
+/// <returns>The number of bytes written to `out`</returns>
+uint InterprocessLog::encodeArgs(
+	const char *fmt, va_list args, char *out, uint outSize,
+	bool *truncatedOut)
+{
+	uint size = 0;
+	*truncatedOut = false;
+	FormatSpec spec;
+	for(const char *p = fmt; *p != 0;) {
+		if(*p++ != '%')
+			continue;
+		if(*p == '%') {
+			p++;
+			continue;
+		}
+		p = parseFormatSpec(p, &spec);
+		if(spec.conversion == 0) {
+			// We don't know the type of the argument so we cannot continue
+			*truncatedOut = true;
+			return size;
+		}
+
+		// Fetch the arguments of the specification. Field widths and
+		// precisions that are '*' come first.
+		int numValues = 1 + (spec.widthStar ? 1 : 0) +
+			(spec.precisionStar ? 1 : 0);
+		for(int i = 0; i < numValues; i++) {
+			bool isStar = (i < numValues - 1);
+			uchar type = IntArgType;
+			uint64_t value = 0;
+			const char *str = NULL;
+			const wchar_t *wstr = NULL;
+			if(isStar) {
+				value = (uint64_t)(int64_t)va_arg(args, int);
+			} else {
+				switch(spec.conversion) {
+				case 'd':
+				case 'i':
+					type = IntArgType;
+					switch(spec.length) {
+					case LongFormatLength:
+						value = (uint64_t)(int64_t)va_arg(args, long);
+						break;
+					case LongLongFormatLength:
+						value = (uint64_t)va_arg(args, long long);
+						break;
+					case SizeFormatLength:
+					case PtrDiffFormatLength:
+						value = (uint64_t)(int64_t)va_arg(args, ptrdiff_t);
+						break;
+					case IntMaxFormatLength:
+						value = (uint64_t)(int64_t)va_arg(args, intmax_t);
+						break;
+					default:
+						value = (uint64_t)(int64_t)va_arg(args, int);
+						break;
+					}
+					break;
+				case 'u':
+				case 'o':
+				case 'x':
+				case 'X':
+					type = UIntArgType;
+					switch(spec.length) {
+					case LongFormatLength:
+						value = (uint64_t)va_arg(args, unsigned long);
+						break;
+					case LongLongFormatLength:
+						value = (uint64_t)va_arg(args, unsigned long long);
+						break;
+					case SizeFormatLength:
+					case PtrDiffFormatLength:
+						value = (uint64_t)va_arg(args, size_t);
+						break;
+					case IntMaxFormatLength:
+						value = (uint64_t)va_arg(args, uintmax_t);
+						break;
+					default:
+						value = (uint64_t)va_arg(args, unsigned int);
+						break;
+					}
+					break;
+				case 'c':
+					type = IntArgType;
+					value = (uint64_t)(int64_t)va_arg(args, int);
+					break;
+				case 'f':
+				case 'F':
+				case 'e':
+				case 'E':
+				case 'g':
+				case 'G':
+				case 'a':
+				case 'A': {
+					type = DoubleArgType;
+					double dbl;
+					if(spec.length == LongDoubleFormatLength)
+						dbl = (double)va_arg(args, long double);
+					else
+						dbl = va_arg(args, double);
+					memcpy(&value, &dbl, sizeof(value));
+					break; }
+				case 'p':
+					type = PointerArgType;
+					value = (uint64_t)(uintptr_t)va_arg(args, void *);
+					break;
+				case 's':
+					type = StringArgType;
+					if(spec.length == LongFormatLength)
+						wstr = va_arg(args, const wchar_t *);
+					else
+						str = va_arg(args, const char *);
+					break;
+				default:
+				case 'n':
+					// Never written to, only consumes the argument
+					va_arg(args, void *);
+					continue;
+				}
+			}
+
+			// Write the argument
+			if(type == StringArgType) {
+				if(str == NULL && wstr == NULL)
+					str = "(null)";
+				uint len = 0;
+				if(str != NULL) {
+					while(len < MAX_STRING_ARG && str[len] != 0)
+						len++;
+				} else {
+					while(len < MAX_STRING_ARG && wstr[len] != 0)
+						len++;
+				}
+				if(size + 3 + len > outSize) {
+					*truncatedOut = true;
+					return size;
+				}
+				out[size] = (char)type;
+				out[size + 1] = (char)(len & 0xFF);
+				out[size + 2] = (char)((len >> 8) & 0xFF);
+				size += 3;
+				if(str != NULL)
+					memcpy(&out[size], str, len);
+				else {
+					// Wide strings are only used for paths and the like,
+					// replace anything that isn't ASCII
+					for(uint j = 0; j < len; j++) {
+						wchar_t c = wstr[j];
+						out[size + j] = (c > 0 && c < 0x80 ? (char)c : '?');
+					}
+				}
+				size += len;
+			} else {
+				if(size + 1 + sizeof(value) > outSize) {
+					*truncatedOut = true;
+					return size;
+				}
+				out[size] = (char)type;
+				memcpy(&out[size + 1], &value, sizeof(value));
+				size += 1 + sizeof(value);
+			}
+		}
+	}
+	return size;
+}
+
+/// <summary>
+/// Formats a message from a format string and arguments that were encoded by
+/// `encodeArgs()`. Each conversion specification is formatted individually
+/// with the C library so the output is identical to `stringf()`. Missing
+/// arguments are replaced with "<?>".
+/// </summary>
+string InterprocessLog::formatArgs(
+	const char *fmt, const char *args, uint argsSize)
+{
+	string ret;
+	uint offset = 0;
+	FormatSpec spec;
+	for(const char *p = fmt; *p != 0;) {
+		if(*p != '%') {
+			ret += *p++;
+			continue;
+		}
+		p++;
+		if(*p == '%') {
+			ret += *p++;
+			continue;
+		}
+		const char *specStart = p - 1;
+		p = parseFormatSpec(p, &spec);
+		if(spec.conversion == 0) {
+			// Unknown specification, output it verbatim
+			ret.append(specStart, p - specStart);
+			continue;
+		}
+		if(spec.conversion == 'n')
+			continue; // Consumes an argument that was never encoded
+
+		// Decode the arguments of the specification
+		int numValues = 1 + (spec.widthStar ? 1 : 0) +
+			(spec.precisionStar ? 1 : 0);
+		uchar types[3];
+		uint64_t values[3];
+		string str;
+		bool isValid = true;
+		for(int i = 0; i < numValues; i++) {
+			if(offset >= argsSize) {
+				isValid = false;
+				break;
+			}
+			types[i] = (uchar)args[offset++];
+			if(types[i] == StringArgType) {
+				if(offset + 2 > argsSize) {
+					isValid = false;
+					break;
+				}
+				uint len = (uint)(uchar)args[offset] |
+					((uint)(uchar)args[offset + 1] << 8);
+				offset += 2;
+				if(offset + len > argsSize) {
+					isValid = false;
+					break;
+				}
+				str.assign(&args[offset], len);
+				offset += len;
+				values[i] = 0;
+			} else {
+				if(offset + sizeof(uint64_t) > argsSize) {
+					isValid = false;
+					break;
+				}
+				memcpy(&values[i], &args[offset], sizeof(uint64_t));
+				offset += sizeof(uint64_t);
+			}
+		}
+		if(!isValid) {
+			ret += "<?>";
+			offset = argsSize; // Everything after is unreliable
+			continue;
+		}
+
+		// Rebuild the specification with the '*'s replaced
+		string fmtSpec = "%" + spec.flags;
+		int i = 0;
+		if(spec.widthStar)
+			fmtSpec += stringf("%d", (int)(int64_t)values[i++]);
+		if(spec.precisionStar) {
+			fmtSpec += stringf(".%d", (int)(int64_t)values[i++]);
+		} else
+			fmtSpec += spec.precision;
+
+		// Format the value with the type that it was encoded as
+		uint64_t value = values[i];
+		switch(types[i]) {
+		case IntArgType:
+			if(spec.conversion == 'c')
+				ret += stringf(fmtSpec + "c", (int)(int64_t)value);
+			else {
+				ret += stringf(fmtSpec + "lld", (long long)(int64_t)value);
+			}
+			break;
+		case UIntArgType: {
+			char conv[2] = { spec.conversion, 0 };
+			ret += stringf(fmtSpec + "ll" + conv, (unsigned long long)value);
+			break; }
+		case DoubleArgType: {
+			double dbl;
+			memcpy(&dbl, &value, sizeof(dbl));
+			char conv[2] = { spec.conversion, 0 };
+			ret += stringf(fmtSpec + conv, dbl);
+			break; }
+		case PointerArgType:
+			ret += stringf("0x%llX", (unsigned long long)value);
+			break;
+		case StringArgType:
+			ret += stringf(fmtSpec + "s", str.data());
+			break;
+		default:
+			ret += "<?>";
+			break;
+		}
+	}
+	return ret;
+}
+
+/// <summary>
+/// Converts a queued entry into its text form. The entry could be modified
+/// while we read it if its writer was skipped so never trust its contents.
+/// </summary>
+void InterprocessLog::readEntry(const LogEntry *entry, LogData *out)
+{
+	LogEntry copy;
+	memcpy(&copy, entry, sizeof(copy));
+	copy.cat[CAT_SIZE - 1] = 0;
+	copy.data[DATA_SIZE - 1] = 0;
+
+	out->lvl = copy.lvl;
+	out->processId = copy.processId;
+	out->timestamp = copy.timestamp;
+	if(copy.cat[0] == 0)
+		out->cat = stringf("Hook:0x%X", copy.processId);
+	else
+		out->cat = string(copy.cat);
+
+	uint fmtSize = copy.fmtSize;
+	if(fmtSize > DATA_SIZE)
+		fmtSize = DATA_SIZE;
+	uint fmtLen = 0;
+	while(fmtLen < fmtSize && copy.data[fmtLen] != 0)
+		fmtLen++;
+	string fmt(copy.data, fmtLen);
+	if(copy.flags & LiteralFlag) {
+		out->msg = fmt;
+		return;
+	}
+	uint argsSize = copy.argsSize;
+	if(argsSize > DATA_SIZE - fmtSize)
+		argsSize = DATA_SIZE - fmtSize;
+	out->msg = formatArgs(fmt.data(), &copy.data[fmtSize], argsSize);
+	if(copy.flags & TruncatedFlag)
+		out->msg += " <truncated>";
+}
@@ -19,8 +19,7 @@
 #define COMMON_INTERPROCESSLOG_H
 
 #include "stlincludes.h"
-#include <boost/interprocess/sync/interprocess_mutex.hpp>
-using namespace boost::interprocess;
+#include <stdarg.h>
 
 //=============================================================================
 /// <summary>
@@ -28,6 +27,19 @@ using namespace boost::interprocess;
 /// to a log file that is opened in another process. WARNING: If this object is
 /// modified then any persistent shared memory segments need to be reset!
 ///
+/// The queue is a bounded lock-free ring that any number of threads in any
+/// number of processes can write to while a single consumer empties it. Each
+/// entry has a sequence number that tells writers when they can claim it and
+/// the reader when it has been completely written so logging never blocks
+/// the calling thread. If the ring is full then the message is dropped and
+/// counted in a per-level drop counter instead.
+///
+/// Messages logged with `logf()` are not formatted by the writer. The format
+/// string is copied verbatim and the arguments are encoded in a compact
+/// binary form which is only converted to text by the consumer in
+/// `emptyLog()`. Every message is timestamped with `getMonotonicUsec()` and
+/// the ID of the process that logged it.
+///
 /// If `INTERPROCESS_NO_LOG` is defined then the `log()` methods are not
 /// implemented. This is to prevent dependencies that are only used for
 /// automatic log category detection.
@@ -36,37 +48,91 @@ class InterprocessLog
 {
 public: // Datatypes ----------------------------------------------------------
 	static const int	CAT_SIZE = 16;
-	static const int	MSG_SIZE = 256;
-	static const int	NUM_MSGS = 64;
+	static const int	DATA_SIZE = 472; // Format string and arguments
+	static const int	NUM_MSGS = 256; // Must be a power of two
+	static const int	MAX_STRING_ARG = 128; // Longer strings are truncated
 	enum LogLevel {
 		Notice = 0,
 		Warning,
-		Critical
+		Critical,
+
+		NUM_LOG_LEVELS // Must be last
 	};
 	struct LogData {
-		// TODO: Timestamps?
 		unsigned char	lvl;
-		char			cat[CAT_SIZE];
-		char			msg[MSG_SIZE];
+		uint32_t		processId;
+		uint64_t		timestamp; // See `getMonotonicUsec()`
+		string			cat;
+		string			msg;
+	};
+
+private: // Datatypes ---------------------------------------------------------
+	enum EntryFlags {
+		LiteralFlag = 0x01, // Data is a plain message instead of a format
+		TruncatedFlag = 0x02 // Not every argument fitted in the entry
+	};
+
+	enum ArgType {
+		IntArgType = 0,
+		UIntArgType,
+		DoubleArgType,
+		PointerArgType,
+		StringArgType
 	};
 
-private: // Members -----------------------------------------------------------
 	// WARNING: All datatypes must have the same size on both 32- and 64-bit
 	// systems as the memory could be shared between processes of different
 	// bitness!
-	interprocess_mutex	m_mutex;
-	LogData				m_msgs[NUM_MSGS];
-	unsigned char		m_nextMsg;
+	struct LogEntry {
+		uint32_t	seq; // See `log()` and `emptyLog()`, atomic
+		uint32_t	processId;
+		uint64_t	timestamp;
+		uint8_t		lvl;
+		uint8_t		flags; // See `EntryFlags`
+		uint16_t	fmtSize; // Bytes of data used by the format string
+		uint16_t	argsSize; // Bytes of data used by the arguments
+		uint16_t	padding;
+		char		cat[CAT_SIZE]; // Empty for the default category
+		char		data[DATA_SIZE]; // NULL-terminated format then arguments
+	};
+
+	// An entry that is being written by a process that stopped responding
+	// would block the queue forever. The consumer skips it once the queue has
+	// been stuck on it for this long.
+	static const uint64_t STALL_TIMEOUT_USEC = 1000000ULL; // 1 sec
+
+private: // Members -----------------------------------------------------------
+	uint32_t			m_writePos; // Next entry to claim by writers, atomic
+	uint32_t			m_numDropped[NUM_LOG_LEVELS]; // Atomic
+	uchar				m_padding1[48];
+	uint32_t			m_readPos; // Next entry to read, atomic
+	uint32_t			m_stallPos; // Entry that blocked the reader, atomic
+	uint64_t			m_stallTimestamp; // When it first blocked, atomic
+	uchar				m_padding3[48];
+	LogEntry			m_msgs[NUM_MSGS];
 
 public: // Constructor/destructor ---------------------------------------------
 	InterprocessLog();
 
 public: // Methods ------------------------------------------------------------
 	vector<LogData>	emptyLog();
+	uint32_t		takeNumDropped(LogLevel lvl);
 
 	void			log(LogLevel lvl, const string &cat, const string &msg);
 	void			log(LogLevel lvl, const string &msg);
 	void			log(const string &msg);
+	void			logf(LogLevel lvl, const char *fmt, ...);
+	void			logv(LogLevel lvl, const char *fmt, va_list args);
+
+private:
+	LogEntry *		beginWrite(LogLevel lvl, uint32_t *posOut);
+	void			endWrite(LogEntry *entry, uint32_t pos);
+	static uint		encodeArgs(
+		const char *fmt, va_list args, char *out, uint outSize,
+		bool *truncatedOut);
+	static string	formatArgs(
+		const char *fmt, const char *args, uint argsSize);
+	static void		readEntry(const LogEntry *entry, LogData *out);
 };
 //=============================================================================
 
@@ -28,6 +28,8 @@ typedef unsigned int uint;
 #define OS_MAC
 #elif defined(WIN32) || defined(_WIN32) || defined(__WIN32__) || defined(__NT__)
 #define OS_WIN
+#elif defined(__linux__)
+#define OS_LINUX
 #else
 #error Unknown platform
 #endif
@@ -46,7 +48,7 @@ typedef unsigned int uint;
 
 // GCC
 #if __GNUC__
-#if __x86_64__ || __ppc64__
+#if __x86_64__ || __ppc64__ || __aarch64__
 #define IS64
 #else
 #define IS32
@@ -57,6 +59,31 @@ typedef unsigned int uint;
 #error Unknown bitness
 #endif
 
+//=============================================================================
+// What instruction set are we using?
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || \
+	defined(__x86_64__)
+#define ARCH_X86
+#endif
+
+// Marks a function as being allowed to use an instruction set extension that
+// the rest of the program is not compiled for. MSVC always allows intrinsics
+// of any instruction set so only GCC and Clang need this. The caller must
+// test that the CPU supports the extension with `getCpuFeatures()`.
+#if defined(__GNUC__) && defined(ARCH_X86)
+#define SIMD_TARGET(isa) __attribute__((target(isa)))
+#else
+#define SIMD_TARGET(isa)
+#endif
+
+// AVX-512 intrinsics are only available in newer compilers
+#if defined(ARCH_X86) && ((defined(_MSC_VER) && _MSC_VER >= 1911) || \
+	(defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 5) || \
+	(defined(__clang__) && __clang_major__ >= 4))
+#define HAS_AVX512_INTRINSICS
+#endif
+
 //=============================================================================
 // SSE helper macros
 
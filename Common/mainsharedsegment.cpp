@@ -16,10 +16,47 @@
 //*****************************************************************************
 
 #include "mainsharedsegment.h"
+#include "atomicops.h"
+#include "doorbell.h"
 #include "interprocesslog.h"
 #include "managedsharedmemory.h"
+#include "stlhelpers.h"
+#include <boost/date_time/posix_time/posix_time_types.hpp>
 
-MainSharedSegment::MainSharedSegment()
+// Lock-free readers give up after this many attempts at taking a snapshot.
+// A writer only holds a sequence lock for a few stores so this is only ever
+// reached if the writing process died or was suspended in the middle of an
+// update, which must never hang the render thread of a hooked application.
+static const int MAX_SEQLOCK_RETRIES = 256;
+
+/// <summary>
+/// Returns the table size that is used for a registry that can hold
+/// `capacity` windows.
+/// </summary>
+static uint32_t calcTableSize(uint capacity)
+{
+	uint32_t tableSize = 16;
+	while(tableSize < capacity * 2)
+		tableSize <<= 1;
+	return tableSize;
+}
+
+/// <summary>
+/// Returns the size of the main segment if it is created with a hook registry
+/// that can hold `registryCapacity` windows.
+/// </summary>
+uint64_t MainSharedSegment::calcSegmentSize(uint registryCapacity)
+{
+	return (uint64_t)SEGMENT_SIZE +
+		(uint64_t)calcTableSize(registryCapacity) * sizeof(HookRegEntry);
+}
+
+/// <summary>
+/// Opens the main shared segment creating it if it doesn't already exist. The
+/// hook registry capacity is only used if the segment is new, otherwise the
+/// capacity that the segment was created with is used.
+/// </summary>
+MainSharedSegment::MainSharedSegment(uint registryCapacity)
 	: m_shm(NULL)
 	, m_isValid(false)
 	, m_errorReason()
@@ -31,21 +68,34 @@ MainSharedSegment::MainSharedSegment()
 	, m_hasDxgi11(NULL)
 	, m_hasBgraTexSupport(NULL)
 	, m_fuzzyCapture(NULL)
+	, m_hookPoolThreads(NULL)
+	, m_hookPoolPinned(NULL)
 	, m_interprocessLog(NULL)
+	, m_consumerTicks(NULL)
+	, m_captureClock(NULL)
 	, m_hookRegistry(NULL)
+	, m_hookRegTable(NULL)
+	, m_hookRegDoorbellState(NULL)
+	, m_hookRegDoorbell(NULL)
 {
+	if(registryCapacity < 1)
+		registryCapacity = HOOK_REGISTRY_SIZE;
+	if(registryCapacity > MAX_HOOK_REGISTRY_SIZE)
+		registryCapacity = MAX_HOOK_REGISTRY_SIZE;
+
 	try {
-		m_shm = new ManagedSharedMemory("LibdeskcapSHM", SEGMENT_SIZE);
+		m_shm = new ManagedSharedMemory(
+			"LibdeskcapSHM", calcSegmentSize(registryCapacity));
 
 		// Add a version number to the very beginning of the shared segment so
 		// that we can detect when we've upgraded Libdeskcap on OS's that have
 		// persistent shared segments and the segment has a different format.
 		uchar *version = m_shm->unserialize<uchar>();
-		if(*version > 1) {
+		if(*version != 0 && *version != LAYOUT_VERSION) {
 			m_errorReason = "Unknown version number";
 			return;
 		}
-		*version = 1;
+		*version = LAYOUT_VERSION;
 
 		// Get the addresses of our shared objects
 		m_processRunning = m_shm->unserialize<char>();
@@ -54,8 +104,43 @@ MainSharedSegment::MainSharedSegment()
 		m_hasDxgi11 = m_shm->unserialize<char>();
 		m_hasBgraTexSupport = m_shm->unserialize<char>();
 		m_fuzzyCapture = m_shm->unserialize<char>();
-		m_interprocessLog = m_shm->unserialize<InterprocessLog>();
-		m_hookRegistry = m_shm->unserialize<HookRegistry>();
+		m_hookPoolThreads = m_shm->unserialize<uint32_t>();
+		m_hookPoolPinned = m_shm->unserialize<char>();
+		m_interprocessLog =
+			m_shm->unserializeAligned<InterprocessLog>(1, 64);
+		m_consumerTicks =
+			m_shm->unserializeAligned<ConsumerTickState>(1, 64);
+		m_captureClock =
+			m_shm->unserializeAligned<CaptureClockState>(1, 64);
+		m_hookRegDoorbellState =
+			m_shm->unserializeAligned<DoorbellState>(1, 64);
+		m_hookRegistry = m_shm->unserializeAligned<HookRegistry>();
+		if(m_hookRegDoorbellState == NULL || m_hookRegistry == NULL) {
+			m_errorReason = "Failed to map hook registry";
+			return;
+		}
+		m_hookRegDoorbell =
+			new Doorbell(m_hookRegDoorbellState, "HookRegistry");
+
+		// Whoever accesses the registry first decides its capacity
+		m_hookRegistry->lock.lock();
+		if(m_hookRegistry->tableSize == 0) {
+			m_hookRegistry->capacity = registryCapacity;
+			m_hookRegistry->tableSize = calcTableSize(registryCapacity);
+		}
+		uint32_t tableSize = m_hookRegistry->tableSize;
+		m_hookRegistry->lock.unlock();
+		if((tableSize & (tableSize - 1)) != 0 ||
+			tableSize > calcTableSize(MAX_HOOK_REGISTRY_SIZE))
+		{
+			m_errorReason = "Corrupt hook registry";
+			return;
+		}
+		m_hookRegTable = m_shm->unserializeAligned<HookRegEntry>(tableSize);
+		if(m_hookRegTable == NULL) {
+			m_errorReason = "Hook registry does not fit in segment";
+			return;
+		}
 
 		m_isValid = true;
 	} catch(interprocess_exception &ex) {
@@ -65,6 +150,10 @@ MainSharedSegment::MainSharedSegment()
 
 MainSharedSegment::~MainSharedSegment()
 {
+	if(m_hookRegDoorbell != NULL)
+		delete m_hookRegDoorbell;
+	m_hookRegDoorbell = NULL;
+
 	// Free the shared memory segment manager. Note that this doesn't actually
 	// delete the segment as it's persistent.
 	if(m_shm != NULL)
@@ -153,11 +242,310 @@ void MainSharedSegment::setFuzzyCapture(bool fuzzyCapture)
 	*m_fuzzyCapture = (fuzzyCapture ? 1 : 0);
 }
 
+/// <summary>
+/// Returns the number of frame copy threads that hooks create or zero if the
+/// main application hasn't chosen one.
+/// </summary>
+uint32_t MainSharedSegment::getHookPoolThreads()
+{
+	if(m_hookPoolThreads == NULL)
+		return 0;
+	// WARNING: Doesn't lock
+	return *m_hookPoolThreads;
+}
+
+bool MainSharedSegment::getHookPoolPinned()
+{
+	if(m_hookPoolPinned == NULL)
+		return false;
+	return (*m_hookPoolPinned != 0) ? true : false;
+}
+
+/// <summary>
+/// Sets the size of the frame copy worker pool that hooks create in the
+/// process that they are injected into and whether its threads are pinned to
+/// CPUs. Zero threads lets the hook decide. Hooks read this once when they
+/// start so it only affects processes that are hooked afterwards.
+/// </summary>
+void MainSharedSegment::setHookPool(uint32_t numThreads, bool pinThreads)
+{
+	if(m_hookPoolThreads == NULL || m_hookPoolPinned == NULL)
+		return;
+	// WARNING: Doesn't lock
+	*m_hookPoolThreads = numThreads;
+	*m_hookPoolPinned = (pinThreads ? 1 : 0);
+}
+
 InterprocessLog *MainSharedSegment::getInterprocessLog()
 {
 	return m_interprocessLog;
 }
 
+/// <summary>
+/// Replaces the consumer tick state with `state` without locking. The
+/// sequence number and process ID of `state` are ignored. If another consumer
+/// process has published recently or is currently publishing then nothing is
+/// written.
+/// </summary>
+/// <returns>True if the state was written</returns>
+bool MainSharedSegment::publishConsumerTicks(const ConsumerTickState &state)
+{
+	if(m_consumerTicks == NULL)
+		return false;
+	ConsumerTickState *ticks = m_consumerTicks;
+
+	// Take ownership of the sequence lock
+	uint32_t seq = atomicLoad32(&ticks->seq);
+	if(seq & 1)
+		return false;
+	if(!atomicCas32(&ticks->seq, seq, seq + 1))
+		return false;
+
+	uint32_t procId = getProcessId();
+	uint32_t owner = atomicLoad32(&ticks->procId);
+	uint64_t updated = atomicLoad64(&ticks->updatedUsec);
+	if(owner != 0 && owner != procId &&
+		state.updatedUsec < updated + ConsumerTickState::STALE_USEC)
+	{
+		// Another consumer is publishing, restore the original sequence
+		// number as nothing was modified
+		atomicStore32(&ticks->seq, seq);
+		return false;
+	}
+
+	atomicStore32(&ticks->procId, procId);
+	atomicStore32(&ticks->lockNum, state.lockNum);
+	atomicStore32(&ticks->jitterUsec, state.jitterUsec);
+	atomicStore64(&ticks->tickNum, state.tickNum);
+	atomicStore64(&ticks->tickUsec, state.tickUsec);
+	atomicStore64(&ticks->periodNsec, state.periodNsec);
+	atomicStore64(&ticks->updatedUsec, state.updatedUsec);
+	atomicStore32((volatile uint32_t *)&ticks->driftPpm,
+		(uint32_t)state.driftPpm);
+	atomicStore32(&ticks->seq, seq + 2);
+	return true;
+}
+
+/// <summary>
+/// Reads a consistent copy of the consumer tick state without locking. This
+/// is safe to call every frame.
+/// </summary>
+/// <returns>False if no consumer has ever published its ticks or if the
+/// publisher never finished its last update</returns>
+bool MainSharedSegment::readConsumerTicks(ConsumerTickState *out)
+{
+	if(m_consumerTicks == NULL || out == NULL)
+		return false;
+	ConsumerTickState *ticks = m_consumerTicks;
+
+	// See `readHookRegistry()`
+	ConsumerTickState copy;
+	for(int retry = 0;; retry++) {
+		if(retry >= MAX_SEQLOCK_RETRIES)
+			return false;
+		uint32_t seq = atomicLoad32(&ticks->seq);
+		if(seq & 1) {
+			// Writer is in the middle of modifying the state
+			cpuRelax();
+			continue;
+		}
+		copy.procId = atomicLoad32(&ticks->procId);
+		copy.lockNum = atomicLoad32(&ticks->lockNum);
+		copy.jitterUsec = atomicLoad32(&ticks->jitterUsec);
+		copy.tickNum = atomicLoad64(&ticks->tickNum);
+		copy.tickUsec = atomicLoad64(&ticks->tickUsec);
+		copy.periodNsec = atomicLoad64(&ticks->periodNsec);
+		copy.updatedUsec = atomicLoad64(&ticks->updatedUsec);
+		copy.driftPpm = (int32_t)atomicLoad32(
+			(volatile uint32_t *)&ticks->driftPpm);
+		if(atomicLoad32(&ticks->seq) == seq) {
+			copy.seq = seq;
+			break;
+		}
+	}
+	if(copy.procId == 0)
+		return false;
+	*out = copy;
+	return true;
+}
+
+/// <summary>
+/// Replaces the capture clock domain with `state` without locking and makes
+/// the calling process the one that calibrates it. The sequence number,
+/// process ID and update time of `state` are ignored. If another process has
+/// published recently or is currently publishing then nothing is written.
+/// The owning process must publish at least every `STALE_USEC` to keep it.
+/// </summary>
+/// <returns>True if the domain was written</returns>
+bool MainSharedSegment::publishCaptureClock(const CaptureClockState &state)
+{
+	if(m_captureClock == NULL)
+		return false;
+	CaptureClockState *clock = m_captureClock;
+
+	// Take ownership of the sequence lock
+	uint32_t seq = atomicLoad32(&clock->seq);
+	if(seq & 1)
+		return false;
+	if(!atomicCas32(&clock->seq, seq, seq + 1))
+		return false;
+
+	uint64_t now = getMonotonicUsec();
+	uint32_t procId = getProcessId();
+	uint32_t owner = atomicLoad32(&clock->procId);
+	uint64_t updated = atomicLoad64(&clock->updatedUsec);
+	if(owner != 0 && owner != procId &&
+		now < updated + CaptureClockState::STALE_USEC)
+	{
+		// Another process owns the domain, restore the original sequence
+		// number as nothing was modified
+		atomicStore32(&clock->seq, seq);
+		return false;
+	}
+
+	atomicStore32(&clock->procId, procId);
+	atomicStore32((volatile uint32_t *)&clock->rateAdjPpb,
+		(uint32_t)state.rateAdjPpb);
+	atomicStore32(&clock->generation, state.generation);
+	atomicStore64(&clock->monoAnchorUsec, state.monoAnchorUsec);
+	atomicStore64(&clock->clockAnchorUsec, state.clockAnchorUsec);
+	atomicStore64(&clock->updatedUsec, now);
+	atomicStore32(&clock->seq, seq + 2);
+	return true;
+}
+
+/// <summary>
+/// Reads a consistent copy of the capture clock domain without locking. This
+/// is safe to call every frame.
+/// </summary>
+/// <returns>False if the domain has not been created or if the publisher
+/// never finished its last update</returns>
+bool MainSharedSegment::readCaptureClock(CaptureClockState *out)
+{
+	if(m_captureClock == NULL || out == NULL)
+		return false;
+	CaptureClockState *clock = m_captureClock;
+
+	// See `readHookRegistry()`
+	CaptureClockState copy;
+	for(int retry = 0;; retry++) {
+		if(retry >= MAX_SEQLOCK_RETRIES)
+			return false;
+		uint32_t seq = atomicLoad32(&clock->seq);
+		if(seq & 1) {
+			// Writer is in the middle of modifying the domain
+			cpuRelax();
+			continue;
+		}
+		copy.procId = atomicLoad32(&clock->procId);
+		copy.rateAdjPpb = (int32_t)atomicLoad32(
+			(volatile uint32_t *)&clock->rateAdjPpb);
+		copy.generation = atomicLoad32(&clock->generation);
+		copy.monoAnchorUsec = atomicLoad64(&clock->monoAnchorUsec);
+		copy.clockAnchorUsec = atomicLoad64(&clock->clockAnchorUsec);
+		copy.updatedUsec = atomicLoad64(&clock->updatedUsec);
+		if(atomicLoad32(&clock->seq) == seq) {
+			copy.seq = seq;
+			break;
+		}
+	}
+	if(copy.procId == 0)
+		return false;
+	*out = copy;
+	return true;
+}
+
+/// <summary>
+/// Reads a consistent copy of the registry entry for `winId` without locking
+/// the registry. This is safe to call every frame. If the registry is being
+/// compacted at the same time then the window may transiently not be found so
+/// callers should treat a failure as "no change". The read also fails instead
+/// of waiting forever if the entry is never released by its writer.
+/// </summary>
+/// <returns>True if the window was found</returns>
+bool MainSharedSegment::readHookRegistry(uint32_t winId, HookRegEntry *out)
+{
+	if(m_hookRegTable == NULL || out == NULL)
+		return false;
+	if(winId == HookRegEntry::EMPTY_WIN_ID ||
+		winId == HookRegEntry::DELETED_WIN_ID)
+	{
+		return false;
+	}
+
+	uint32_t mask = m_hookRegistry->tableSize - 1;
+	uint32_t index = hashWinId(winId);
+	for(uint32_t i = 0; i <= mask; i++) {
+		HookRegEntry *entry = &m_hookRegTable[index];
+
+		// Take a snapshot of the entry, retrying if it was modified while we
+		// were reading it. All loads have acquire semantics so the final
+		// sequence number load cannot be reordered before the field loads.
+		HookRegEntry copy;
+		for(int retry = 0;; retry++) {
+			if(retry >= MAX_SEQLOCK_RETRIES)
+				return false;
+			uint32_t seq = atomicLoad32(&entry->seq);
+			if(seq & 1) {
+				// Writer is in the middle of modifying the entry
+				cpuRelax();
+				continue;
+			}
+			copy.winId = atomicLoad32(&entry->winId);
+			copy.hookProcId = atomicLoad32(&entry->hookProcId);
+			copy.shmName = atomicLoad32(&entry->shmName);
+			copy.flags = atomicLoad32(&entry->flags);
+			copy.numCaptureRefs = atomicLoad32(&entry->numCaptureRefs);
+			copy.shmSize = atomicLoad64(&entry->shmSize);
+			copy.roiX = atomicLoad32(&entry->roiX);
+			copy.roiY = atomicLoad32(&entry->roiY);
+			copy.roiWidth = atomicLoad32(&entry->roiWidth);
+			copy.roiHeight = atomicLoad32(&entry->roiHeight);
+			copy.outWidth = atomicLoad32(&entry->outWidth);
+			copy.outHeight = atomicLoad32(&entry->outHeight);
+			copy.framePeriodUsec = atomicLoad32(&entry->framePeriodUsec);
+			copy.compressFrames = atomicLoad32(&entry->compressFrames);
+			if(atomicLoad32(&entry->seq) == seq) {
+				copy.seq = seq;
+				break;
+			}
+		}
+
+		if(copy.winId == winId) {
+			*out = copy;
+			return true;
+		}
+		if(copy.winId == HookRegEntry::EMPTY_WIN_ID)
+			return false; // End of probe sequence
+		index = (index + 1) & mask;
+	}
+	return false;
+}
+
+/// <summary>
+/// Returns a counter that is incremented every time that the hook registry is
+/// modified by any process.
+/// </summary>
+uint32_t MainSharedSegment::getHookRegistryGeneration() const
+{
+	if(m_hookRegDoorbell == NULL)
+		return 0;
+	return m_hookRegDoorbell->getGeneration();
+}
+
+/// <summary>
+/// Blocks the calling thread until the hook registry generation differs from
+/// `generation` or until `timeoutUsec` microseconds have passed.
+/// </summary>
+/// <returns>True if the registry was modified</returns>
+bool MainSharedSegment::waitForHookRegistryChange(
+	uint32_t generation, uint timeoutUsec)
+{
+	if(m_hookRegDoorbell == NULL)
+		return false;
+	return m_hookRegDoorbell->wait(generation, timeoutUsec);
+}
+
 /// <summary>
 /// Attempts to lock the hook registry from being written to. If `timeoutMsec`
 /// is `0` then the lock will never time out.
@@ -186,42 +574,97 @@ void MainSharedSegment::unlockHookRegistry()
 }
 
 /// <summary>
-/// WARNING: The hook registry must be locked before calling this method!
+/// WARNING: The hook registry must be locked before calling this method! The
+/// returned entry must only be modified using `setHookRegistryFlags()` and
+/// `setHookRegistryShm()` so that lock-free readers remain consistent.
 /// </summary>
 HookRegEntry *MainSharedSegment::findWindowInHookRegistry(uint32_t winId)
 {
-	for(uint i = 0; i < m_hookRegistry->numEntries; i++) {
-		HookRegEntry *entry = &m_hookRegistry->entries[i];
-		if(winId == entry->winId)
+	if(m_hookRegTable == NULL)
+		return NULL;
+	if(winId == HookRegEntry::EMPTY_WIN_ID ||
+		winId == HookRegEntry::DELETED_WIN_ID)
+	{
+		return NULL;
+	}
+
+	uint32_t mask = m_hookRegistry->tableSize - 1;
+	uint32_t index = hashWinId(winId);
+	for(uint32_t i = 0; i <= mask; i++) {
+		HookRegEntry *entry = &m_hookRegTable[index];
+		if(entry->winId == winId)
 			return entry;
+		if(entry->winId == HookRegEntry::EMPTY_WIN_ID)
+			return NULL; // End of probe sequence
+		index = (index + 1) & mask;
 	}
 	return NULL;
 }
 
 /// <summary>
+/// Returns the raw hash table. Not every slot contains a window so callers
+/// must skip any entry where `isUsed()` returns false.
+///
 /// WARNING: The hook registry must be locked before calling this method!
 /// </summary>
-HookRegEntry *MainSharedSegment::iterateHookRegistry(uint &numEntriesOut)
+HookRegEntry *MainSharedSegment::iterateHookRegistry(uint &tableSizeOut)
 {
-	numEntriesOut = m_hookRegistry->numEntries;
-	return m_hookRegistry->entries;
+	if(m_hookRegTable == NULL) {
+		tableSizeOut = 0;
+		return NULL;
+	}
+	tableSizeOut = m_hookRegistry->tableSize;
+	return m_hookRegTable;
 }
 
 /// <summary>
+/// Adds a window to the registry replacing any existing entry for the same
+/// window.
+///
 /// WARNING: The hook registry must be locked before calling this method!
 /// </summary>
-void MainSharedSegment::addHookRegistry(const HookRegEntry &data)
+/// <returns>False if the registry is full</returns>
+bool MainSharedSegment::addHookRegistry(const HookRegEntry &data)
 {
-	// Search if the window already exists and if it does delete it
-	if(findWindowInHookRegistry(data.winId) != NULL)
-		removeHookRegistry(data.winId);
+	if(m_hookRegTable == NULL)
+		return false;
+	if(data.winId == HookRegEntry::EMPTY_WIN_ID ||
+		data.winId == HookRegEntry::DELETED_WIN_ID)
+	{
+		return false;
+	}
+
+	// Replace the existing entry in-place if the window already exists
+	HookRegEntry *entry = findWindowInHookRegistry(data.winId);
+	if(entry != NULL) {
+		writeEntry(entry, data);
+		m_hookRegDoorbell->ring();
+		return true;
+	}
 
 	// Prevent overflow
-	if(m_hookRegistry->numEntries >= HOOK_REGISTRY_SIZE)
-		return;
+	if(m_hookRegistry->numEntries >= m_hookRegistry->capacity)
+		return false;
 
-	m_hookRegistry->entries[m_hookRegistry->numEntries] = data;
+	// Insert into the first empty or deleted slot in the probe sequence. As
+	// the table is at least twice the capacity and we compact it whenever
+	// there are too many deleted slots we are guaranteed to find one.
+	uint32_t mask = m_hookRegistry->tableSize - 1;
+	uint32_t index = hashWinId(data.winId);
+	for(uint32_t i = 0; i <= mask; i++) {
+		entry = &m_hookRegTable[index];
+		if(!entry->isUsed())
+			break;
+		index = (index + 1) & mask;
+	}
+	if(entry->isUsed())
+		return false; // Should never happen
+	if(entry->winId == HookRegEntry::DELETED_WIN_ID)
+		m_hookRegistry->numDeleted--;
+	writeEntry(entry, data);
 	m_hookRegistry->numEntries++;
+	m_hookRegDoorbell->ring();
+	return true;
 }
 
 /// <summary>
@@ -233,13 +676,385 @@ void MainSharedSegment::removeHookRegistry(uint32_t winId)
 	if(entry == NULL)
 		return; // Already removed
 
-	// Get number of bytes that we need to move
-	int index =
-		(int)((entry - m_hookRegistry->entries) / sizeof(HookRegEntry));
-	int bytesAfter = (HOOK_REGISTRY_SIZE - index - 1) * sizeof(HookRegEntry);
-
-	// Remove the entry
-	if(bytesAfter > 0)
-		memmove(entry, entry + sizeof(HookRegEntry), bytesAfter);
+	// Mark the slot as deleted instead of empty so that the probe sequences
+	// of other windows are not broken
+	HookRegEntry deleted;
+	deleted.winId = HookRegEntry::DELETED_WIN_ID;
+	writeEntry(entry, deleted);
 	m_hookRegistry->numEntries--;
+	m_hookRegistry->numDeleted++;
+	m_hookRegDoorbell->ring();
+
+	// Deleted slots make unsuccessful lookups slower so compact the table
+	// once there are too many of them
+	if(m_hookRegistry->numDeleted > m_hookRegistry->tableSize / 4)
+		rebuildHookRegistry();
+}
+
+/// <summary>
+/// Atomically sets and clears the specified flags of a registry entry.
+///
+/// WARNING: The hook registry must be locked before calling this method!
+/// </summary>
+void MainSharedSegment::setHookRegistryFlags(
+	HookRegEntry *entry, uint32_t setFlags, uint32_t clearFlags)
+{
+	if(entry == NULL)
+		return;
+	uint32_t flags = (entry->flags | setFlags) & ~clearFlags;
+	if(flags == entry->flags)
+		return; // No change, don't wake anyone up
+	beginWriteEntry(entry);
+	atomicStore32(&entry->flags, flags);
+	endWriteEntry(entry);
+	m_hookRegDoorbell->ring();
+}
+
+/// <summary>
+/// Sets the capture shared segment details of a registry entry.
+///
+/// WARNING: The hook registry must be locked before calling this method!
+/// </summary>
+void MainSharedSegment::setHookRegistryShm(
+	HookRegEntry *entry, uint32_t shmName, uint64_t shmSize)
+{
+	if(entry == NULL)
+		return;
+	beginWriteEntry(entry);
+	atomicStore32(&entry->shmName, shmName);
+	atomicStore64(&entry->shmSize, shmSize);
+	endWriteEntry(entry);
+	m_hookRegDoorbell->ring();
+}
+
+/// <summary>
+/// Adds or removes a reference to the capture request of a window. The window
+/// is captured as long as at least one consumer process references it. Each
+/// process must only ever hold a single reference.
+///
+/// WARNING: The hook registry must be locked before calling this method!
+/// </summary>
+void MainSharedSegment::refHookRegistryCapture(
+	HookRegEntry *entry, bool capture)
+{
+	if(entry == NULL)
+		return;
+	uint32_t refs = entry->numCaptureRefs;
+	if(capture)
+		refs++;
+	else if(refs > 0)
+		refs--;
+	uint32_t flags = entry->flags & ~HookRegEntry::CaptureFlag;
+	if(refs > 0)
+		flags |= HookRegEntry::CaptureFlag;
+
+	beginWriteEntry(entry);
+	atomicStore32(&entry->numCaptureRefs, refs);
+	atomicStore32(&entry->flags, flags);
+	writeEntryConsumers(entry);
+	endWriteEntry(entry);
+	m_hookRegDoorbell->ring();
+}
+
+/// <summary>
+/// Sets the region of interest of the consumer process `procId`. An empty
+/// region means that the consumer needs the entire window. Consumers must
+/// clear their region when they release their capture reference. If there are
+/// no free consumer slots then the consumer silently receives the entire
+/// window.
+///
+/// WARNING: The hook registry must be locked before calling this method!
+/// </summary>
+void MainSharedSegment::setHookRegistryRoi(
+	HookRegEntry *entry, uint32_t procId, uint32_t x, uint32_t y,
+	uint32_t width, uint32_t height)
+{
+	if(width == 0 || height == 0)
+		x = y = width = height = 0;
+	HookRegConsumer *slot = findConsumer(entry, procId, width > 0);
+	if(slot == NULL)
+		return;
+	HookRegConsumer data = *slot;
+	data.procId = procId;
+	data.roiX = x;
+	data.roiY = y;
+	data.roiWidth = width;
+	data.roiHeight = height;
+	writeConsumer(entry, slot, data);
+}
+
+/// <summary>
+/// Sets the output size that the consumer process `procId` wants the window
+/// to be downscaled to. An empty size means that the consumer needs the
+/// window at its full size. Consumers must clear their size when they release
+/// their capture reference. If there are no free consumer slots then the
+/// consumer silently receives the window at its full size.
+///
+/// WARNING: The hook registry must be locked before calling this method!
+/// </summary>
+void MainSharedSegment::setHookRegistryOutputSize(
+	HookRegEntry *entry, uint32_t procId, uint32_t width, uint32_t height)
+{
+	if(width == 0 || height == 0)
+		width = height = 0;
+	HookRegConsumer *slot = findConsumer(entry, procId, width > 0);
+	if(slot == NULL)
+		return;
+	HookRegConsumer data = *slot;
+	data.procId = procId;
+	data.outWidth = width;
+	data.outHeight = height;
+	writeConsumer(entry, slot, data);
+}
+
+/// <summary>
+/// Sets the period that the consumer process `procId` wants frames of the
+/// window at. Zero means that the consumer needs every video frame.
+/// Consumers must clear their period when they release their capture
+/// reference. If there are no free consumer slots then the consumer silently
+/// receives every video frame.
+///
+/// WARNING: The hook registry must be locked before calling this method!
+/// </summary>
+void MainSharedSegment::setHookRegistryFramePeriod(
+	HookRegEntry *entry, uint32_t procId, uint32_t periodUsec)
+{
+	HookRegConsumer *slot = findConsumer(entry, procId, periodUsec > 0);
+	if(slot == NULL)
+		return;
+	HookRegConsumer data = *slot;
+	data.procId = procId;
+	data.framePeriodUsec = periodUsec;
+	writeConsumer(entry, slot, data);
+}
+
+/// <summary>
+/// Sets if the consumer process `procId` can decode frames that the hook
+/// losslessly compressed with `encodeFrame()`. Consumers must clear it when
+/// they release their capture reference. If there are no free consumer slots
+/// then the consumer silently receives uncompressed frames.
+///
+/// WARNING: The hook registry must be locked before calling this method!
+/// </summary>
+void MainSharedSegment::setHookRegistryCompression(
+	HookRegEntry *entry, uint32_t procId, bool compress)
+{
+	HookRegConsumer *slot = findConsumer(entry, procId, compress);
+	if(slot == NULL)
+		return;
+	HookRegConsumer data = *slot;
+	data.procId = procId;
+	data.compressFrames = (compress ? 1 : 0);
+	writeConsumer(entry, slot, data);
+}
+
+/// <summary>
+/// Returns the preferred table index for `winId`. HWNDs are mostly small
+/// multiples of two so the bits are mixed before masking.
+/// </summary>
+uint32_t MainSharedSegment::hashWinId(uint32_t winId) const
+{
+	uint32_t hash = winId;
+	hash ^= hash >> 16;
+	hash *= 0x7FEB352DU;
+	hash ^= hash >> 15;
+	hash *= 0x846CA68BU;
+	hash ^= hash >> 16;
+	return hash & (m_hookRegistry->tableSize - 1);
+}
+
+/// <summary>
+/// Marks an entry as being modified. The read-modify-write operation is a
+/// full barrier so none of the following stores can become visible before
+/// the sequence number does.
+/// </summary>
+void MainSharedSegment::beginWriteEntry(HookRegEntry *entry)
+{
+	atomicFetchAdd32(&entry->seq, 1);
+}
+
+void MainSharedSegment::endWriteEntry(HookRegEntry *entry)
+{
+	atomicFetchAdd32(&entry->seq, 1);
+}
+
+/// <summary>
+/// Overwrites every field of an entry except for its sequence number.
+/// </summary>
+void MainSharedSegment::writeEntry(
+	HookRegEntry *entry, const HookRegEntry &data)
+{
+	beginWriteEntry(entry);
+	atomicStore32(&entry->winId, data.winId);
+	atomicStore32(&entry->hookProcId, data.hookProcId);
+	atomicStore32(&entry->shmName, data.shmName);
+	atomicStore32(&entry->flags, data.flags);
+	atomicStore32(&entry->numCaptureRefs, data.numCaptureRefs);
+	atomicStore64(&entry->shmSize, data.shmSize);
+	for(int i = 0; i < HookRegEntry::MAX_CONSUMERS; i++) {
+		const HookRegConsumer &src = data.consumers[i];
+		HookRegConsumer &dst = entry->consumers[i];
+		atomicStore32(&dst.procId, src.procId);
+		atomicStore32(&dst.roiX, src.roiX);
+		atomicStore32(&dst.roiY, src.roiY);
+		atomicStore32(&dst.roiWidth, src.roiWidth);
+		atomicStore32(&dst.roiHeight, src.roiHeight);
+		atomicStore32(&dst.outWidth, src.outWidth);
+		atomicStore32(&dst.outHeight, src.outHeight);
+		atomicStore32(&dst.framePeriodUsec, src.framePeriodUsec);
+		atomicStore32(&dst.compressFrames, src.compressFrames);
+	}
+	writeEntryConsumers(entry);
+	endWriteEntry(entry);
+}
+
+/// <summary>
+/// Returns the consumer slot of the process `procId`. If the process doesn't
+/// have a slot yet and `create` is true then a free slot is returned instead.
+/// </summary>
+/// <returns>NULL if there is no slot</returns>
+HookRegConsumer *MainSharedSegment::findConsumer(
+	HookRegEntry *entry, uint32_t procId, bool create)
+{
+	if(entry == NULL || procId == 0)
+		return NULL;
+	for(int i = 0; i < HookRegEntry::MAX_CONSUMERS; i++) {
+		if(entry->consumers[i].procId == procId)
+			return &entry->consumers[i];
+	}
+	if(!create)
+		return NULL; // Already using the defaults
+	for(int i = 0; i < HookRegEntry::MAX_CONSUMERS; i++) {
+		if(entry->consumers[i].procId == 0)
+			return &entry->consumers[i];
+	}
+	return NULL; // No free slots
+}
+
+/// <summary>
+/// Replaces the requests of a consumer slot and notifies everyone of the
+/// change. The slot is released if the consumer no longer has any requests.
+///
+/// WARNING: The hook registry must be locked before calling this method!
+/// </summary>
+void MainSharedSegment::writeConsumer(
+	HookRegEntry *entry, HookRegConsumer *slot, const HookRegConsumer &data)
+{
+	if(slot->procId == data.procId && slot->roiX == data.roiX &&
+		slot->roiY == data.roiY && slot->roiWidth == data.roiWidth &&
+		slot->roiHeight == data.roiHeight &&
+		slot->outWidth == data.outWidth &&
+		slot->outHeight == data.outHeight &&
+		slot->framePeriodUsec == data.framePeriodUsec &&
+		slot->compressFrames == data.compressFrames)
+	{
+		return; // No change, don't wake anyone up
+	}
+
+	beginWriteEntry(entry);
+	atomicStore32(&slot->procId, data.isEmpty() ? 0 : data.procId);
+	atomicStore32(&slot->roiX, data.roiX);
+	atomicStore32(&slot->roiY, data.roiY);
+	atomicStore32(&slot->roiWidth, data.roiWidth);
+	atomicStore32(&slot->roiHeight, data.roiHeight);
+	atomicStore32(&slot->outWidth, data.outWidth);
+	atomicStore32(&slot->outHeight, data.outHeight);
+	atomicStore32(&slot->framePeriodUsec, data.framePeriodUsec);
+	atomicStore32(&slot->compressFrames, data.compressFrames);
+	writeEntryConsumers(entry);
+	endWriteEntry(entry);
+	m_hookRegDoorbell->ring();
+}
+
+/// <summary>
+/// Recalculates the union of the consumer regions of interest, the largest
+/// consumer output size, the shortest consumer frame period and if frames
+/// can be compressed of an entry that is being written. If any process that
+/// references the capture doesn't have a region, an output size or a frame
+/// period then the union is the entire window, the window size or every
+/// video frame respectively. Frames are only compressed if every process
+/// allowed it.
+/// </summary>
+void MainSharedSegment::writeEntryConsumers(HookRegEntry *entry)
+{
+	uint32_t numRois = 0;
+	uint32_t left = 0, top = 0, right = 0, bottom = 0;
+	uint32_t numSizes = 0;
+	uint32_t outWidth = 0, outHeight = 0;
+	uint32_t numPeriods = 0;
+	uint32_t period = 0;
+	uint32_t numCompress = 0;
+	for(int i = 0; i < HookRegEntry::MAX_CONSUMERS; i++) {
+		const HookRegConsumer &consumer = entry->consumers[i];
+		if(consumer.procId == 0)
+			continue;
+		if(consumer.compressFrames != 0)
+			numCompress++;
+		if(consumer.framePeriodUsec > 0) {
+			if(numPeriods == 0 || consumer.framePeriodUsec < period)
+				period = consumer.framePeriodUsec;
+			numPeriods++;
+		}
+		if(consumer.outWidth > 0 && consumer.outHeight > 0) {
+			if(consumer.outWidth > outWidth)
+				outWidth = consumer.outWidth;
+			if(consumer.outHeight > outHeight)
+				outHeight = consumer.outHeight;
+			numSizes++;
+		}
+		if(consumer.roiWidth == 0 || consumer.roiHeight == 0)
+			continue;
+		uint32_t r = consumer.roiX + consumer.roiWidth;
+		uint32_t b = consumer.roiY + consumer.roiHeight;
+		if(numRois == 0 || consumer.roiX < left)
+			left = consumer.roiX;
+		if(numRois == 0 || consumer.roiY < top)
+			top = consumer.roiY;
+		if(r > right)
+			right = r;
+		if(b > bottom)
+			bottom = b;
+		numRois++;
+	}
+	if(numRois == 0 || numRois < entry->numCaptureRefs)
+		left = top = right = bottom = 0;
+	if(numSizes == 0 || numSizes < entry->numCaptureRefs)
+		outWidth = outHeight = 0;
+	if(numPeriods == 0 || numPeriods < entry->numCaptureRefs)
+		period = 0;
+	uint32_t compress = 1;
+	if(numCompress == 0 || numCompress < entry->numCaptureRefs)
+		compress = 0;
+	atomicStore32(&entry->roiX, left);
+	atomicStore32(&entry->roiY, top);
+	atomicStore32(&entry->roiWidth, right - left);
+	atomicStore32(&entry->roiHeight, bottom - top);
+	atomicStore32(&entry->outWidth, outWidth);
+	atomicStore32(&entry->outHeight, outHeight);
+	atomicStore32(&entry->framePeriodUsec, period);
+	atomicStore32(&entry->compressFrames, compress);
+}
+
+/// <summary>
+/// Removes all deleted slots from the table by reinserting every window. Lock-
+/// free readers may fail to find a window while this is in progress.
+///
+/// WARNING: The hook registry must be locked before calling this method!
+/// </summary>
+void MainSharedSegment::rebuildHookRegistry()
+{
+	uint32_t tableSize = m_hookRegistry->tableSize;
+	vector<HookRegEntry> entries;
+	entries.reserve(m_hookRegistry->numEntries);
+	for(uint32_t i = 0; i < tableSize; i++) {
+		HookRegEntry *entry = &m_hookRegTable[i];
+		if(entry->isUsed())
+			entries.push_back(*entry);
+		if(entry->winId != HookRegEntry::EMPTY_WIN_ID)
+			writeEntry(entry, HookRegEntry());
+	}
+	m_hookRegistry->numEntries = 0;
+	m_hookRegistry->numDeleted = 0;
+	for(uint i = 0; i < entries.size(); i++)
+		addHookRegistry(entries.at(i));
 }
@@ -23,8 +23,10 @@
 #include <boost/interprocess/sync/interprocess_recursive_mutex.hpp>
 using namespace boost::interprocess;
 
+class Doorbell;
 class InterprocessLog;
 class ManagedSharedMemory;
+struct DoorbellState;
 
 //=============================================================================
 // Hook registry
@@ -32,10 +34,71 @@ class ManagedSharedMemory;
 // WARNING: All datatypes must have the same size on both 32- and 64-bit
 // systems as the memory could be shared between processes of different
 // bitness!
+//
+// Entries are stored in an open-addressed hash table keyed by `winId` and are
+// only ever added, modified or removed while the registry is locked. Each
+// entry is protected by a sequence lock (`seq` is odd while the entry is
+// being written) so that it can also be read without taking the registry lock
+// by using `MainSharedSegment::readHookRegistry()`.
+//
+// Every modification rings the registry doorbell which increments its
+// generation counter. Consumers can compare generations to detect that
+// nothing has changed without scanning the table.
+//
+// Regions of interest are in top-down window client coordinates. Consumer
+// processes register their own region with
+// `MainSharedSegment::setHookRegistryRoi()` and the hook only reads back the
+// union of every region. An empty region means the entire window.
+//
+// Consumers can also request that the hook downscales the window to a smaller
+// output size with `MainSharedSegment::setHookRegistryOutputSize()`. The hook
+// uses the largest requested size so that every consumer receives at least
+// the resolution that it asked for. Regions of interest always remain in
+// unscaled window coordinates.
+//
+// Consumers can also lower the rate that the hook captures frames at with
+// `MainSharedSegment::setHookRegistryFramePeriod()`. The hook uses the
+// shortest requested period so that every consumer receives at least the
+// rate that it asked for. A period of zero means every video frame.
+//
+// Consumers that decode compressed frames can allow the hook to losslessly
+// compress raw BGRA frames with
+// `MainSharedSegment::setHookRegistryCompression()`. As other consumers may
+// not be able to decode them the hook only compresses if every process that
+// references the capture allowed it.
+struct HookRegConsumer {
+	uint32_t	procId; // Consumer process ID, zero if the slot is unused
+	uint32_t	roiX;
+	uint32_t	roiY;
+	uint32_t	roiWidth;
+	uint32_t	roiHeight;
+	uint32_t	outWidth; // Zero for the window size
+	uint32_t	outHeight;
+	uint32_t	framePeriodUsec; // Zero for the video frequency
+	uint32_t	compressFrames; // Non-zero if compressed frames are accepted
+	uint32_t	padding;
+
+	HookRegConsumer() : procId(0), roiX(0), roiY(0), roiWidth(0)
+		, roiHeight(0), outWidth(0), outHeight(0), framePeriodUsec(0)
+		, compressFrames(0), padding(0) {};
+
+	/// <summary>
+	/// Returns true if the consumer has no requests and its slot can be
+	/// released.
+	/// </summary>
+	bool isEmpty() const {
+		return (roiWidth == 0 || roiHeight == 0) &&
+			(outWidth == 0 || outHeight == 0) && framePeriodUsec == 0 &&
+			compressFrames == 0;
+	};
+};
+
 struct HookRegEntry {
 	enum HookRegFlags {
 		// Set by the main application to let the hook know if a window should
-		// be captured.
+		// be captured. Multiple consumer processes can capture the same window
+		// so this is set whenever `numCaptureRefs` is non-zero. Use
+		// `MainSharedSegment::refHookRegistryCapture()` to modify it.
 		CaptureFlag = 0x01,
 
 		// Set by the hook to notify the main application that the shared
@@ -49,13 +112,129 @@ struct HookRegEntry {
 		ShmResetFlag = 0x04
 	};
 
+	// Special `winId` values. HWNDs are never `0` or `0xFFFFFFFF`.
+	static const uint32_t EMPTY_WIN_ID = 0;
+	static const uint32_t DELETED_WIN_ID = 0xFFFFFFFF;
+
+	// Maximum number of consumer processes that can have their own region of
+	// interest, output size, frame rate or compression. Any other consumer
+	// always receives the entire uncompressed window at its full size and at
+	// the video frequency.
+	static const int MAX_CONSUMERS = 4;
+
+	uint32_t	seq; // Sequence lock, odd while being modified
 	uint32_t	winId; // Window that can be hooked
 	uint32_t	hookProcId; // Hook process ID that manages the window
 	uint32_t	shmName; // SHM segment unique ID (Random number)
-	uint32_t	shmSize; // Size of the SHM segment
-	uchar		flags;
+	uint32_t	flags;
+	uint32_t	numCaptureRefs; // Consumer processes that want it captured
+	uint64_t	shmSize; // Size of the SHM segment
+	uint32_t	roiX; // Union of all consumer regions of interest
+	uint32_t	roiY;
+	uint32_t	roiWidth;
+	uint32_t	roiHeight;
+	uint32_t	outWidth; // Largest consumer output size
+	uint32_t	outHeight;
+	uint32_t	framePeriodUsec; // Shortest consumer frame period
+	uint32_t	compressFrames; // Non-zero if every consumer accepts them
+	HookRegConsumer	consumers[MAX_CONSUMERS];
 
-	HookRegEntry() : winId(0), hookProcId(0), shmName(0), flags(0) {};
+	HookRegEntry() : seq(0), winId(EMPTY_WIN_ID), hookProcId(0), shmName(0)
+		, flags(0), numCaptureRefs(0), shmSize(0), roiX(0), roiY(0)
+		, roiWidth(0), roiHeight(0), outWidth(0), outHeight(0)
+		, framePeriodUsec(0), compressFrames(0) {};
+
+	/// <summary>
+	/// Returns true if the hook only needs to capture part of the window.
+	/// </summary>
+	bool hasRoi() const {
+		return roiWidth > 0 && roiHeight > 0;
+	};
+
+	/// <summary>
+	/// Returns true if every consumer wants the window downscaled.
+	/// </summary>
+	bool hasOutputSize() const {
+		return outWidth > 0 && outHeight > 0;
+	};
+
+	/// <summary>
+	/// Returns true if this table slot contains a window. Empty and deleted
+	/// slots must be skipped when iterating over the registry.
+	/// </summary>
+	bool isUsed() const {
+		return winId != EMPTY_WIN_ID && winId != DELETED_WIN_ID;
+	};
+};
+
+//=============================================================================
+// Consumer tick timing
+
+// WARNING: All datatypes must have the same size on both 32- and 64-bit
+// systems as the memory could be shared between processes of different
+// bitness!
+//
+// Published by the main application after every video frame tick so that
+// hooks can time their captures to complete just before the next tick. The
+// tick times are phase-locked estimates of when the consumer ticks, not raw
+// measurements, and are in `getMonotonicUsec()` time. Only one consumer
+// process can publish at a time, another process can take over once the
+// state has not been updated for `STALE_USEC`. The state is protected by a
+// sequence lock in the same way as hook registry entries.
+struct ConsumerTickState {
+	// Consumer ticks that are older than this are ignored by hooks
+	static const uint64_t STALE_USEC = 250000; // 250 msec
+
+	uint32_t	seq; // Sequence lock, odd while being modified
+	uint32_t	procId; // Publishing process ID, zero if never published
+	uint32_t	lockNum; // Incremented every time the estimator relocks
+	uint32_t	jitterUsec; // RMS error of measured ticks
+	uint64_t	tickNum; // Number of the tick at `tickUsec`
+	uint64_t	tickUsec; // Estimated time of tick `tickNum`
+	uint64_t	periodNsec; // Estimated tick period
+	uint64_t	updatedUsec; // Time of the last measured tick
+	int32_t		driftPpm; // Estimated period relative to the nominal
+	uint32_t	padding;
+
+	ConsumerTickState() : seq(0), procId(0), lockNum(0), jitterUsec(0)
+		, tickNum(0), tickUsec(0), periodNsec(0), updatedUsec(0)
+		, driftPpm(0), padding(0) {};
+};
+
+//=============================================================================
+// Capture clock domain
+
+// WARNING: All datatypes must have the same size on both 32- and 64-bit
+// systems as the memory could be shared between processes of different
+// bitness!
+//
+// Maps the system-wide `getMonotonicUsec()` clock to the capture clock that
+// every frame timestamp is in. Use `CaptureClock` instead of accessing this
+// directly. The capture time of a monotonic time `mono` is:
+//
+//     clockAnchorUsec + (mono - monoAnchorUsec) * (1 + rateAdjPpb / 10^9)
+//
+// The main application creates the domain when it starts and can calibrate
+// it against an external clock such as its audio clock. Calibrating moves
+// the anchors to the current instant so that the capture clock never jumps
+// unless it is explicitly stepped which increments `generation`. Only one
+// process can calibrate the domain at a time, another process can take over
+// once the domain has not been refreshed for `STALE_USEC`. The state is
+// protected by a sequence lock in the same way as hook registry entries.
+struct CaptureClockState {
+	// Domains that are older than this can be taken over by another process
+	static const uint64_t STALE_USEC = 2000000; // 2 sec
+
+	uint32_t	seq; // Sequence lock, odd while being modified
+	uint32_t	procId; // Calibrating process ID, zero if no domain exists
+	int32_t		rateAdjPpb; // Capture clock rate relative to monotonic
+	uint32_t	generation; // Incremented every time the clock steps
+	uint64_t	monoAnchorUsec;
+	uint64_t	clockAnchorUsec;
+	uint64_t	updatedUsec; // Monotonic time of the last publish
+
+	CaptureClockState() : seq(0), procId(0), rateAdjPpb(0), generation(0)
+		, monoAnchorUsec(0), clockAnchorUsec(0), updatedUsec(0) {};
 };
 
 //=============================================================================
@@ -65,8 +244,10 @@ struct HookRegEntry {
 class MainSharedSegment
 {
 public: // Constants ----------------------------------------------------------
-	static const int SEGMENT_SIZE = 512 * 1024; // 512 KB
-	static const int HOOK_REGISTRY_SIZE = 128;
+	static const int LAYOUT_VERSION = 14;
+	static const int SEGMENT_SIZE = 512 * 1024; // 512 KB + hook registry
+	static const int HOOK_REGISTRY_SIZE = 128; // Default capacity
+	static const int MAX_HOOK_REGISTRY_SIZE = 64 * 1024;
 
 private: // Datatypes ----------------------------------------------------------
 	struct LockedUInt32 {
@@ -76,15 +257,18 @@ private: // Datatypes ----------------------------------------------------------
 		LockedUInt32() : val(0), lock() {};
 	};
 
-	// Hook registry
+	// Hook registry header. The hash table itself immediately follows it in
+	// the segment. The table is always at least twice as large as the
+	// capacity so that probe sequences stay short.
 	struct HookRegistry {
 		interprocess_recursive_mutex	lock;
+		uint32_t						capacity; // Max number of windows
+		uint32_t						tableSize; // Power of two
 		uint32_t						numEntries;
-		HookRegEntry					entries[HOOK_REGISTRY_SIZE];
+		uint32_t						numDeleted;
 
-		HookRegistry() : lock(), numEntries(0) {
-			memset(entries, 0, sizeof(entries));
-		};
+		HookRegistry() : lock(), capacity(0), tableSize(0), numEntries(0)
+			, numDeleted(0) {};
 	};
 
 private: // Members -----------------------------------------------------------
@@ -99,11 +283,21 @@ private: // Members -----------------------------------------------------------
 	char *					m_hasDxgi11;
 	char *					m_hasBgraTexSupport;
 	char *					m_fuzzyCapture;
+	uint32_t *				m_hookPoolThreads;
+	char *					m_hookPoolPinned;
 	InterprocessLog *		m_interprocessLog;
+	ConsumerTickState *		m_consumerTicks;
+	CaptureClockState *		m_captureClock;
 	HookRegistry *			m_hookRegistry;
+	HookRegEntry *			m_hookRegTable;
+	DoorbellState *			m_hookRegDoorbellState;
+	Doorbell *				m_hookRegDoorbell;
+
+public: // Static methods -----------------------------------------------------
+	static uint64_t		calcSegmentSize(uint registryCapacity);
 
 public: // Constructor/destructor ---------------------------------------------
-	MainSharedSegment();
+	MainSharedSegment(uint registryCapacity = HOOK_REGISTRY_SIZE);
 	virtual ~MainSharedSegment();
 
 public: // Methods ------------------------------------------------------------
@@ -127,14 +321,59 @@ public: // Methods ------------------------------------------------------------
 	bool				getFuzzyCapture();
 	void				setFuzzyCapture(bool fuzzyCapture);
 
+	uint32_t			getHookPoolThreads();
+	bool				getHookPoolPinned();
+	void				setHookPool(uint32_t numThreads, bool pinThreads);
+
 	InterprocessLog *	getInterprocessLog();
 
+	bool				publishConsumerTicks(const ConsumerTickState &state);
+	bool				readConsumerTicks(ConsumerTickState *out);
+
+	bool				publishCaptureClock(const CaptureClockState &state);
+	bool				readCaptureClock(CaptureClockState *out);
+
+	uint				getHookRegistryCapacity() const;
+	bool				readHookRegistry(uint32_t winId, HookRegEntry *out);
+	uint32_t			getHookRegistryGeneration() const;
+	bool				waitForHookRegistryChange(
+		uint32_t generation, uint timeoutUsec);
 	bool				lockHookRegistry(uint timeoutMsec = 0);
 	void				unlockHookRegistry();
 	HookRegEntry *		findWindowInHookRegistry(uint32_t winId);
-	HookRegEntry *		iterateHookRegistry(uint &numEntriesOut);
-	void				addHookRegistry(const HookRegEntry &data);
+	HookRegEntry *		iterateHookRegistry(uint &tableSizeOut);
+	bool				addHookRegistry(const HookRegEntry &data);
 	void				removeHookRegistry(uint32_t winId);
+	void				setHookRegistryFlags(
+		HookRegEntry *entry, uint32_t setFlags, uint32_t clearFlags);
+	void				setHookRegistryShm(
+		HookRegEntry *entry, uint32_t shmName, uint64_t shmSize);
+	void				refHookRegistryCapture(
+		HookRegEntry *entry, bool capture);
+	void				setHookRegistryRoi(
+		HookRegEntry *entry, uint32_t procId, uint32_t x, uint32_t y,
+		uint32_t width, uint32_t height);
+	void				setHookRegistryOutputSize(
+		HookRegEntry *entry, uint32_t procId, uint32_t width,
+		uint32_t height);
+	void				setHookRegistryFramePeriod(
+		HookRegEntry *entry, uint32_t procId, uint32_t periodUsec);
+	void				setHookRegistryCompression(
+		HookRegEntry *entry, uint32_t procId, bool compress);
+
+private:
+	uint32_t			hashWinId(uint32_t winId) const;
+	void				beginWriteEntry(HookRegEntry *entry);
+	void				endWriteEntry(HookRegEntry *entry);
+	void				writeEntry(
+		HookRegEntry *entry, const HookRegEntry &data);
+	HookRegConsumer *	findConsumer(
+		HookRegEntry *entry, uint32_t procId, bool create);
+	void				writeConsumer(
+		HookRegEntry *entry, HookRegConsumer *slot,
+		const HookRegConsumer &data);
+	void				writeEntryConsumers(HookRegEntry *entry);
+	void				rebuildHookRegistry();
 };
 //=============================================================================
 
@@ -148,4 +387,11 @@ inline string MainSharedSegment::getErrorReason() const
 	return m_errorReason;
 }
 
+inline uint MainSharedSegment::getHookRegistryCapacity() const
+{
+	if(m_hookRegistry == NULL)
+		return 0;
+	return m_hookRegistry->capacity;
+}
+
 #endif // COMMON_MAINSHAREDSEGMENT_H
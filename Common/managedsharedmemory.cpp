@@ -15,55 +15,477 @@
 // more details.
 //*****************************************************************************
 
+#include "macros.h"
+#ifdef OS_LINUX
+// System headers must be included before `using namespace boost::interprocess`
+// as it also defines `mode_t`
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 #include "managedsharedmemory.h"
+#include "stlhelpers.h"
+#include <boost/thread.hpp>
+#ifdef OS_WIN
+#include <windows.h>
+#include <psapi.h>
+#elif !defined(OS_LINUX)
+#include <sys/resource.h>
+#endif
+
+#ifdef OS_LINUX
+/// <summary>
+/// Converts a segment name into a POSIX shared memory object name. POSIX
+/// requires the name to begin with a slash and contain no other slashes.
+/// </summary>
+static string posixShmName(const char *name)
+{
+	return stringf("/%s", name);
+}
+
+/// <summary>
+/// Throws an exception that contains the description of the current `errno`
+/// value so that callers can handle all platforms in the same way.
+/// </summary>
+static void throwErrno(const char *func)
+{
+	string msg = stringf("%s() failed: %s", func, strerror(errno));
+	throw interprocess_exception(msg.data());
+}
+#endif
+
+/// <summary>
+/// Deletes the named shared memory segment `name` on operating systems that
+/// have persistent segments. Processes that already have the segment mapped
+/// can continue to use it until they unmap it but it can no longer be opened
+/// by name.
+/// </summary>
+void ManagedSharedMemory::remove(const char *name)
+{
+	if(name == NULL)
+		return; // Anonymous segments are never persistent
+#ifdef OS_WIN
+	// Windows automatically deletes once the segment is no longer referenced
+#elif defined(OS_LINUX)
+	shm_unlink(posixShmName(name).data());
+#else
+	shared_memory_object::remove(name);
+#endif
+}
+
+/// <summary>
+/// Returns the total number of page faults that this process has taken since
+/// it started. Used to measure the effectiveness of the memory policy.
+/// </summary>
+uint64_t ManagedSharedMemory::getPageFaultCount()
+{
+#ifdef OS_WIN
+	PROCESS_MEMORY_COUNTERS counters;
+	memset(&counters, 0, sizeof(counters));
+	counters.cb = sizeof(counters);
+	if(!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return 0;
+	return counters.PageFaultCount;
+#else
+	struct rusage usage;
+	if(getrusage(RUSAGE_SELF, &usage) < 0)
+		return 0;
+	return (uint64_t)usage.ru_minflt + (uint64_t)usage.ru_majflt;
+#endif
+}
+
+#ifdef OS_LINUX
+/// <summary>
+/// Sends the shared memory file descriptor `fd` over the connected Unix domain
+/// socket `sock`. The receiving process gets its own descriptor that refers to
+/// the same segment and `fd` remains open in this process.
+/// </summary>
+/// <returns>True if the descriptor was sent successfully</returns>
+bool ManagedSharedMemory::sendFd(int sock, int fd)
+{
+	// At least one byte of real data must be sent with the ancillary data
+	char dummy = 0;
+	struct iovec iov;
+	iov.iov_base = &dummy;
+	iov.iov_len = sizeof(dummy);
+
+	union {
+		struct cmsghdr	align;
+		char			buf[CMSG_SPACE(sizeof(int))];
+	} ctrl;
+	memset(&ctrl, 0, sizeof(ctrl));
 
-ManagedSharedMemory::ManagedSharedMemory(const char *name, int size)
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctrl.buf;
+	msg.msg_controllen = sizeof(ctrl.buf);
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	ssize_t ret;
+	do {
+		ret = sendmsg(sock, &msg, MSG_NOSIGNAL);
+	} while(ret < 0 && errno == EINTR);
+	return ret == sizeof(dummy);
+}
+
+/// <summary>
+/// Receives a shared memory file descriptor that was sent with `sendFd()` over
+/// the connected Unix domain socket `sock`. The returned descriptor can be
+/// passed directly to the `ManagedSharedMemory(int fd)` constructor.
+/// </summary>
+/// <returns>-1 on failure</returns>
+int ManagedSharedMemory::receiveFd(int sock)
+{
+	char dummy = 0;
+	struct iovec iov;
+	iov.iov_base = &dummy;
+	iov.iov_len = sizeof(dummy);
+
+	union {
+		struct cmsghdr	align;
+		char			buf[CMSG_SPACE(sizeof(int))];
+	} ctrl;
+	memset(&ctrl, 0, sizeof(ctrl));
+
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctrl.buf;
+	msg.msg_controllen = sizeof(ctrl.buf);
+
+	ssize_t ret;
+	do {
+		ret = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	} while(ret < 0 && errno == EINTR);
+	if(ret <= 0)
+		return -1;
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if(cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+		cmsg->cmsg_type != SCM_RIGHTS ||
+		cmsg->cmsg_len != CMSG_LEN(sizeof(int)))
+	{
+		return -1; // No descriptor attached
+	}
+	int fd = -1;
+	memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+	return fd;
+}
+#endif
+
+/// <summary>
+/// Opens the shared memory segment `name` creating it with a size of `size`
+/// bytes if it doesn't already exist. On Linux a `name` of NULL creates a new
+/// anonymous segment that can only be shared by passing its file descriptor.
+/// `policy` is a combination of `MemoryPolicyFlags`.
+/// </summary>
+ManagedSharedMemory::ManagedSharedMemory(
+	const char *name, uint64_t size, uint policy)
 #ifdef OS_WIN
 	: m_shm()
+	, m_region()
+#elif defined(OS_LINUX)
+	: m_fd(-1)
+	, m_address(NULL)
+	, m_size(0)
 #else
 	: m_shm(open_or_create, name, read_write)
-#endif
 	, m_region()
+#endif
 	, m_isHeaderAlloc(false)
 	, m_unserializeOffset(getStartOffset())
+	, m_policy(policy)
+	, m_prefaultThread(NULL)
+	, m_prefaultAbort(false)
+	, m_prefaultComplete(true)
+	, m_prefaultPageFaults(0)
 {
 	// Construct a shared memory object detecting if it has been previously
-	// used before so the memory can be zeroed.
-	bool needsZero = false;
+	// used before so that the header can be constructed. All operating systems
+	// zero-fill new segments so we never need to clear the memory ourselves.
+	// Doing so would also fault in every single page on the calling thread
+	// which defeats the purpose of `PrefaultPolicy`.
+	bool isNew = false;
+	if(size > (uint64_t)SIZE_MAX) {
+		// Can never be mapped into our address space
+		throw interprocess_exception(
+			"Shared memory segment is too large for this process");
+	}
 #ifdef OS_WIN
 	try {
 		m_shm = windows_shared_memory(open_only, name, read_write);
 	} catch(interprocess_exception) {
-		m_shm = windows_shared_memory(create_only, name, read_write, size);
-		needsZero = true;
+		m_shm = windows_shared_memory(
+			create_only, name, read_write, (size_t)size);
+		isNew = true;
+	}
+#elif defined(OS_LINUX)
+	if(name == NULL) {
+#ifdef MFD_HUGETLB
+		if(m_policy & HugePagesPolicy) {
+			// Explicit huge pages are only available if the administrator has
+			// reserved them so silently fall back to normal pages on failure
+			m_fd = memfd_create("LibdeskcapSHM", MFD_CLOEXEC | MFD_HUGETLB);
+			if(m_fd >= 0) {
+				uint64_t hugeSize = (size + HUGE_PAGE_SIZE - 1) &
+					~((uint64_t)HUGE_PAGE_SIZE - 1);
+				try {
+					mapFd(hugeSize, true);
+				} catch(interprocess_exception &) {
+					close(m_fd);
+					m_fd = -1;
+				}
+			}
+		}
+#endif // MFD_HUGETLB
+		if(m_fd < 0) {
+			m_fd = memfd_create("LibdeskcapSHM", MFD_CLOEXEC);
+			if(m_fd < 0)
+				throwErrno("memfd_create");
+		}
+		isNew = true;
+	} else {
+		string shmName = posixShmName(name);
+		m_fd = shm_open(
+			shmName.data(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+		if(m_fd >= 0)
+			isNew = true;
+		else if(errno == EEXIST)
+			m_fd = shm_open(shmName.data(), O_RDWR | O_CLOEXEC, 0600);
+		if(m_fd < 0)
+			throwErrno("shm_open");
+	}
+	if(m_address == NULL) {
+		try {
+			mapFd(size, isNew);
+		} catch(interprocess_exception &) {
+			// Our destructor will not be called
+			close(m_fd);
+			throw;
+		}
 	}
 #else
 	offset_t oldSize;
 	if(!m_shm.get_size(oldSize) || oldSize == 0) {
-		m_shm.truncate(size);
-		needsZero = true;
+		m_shm.truncate((offset_t)size);
+		isNew = true;
 	}
 #endif
 
 	// Map shared memory to local address space
+#ifndef OS_LINUX
 	m_region = mapped_region(m_shm, read_write);
+#endif
 
-	// Zero the entire region if required and allocate the header.
+	// Allocate the header if required.
 	// TODO: We never verify that the region size is large enough to fit the
 	// header
-	if(needsZero) {
-		memset(m_region.get_address(), 0, m_region.get_size());
-
+	if(isNew) {
 		m_isHeaderAlloc = true;
 		if(getObject<Header>(0) == NULL) {
 			// TODO: Failed to allocate header!
 		}
 		m_isHeaderAlloc = false;
 	}
+
+	applyPolicy();
 }
 
+#ifdef OS_LINUX
+/// <summary>
+/// Maps an existing segment from a file descriptor that was received from
+/// another process with `receiveFd()`. Takes ownership of `fd`.
+/// </summary>
+ManagedSharedMemory::ManagedSharedMemory(int fd, uint policy)
+	: m_fd(fd)
+	, m_address(NULL)
+	, m_size(0)
+	, m_isHeaderAlloc(false)
+	, m_unserializeOffset(getStartOffset())
+	, m_policy(policy)
+	, m_prefaultThread(NULL)
+	, m_prefaultAbort(false)
+	, m_prefaultComplete(true)
+	, m_prefaultPageFaults(0)
+{
+	if(m_fd < 0)
+		throw interprocess_exception("Invalid shared memory descriptor");
+	try {
+		mapFd(0, false);
+	} catch(interprocess_exception &) {
+		// Our destructor will not be called
+		close(m_fd);
+		throw;
+	}
+	applyPolicy();
+}
+#endif
+
 ManagedSharedMemory::~ManagedSharedMemory()
 {
+	// The prefault thread must not touch the mapping after it's been unmapped
+	if(m_prefaultThread != NULL) {
+		m_prefaultAbort = true;
+		m_prefaultThread->join();
+		delete m_prefaultThread;
+		m_prefaultThread = NULL;
+	}
+
+	if(m_policy & LockPolicy) {
+#ifdef OS_WIN
+		VirtualUnlock(getAddress(), getSize());
+#else
+		munlock(getAddress(), getSize());
+#endif
+	}
+
+#ifdef OS_LINUX
+	if(m_address != NULL)
+		munmap(m_address, m_size);
+	if(m_fd >= 0)
+		close(m_fd);
+#endif
+}
+
+#ifdef OS_LINUX
+/// <summary>
+/// Maps our file descriptor into the local address space. If the object is
+/// new, or hasn't been sized yet by the process that created it, it is first
+/// resized to `size` bytes.
+/// </summary>
+void ManagedSharedMemory::mapFd(uint64_t size, bool isNew)
+{
+	struct stat info;
+	if(fstat(m_fd, &info) < 0)
+		throwErrno("fstat");
+	if(isNew || info.st_size == 0) {
+		if(size == 0)
+			throw interprocess_exception("Shared memory segment is empty");
+		if(ftruncate(m_fd, (off_t)size) < 0)
+			throwErrno("ftruncate");
+		info.st_size = (off_t)size;
+	}
+
+	void *addr = mmap(NULL, (size_t)info.st_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED, m_fd, 0);
+	if(addr == MAP_FAILED)
+		throwErrno("mmap");
+	m_address = addr;
+	m_size = (size_t)info.st_size;
+}
+#endif
+
+/// <summary>
+/// Applies the memory policy to our mapping of the segment. Every process
+/// that maps the segment has its own page tables so this is done by both the
+/// producer and the consumer. Failures are ignored as the policy is only an
+/// optimisation.
+/// </summary>
+void ManagedSharedMemory::applyPolicy()
+{
+	void *addr = getAddress();
+	size_t size = getSize();
+	if(addr == NULL || size == 0)
+		return;
+
+#if defined(OS_LINUX) && defined(MADV_HUGEPAGE)
+	// Request transparent huge pages. This is a no-op if the segment is
+	// already backed by `MFD_HUGETLB` or if shmem THP is disabled.
+	if(m_policy & HugePagesPolicy)
+		madvise(addr, size, MADV_HUGEPAGE);
+#endif
+
+	if(m_policy & LockPolicy) {
+#ifdef OS_WIN
+		// `VirtualLock()` can only lock pages that fit inside of our minimum
+		// working set size so grow it first
+		SIZE_T minSize = 0, maxSize = 0;
+		HANDLE proc = GetCurrentProcess();
+		if(GetProcessWorkingSetSize(proc, &minSize, &maxSize))
+			SetProcessWorkingSetSize(proc, minSize + size, maxSize + size);
+		if(!VirtualLock(addr, size))
+			m_policy &= ~LockPolicy;
+#else
+		// Locking also faults in every page
+		if(mlock(addr, size) < 0)
+			m_policy &= ~LockPolicy;
+#endif
+	}
+
+	if((m_policy & PrefaultPolicy) && !(m_policy & LockPolicy)) {
+		m_prefaultComplete = false;
+		m_prefaultThread = new boost::thread(
+			&ManagedSharedMemory::prefaultThreadMain, this);
+	}
+}
+
+/// <summary>
+/// Touches every page of the mapping so that the kernel allocates and maps
+/// them now instead of when the producer first writes each frame. The pages
+/// are only ever read from as other processes may already be using the
+/// segment.
+/// </summary>
+void ManagedSharedMemory::prefaultThreadMain()
+{
+	volatile uchar *addr = (volatile uchar *)getAddress();
+	size_t size = getSize();
+
+#ifdef OS_LINUX
+	struct rusage usage;
+	getrusage(RUSAGE_THREAD, &usage);
+	uint64_t faultsBefore = (uint64_t)usage.ru_minflt + usage.ru_majflt;
+#else
+	uint64_t faultsBefore = getPageFaultCount();
+#endif
+
+#if defined(OS_LINUX) && defined(MADV_POPULATE_WRITE)
+	// Populate the page tables writable in large chunks so that the producer
+	// doesn't take a write-protect fault later either. Falls back to touching
+	// each page below on kernels older than 5.14.
+	const size_t CHUNK_SIZE = 16 * 1024 * 1024;
+	size_t offset = 0;
+	for(; offset < size && !m_prefaultAbort; offset += CHUNK_SIZE) {
+		size_t len = size - offset;
+		if(len > CHUNK_SIZE)
+			len = CHUNK_SIZE;
+		if(madvise((void *)(addr + offset), len, MADV_POPULATE_WRITE) < 0)
+			break;
+	}
+	if(offset >= size)
+		size = 0; // Nothing left to touch
+#endif
+
+	const size_t TOUCH_STRIDE = 4096; // Smallest page size
+	uchar dummy = 0;
+	for(size_t i = 0; i < size; i += TOUCH_STRIDE) {
+		if(m_prefaultAbort)
+			break;
+		dummy ^= addr[i];
+	}
+	(void)dummy;
+
+#ifdef OS_LINUX
+	getrusage(RUSAGE_THREAD, &usage);
+	m_prefaultPageFaults =
+		(uint64_t)usage.ru_minflt + usage.ru_majflt - faultsBefore;
+#else
+	// Not thread-specific but there is no per-thread counter on Windows
+	m_prefaultPageFaults = getPageFaultCount() - faultsBefore;
+#endif
+	m_prefaultComplete = true;
 }
 
 void *ManagedSharedMemory::getAllocation(
@@ -71,17 +493,17 @@ void *ManagedSharedMemory::getAllocation(
 {
 	if(isNew != NULL)
 		*isNew = false;
-	size_t regSize = m_region.get_size();
+	size_t regSize = getSize();
 
 	// Verify that the allocation is inside the memory region and, if it's not
 	// the header itself, doesn't overlap the header.
-	if((m_isHeaderAlloc && offset < 0) || (!m_isHeaderAlloc &&
-		offset < sizeof(Header)) || size + ALLOCATION_OVERHEAD >= regSize)
+	if(offset < 0 || (!m_isHeaderAlloc && offset < (offset_t)sizeof(Header))
+		|| (uint64_t)offset + size + ALLOCATION_OVERHEAD > regSize)
 	{
 		return NULL; // Outside valid memory region
 	}
 
-	void *addr = (void *)((offset_t)m_region.get_address() + offset);
+	void *addr = (void *)((offset_t)getAddress() + offset);
 
 	// Detect if this was the first time that this allocation was accessed.
 	char *head = (char *)addr;
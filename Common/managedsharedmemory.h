@@ -21,14 +21,24 @@
 #include "macros.h"
 #ifdef OS_WIN
 #include <boost/interprocess/windows_shared_memory.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#elif defined(OS_LINUX)
+// Don't include `mapped_region` as it pulls in system headers that conflict
+// with `using namespace boost::interprocess` elsewhere
+#include <boost/interprocess/detail/os_file_functions.hpp>
+#include <boost/interprocess/exceptions.hpp>
 #else
 #include <boost/interprocess/shared_memory_object.hpp>
-#endif
 #include <boost/interprocess/mapped_region.hpp>
+#endif
 #include <boost/interprocess/sync/interprocess_mutex.hpp>
 
 using namespace boost::interprocess;
 
+namespace boost {
+class thread;
+}
+
 //=============================================================================
 /// <summary>
 /// While Boost's `managed_shared_memory` basically does what we want it
@@ -42,11 +52,40 @@ using namespace boost::interprocess;
 /// The only thing it does support is detecting if a memory offset has
 /// previously been used in order to allow automatic construction of new
 /// objects using their default contructor.
+///
+/// On Linux we bypass Boost entirely and use POSIX shared memory directly so
+/// that segments can also be created anonymously with `memfd_create()`. An
+/// anonymous segment has no name in /dev/shm and can only be shared with
+/// another process by passing its file descriptor over a Unix domain socket
+/// using `sendFd()` and `receiveFd()`.
+///
+/// Large segments can be given a memory policy that reduces the number of page
+/// faults and TLB misses that are taken the first time each page is accessed.
+/// See `MemoryPolicyFlags` for details.
 /// </summary>
 class ManagedSharedMemory
 {
 public: // Constants ----------------------------------------------------------
 	static const int ALLOCATION_OVERHEAD = 1;
+	static const int HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+public: // Datatypes ----------------------------------------------------------
+	enum MemoryPolicyFlags {
+		// Back the segment with huge pages. On Linux anonymous segments use
+		// `MFD_HUGETLB` if huge pages have been reserved and all other
+		// segments fall back to transparent huge pages. Not supported on
+		// Windows as it requires the "lock pages in memory" privilege.
+		HugePagesPolicy = 0x01,
+
+		// Fault in every page of the mapping in a background thread so that
+		// the first write to each frame doesn't stall the caller
+		PrefaultPolicy = 0x02,
+
+		// Lock the mapping into physical memory so that it can never be paged
+		// out. This can fail if the process is not permitted to lock that
+		// much memory.
+		LockPolicy = 0x04
+	};
 
 private: // Datatypes ---------------------------------------------------------
 	struct Header {
@@ -56,22 +95,51 @@ private: // Datatypes ---------------------------------------------------------
 private: // Members -----------------------------------------------------------
 #ifdef OS_WIN
 	windows_shared_memory	m_shm;
+	mapped_region			m_region;
+#elif defined(OS_LINUX)
+	int						m_fd;
+	void *					m_address;
+	size_t					m_size;
 #else
 	shared_memory_object	m_shm;
-#endif
 	mapped_region			m_region;
+#endif
 	bool					m_isHeaderAlloc;
 	offset_t				m_unserializeOffset;
+	uint					m_policy;
+	boost::thread *			m_prefaultThread;
+	volatile bool			m_prefaultAbort;
+	volatile bool			m_prefaultComplete;
+	uint64_t				m_prefaultPageFaults;
+
+public: // Static methods -----------------------------------------------------
+	static void		remove(const char *name);
+	static uint64_t	getPageFaultCount();
+#ifdef OS_LINUX
+	static bool		sendFd(int sock, int fd);
+	static int		receiveFd(int sock);
+#endif
 
 public: // Constructor/destructor ---------------------------------------------
-	ManagedSharedMemory(const char *name, int size);
+	ManagedSharedMemory(const char *name, uint64_t size, uint policy = 0);
+#ifdef OS_LINUX
+	ManagedSharedMemory(int fd, uint policy = 0);
+#endif
 	~ManagedSharedMemory();
 
 public: // Methods ------------------------------------------------------------
+	size_t		getSize() const;
+#ifdef OS_LINUX
+	int			getFd() const;
+#endif
+	uint		getPolicy() const;
+	bool		isPrefaultComplete() const;
+	uint64_t	getPrefaultPageFaults() const;
 	offset_t	getStartOffset() const;
 	offset_t	getUnserializeOffset() const;
 	void		setUnserializeOffset(offset_t offset);
 	void		resetUnserializeOffset();
+	void		alignUnserializeOffset(uint alignment);
 	void *		getAllocation(offset_t offset, size_t size, bool *isNew);
 
 	template <typename T>
@@ -82,7 +150,7 @@ public: // Methods ------------------------------------------------------------
 		if(isNew) {
 			// Construct object on first access
 			for(uint i = 0; i < size; i++)
-				new(addr + sizeof(T) * i) T();
+				new(addr + i) T();
 		}
 		return addr;
 	};
@@ -97,8 +165,26 @@ public: // Methods ------------------------------------------------------------
 		return obj;
 	};
 
+	/// <summary>
+	/// Same as `unserialize()` except that the returned object is guaranteed
+	/// to be aligned to `alignment` bytes which must be a power of two. Use
+	/// this for any object that is accessed atomically.
+	/// </summary>
+	template <typename T>
+	inline T *unserializeAligned(uint size = 1, uint alignment = 8)
+	{
+		alignUnserializeOffset(alignment);
+		return unserialize<T>(size);
+	};
+
 private:
 	Header *	header() const;
+	void *		getAddress() const;
+#ifdef OS_LINUX
+	void		mapFd(uint64_t size, bool isNew);
+#endif
+	void		applyPolicy();
+	void		prefaultThreadMain();
 };
 //=============================================================================
 
@@ -130,12 +216,78 @@ inline void ManagedSharedMemory::resetUnserializeOffset()
 	m_unserializeOffset = getStartOffset();
 }
 
+/// <summary>
+/// Moves the unserialize offset forward so that the next unserialized object
+/// begins on an `alignment`-byte boundary. As the mapped region always begins
+/// on a page boundary an aligned offset is also an aligned address.
+/// </summary>
+inline void ManagedSharedMemory::alignUnserializeOffset(uint alignment)
+{
+	// Objects are located immediately after their allocation marker
+	offset_t objOffset = m_unserializeOffset + ALLOCATION_OVERHEAD;
+	objOffset = (objOffset + alignment - 1) & ~((offset_t)alignment - 1);
+	m_unserializeOffset = objOffset - ALLOCATION_OVERHEAD;
+}
+
+#ifdef OS_LINUX
+/// <summary>
+/// Returns the file descriptor of the underlying shared memory object so that
+/// it can be passed to another process with `sendFd()`. The descriptor remains
+/// owned by this object.
+/// </summary>
+inline int ManagedSharedMemory::getFd() const
+{
+	return m_fd;
+}
+#endif
+
+inline uint ManagedSharedMemory::getPolicy() const
+{
+	return m_policy;
+}
+
+/// <summary>
+/// Returns true once the background prefault thread has touched every page of
+/// the mapping or immediately if `PrefaultPolicy` wasn't requested.
+/// </summary>
+inline bool ManagedSharedMemory::isPrefaultComplete() const
+{
+	return m_prefaultComplete;
+}
+
+/// <summary>
+/// Returns the number of page faults that were taken by the background
+/// prefault thread. Only valid once `isPrefaultComplete()` returns true.
+/// </summary>
+inline uint64_t ManagedSharedMemory::getPrefaultPageFaults() const
+{
+	return m_prefaultPageFaults;
+}
+
 /// <summary>
 /// Convenience method to get a pointer to the shared header object.
 /// </summary>
 inline ManagedSharedMemory::Header *ManagedSharedMemory::header() const
 {
-	return (Header *)((offset_t)m_region.get_address() + ALLOCATION_OVERHEAD);
+	return (Header *)((offset_t)getAddress() + ALLOCATION_OVERHEAD);
+}
+
+inline void *ManagedSharedMemory::getAddress() const
+{
+#ifdef OS_LINUX
+	return m_address;
+#else
+	return m_region.get_address();
+#endif
+}
+
+inline size_t ManagedSharedMemory::getSize() const
+{
+#ifdef OS_LINUX
+	return m_size;
+#else
+	return m_region.get_size();
+#endif
 }
 
 #endif // COMMON_MANAGEDSHAREDMEMORY_H
@@ -0,0 +1,336 @@
+//*****************************************************************************
+// Libdeskcap: A high-performance desktop capture library
+//
+// Copyright (C) 2014 Lucas Murray <lucas@polyflare.com>
+// All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation; either version 2 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//*****************************************************************************
+
+#include "memcopy.h"
+#include "atomicops.h"
+#include "cpuinfo.h"
+#include "workerpool.h"
+#ifdef ARCH_X86
+#include <immintrin.h>
+#endif
+
+// Copies smaller than this always use `memcpy()` as the setup cost of
+// anything else isn't worth it
+static const size_t MIN_FAST_COPY_SIZE = 64 * 1024;
+
+// Large copies are streamed in blocks of a single page so that the source and
+// destination of each block only need one TLB entry each. The page after the
+// next block is touched ahead of time as the hardware prefetcher never
+// crosses a page boundary.
+static const size_t COPY_BLOCK_SIZE = 4096;
+
+// Copies that are larger than this fraction of the last level cache would
+// evict most of it, including the source data, so we bypass the cache
+// instead. The cache is shared with every other core so we don't use all of
+// it.
+static const size_t STREAM_LLC_DENOM = 2;
+
+// Threading is disabled by default as the hook runs inside of other
+// processes. See `setFastMemcpyThreadingThreshold()`. Each thread copies at
+// least this many blocks.
+static const uint MIN_STRIPE_BLOCKS = 256;
+static volatile uint64_t s_threadingThreshold = 0;
+
+struct MemCopyTask {
+	uchar *			dst;
+	const uchar *	src;
+	size_t			size;
+	StreamCopyFunc	copy;
+};
+
+//=============================================================================
+// Non-temporal copy kernels. Each one aligns the destination to its vector
+// size, streams the aligned part and copies the unaligned head and tail with
+// `memcpy()`.
+
+#ifdef ARCH_X86
+
+SIMD_TARGET("sse2")
+static void streamCopySSE2(void *dstPtr, const void *srcPtr, size_t size)
+{
+	uchar *dst = (uchar *)dstPtr;
+	const uchar *src = (const uchar *)srcPtr;
+	size_t head = (16 - ((uintptr_t)dst & 15)) & 15;
+	if(head > size)
+		head = size;
+	memcpy(dst, src, head);
+	dst += head;
+	src += head;
+	size -= head;
+	while(size >= 64) {
+		_mm_prefetch(
+			(const char *)src + STREAM_PREFETCH_DISTANCE, _MM_HINT_T0);
+		__m128i a = _mm_loadu_si128((const __m128i *)src);
+		__m128i b = _mm_loadu_si128((const __m128i *)(src + 16));
+		__m128i c = _mm_loadu_si128((const __m128i *)(src + 32));
+		__m128i d = _mm_loadu_si128((const __m128i *)(src + 48));
+		_mm_stream_si128((__m128i *)dst, a);
+		_mm_stream_si128((__m128i *)(dst + 16), b);
+		_mm_stream_si128((__m128i *)(dst + 32), c);
+		_mm_stream_si128((__m128i *)(dst + 48), d);
+		dst += 64;
+		src += 64;
+		size -= 64;
+	}
+	while(size >= 16) {
+		_mm_stream_si128(
+			(__m128i *)dst, _mm_loadu_si128((const __m128i *)src));
+		dst += 16;
+		src += 16;
+		size -= 16;
+	}
+	memcpy(dst, src, size);
+}
+
+SIMD_TARGET("avx2")
+static void streamCopyAVX2(void *dstPtr, const void *srcPtr, size_t size)
+{
+	uchar *dst = (uchar *)dstPtr;
+	const uchar *src = (const uchar *)srcPtr;
+	size_t head = (32 - ((uintptr_t)dst & 31)) & 31;
+	if(head > size)
+		head = size;
+	memcpy(dst, src, head);
+	dst += head;
+	src += head;
+	size -= head;
+	while(size >= 128) {
+		_mm_prefetch(
+			(const char *)src + STREAM_PREFETCH_DISTANCE, _MM_HINT_T0);
+		_mm_prefetch(
+			(const char *)src + STREAM_PREFETCH_DISTANCE + 64, _MM_HINT_T0);
+		__m256i a = _mm256_loadu_si256((const __m256i *)src);
+		__m256i b = _mm256_loadu_si256((const __m256i *)(src + 32));
+		__m256i c = _mm256_loadu_si256((const __m256i *)(src + 64));
+		__m256i d = _mm256_loadu_si256((const __m256i *)(src + 96));
+		_mm256_stream_si256((__m256i *)dst, a);
+		_mm256_stream_si256((__m256i *)(dst + 32), b);
+		_mm256_stream_si256((__m256i *)(dst + 64), c);
+		_mm256_stream_si256((__m256i *)(dst + 96), d);
+		dst += 128;
+		src += 128;
+		size -= 128;
+	}
+	while(size >= 32) {
+		_mm256_stream_si256(
+			(__m256i *)dst, _mm256_loadu_si256((const __m256i *)src));
+		dst += 32;
+		src += 32;
+		size -= 32;
+	}
+	_mm256_zeroupper(); // Prevent SSE transition penalties
+	memcpy(dst, src, size);
+}
+
+#ifdef HAS_AVX512_INTRINSICS
+SIMD_TARGET("avx512f")
+static void streamCopyAVX512(void *dstPtr, const void *srcPtr, size_t size)
+{
+	uchar *dst = (uchar *)dstPtr;
+	const uchar *src = (const uchar *)srcPtr;
+	size_t head = (64 - ((uintptr_t)dst & 63)) & 63;
+	if(head > size)
+		head = size;
+	memcpy(dst, src, head);
+	dst += head;
+	src += head;
+	size -= head;
+	while(size >= 256) {
+		_mm_prefetch(
+			(const char *)src + STREAM_PREFETCH_DISTANCE, _MM_HINT_T0);
+		_mm_prefetch(
+			(const char *)src + STREAM_PREFETCH_DISTANCE + 64, _MM_HINT_T0);
+		_mm_prefetch(
+			(const char *)src + STREAM_PREFETCH_DISTANCE + 128, _MM_HINT_T0);
+		_mm_prefetch(
+			(const char *)src + STREAM_PREFETCH_DISTANCE + 192, _MM_HINT_T0);
+		__m512i a = _mm512_loadu_si512((const void *)src);
+		__m512i b = _mm512_loadu_si512((const void *)(src + 64));
+		__m512i c = _mm512_loadu_si512((const void *)(src + 128));
+		__m512i d = _mm512_loadu_si512((const void *)(src + 192));
+		_mm512_stream_si512((__m512i *)dst, a);
+		_mm512_stream_si512((__m512i *)(dst + 64), b);
+		_mm512_stream_si512((__m512i *)(dst + 128), c);
+		_mm512_stream_si512((__m512i *)(dst + 192), d);
+		dst += 256;
+		src += 256;
+		size -= 256;
+	}
+	while(size >= 64) {
+		_mm512_stream_si512(
+			(__m512i *)dst, _mm512_loadu_si512((const void *)src));
+		dst += 64;
+		src += 64;
+		size -= 64;
+	}
+	_mm256_zeroupper(); // Prevent SSE transition penalties
+	memcpy(dst, src, size);
+}
+#endif // HAS_AVX512_INTRINSICS
+
+#endif // ARCH_X86
+
+//=============================================================================
+// Large-block copy engine
+
+/// <summary>
+/// Copies a contiguous range with `copy` or with `memcpy()` if `copy` is
+/// NULL. Streamed copies are done one page-aligned block of the destination
+/// at a time so that every block starts on a cache line boundary and its
+/// stores are never split across pages.
+/// </summary>
+static void copyRange(
+	uchar *dst, const uchar *src, size_t size, StreamCopyFunc copy)
+{
+	if(copy == NULL) {
+		// The C runtime's copy is already optimal for temporal stores
+		memcpy(dst, src, size);
+		return;
+	}
+
+	while(size > 0) {
+		size_t blockSize =
+			COPY_BLOCK_SIZE - ((uintptr_t)dst & (COPY_BLOCK_SIZE - 1));
+		if(blockSize > size)
+			blockSize = size;
+#ifdef ARCH_X86
+		if(size > blockSize + COPY_BLOCK_SIZE) {
+			_mm_prefetch(
+				(const char *)src + blockSize + COPY_BLOCK_SIZE,
+				_MM_HINT_T0);
+		}
+#endif
+		copy(dst, src, blockSize);
+		dst += blockSize;
+		src += blockSize;
+		size -= blockSize;
+	}
+}
+
+/// <summary>
+/// Copies a range of blocks of a `fastmemcpy()` operation. The `WorkerPool`
+/// calls these "rows".
+/// </summary>
+static void copyBlockRange(void *opaque, uint firstBlock, uint numBlocks)
+{
+	const MemCopyTask *task = (const MemCopyTask *)opaque;
+	size_t offset = (size_t)firstBlock * COPY_BLOCK_SIZE;
+	size_t size = (size_t)numBlocks * COPY_BLOCK_SIZE;
+	if(size > task->size - offset)
+		size = task->size - offset;
+	copyRange(task->dst + offset, task->src + offset, size, task->copy);
+
+	// Non-temporal stores are only ordered per thread
+	if(task->copy != NULL)
+		streamCopyFence();
+}
+
+//=============================================================================
+// Helper functions
+
+/// <summary>
+/// Returns the fastest non-temporal copy kernel that the CPU supports or NULL
+/// if there isn't one.
+/// </summary>
+StreamCopyFunc getStreamCopyFunc()
+{
+#ifdef ARCH_X86
+	uint features = getCpuFeatures();
+#ifdef HAS_AVX512_INTRINSICS
+	if(features & AVX512FCpuFeature)
+		return &streamCopyAVX512;
+#endif
+	if(features & AVX2CpuFeature)
+		return &streamCopyAVX2;
+	if(features & SSE2CpuFeature)
+		return &streamCopySSE2;
+#endif // ARCH_X86
+	return NULL;
+}
+
+/// <summary>
+/// Non-temporal stores are weakly ordered, this makes sure that they are
+/// visible before anybody else is told that the data is ready.
+/// </summary>
+void streamCopyFence()
+{
+#ifdef ARCH_X86
+	_mm_sfence();
+#endif
+}
+
+/// <summary>
+/// A `memcpy()` replacement for large transfers such as entire frames. Copies
+/// that would evict a large part of the last level cache bypass it with
+/// non-temporal stores using the widest vector instructions that the CPU
+/// supports, all others use `memcpy()`. Very large copies can optionally be
+/// split across the shared worker pool, see
+/// `setFastMemcpyThreadingThreshold()`. The buffers
+/// must not overlap.
+/// </summary>
+void *fastmemcpy(void *dst, const void *src, size_t size)
+{
+	if(size < MIN_FAST_COPY_SIZE)
+		return memcpy(dst, src, size);
+
+	StreamCopyFunc copy = NULL;
+	if(size >= getFastMemcpyStreamThreshold())
+		copy = getStreamCopyFunc();
+
+	MemCopyTask task;
+	task.dst = (uchar *)dst;
+	task.src = (const uchar *)src;
+	task.size = size;
+	task.copy = copy;
+
+	uint numBlocks = (uint)((size + COPY_BLOCK_SIZE - 1) / COPY_BLOCK_SIZE);
+	WorkerPool *pool = WorkerPool::getShared();
+	uint64_t threshold = atomicLoad64(&s_threadingThreshold);
+	if(pool != NULL && threshold != 0 && (uint64_t)size >= threshold)
+		pool->runRows(&copyBlockRange, &task, numBlocks, MIN_STRIPE_BLOCKS);
+	else
+		copyBlockRange(&task, 0, numBlocks);
+	return dst;
+}
+
+/// <summary>
+/// Returns the size at which `fastmemcpy()` switches to non-temporal stores.
+/// </summary>
+size_t getFastMemcpyStreamThreshold()
+{
+	size_t threshold = getLastLevelCacheSize() / STREAM_LLC_DENOM;
+	if(threshold < MIN_FAST_COPY_SIZE)
+		threshold = MIN_FAST_COPY_SIZE;
+	return threshold;
+}
+
+size_t getFastMemcpyThreadingThreshold()
+{
+	return (size_t)atomicLoad64(&s_threadingThreshold);
+}
+
+/// <summary>
+/// Makes `fastmemcpy()` split copies of at least `minSize` bytes across the
+/// shared `WorkerPool` if it exists. A single thread can usually not saturate
+/// the memory bandwidth of the system but waking the workers costs tens of
+/// microseconds so this is only worthwhile for copies of several megabytes.
+/// Zero disables threading which is the default.
+/// </summary>
+void setFastMemcpyThreadingThreshold(size_t minSize)
+{
+	atomicStore64(&s_threadingThreshold, (uint64_t)minSize);
+}
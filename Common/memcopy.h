@@ -0,0 +1,48 @@
+//*****************************************************************************
+// Libdeskcap: A high-performance desktop capture library
+//
+// Copyright (C) 2014 Lucas Murray <lucas@polyflare.com>
+// All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation; either version 2 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//*****************************************************************************
+
+#ifndef COMMON_MEMCOPY_H
+#define COMMON_MEMCOPY_H
+
+#include "stlincludes.h"
+
+// Size of a cache line on every CPU that we care about
+const uint CACHE_LINE_SIZE = 64;
+
+// How far ahead of the current position the stream copy kernels prefetch the
+// source. This needs to cover the memory latency at the bandwidth of a single
+// core.
+const uint STREAM_PREFETCH_DISTANCE = 1024;
+
+/// <summary>
+/// A copy kernel that bypasses the cache with non-temporal stores. The caller
+/// must call `streamCopyFence()` once it has finished copying and before the
+/// destination is handed to another thread.
+/// </summary>
+typedef void (*StreamCopyFunc)(void *dst, const void *src, size_t size);
+
+//=============================================================================
+// Helper functions
+
+StreamCopyFunc	getStreamCopyFunc();
+void			streamCopyFence();
+void *			fastmemcpy(void *dst, const void *src, size_t size);
+size_t			getFastMemcpyStreamThreshold();
+size_t			getFastMemcpyThreadingThreshold();
+void			setFastMemcpyThreadingThreshold(size_t minSize);
+
+#endif // COMMON_MEMCOPY_H
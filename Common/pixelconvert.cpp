@@ -0,0 +1,1359 @@
+//*****************************************************************************
+// Libdeskcap: A high-performance desktop capture library
+//
+// Copyright (C) 2014 Lucas Murray <lucas@polyflare.com>
+// All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation; either version 2 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//*****************************************************************************
+
+#include "pixelconvert.h"
+#include "cpuinfo.h"
+#include "imghelpers.h"
+#include <math.h>
+#ifdef ARCH_X86
+#include <immintrin.h>
+#endif
+
+// `DXGI_FORMAT` values of the raw formats that we understand. We don't
+// include the DirectX headers as they are not available on every platform.
+static const uint32_t DXGI_R16G16B16A16_FLOAT = DXGIBeginPixelFormat + 10;
+static const uint32_t DXGI_R10G10B10A2_UNORM = DXGIBeginPixelFormat + 24;
+static const uint32_t DXGI_R8G8B8A8_UNORM = DXGIBeginPixelFormat + 28;
+static const uint32_t DXGI_R8G8B8A8_UNORM_SRGB = DXGIBeginPixelFormat + 29;
+static const uint32_t DXGI_B8G8R8A8_UNORM = DXGIBeginPixelFormat + 87;
+static const uint32_t DXGI_B8G8R8X8_UNORM = DXGIBeginPixelFormat + 88;
+static const uint32_t DXGI_B8G8R8A8_UNORM_SRGB = DXGIBeginPixelFormat + 91;
+static const uint32_t DXGI_B8G8R8X8_UNORM_SRGB = DXGIBeginPixelFormat + 93;
+
+// 8-bit BGR with an unused fourth byte. There is no `RawPixelFormat` for it
+// so we use the DXGI format internally.
+static const uint32_t BGRX_PIXEL_FORMAT = DXGI_B8G8R8X8_UNORM;
+
+//=============================================================================
+// Pixel layouts
+
+/// <summary>
+/// Describes the byte offset of each channel of an 8-bit per channel pixel
+/// format. `A` is -1 if the format has no alpha channel in which case the
+/// pixels are treated as opaque.
+/// </summary>
+template<uint32_t Format>
+struct PixelLayout {};
+
+template<>
+struct PixelLayout<BGRAPixelFormat> {
+	enum { BPP = 4, B = 0, G = 1, R = 2, A = 3 };
+};
+
+template<>
+struct PixelLayout<BGRPixelFormat> {
+	enum { BPP = 3, B = 0, G = 1, R = 2, A = -1 };
+};
+
+template<>
+struct PixelLayout<RGBAPixelFormat> {
+	enum { BPP = 4, B = 2, G = 1, R = 0, A = 3 };
+};
+
+template<>
+struct PixelLayout<BGRX_PIXEL_FORMAT> {
+	enum { BPP = 4, B = 0, G = 1, R = 2, A = -1 };
+};
+
+/// <summary>
+/// Maps formats that have an identical memory layout to the one that we
+/// implement the kernels for.
+/// </summary>
+static uint32_t canonicalFormat(uint32_t format)
+{
+	switch(format) {
+	default:
+		return format;
+	case DXGI_B8G8R8A8_UNORM:
+	case DXGI_B8G8R8A8_UNORM_SRGB:
+		return BGRAPixelFormat;
+	case DXGI_R8G8B8A8_UNORM:
+	case DXGI_R8G8B8A8_UNORM_SRGB:
+		return RGBAPixelFormat;
+	case DXGI_B8G8R8X8_UNORM_SRGB:
+		return BGRX_PIXEL_FORMAT;
+	}
+}
+
+//=============================================================================
+// Conversion kernels. Every kernel is a template that is specialized on its
+// source and destination format at compile time so that all channel offsets
+// and shuffle masks are constants. Destination formats are always 8-bit with
+// an alpha channel.
+
+/// <summary>
+/// Reorders the bytes of 8-bit per channel formats with the SSSE3 and AVX2
+/// byte shuffles. Each 16-byte lane produces four destination pixels.
+/// </summary>
+template<uint32_t Src, uint32_t Dst>
+struct SwizzleConverter
+{
+	typedef PixelLayout<Src> S;
+	typedef PixelLayout<Dst> D;
+
+	/// <summary>
+	/// Returns the source byte of destination byte `dstByte` of a pixel or -1
+	/// if it's the alpha channel and the source doesn't have one.
+	/// </summary>
+	static int srcByteOf(int dstByte)
+	{
+		if(dstByte == D::B)
+			return S::B;
+		if(dstByte == D::G)
+			return S::G;
+		if(dstByte == D::R)
+			return S::R;
+		return S::A;
+	}
+
+	static void convertScalar(void *dstPtr, const void *srcPtr, uint numPixels)
+	{
+		uchar *dst = (uchar *)dstPtr;
+		const uchar *src = (const uchar *)srcPtr;
+		for(uint i = 0; i < numPixels; i++) {
+			dst[D::B] = src[S::B];
+			dst[D::G] = src[S::G];
+			dst[D::R] = src[S::R];
+			dst[D::A] = (S::A < 0 ? 0xFF : src[S::A < 0 ? 0 : S::A]);
+			dst += D::BPP;
+			src += S::BPP;
+		}
+	}
+
+#ifdef ARCH_X86
+	/// <summary>
+	/// Builds the shuffle mask of four pixels and the mask that is ORed into
+	/// the result to make pixels without an alpha channel opaque.
+	/// </summary>
+	static void buildMasks(char shuffle[16], char alpha[16])
+	{
+		for(int i = 0; i < 16; i++) {
+			int srcByte = srcByteOf(i % 4);
+			if(srcByte < 0) {
+				shuffle[i] = (char)0x80; // Zero
+				alpha[i] = (char)0xFF;
+			} else {
+				shuffle[i] = (char)((i / 4) * S::BPP + srcByte);
+				alpha[i] = 0;
+			}
+		}
+	}
+
+	SIMD_TARGET("ssse3")
+	static void convertSSSE3(void *dstPtr, const void *srcPtr, uint numPixels)
+	{
+		uchar *dst = (uchar *)dstPtr;
+		const uchar *src = (const uchar *)srcPtr;
+		char shuffleBytes[16], alphaBytes[16];
+		buildMasks(shuffleBytes, alphaBytes);
+		__m128i shuffle = _mm_loadu_si128((const __m128i *)shuffleBytes);
+		__m128i alpha = _mm_loadu_si128((const __m128i *)alphaBytes);
+
+		// Every iteration reads 16 bytes even if it only uses 12 of them
+		const uint minPixels = (16 + S::BPP - 1) / S::BPP;
+		while(numPixels >= minPixels) {
+			__m128i px = _mm_loadu_si128((const __m128i *)src);
+			px = _mm_or_si128(_mm_shuffle_epi8(px, shuffle), alpha);
+			_mm_storeu_si128((__m128i *)dst, px);
+			dst += 4 * D::BPP;
+			src += 4 * S::BPP;
+			numPixels -= 4;
+		}
+		convertScalar(dst, src, numPixels);
+	}
+
+	SIMD_TARGET("avx2")
+	static void convertAVX2(void *dstPtr, const void *srcPtr, uint numPixels)
+	{
+		uchar *dst = (uchar *)dstPtr;
+		const uchar *src = (const uchar *)srcPtr;
+		char shuffleBytes[16], alphaBytes[16];
+		buildMasks(shuffleBytes, alphaBytes);
+		__m256i shuffle = _mm256_broadcastsi128_si256(
+			_mm_loadu_si128((const __m128i *)shuffleBytes));
+		__m256i alpha = _mm256_broadcastsi128_si256(
+			_mm_loadu_si128((const __m128i *)alphaBytes));
+
+		// The shuffle can't cross lanes so each lane loads four source
+		// pixels. Every iteration reads 16 bytes from the second lane's
+		// position even if it only uses 12 of them.
+		const uint minPixels = (4 * S::BPP + 16 + S::BPP - 1) / S::BPP;
+		while(numPixels >= minPixels) {
+			__m256i px;
+			if(S::BPP == 4)
+				px = _mm256_loadu_si256((const __m256i *)src);
+			else {
+				px = _mm256_inserti128_si256(
+					_mm256_castsi128_si256(
+					_mm_loadu_si128((const __m128i *)src)),
+					_mm_loadu_si128((const __m128i *)(src + 4 * S::BPP)), 1);
+			}
+			px = _mm256_or_si256(_mm256_shuffle_epi8(px, shuffle), alpha);
+			_mm256_storeu_si256((__m256i *)dst, px);
+			dst += 8 * D::BPP;
+			src += 8 * S::BPP;
+			numPixels -= 8;
+		}
+		_mm256_zeroupper(); // Prevent SSE transition penalties
+		convertSSSE3(dst, src, numPixels);
+	}
+#endif // ARCH_X86
+
+	static PixelConvertFunc select(uint features)
+	{
+#ifdef ARCH_X86
+		if(features & AVX2CpuFeature)
+			return &convertAVX2;
+		if(features & SSSE3CpuFeature)
+			return &convertSSSE3;
+#endif // ARCH_X86
+		return &convertScalar;
+	}
+};
+
+/// <summary>
+/// Converts `DXGI_FORMAT_R10G10B10A2_UNORM` by keeping the most significant
+/// 8 bits of each colour channel. The 2-bit alpha is expanded to the full
+/// 8-bit range.
+/// </summary>
+template<uint32_t Dst>
+struct R10G10B10A2Converter
+{
+	typedef PixelLayout<Dst> D;
+
+	static void convertScalar(void *dstPtr, const void *srcPtr, uint numPixels)
+	{
+		uchar *dst = (uchar *)dstPtr;
+		const uchar *src = (const uchar *)srcPtr;
+		for(uint i = 0; i < numPixels; i++) {
+			uint32_t px;
+			memcpy(&px, src, sizeof(px));
+			dst[D::R] = (uchar)(px >> 2);
+			dst[D::G] = (uchar)(px >> 12);
+			dst[D::B] = (uchar)(px >> 22);
+			dst[D::A] = (uchar)((px >> 30) * 0x55);
+			dst += 4;
+			src += 4;
+		}
+	}
+
+#ifdef ARCH_X86
+	SIMD_TARGET("sse2")
+	static void convertSSE2(void *dstPtr, const void *srcPtr, uint numPixels)
+	{
+		uchar *dst = (uchar *)dstPtr;
+		const uchar *src = (const uchar *)srcPtr;
+		const __m128i mask = _mm_set1_epi32(0xFF);
+		while(numPixels >= 4) {
+			__m128i px = _mm_loadu_si128((const __m128i *)src);
+			__m128i r = _mm_and_si128(_mm_srli_epi32(px, 2), mask);
+			__m128i g = _mm_and_si128(_mm_srli_epi32(px, 12), mask);
+			__m128i b = _mm_and_si128(_mm_srli_epi32(px, 22), mask);
+			__m128i a = _mm_srli_epi32(px, 30);
+			a = _mm_or_si128(
+				_mm_or_si128(a, _mm_slli_epi32(a, 2)),
+				_mm_or_si128(_mm_slli_epi32(a, 4), _mm_slli_epi32(a, 6)));
+			__m128i out = _mm_or_si128(
+				_mm_or_si128(
+				_mm_slli_epi32(r, 8 * D::R), _mm_slli_epi32(g, 8 * D::G)),
+				_mm_or_si128(
+				_mm_slli_epi32(b, 8 * D::B), _mm_slli_epi32(a, 8 * D::A)));
+			_mm_storeu_si128((__m128i *)dst, out);
+			dst += 16;
+			src += 16;
+			numPixels -= 4;
+		}
+		convertScalar(dst, src, numPixels);
+	}
+
+	SIMD_TARGET("avx2")
+	static void convertAVX2(void *dstPtr, const void *srcPtr, uint numPixels)
+	{
+		uchar *dst = (uchar *)dstPtr;
+		const uchar *src = (const uchar *)srcPtr;
+		const __m256i mask = _mm256_set1_epi32(0xFF);
+		while(numPixels >= 8) {
+			__m256i px = _mm256_loadu_si256((const __m256i *)src);
+			__m256i r = _mm256_and_si256(_mm256_srli_epi32(px, 2), mask);
+			__m256i g = _mm256_and_si256(_mm256_srli_epi32(px, 12), mask);
+			__m256i b = _mm256_and_si256(_mm256_srli_epi32(px, 22), mask);
+			__m256i a = _mm256_srli_epi32(px, 30);
+			a = _mm256_or_si256(
+				_mm256_or_si256(a, _mm256_slli_epi32(a, 2)),
+				_mm256_or_si256(
+				_mm256_slli_epi32(a, 4), _mm256_slli_epi32(a, 6)));
+			__m256i out = _mm256_or_si256(
+				_mm256_or_si256(
+				_mm256_slli_epi32(r, 8 * D::R),
+				_mm256_slli_epi32(g, 8 * D::G)),
+				_mm256_or_si256(
+				_mm256_slli_epi32(b, 8 * D::B),
+				_mm256_slli_epi32(a, 8 * D::A)));
+			_mm256_storeu_si256((__m256i *)dst, out);
+			dst += 32;
+			src += 32;
+			numPixels -= 8;
+		}
+		_mm256_zeroupper(); // Prevent SSE transition penalties
+		convertSSE2(dst, src, numPixels);
+	}
+#endif // ARCH_X86
+
+	static PixelConvertFunc select(uint features)
+	{
+#ifdef ARCH_X86
+		if(features & AVX2CpuFeature)
+			return &convertAVX2;
+		if(features & SSE2CpuFeature)
+			return &convertSSE2;
+#endif // ARCH_X86
+		return &convertScalar;
+	}
+};
+
+// Coefficients of a fast approximation of the sRGB transfer function for
+// linear values above `SRGB_LINEAR_CUTOFF`. After rounding to 8 bits the
+// result differs from the exact curve by at most one step.
+static const float SRGB_LINEAR_CUTOFF = 0.0031308f;
+static const float SRGB_LINEAR_SCALE = 12.92f;
+static const float SRGB_C1 = 0.662002687f;
+static const float SRGB_C2 = 0.684122060f;
+static const float SRGB_C3 = -0.323583601f;
+static const float SRGB_C4 = -0.0225411470f;
+
+static float halfToFloat(uint16_t half)
+{
+	uint32_t sign = (uint32_t)(half & 0x8000) << 16;
+	uint32_t exponent = (half >> 10) & 0x1F;
+	uint32_t mantissa = half & 0x3FF;
+	uint32_t bits;
+	if(exponent == 0) {
+		// Zero or subnormal
+		float val = (float)mantissa * (1.0f / 16777216.0f);
+		return (sign != 0 ? -val : val);
+	} else if(exponent == 31) {
+		// Infinity or NaN
+		bits = sign | 0x7F800000 | (mantissa << 13);
+	} else
+		bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+	float val;
+	memcpy(&val, &bits, sizeof(val));
+	return val;
+}
+
+/// <summary>
+/// Converts a linear colour channel to an 8-bit sRGB value. Out of range
+/// values and NaNs are clamped.
+/// </summary>
+static uchar linearToSrgb8(float val)
+{
+	if(!(val > 0.0f))
+		val = 0.0f;
+	if(val > 1.0f)
+		val = 1.0f;
+	if(val <= SRGB_LINEAR_CUTOFF)
+		val *= SRGB_LINEAR_SCALE;
+	else {
+		float s1 = sqrtf(val);
+		float s2 = sqrtf(s1);
+		float s3 = sqrtf(s2);
+		val = SRGB_C1 * s1 + SRGB_C2 * s2 + SRGB_C3 * s3 + SRGB_C4 * val;
+	}
+	return (uchar)(int)(val * 255.0f + 0.5f);
+}
+
+/// <summary>
+/// Converts a linear alpha channel to an 8-bit value. Out of range values and
+/// NaNs are clamped.
+/// </summary>
+static uchar linearToUnorm8(float val)
+{
+	if(!(val > 0.0f))
+		val = 0.0f;
+	if(val > 1.0f)
+		val = 1.0f;
+	return (uchar)(int)(val * 255.0f + 0.5f);
+}
+
+/// <summary>
+/// Converts `DXGI_FORMAT_R16G16B16A16_FLOAT` which is linear scRGB. Colours
+/// are clamped to the standard range and encoded as sRGB.
+/// </summary>
+template<uint32_t Dst>
+struct FP16Converter
+{
+	typedef PixelLayout<Dst> D;
+
+	static void convertScalar(void *dstPtr, const void *srcPtr, uint numPixels)
+	{
+		uchar *dst = (uchar *)dstPtr;
+		const uchar *src = (const uchar *)srcPtr;
+		for(uint i = 0; i < numPixels; i++) {
+			uint16_t px[4];
+			memcpy(px, src, sizeof(px));
+			dst[D::R] = linearToSrgb8(halfToFloat(px[0]));
+			dst[D::G] = linearToSrgb8(halfToFloat(px[1]));
+			dst[D::B] = linearToSrgb8(halfToFloat(px[2]));
+			dst[D::A] = linearToUnorm8(halfToFloat(px[3]));
+			dst += 4;
+			src += 8;
+		}
+	}
+
+#ifdef ARCH_X86
+	/// <summary>
+	/// Converts two pixels worth of channels to 8-bit integers in 32-bit
+	/// lanes. The operations are identical to the scalar path so that both
+	/// produce the same result.
+	/// </summary>
+	SIMD_TARGET("avx2,f16c")
+	static __m256i convertTwoPixels(__m128i halves)
+	{
+		const __m256 zero = _mm256_setzero_ps();
+		const __m256 one = _mm256_set1_ps(1.0f);
+		const __m256 alphaMask = _mm256_castsi256_ps(
+			_mm256_setr_epi32(0, 0, 0, -1, 0, 0, 0, -1));
+
+		// `max()` returns the second operand if either is NaN
+		__m256 val = _mm256_cvtph_ps(halves);
+		val = _mm256_min_ps(_mm256_max_ps(val, zero), one);
+
+		__m256 s1 = _mm256_sqrt_ps(val);
+		__m256 s2 = _mm256_sqrt_ps(s1);
+		__m256 s3 = _mm256_sqrt_ps(s2);
+		__m256 curve = _mm256_add_ps(
+			_mm256_add_ps(
+			_mm256_add_ps(
+			_mm256_mul_ps(_mm256_set1_ps(SRGB_C1), s1),
+			_mm256_mul_ps(_mm256_set1_ps(SRGB_C2), s2)),
+			_mm256_mul_ps(_mm256_set1_ps(SRGB_C3), s3)),
+			_mm256_mul_ps(_mm256_set1_ps(SRGB_C4), val));
+		__m256 linear = _mm256_mul_ps(val, _mm256_set1_ps(SRGB_LINEAR_SCALE));
+		__m256 isLinear = _mm256_cmp_ps(
+			val, _mm256_set1_ps(SRGB_LINEAR_CUTOFF), _CMP_LE_OQ);
+		__m256 srgb = _mm256_blendv_ps(curve, linear, isLinear);
+		srgb = _mm256_blendv_ps(srgb, val, alphaMask);
+
+		srgb = _mm256_add_ps(
+			_mm256_mul_ps(srgb, _mm256_set1_ps(255.0f)), _mm256_set1_ps(0.5f));
+		return _mm256_cvttps_epi32(srgb);
+	}
+
+	SIMD_TARGET("avx2,f16c")
+	static void convertAVX2(void *dstPtr, const void *srcPtr, uint numPixels)
+	{
+		uchar *dst = (uchar *)dstPtr;
+		const uchar *src = (const uchar *)srcPtr;
+
+		// After packing the bytes are in RGBA order but the pixels are in the
+		// order 0, 2, 1, 3
+		static const int slot[4] = { 0, 2, 1, 3 };
+		char shuffleBytes[16];
+		for(int i = 0; i < 4; i++) {
+			shuffleBytes[i * 4 + D::R] = (char)(slot[i] * 4 + 0);
+			shuffleBytes[i * 4 + D::G] = (char)(slot[i] * 4 + 1);
+			shuffleBytes[i * 4 + D::B] = (char)(slot[i] * 4 + 2);
+			shuffleBytes[i * 4 + D::A] = (char)(slot[i] * 4 + 3);
+		}
+		__m128i shuffle = _mm_loadu_si128((const __m128i *)shuffleBytes);
+
+		while(numPixels >= 4) {
+			__m256i lo = convertTwoPixels(
+				_mm_loadu_si128((const __m128i *)src));
+			__m256i hi = convertTwoPixels(
+				_mm_loadu_si128((const __m128i *)(src + 16)));
+			__m256i words = _mm256_packus_epi32(lo, hi);
+			__m128i bytes = _mm_packus_epi16(
+				_mm256_castsi256_si128(words),
+				_mm256_extracti128_si256(words, 1));
+			bytes = _mm_shuffle_epi8(bytes, shuffle);
+			_mm_storeu_si128((__m128i *)dst, bytes);
+			dst += 16;
+			src += 32;
+			numPixels -= 4;
+		}
+		_mm256_zeroupper(); // Prevent SSE transition penalties
+		convertScalar(dst, src, numPixels);
+	}
+#endif // ARCH_X86
+
+	static PixelConvertFunc select(uint features)
+	{
+#ifdef ARCH_X86
+		if((features & AVX2CpuFeature) && (features & F16CCpuFeature))
+			return &convertAVX2;
+#endif // ARCH_X86
+		return &convertScalar;
+	}
+};
+
+/// <summary>
+/// Returns the fastest kernel that converts `srcFormat` to the destination
+/// format `Dst` or NULL if there isn't one. Both formats must already be
+/// canonical.
+/// </summary>
+template<uint32_t Dst>
+static PixelConvertFunc selectConverter(uint32_t srcFormat, uint features)
+{
+	switch(srcFormat) {
+	default:
+		return NULL;
+	case BGRAPixelFormat:
+		return SwizzleConverter<BGRAPixelFormat, Dst>::select(features);
+	case BGRPixelFormat:
+		return SwizzleConverter<BGRPixelFormat, Dst>::select(features);
+	case RGBAPixelFormat:
+		return SwizzleConverter<RGBAPixelFormat, Dst>::select(features);
+	case BGRX_PIXEL_FORMAT:
+		return SwizzleConverter<BGRX_PIXEL_FORMAT, Dst>::select(features);
+	case DXGI_R10G10B10A2_UNORM:
+		return R10G10B10A2Converter<Dst>::select(features);
+	case DXGI_R16G16B16A16_FLOAT:
+		return FP16Converter<Dst>::select(features);
+	}
+}
+
+//=============================================================================
+// Helper functions
+
+/// <summary>
+/// Returns the number of bytes per pixel of a raw pixel format or zero if we
+/// don't know the format.
+/// </summary>
+uint getPixelFormatBpp(uint32_t format)
+{
+	switch(canonicalFormat(format)) {
+	default:
+		return 0;
+	case BGRAPixelFormat:
+	case RGBAPixelFormat:
+	case BGRX_PIXEL_FORMAT:
+	case DXGI_R10G10B10A2_UNORM:
+		return 4;
+	case BGRPixelFormat:
+		return 3;
+	case DXGI_R16G16B16A16_FLOAT:
+		return 8;
+	}
+}
+
+/// <summary>
+/// Returns the number of bits of each colour channel of a raw pixel format or
+/// zero if we don't know the format.
+/// </summary>
+uint getPixelFormatChannelBits(uint32_t format)
+{
+	switch(canonicalFormat(format)) {
+	default:
+		return 0;
+	case BGRAPixelFormat:
+	case RGBAPixelFormat:
+	case BGRX_PIXEL_FORMAT:
+	case BGRPixelFormat:
+		return 8;
+	case DXGI_R10G10B10A2_UNORM:
+		return 10;
+	case DXGI_R16G16B16A16_FLOAT:
+		return 16;
+	}
+}
+
+/// <summary>
+/// Returns true if `imgConvert()` supports the specified formats.
+/// </summary>
+bool canConvertPixelFormat(uint32_t srcFormat, uint32_t dstFormat)
+{
+	if(srcFormat == dstFormat)
+		return getPixelFormatBpp(srcFormat) != 0;
+	return getPixelConvertFunc(srcFormat, dstFormat) != NULL;
+}
+
+/// <summary>
+/// Returns the fastest kernel that the CPU supports that converts pixels from
+/// `srcFormat` to `dstFormat` or NULL if the conversion isn't supported. The
+/// destination must be 8-bit BGRA or RGBA. Formats without an alpha channel
+/// are converted to opaque pixels.
+/// </summary>
+PixelConvertFunc getPixelConvertFunc(uint32_t srcFormat, uint32_t dstFormat)
+{
+	srcFormat = canonicalFormat(srcFormat);
+	dstFormat = canonicalFormat(dstFormat);
+	uint features = getCpuFeatures();
+	switch(dstFormat) {
+	default:
+		return NULL;
+	case BGRAPixelFormat:
+		return selectConverter<BGRAPixelFormat>(srcFormat, features);
+	case RGBAPixelFormat:
+		return selectConverter<RGBAPixelFormat>(srcFormat, features);
+	}
+}
+
+struct ImgConvertTask {
+	uchar *				dst;
+	const uchar *		src;
+	uint				dstStride;
+	uint				srcStride;
+	uint				width;
+	uint				height;
+	bool				flip;
+	PixelConvertFunc	func;
+};
+
+static void convertImgRows(void *opaque, uint firstRow, uint numRows)
+{
+	const ImgConvertTask *task = (const ImgConvertTask *)opaque;
+
+	// Flipped images are written from the bottom row upwards
+	size_t dstRow = firstRow;
+	ptrdiff_t dstStep = (ptrdiff_t)task->dstStride;
+	if(task->flip) {
+		dstRow = task->height - 1 - firstRow;
+		dstStep = -dstStep;
+	}
+	uchar *dst = task->dst + (size_t)task->dstStride * dstRow;
+	const uchar *src = task->src + (size_t)task->srcStride * firstRow;
+	for(uint i = 0; i < numRows; i++) {
+		task->func(dst, src, task->width);
+		dst += dstStep;
+		src += task->srcStride;
+	}
+}
+
+/// <summary>
+/// Converts an image of `width` by `height` pixels from `srcFormat` to
+/// `dstFormat` taking into account the row strides of both buffers. If the
+/// formats are identical then this is a regular `imgDataCopy()`. Large
+/// images are split into row stripes, see `imgProcessRows()`. If `flip` is
+/// true then the rows are written in reverse order.
+/// </summary>
+/// <returns>False if the conversion isn't supported</returns>
+bool imgConvert(
+	void *dst, const void *src, uint dstStride, uint srcStride, uint width,
+	uint height, uint32_t srcFormat, uint32_t dstFormat, bool flip)
+{
+	if(width == 0 || height == 0)
+		return true;
+	uint srcBpp = getPixelFormatBpp(srcFormat);
+	uint dstBpp = getPixelFormatBpp(dstFormat);
+	if(srcBpp == 0 || dstBpp == 0)
+		return false;
+	if(srcFormat == dstFormat) {
+		imgDataCopy(dst, (void *)src, dstStride, srcStride,
+			(int)(width * srcBpp), (int)height, flip);
+		return true;
+	}
+
+	ImgConvertTask task;
+	task.dst = (uchar *)dst;
+	task.src = (const uchar *)src;
+	task.dstStride = dstStride;
+	task.srcStride = srcStride;
+	task.width = width;
+	task.height = height;
+	task.flip = flip;
+	task.func = getPixelConvertFunc(srcFormat, dstFormat);
+	if(task.func == NULL)
+		return false;
+
+	size_t rowBytes = (size_t)width * (srcBpp > dstBpp ? srcBpp : dstBpp);
+	imgProcessRows(&convertImgRows, &task, height, rowBytes);
+	return true;
+}
+
+//=============================================================================
+// Planar YUV conversion. Every source format is converted to 8-bit BGRA
+// first, except for `DXGI_R10G10B10A2_UNORM` when writing 10-bit samples, so
+// that the kernels only need to understand a single layout. Chroma is the
+// average of each 2x2 block of pixels.
+
+// Fractional bits of the fixed-point colour matrix coefficients
+static const int YUV_COEFF_BITS = 14;
+
+// Alignment of the row strides and offsets of planes in bytes
+static const uint YUV_PLANE_ALIGNMENT = 64;
+
+/// <summary>
+/// A colour matrix in fixed-point. Channels are in R, G, B order and the
+/// results of `y`, `u` and `v` are in the range of the output samples before
+/// the offsets are added.
+/// </summary>
+struct YuvCoeffs {
+	int	y[3];
+	int	u[3];
+	int	v[3];
+	int	yOffset;
+	int	cOffset;
+};
+
+static int roundCoeff(double val)
+{
+	return (int)(val < 0.0 ? val - 0.5 : val + 0.5);
+}
+
+/// <summary>
+/// Calculates the colour matrix of `colorSpace` for `bits` bit samples. The
+/// green coefficients absorb any rounding error so that greys always have
+/// neutral chroma and white is always full intensity.
+/// </summary>
+static void calcYuvCoeffs(uint32_t colorSpace, uint bits, YuvCoeffs *out)
+{
+	double kr = 0.299;
+	double kb = 0.114;
+	if(colorSpace == BT709LimitedColorSpace ||
+		colorSpace == BT709FullColorSpace)
+	{
+		kr = 0.2126;
+		kb = 0.0722;
+	}
+	double yScale = 1.0;
+	double cScale = 1.0;
+	out->yOffset = 0;
+	out->cOffset = 1 << (bits - 1);
+	if(colorSpace == BT601LimitedColorSpace ||
+		colorSpace == BT709LimitedColorSpace)
+	{
+		double maxVal = (double)((1 << bits) - 1);
+		yScale = (double)(219 << (bits - 8)) / maxVal;
+		cScale = (double)(224 << (bits - 8)) / maxVal;
+		out->yOffset = 16 << (bits - 8);
+	}
+	double one = (double)(1 << YUV_COEFF_BITS);
+	out->y[0] = roundCoeff(kr * yScale * one);
+	out->y[2] = roundCoeff(kb * yScale * one);
+	out->y[1] = roundCoeff(yScale * one) - out->y[0] - out->y[2];
+	double cb = cScale * 0.5 / (1.0 - kb);
+	out->u[0] = roundCoeff(-kr * cb * one);
+	out->u[2] = roundCoeff(cScale * 0.5 * one);
+	out->u[1] = -out->u[0] - out->u[2];
+	double cr = cScale * 0.5 / (1.0 - kr);
+	out->v[0] = roundCoeff(cScale * 0.5 * one);
+	out->v[2] = roundCoeff(-kb * cr * one);
+	out->v[1] = -out->v[0] - out->v[2];
+}
+
+/// <summary>
+/// Converts two rows of `width` pixels to Y samples and a single row of
+/// chroma samples. The source is 8-bit BGRA and the destination samples are
+/// 8-bit. Chroma samples are written to every `cStep` element of `u` and `v`
+/// so that both interleaved and separate chroma planes are supported. If the
+/// width is odd then the last column is repeated.
+/// </summary>
+typedef void (*YuvRowPairFunc)(
+	const YuvCoeffs &c, const uchar *src0, const uchar *src1, uchar *y0,
+	uchar *y1, uchar *u, uchar *v, uint cStep, uint width);
+
+/// <summary>
+/// Scalar implementation of `YuvRowPairFunc` for both 8- and 16-bit
+/// samples. Source pixels are four samples in B, G, R, A order and results
+/// are shifted left by `OutShift` bits after being clamped to `maxVal`.
+/// </summary>
+template<typename Sample, int OutShift>
+static void yuvRowPairScalar(
+	const YuvCoeffs &c, const Sample *src0, const Sample *src1, Sample *y0,
+	Sample *y1, Sample *u, Sample *v, uint cStep, uint width, int maxVal)
+{
+	const int yRound = (c.yOffset << YUV_COEFF_BITS) +
+		(1 << (YUV_COEFF_BITS - 1));
+	const int cRound = (c.cOffset << (YUV_COEFF_BITS + 2)) +
+		(1 << (YUV_COEFF_BITS + 1));
+	for(uint x = 0; x < width; x += 2) {
+		uint x1 = (x + 1 < width ? x + 1 : x);
+		const Sample *px[4] = {
+			&src0[x * 4], &src0[x1 * 4], &src1[x * 4], &src1[x1 * 4] };
+		Sample *yOut[4] = { &y0[x], &y0[x1], &y1[x], &y1[x1] };
+		int sum[3] = { 0, 0, 0 }; // R, G, B
+		for(int i = 0; i < 4; i++) {
+			int r = px[i][2];
+			int g = px[i][1];
+			int b = px[i][0];
+			int val = (c.y[0] * r + c.y[1] * g + c.y[2] * b + yRound) >>
+				YUV_COEFF_BITS;
+			val = (val < 0 ? 0 : (val > maxVal ? maxVal : val));
+			*yOut[i] = (Sample)(val << OutShift);
+			sum[0] += r;
+			sum[1] += g;
+			sum[2] += b;
+		}
+		int cu = (c.u[0] * sum[0] + c.u[1] * sum[1] + c.u[2] * sum[2] +
+			cRound) >> (YUV_COEFF_BITS + 2);
+		int cv = (c.v[0] * sum[0] + c.v[1] * sum[1] + c.v[2] * sum[2] +
+			cRound) >> (YUV_COEFF_BITS + 2);
+		cu = (cu < 0 ? 0 : (cu > maxVal ? maxVal : cu));
+		cv = (cv < 0 ? 0 : (cv > maxVal ? maxVal : cv));
+		u[(x / 2) * cStep] = (Sample)(cu << OutShift);
+		v[(x / 2) * cStep] = (Sample)(cv << OutShift);
+	}
+}
+
+/// <summary>
+/// Same as `YuvRowPairFunc` except that both the source and the destination
+/// samples are 16-bit. Source samples are 10-bit and destination samples
+/// have 10 significant MSBs.
+/// </summary>
+typedef void (*YuvRowPair16Func)(
+	const YuvCoeffs &c, const uint16_t *src0, const uint16_t *src1,
+	uint16_t *y0, uint16_t *y1, uint16_t *u, uint16_t *v, uint cStep,
+	uint width);
+
+static void yuvRowPair16Scalar(
+	const YuvCoeffs &c, const uint16_t *src0, const uint16_t *src1,
+	uint16_t *y0, uint16_t *y1, uint16_t *u, uint16_t *v, uint cStep,
+	uint width)
+{
+	yuvRowPairScalar<uint16_t, 6>(
+		c, src0, src1, y0, y1, u, v, cStep, width, 1023);
+}
+
+static void yuvRowPair8Scalar(
+	const YuvCoeffs &c, const uchar *src0, const uchar *src1, uchar *y0,
+	uchar *y1, uchar *u, uchar *v, uint cStep, uint width)
+{
+	yuvRowPairScalar<uchar, 0>(
+		c, src0, src1, y0, y1, u, v, cStep, width, 255);
+}
+
+#ifdef ARCH_X86
+/// <summary>
+/// Multiplies two 16-bit BGRA pixels by `coeffs` and returns the sum of each
+/// pixel in the 32-bit elements 0 and 2.
+/// </summary>
+SIMD_TARGET("sse2")
+static inline __m128i yuvDot2(__m128i pixels, __m128i coeffs)
+{
+	__m128i prod = _mm_madd_epi16(pixels, coeffs);
+	return _mm_add_epi32(prod, _mm_srli_epi64(prod, 32));
+}
+
+/// <summary>
+/// Combines the results of two `yuvDot2()` calls into four 32-bit elements.
+/// </summary>
+SIMD_TARGET("sse2")
+static inline __m128i yuvJoin(__m128i a, __m128i b)
+{
+	return _mm_unpacklo_epi64(
+		_mm_shuffle_epi32(a, _MM_SHUFFLE(3, 1, 2, 0)),
+		_mm_shuffle_epi32(b, _MM_SHUFFLE(3, 1, 2, 0)));
+}
+
+/// <summary>
+/// Converts eight pixels to 8-bit Y samples.
+/// </summary>
+SIMD_TARGET("sse2")
+static inline __m128i yuvLuma8(
+	__m128i px0, __m128i px1, __m128i coeffs, __m128i round)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i lo = yuvJoin(
+		yuvDot2(_mm_unpacklo_epi8(px0, zero), coeffs),
+		yuvDot2(_mm_unpackhi_epi8(px0, zero), coeffs));
+	__m128i hi = yuvJoin(
+		yuvDot2(_mm_unpacklo_epi8(px1, zero), coeffs),
+		yuvDot2(_mm_unpackhi_epi8(px1, zero), coeffs));
+	lo = _mm_srai_epi32(_mm_add_epi32(lo, round), YUV_COEFF_BITS);
+	hi = _mm_srai_epi32(_mm_add_epi32(hi, round), YUV_COEFF_BITS);
+	__m128i words = _mm_packs_epi32(lo, hi);
+	return _mm_packus_epi16(words, words);
+}
+
+/// <summary>
+/// SSE2 implementation of `YuvRowPairFunc` that converts eight pixels of
+/// each row per iteration.
+/// </summary>
+SIMD_TARGET("sse2")
+static void yuvRowPair8SSE2(
+	const YuvCoeffs &c, const uchar *src0, const uchar *src1, uchar *y0,
+	uchar *y1, uchar *u, uchar *v, uint cStep, uint width)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i yCoeffs = _mm_set_epi16(
+		0, (short)c.y[0], (short)c.y[1], (short)c.y[2],
+		0, (short)c.y[0], (short)c.y[1], (short)c.y[2]);
+	const __m128i uCoeffs = _mm_set_epi16(
+		0, (short)c.u[0], (short)c.u[1], (short)c.u[2],
+		0, (short)c.u[0], (short)c.u[1], (short)c.u[2]);
+	const __m128i vCoeffs = _mm_set_epi16(
+		0, (short)c.v[0], (short)c.v[1], (short)c.v[2],
+		0, (short)c.v[0], (short)c.v[1], (short)c.v[2]);
+	const __m128i yRound = _mm_set1_epi32(
+		(c.yOffset << YUV_COEFF_BITS) + (1 << (YUV_COEFF_BITS - 1)));
+	const __m128i cRound = _mm_set1_epi32(
+		(c.cOffset << (YUV_COEFF_BITS + 2)) + (1 << (YUV_COEFF_BITS + 1)));
+
+	uint x = 0;
+	for(; x + 8 <= width; x += 8) {
+		__m128i a0 = _mm_loadu_si128((const __m128i *)&src0[x * 4]);
+		__m128i a1 = _mm_loadu_si128((const __m128i *)&src0[x * 4 + 16]);
+		__m128i b0 = _mm_loadu_si128((const __m128i *)&src1[x * 4]);
+		__m128i b1 = _mm_loadu_si128((const __m128i *)&src1[x * 4 + 16]);
+		_mm_storel_epi64(
+			(__m128i *)&y0[x], yuvLuma8(a0, a1, yCoeffs, yRound));
+		_mm_storel_epi64(
+			(__m128i *)&y1[x], yuvLuma8(b0, b1, yCoeffs, yRound));
+
+		// Sum each 2x2 block. Each sum ends up in the low four words.
+		__m128i sum[4];
+		sum[0] = _mm_add_epi16(_mm_unpacklo_epi8(a0, zero),
+			_mm_unpacklo_epi8(b0, zero));
+		sum[1] = _mm_add_epi16(_mm_unpackhi_epi8(a0, zero),
+			_mm_unpackhi_epi8(b0, zero));
+		sum[2] = _mm_add_epi16(_mm_unpacklo_epi8(a1, zero),
+			_mm_unpacklo_epi8(b1, zero));
+		sum[3] = _mm_add_epi16(_mm_unpackhi_epi8(a1, zero),
+			_mm_unpackhi_epi8(b1, zero));
+		for(int i = 0; i < 4; i++)
+			sum[i] = _mm_add_epi16(sum[i], _mm_srli_si128(sum[i], 8));
+		__m128i blocks01 = _mm_unpacklo_epi64(sum[0], sum[1]);
+		__m128i blocks23 = _mm_unpacklo_epi64(sum[2], sum[3]);
+
+		__m128i cu = yuvJoin(
+			yuvDot2(blocks01, uCoeffs), yuvDot2(blocks23, uCoeffs));
+		__m128i cv = yuvJoin(
+			yuvDot2(blocks01, vCoeffs), yuvDot2(blocks23, vCoeffs));
+		cu = _mm_srai_epi32(_mm_add_epi32(cu, cRound), YUV_COEFF_BITS + 2);
+		cv = _mm_srai_epi32(_mm_add_epi32(cv, cRound), YUV_COEFF_BITS + 2);
+		__m128i words = _mm_packs_epi32(cu, cv); // U0-3, V0-3
+		if(cStep == 2 && v == u + 1) {
+			// Interleaved UV plane
+			words = _mm_unpacklo_epi16(words, _mm_srli_si128(words, 8));
+			_mm_storel_epi64(
+				(__m128i *)&u[x], _mm_packus_epi16(words, words));
+		} else if(cStep == 1) {
+			__m128i bytes = _mm_packus_epi16(words, words);
+			int packedU = _mm_cvtsi128_si32(bytes);
+			int packedV = _mm_cvtsi128_si32(_mm_srli_si128(bytes, 4));
+			memcpy(&u[x / 2], &packedU, 4);
+			memcpy(&v[x / 2], &packedV, 4);
+		} else {
+			uchar bytes[16];
+			_mm_storeu_si128((__m128i *)bytes,
+				_mm_packus_epi16(words, words));
+			for(int i = 0; i < 4; i++) {
+				u[(x / 2 + i) * cStep] = bytes[i];
+				v[(x / 2 + i) * cStep] = bytes[4 + i];
+			}
+		}
+	}
+	if(x < width) {
+		yuvRowPair8Scalar(c, &src0[x * 4], &src1[x * 4], &y0[x], &y1[x],
+			&u[(x / 2) * cStep], &v[(x / 2) * cStep], cStep, width - x);
+	}
+}
+#endif // ARCH_X86
+
+#ifdef ARCH_X86
+/// <summary>
+/// Converts eight pixels of 10-bit samples to Y samples with 10 significant
+/// MSBs.
+/// </summary>
+SIMD_TARGET("sse2")
+static inline __m128i yuvLuma16(
+	const __m128i *px, __m128i coeffs, __m128i round)
+{
+	__m128i lo = yuvJoin(yuvDot2(px[0], coeffs), yuvDot2(px[1], coeffs));
+	__m128i hi = yuvJoin(yuvDot2(px[2], coeffs), yuvDot2(px[3], coeffs));
+	lo = _mm_srai_epi32(_mm_add_epi32(lo, round), YUV_COEFF_BITS);
+	hi = _mm_srai_epi32(_mm_add_epi32(hi, round), YUV_COEFF_BITS);
+	__m128i words = _mm_packs_epi32(lo, hi);
+	words = _mm_min_epi16(
+		_mm_max_epi16(words, _mm_setzero_si128()), _mm_set1_epi16(1023));
+	return _mm_slli_epi16(words, 6);
+}
+
+/// <summary>
+/// SSE2 implementation of `YuvRowPair16Func` for interleaved chroma that
+/// converts eight pixels of each row per iteration.
+/// </summary>
+SIMD_TARGET("sse2")
+static void yuvRowPair16SSE2(
+	const YuvCoeffs &c, const uint16_t *src0, const uint16_t *src1,
+	uint16_t *y0, uint16_t *y1, uint16_t *u, uint16_t *v, uint cStep,
+	uint width)
+{
+	if(cStep != 2 || v != u + 1) {
+		yuvRowPair16Scalar(c, src0, src1, y0, y1, u, v, cStep, width);
+		return;
+	}
+	const __m128i yCoeffs = _mm_set_epi16(
+		0, (short)c.y[0], (short)c.y[1], (short)c.y[2],
+		0, (short)c.y[0], (short)c.y[1], (short)c.y[2]);
+	const __m128i uCoeffs = _mm_set_epi16(
+		0, (short)c.u[0], (short)c.u[1], (short)c.u[2],
+		0, (short)c.u[0], (short)c.u[1], (short)c.u[2]);
+	const __m128i vCoeffs = _mm_set_epi16(
+		0, (short)c.v[0], (short)c.v[1], (short)c.v[2],
+		0, (short)c.v[0], (short)c.v[1], (short)c.v[2]);
+	const __m128i yRound = _mm_set1_epi32(
+		(c.yOffset << YUV_COEFF_BITS) + (1 << (YUV_COEFF_BITS - 1)));
+	const __m128i cRound = _mm_set1_epi32(
+		(c.cOffset << (YUV_COEFF_BITS + 2)) + (1 << (YUV_COEFF_BITS + 1)));
+
+	uint x = 0;
+	for(; x + 8 <= width; x += 8) {
+		__m128i a[4];
+		__m128i b[4];
+		__m128i sum[4];
+		for(int i = 0; i < 4; i++) {
+			a[i] = _mm_loadu_si128((const __m128i *)&src0[x * 4 + i * 8]);
+			b[i] = _mm_loadu_si128((const __m128i *)&src1[x * 4 + i * 8]);
+
+			// Sum each 2x2 block into the low four words
+			sum[i] = _mm_add_epi16(a[i], b[i]);
+			sum[i] = _mm_add_epi16(sum[i], _mm_srli_si128(sum[i], 8));
+		}
+		_mm_storeu_si128((__m128i *)&y0[x], yuvLuma16(a, yCoeffs, yRound));
+		_mm_storeu_si128((__m128i *)&y1[x], yuvLuma16(b, yCoeffs, yRound));
+
+		__m128i blocks01 = _mm_unpacklo_epi64(sum[0], sum[1]);
+		__m128i blocks23 = _mm_unpacklo_epi64(sum[2], sum[3]);
+		__m128i cu = yuvJoin(
+			yuvDot2(blocks01, uCoeffs), yuvDot2(blocks23, uCoeffs));
+		__m128i cv = yuvJoin(
+			yuvDot2(blocks01, vCoeffs), yuvDot2(blocks23, vCoeffs));
+		cu = _mm_srai_epi32(_mm_add_epi32(cu, cRound), YUV_COEFF_BITS + 2);
+		cv = _mm_srai_epi32(_mm_add_epi32(cv, cRound), YUV_COEFF_BITS + 2);
+		__m128i words = _mm_packs_epi32(cu, cv); // U0-3, V0-3
+		words = _mm_min_epi16(_mm_max_epi16(words, _mm_setzero_si128()),
+			_mm_set1_epi16(1023));
+		words = _mm_unpacklo_epi16(words, _mm_srli_si128(words, 8));
+		_mm_storeu_si128((__m128i *)&u[x], _mm_slli_epi16(words, 6));
+	}
+	if(x < width) {
+		yuvRowPair16Scalar(c, &src0[x * 4], &src1[x * 4], &y0[x], &y1[x],
+			&u[x], &v[x], cStep, width - x);
+	}
+}
+#endif // ARCH_X86
+
+static YuvRowPair16Func getYuvRowPair16Func()
+{
+#ifdef ARCH_X86
+	if(getCpuFeatures() & SSE2CpuFeature)
+		return &yuvRowPair16SSE2;
+#endif // ARCH_X86
+	return &yuvRowPair16Scalar;
+}
+
+static YuvRowPairFunc getYuvRowPairFunc()
+{
+#ifdef ARCH_X86
+	if(getCpuFeatures() & SSE2CpuFeature)
+		return &yuvRowPair8SSE2;
+#endif // ARCH_X86
+	return &yuvRowPair8Scalar;
+}
+
+#ifdef ARCH_X86
+/// <summary>
+/// SSE2 implementation of `expandRowTo10Bit()`. Returns the number of pixels
+/// that were converted, the caller converts the rest.
+/// </summary>
+SIMD_TARGET("sse2")
+static uint expandRowTo10BitSSE2(
+	uint16_t *dst, const uchar *src, uint numPixels, bool isR10G10B10A2)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i mask = _mm_set1_epi32(0x3FF);
+	uint i = 0;
+	for(; i + 4 <= numPixels; i += 4) {
+		__m128i px = _mm_loadu_si128((const __m128i *)&src[i * 4]);
+		__m128i lo, hi;
+		if(isR10G10B10A2) {
+			// Build B | G << 16 and R in each 32-bit element and interleave
+			__m128i b = _mm_and_si128(_mm_srli_epi32(px, 20), mask);
+			__m128i g = _mm_and_si128(_mm_srli_epi32(px, 10), mask);
+			__m128i r = _mm_and_si128(px, mask);
+			__m128i bg = _mm_or_si128(b, _mm_slli_epi32(g, 16));
+			lo = _mm_unpacklo_epi32(bg, r);
+			hi = _mm_unpackhi_epi32(bg, r);
+		} else {
+			lo = _mm_unpacklo_epi8(px, zero);
+			hi = _mm_unpackhi_epi8(px, zero);
+			lo = _mm_or_si128(_mm_slli_epi16(lo, 2), _mm_srli_epi16(lo, 6));
+			hi = _mm_or_si128(_mm_slli_epi16(hi, 2), _mm_srli_epi16(hi, 6));
+		}
+		_mm_storeu_si128((__m128i *)&dst[i * 4], lo);
+		_mm_storeu_si128((__m128i *)&dst[i * 4 + 8], hi);
+	}
+	return i;
+}
+#endif // ARCH_X86
+
+/// <summary>
+/// Converts a row of pixels to 10-bit BGRA samples that are stored in 16-bit
+/// words. `DXGI_R10G10B10A2_UNORM` keeps its full precision while every
+/// other format is expanded from 8-bit BGRA. Alpha is unused by the YUV
+/// kernels and is not always written.
+/// </summary>
+static void expandRowTo10Bit(
+	uint16_t *dst, const uchar *src, uint numPixels, uint32_t srcFormat,
+	PixelConvertFunc toBgra, uchar *scratch)
+{
+	bool isR10G10B10A2 = (srcFormat == DXGI_R10G10B10A2_UNORM);
+	if(!isR10G10B10A2 && toBgra != NULL) {
+		toBgra(scratch, src, numPixels);
+		src = scratch;
+	}
+	uint i = 0;
+#ifdef ARCH_X86
+	if(getCpuFeatures() & SSE2CpuFeature)
+		i = expandRowTo10BitSSE2(dst, src, numPixels, isR10G10B10A2);
+#endif // ARCH_X86
+	for(; i < numPixels; i++) {
+		if(isR10G10B10A2) {
+			uint32_t px;
+			memcpy(&px, &src[i * 4], sizeof(px));
+			dst[i * 4 + 0] = (uint16_t)((px >> 20) & 0x3FF);
+			dst[i * 4 + 1] = (uint16_t)((px >> 10) & 0x3FF);
+			dst[i * 4 + 2] = (uint16_t)(px & 0x3FF);
+			dst[i * 4 + 3] = 0;
+			continue;
+		}
+		for(int j = 0; j < 4; j++) {
+			uchar val = src[i * 4 + j];
+			dst[i * 4 + j] = (uint16_t)((val << 2) | (val >> 6));
+		}
+	}
+}
+
+struct YuvConvertTask {
+	uchar *				planes[3];
+	uint				strides[3];
+	const uchar *		src;
+	uint				srcStride;
+	uint				width;
+	uint				height;
+	bool				flip;
+	uint32_t			srcFormat; // Canonical
+	uint32_t			dstFormat;
+	PixelConvertFunc	toBgra; // NULL if the source is already BGRA
+	YuvRowPairFunc		rowPair;
+	YuvRowPair16Func	rowPair16;
+	YuvCoeffs			coeffs;
+};
+
+/// <summary>
+/// Converts a range of row pairs for `imgConvertToYuv()`.
+/// </summary>
+static void convertYuvRows(void *opaque, uint firstRow, uint numRows)
+{
+	const YuvConvertTask *task = (const YuvConvertTask *)opaque;
+	uint width = task->width;
+	bool is10Bit = (task->dstFormat == P010PixelFormat);
+
+	// Scratch space for two converted source rows and the Y samples of the
+	// row after the last row of an image with an odd height
+	size_t rowBytes = (size_t)width * 4 * (is10Bit ? 2 : 1);
+	vector<uchar> scratch(rowBytes * 3 + (size_t)width * 4);
+	uchar *rowBuf[2] = { &scratch[0], &scratch[rowBytes] };
+	uchar *yScratch = &scratch[rowBytes * 2];
+	uchar *bgraScratch = &scratch[rowBytes * 3];
+
+	for(uint pair = firstRow; pair < firstRow + numRows; pair++) {
+		uint y = pair * 2;
+		bool hasSecond = (y + 1 < task->height);
+		const uchar *src[2];
+		for(int i = 0; i < 2; i++) {
+			uint srcY = (i == 1 && hasSecond ? y + 1 : y);
+			if(task->flip)
+				srcY = task->height - 1 - srcY;
+			src[i] = task->src + (size_t)srcY * task->srcStride;
+			if(is10Bit) {
+				expandRowTo10Bit((uint16_t *)rowBuf[i], src[i], width,
+					task->srcFormat, task->toBgra, bgraScratch);
+				src[i] = rowBuf[i];
+			} else if(task->toBgra != NULL) {
+				task->toBgra(rowBuf[i], src[i], width);
+				src[i] = rowBuf[i];
+			}
+		}
+		uchar *y0 = task->planes[0] + (size_t)y * task->strides[0];
+		uchar *y1 = yScratch;
+		if(hasSecond)
+			y1 = y0 + task->strides[0];
+		uchar *chroma = task->planes[1] + (size_t)pair * task->strides[1];
+
+		switch(task->dstFormat) {
+		default:
+			break;
+		case NV12PixelFormat:
+			task->rowPair(task->coeffs, src[0], src[1], y0, y1, chroma,
+				chroma + 1, 2, width);
+			break;
+		case I420PixelFormat:
+			task->rowPair(task->coeffs, src[0], src[1], y0, y1, chroma,
+				task->planes[2] + (size_t)pair * task->strides[2], 1,
+				width);
+			break;
+		case P010PixelFormat: {
+			uint16_t *uv = (uint16_t *)chroma;
+			task->rowPair16(task->coeffs, (const uint16_t *)src[0],
+				(const uint16_t *)src[1], (uint16_t *)y0, (uint16_t *)y1, uv,
+				uv + 1, 2, width);
+			break; }
+		}
+	}
+}
+
+//=============================================================================
+// Planar YUV helper functions
+
+/// <summary>
+/// Returns true if `format` is one of the planar YUV formats.
+/// </summary>
+bool isYuvPixelFormat(uint32_t format)
+{
+	return format == NV12PixelFormat || format == I420PixelFormat ||
+		format == P010PixelFormat;
+}
+
+/// <summary>
+/// Returns the number of planes of a pixel format. Packed formats that we
+/// know always have a single plane.
+/// </summary>
+/// <returns>Zero if we don't know the format</returns>
+uint getPixelFormatNumPlanes(uint32_t format)
+{
+	switch(format) {
+	default:
+		return getPixelFormatBpp(format) != 0 ? 1 : 0;
+	case NV12PixelFormat:
+	case P010PixelFormat:
+		return 2;
+	case I420PixelFormat:
+		return 3;
+	}
+}
+
+/// <summary>
+/// Returns the number of rows in a plane of a `height` pixel tall image.
+/// Chroma planes of YUV 4:2:0 formats have half the height rounded up.
+/// </summary>
+/// <returns>Zero if the plane doesn't exist</returns>
+uint getPixelFormatPlaneRows(uint32_t format, uint plane, uint height)
+{
+	if(plane >= getPixelFormatNumPlanes(format))
+		return 0;
+	if(plane == 0)
+		return height;
+	return (height + 1) / 2;
+}
+
+/// <summary>
+/// Calculates where each plane of a `width` by `height` pixel image is
+/// located when all planes are stored in a single buffer. Planes begin on
+/// `YUV_PLANE_ALIGNMENT` byte boundaries and their rows are padded to the
+/// same alignment. Chroma planes of YUV 4:2:0 formats have half the width and
+/// height rounded up. `offsetsOut` and `stridesOut` must have room for
+/// `CaptureSharedSegment::MAX_PLANES` elements, unused planes are zero so
+/// that they can be passed to `CaptureSharedSegment::setFramePlanes()`.
+/// </summary>
+/// <returns>The total size of the image in bytes or zero if we don't know
+/// the format</returns>
+uint64_t calcPixelFormatPlanes(
+	uint32_t format, uint width, uint height, uint *offsetsOut,
+	uint *stridesOut)
+{
+	uint numPlanes = getPixelFormatNumPlanes(format);
+	if(numPlanes == 0 || offsetsOut == NULL || stridesOut == NULL)
+		return 0;
+	for(uint i = 0; i < CaptureSharedSegment::MAX_PLANES; i++) {
+		offsetsOut[i] = 0;
+		stridesOut[i] = 0;
+	}
+	if(numPlanes == 1) {
+		offsetsOut[0] = 0;
+		stridesOut[0] = width * getPixelFormatBpp(format);
+		return (uint64_t)stridesOut[0] * height;
+	}
+
+	const uint align = YUV_PLANE_ALIGNMENT;
+	uint sampleBytes = (format == P010PixelFormat ? 2 : 1);
+	uint chromaWidth = (width + 1) / 2;
+	uint chromaHeight = getPixelFormatPlaneRows(format, 1, height);
+	stridesOut[0] = (width * sampleBytes + align - 1) / align * align;
+	uint chromaBytes = chromaWidth * sampleBytes;
+	if(numPlanes == 2)
+		chromaBytes *= 2; // Interleaved
+	uint chromaStride = (chromaBytes + align - 1) / align * align;
+	uint64_t offset = (uint64_t)stridesOut[0] * height;
+	for(uint i = 1; i < numPlanes; i++) {
+		offsetsOut[i] = (uint)offset;
+		stridesOut[i] = chromaStride;
+		offset += (uint64_t)chromaStride * chromaHeight;
+	}
+	return offset;
+}
+
+/// <summary>
+/// Returns true if `imgConvertToYuv()` supports the specified formats.
+/// </summary>
+bool canConvertToYuv(uint32_t srcFormat, uint32_t dstFormat)
+{
+	if(!isYuvPixelFormat(dstFormat))
+		return false;
+	return canConvertPixelFormat(srcFormat, BGRAPixelFormat);
+}
+
+/// <summary>
+/// Converts an image of `width` by `height` pixels from a packed `srcFormat`
+/// to the planar YUV 4:2:0 format `dstFormat` using the colour matrix and
+/// range of `colorSpace`. `dstPlanes` and `dstStrides` describe each plane
+/// of the destination, see `calcPixelFormatPlanes()`. Images with an odd
+/// width or height repeat their last column or row when calculating chroma.
+/// Large images are split into row stripes, see `imgProcessRows()`. If
+/// `flip` is true then the source rows are read in reverse order.
+/// </summary>
+/// <returns>False if the conversion isn't supported</returns>
+bool imgConvertToYuv(
+	void *const *dstPlanes, const uint *dstStrides, const void *src,
+	uint srcStride, uint width, uint height, uint32_t srcFormat,
+	uint32_t dstFormat, uint32_t colorSpace, bool flip)
+{
+	if(!canConvertToYuv(srcFormat, dstFormat))
+		return false;
+	if(width == 0 || height == 0)
+		return true;
+
+	YuvConvertTask task;
+	uint numPlanes = getPixelFormatNumPlanes(dstFormat);
+	for(uint i = 0; i < 3; i++) {
+		task.planes[i] = (i < numPlanes ? (uchar *)dstPlanes[i] : NULL);
+		task.strides[i] = (i < numPlanes ? dstStrides[i] : 0);
+	}
+	task.src = (const uchar *)src;
+	task.srcStride = srcStride;
+	task.width = width;
+	task.height = height;
+	task.flip = flip;
+	task.srcFormat = canonicalFormat(srcFormat);
+	task.dstFormat = dstFormat;
+	task.toBgra = NULL;
+	if(task.srcFormat != BGRAPixelFormat &&
+		task.srcFormat != BGRX_PIXEL_FORMAT)
+	{
+		task.toBgra = getPixelConvertFunc(srcFormat, BGRAPixelFormat);
+	}
+	task.rowPair = getYuvRowPairFunc();
+	task.rowPair16 = getYuvRowPair16Func();
+	calcYuvCoeffs(colorSpace, dstFormat == P010PixelFormat ? 10 : 8,
+		&task.coeffs);
+
+	size_t rowBytes = (size_t)width * 2 * (getPixelFormatBpp(srcFormat) + 2);
+	imgProcessRows(&convertYuvRows, &task, (height + 1) / 2, rowBytes);
+	return true;
+}
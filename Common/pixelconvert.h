@@ -0,0 +1,55 @@
+//*****************************************************************************
+// Libdeskcap: A high-performance desktop capture library
+//
+// Copyright (C) 2014 Lucas Murray <lucas@polyflare.com>
+// All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation; either version 2 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//*****************************************************************************
+
+#ifndef COMMON_PIXELCONVERT_H
+#define COMMON_PIXELCONVERT_H
+
+#include "stlincludes.h"
+#include "capturesharedsegment.h"
+
+/// <summary>
+/// Converts a row of `numPixels` pixels from one `RawPixelFormat` to another.
+/// The buffers must not overlap and don't need to be aligned.
+/// </summary>
+typedef void (*PixelConvertFunc)(void *dst, const void *src, uint numPixels);
+
+//=============================================================================
+// Helper functions
+
+uint				getPixelFormatBpp(uint32_t format);
+uint				getPixelFormatChannelBits(uint32_t format);
+bool				canConvertPixelFormat(
+	uint32_t srcFormat, uint32_t dstFormat);
+PixelConvertFunc	getPixelConvertFunc(uint32_t srcFormat, uint32_t dstFormat);
+bool				imgConvert(
+	void *dst, const void *src, uint dstStride, uint srcStride, uint width,
+	uint height, uint32_t srcFormat, uint32_t dstFormat, bool flip = false);
+
+bool				isYuvPixelFormat(uint32_t format);
+uint				getPixelFormatNumPlanes(uint32_t format);
+uint				getPixelFormatPlaneRows(
+	uint32_t format, uint plane, uint height);
+uint64_t			calcPixelFormatPlanes(
+	uint32_t format, uint width, uint height, uint *offsetsOut,
+	uint *stridesOut);
+bool				canConvertToYuv(uint32_t srcFormat, uint32_t dstFormat);
+bool				imgConvertToYuv(
+	void *const *dstPlanes, const uint *dstStrides, const void *src,
+	uint srcStride, uint width, uint height, uint32_t srcFormat,
+	uint32_t dstFormat, uint32_t colorSpace, bool flip = false);
+
+#endif // COMMON_PIXELCONVERT_H
@@ -23,10 +23,11 @@
 //=============================================================================
 // Helper functions
 
-void *	fastmemcpy(void *dst, const void *src, size_t size);
 string	stringf(const string fmt, ...);
 string	pointerToString(void *ptr);
 string	numberToHexString(uint64_t num);
+uint64_t	getMonotonicUsec();
+uint32_t	getProcessId();
 
 /// <summary>
 /// Returns a pointer that is offset from the input by `offset` bytes.
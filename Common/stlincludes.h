@@ -21,6 +21,7 @@
 #include "macros.h"
 
 #include <cstdint>
+#include <cstring>
 #include <iostream>
 #include <string>
 #include <vector>
@@ -0,0 +1,264 @@
+//*****************************************************************************
+// Libdeskcap: A high-performance desktop capture library
+//
+// Copyright (C) 2014 Lucas Murray <lucas@polyflare.com>
+// All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation; either version 2 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//*****************************************************************************
+
+#include "macros.h"
+#ifdef OS_LINUX
+#include <pthread.h>
+#include <sched.h>
+#endif
+#include "workerpool.h"
+#include "atomicops.h"
+#include "stlhelpers.h"
+#include <boost/thread.hpp>
+#ifdef OS_WIN
+#include <windows.h>
+#endif
+
+WorkerPool *WorkerPool::s_shared = NULL;
+
+/// <summary>
+/// Pins the calling thread to a single logical CPU.
+/// </summary>
+static void pinCurrentThread(uint cpu)
+{
+#ifdef OS_WIN
+	const uint maxCpus = sizeof(DWORD_PTR) * 8;
+	SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << (cpu % maxCpus));
+#elif defined(OS_LINUX)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu % CPU_SETSIZE, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+/// <summary>
+/// Creates the shared pool of the process if it doesn't exist yet. Must not
+/// be called from `DllMain()`.
+/// </summary>
+WorkerPool *WorkerPool::initializeShared(uint numThreads, bool pinThreads)
+{
+	if(s_shared != NULL)
+		return s_shared;
+	s_shared = new WorkerPool(numThreads, pinThreads);
+	return s_shared;
+}
+
+/// <summary>
+/// Stops and destroys the shared pool. The caller must make sure that nothing
+/// else is using the pool. Must not be called from `DllMain()`.
+/// </summary>
+void WorkerPool::destroyShared()
+{
+	if(s_shared == NULL)
+		return;
+	WorkerPool *pool = s_shared;
+	s_shared = NULL;
+	delete pool;
+}
+
+/// <summary>
+/// Returns a sensible pool size for this system. Only half of the logical
+/// CPUs are used as a single copy thread can already use a large part of the
+/// memory bandwidth and we share the system with the applications that we
+/// are capturing.
+/// </summary>
+uint WorkerPool::getDefaultNumThreads()
+{
+	uint numThreads = boost::thread::hardware_concurrency() / 2;
+	if(numThreads < 1)
+		numThreads = 1;
+	if(numThreads > MAX_THREADS)
+		numThreads = MAX_THREADS;
+	return numThreads;
+}
+
+/// <summary>
+/// Creates a pool that processes tasks with up to `numThreads` threads
+/// including the submitting thread. If `pinThreads` is true then every worker
+/// is pinned to a different logical CPU so that it doesn't migrate between
+/// cores in the middle of a task. The first CPU depends on the process ID so
+/// that the pools of multiple processes are spread over the system.
+/// </summary>
+WorkerPool::WorkerPool(uint numThreads, bool pinThreads)
+	: m_workers()
+	, m_pinThreads(pinThreads)
+	, m_submitMutex(new boost::mutex())
+	, m_mutex(new boost::mutex())
+	, m_wakeCond(new boost::condition_variable())
+	, m_doneCond(new boost::condition_variable())
+	, m_exiting(false)
+	, m_taskGeneration(0)
+	, m_taskFinished(true)
+	, m_numActive(0)
+
+	// Current task
+	, m_func(NULL)
+	, m_opaque(NULL)
+	, m_numRows(0)
+	, m_stripeRows(0)
+	, m_numStripes(0)
+	, m_nextStripe(0)
+{
+	if(numThreads < 1)
+		numThreads = 1;
+	if(numThreads > MAX_THREADS)
+		numThreads = MAX_THREADS;
+	m_workers.reserve(numThreads - 1);
+	for(uint i = 0; i < numThreads - 1; i++) {
+		m_workers.push_back(
+			new boost::thread(&WorkerPool::workerMain, this, i));
+	}
+}
+
+WorkerPool::~WorkerPool()
+{
+	{
+		boost::mutex::scoped_lock lock(*m_mutex);
+		m_exiting = true;
+		m_wakeCond->notify_all();
+	}
+	for(uint i = 0; i < m_workers.size(); i++) {
+		m_workers.at(i)->join();
+		delete m_workers.at(i);
+	}
+	m_workers.clear();
+
+	delete m_doneCond;
+	delete m_wakeCond;
+	delete m_mutex;
+	delete m_submitMutex;
+}
+
+/// <summary>
+/// Calls `func` for every row in `[0, numRows)` split into stripes of at
+/// least `minStripeRows` rows and returns once every row has been processed.
+/// Tasks that are too small to be split are processed on the calling thread
+/// without waking any workers.
+/// </summary>
+void WorkerPool::runRows(
+	RowRangeFunc func, void *opaque, uint numRows, uint minStripeRows)
+{
+	if(func == NULL || numRows == 0)
+		return;
+	if(minStripeRows < 1)
+		minStripeRows = 1;
+
+	// Use a single stripe per thread. Each thread processes one large
+	// contiguous range which is friendlier to the hardware prefetcher than
+	// interleaving smaller ones.
+	uint numStripes = getNumThreads();
+	uint stripeRows = (numRows + numStripes - 1) / numStripes;
+	if(stripeRows < minStripeRows)
+		stripeRows = minStripeRows;
+	numStripes = (numRows + stripeRows - 1) / stripeRows;
+	if(numStripes <= 1 || m_workers.empty()) {
+		func(opaque, 0, numRows);
+		return;
+	}
+
+	// Don't wait for another submitter to finish, they are already using
+	// every worker
+	boost::mutex::scoped_try_lock submitLock(*m_submitMutex);
+	if(!submitLock.owns_lock()) {
+		func(opaque, 0, numRows);
+		return;
+	}
+
+	// Publish the task
+	{
+		boost::mutex::scoped_lock lock(*m_mutex);
+		m_func = func;
+		m_opaque = opaque;
+		m_numRows = numRows;
+		m_stripeRows = stripeRows;
+		m_numStripes = numStripes;
+		atomicStore32(&m_nextStripe, 0);
+		m_taskFinished = false;
+		m_taskGeneration++;
+		m_wakeCond->notify_all();
+	}
+
+	processStripes(func, opaque, numRows, stripeRows, numStripes);
+
+	// Every stripe has now been claimed. Workers that haven't woken up yet
+	// must not join the task and we have to wait for the ones that did to
+	// finish their stripes before the task can be reused.
+	boost::mutex::scoped_lock lock(*m_mutex);
+	m_taskFinished = true;
+	while(m_numActive > 0)
+		m_doneCond->wait(lock);
+}
+
+void WorkerPool::workerMain(uint index)
+{
+	if(m_pinThreads) {
+		uint numCpus = boost::thread::hardware_concurrency();
+		if(numCpus > 0)
+			pinCurrentThread((getProcessId() + index) % numCpus);
+	}
+
+	uint64_t lastGeneration = 0;
+	for(;;) {
+		RowRangeFunc func;
+		void *opaque;
+		uint numRows, stripeRows, numStripes;
+		{
+			boost::mutex::scoped_lock lock(*m_mutex);
+			while(!m_exiting && m_taskGeneration == lastGeneration)
+				m_wakeCond->wait(lock);
+			if(m_exiting)
+				break;
+			lastGeneration = m_taskGeneration;
+			if(m_taskFinished)
+				continue; // Woke up too late
+			m_numActive++;
+			func = m_func;
+			opaque = m_opaque;
+			numRows = m_numRows;
+			stripeRows = m_stripeRows;
+			numStripes = m_numStripes;
+		}
+
+		processStripes(func, opaque, numRows, stripeRows, numStripes);
+
+		boost::mutex::scoped_lock lock(*m_mutex);
+		m_numActive--;
+		if(m_numActive == 0)
+			m_doneCond->notify_all();
+	}
+}
+
+/// <summary>
+/// Claims and processes stripes of the current task until there are none
+/// left.
+/// </summary>
+void WorkerPool::processStripes(
+	RowRangeFunc func, void *opaque, uint numRows, uint stripeRows,
+	uint numStripes)
+{
+	for(;;) {
+		uint stripe = (uint)atomicFetchAdd32(&m_nextStripe, 1);
+		if(stripe >= numStripes)
+			break;
+		uint firstRow = stripe * stripeRows;
+		uint thisRows = stripeRows;
+		if(thisRows > numRows - firstRow)
+			thisRows = numRows - firstRow;
+		func(opaque, firstRow, thisRows);
+	}
+}
@@ -0,0 +1,117 @@
+//*****************************************************************************
+// Libdeskcap: A high-performance desktop capture library
+//
+// Copyright (C) 2014 Lucas Murray <lucas@polyflare.com>
+// All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation; either version 2 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//*****************************************************************************
+
+#ifndef COMMON_WORKERPOOL_H
+#define COMMON_WORKERPOOL_H
+
+#include "stlincludes.h"
+
+namespace boost {
+class condition_variable;
+class mutex;
+class thread;
+}
+
+/// <summary>
+/// Processes the rows `[firstRow, firstRow + numRows)` of a task. Called
+/// concurrently from multiple threads with disjoint row ranges.
+/// </summary>
+typedef void (*RowRangeFunc)(void *opaque, uint firstRow, uint numRows);
+
+//=============================================================================
+/// <summary>
+/// A small pool of worker threads that split row-based tasks such as image
+/// copies and pixel format conversions into horizontal stripes. The thread
+/// that submits a task also processes stripes so a pool of `numThreads`
+/// threads only creates `numThreads - 1` workers. Stripes are claimed
+/// dynamically so a worker that is descheduled doesn't stall the entire
+/// task.
+///
+/// Only one task runs at a time. If another thread is already using the pool
+/// then the task is processed entirely on the calling thread instead of
+/// waiting.
+///
+/// Each process has at most one shared pool that is created explicitly with
+/// `initializeShared()` as worker threads must never be created or destroyed
+/// while the loader lock is held.
+/// </summary>
+class WorkerPool
+{
+private: // Static members ----------------------------------------------------
+	static WorkerPool *		s_shared;
+
+public: // Constants ----------------------------------------------------------
+	static const uint	MAX_THREADS = 16;
+
+private: // Members -----------------------------------------------------------
+	vector<boost::thread *>		m_workers;
+	bool						m_pinThreads;
+	boost::mutex *				m_submitMutex; // Serializes submitters
+	boost::mutex *				m_mutex; // Protects everything below
+	boost::condition_variable *	m_wakeCond;
+	boost::condition_variable *	m_doneCond;
+	bool						m_exiting;
+	uint64_t					m_taskGeneration;
+	bool						m_taskFinished;
+	uint						m_numActive; // Workers inside the current task
+
+	// Current task
+	RowRangeFunc		m_func;
+	void *				m_opaque;
+	uint				m_numRows;
+	uint				m_stripeRows;
+	uint				m_numStripes;
+	volatile uint32_t	m_nextStripe;
+
+public: // Static methods -----------------------------------------------------
+	static WorkerPool *	initializeShared(uint numThreads, bool pinThreads);
+	static WorkerPool *	getShared();
+	static void			destroyShared();
+	static uint			getDefaultNumThreads();
+
+public: // Constructor/destructor ---------------------------------------------
+	WorkerPool(uint numThreads, bool pinThreads);
+	virtual ~WorkerPool();
+
+public: // Methods ------------------------------------------------------------
+	uint	getNumThreads() const;
+	void	runRows(
+		RowRangeFunc func, void *opaque, uint numRows, uint minStripeRows);
+
+private:
+	void	workerMain(uint index);
+	void	processStripes(
+		RowRangeFunc func, void *opaque, uint numRows, uint stripeRows,
+		uint numStripes);
+};
+//=============================================================================
+
+inline WorkerPool *WorkerPool::getShared()
+{
+	return s_shared;
+}
+
+/// <summary>
+/// Returns the number of threads that can process a task at the same time
+/// including the submitting thread.
+/// </summary>
+inline uint WorkerPool::getNumThreads() const
+{
+	return (uint)m_workers.size() + 1;
+}
+
+#endif // COMMON_WORKERPOOL_H
@@ -19,8 +19,11 @@
 #include "hookmain.h"
 #include "../Common/interprocesslog.h"
 #include "../Common/mainsharedsegment.h"
+#include "../Common/managedsharedmemory.h"
 #include "../Common/stlhelpers.h"
 #include "../Common/imghelpers.h"
+#include "../Common/imgscale.h"
+#include "../Common/framecodec.h"
 
 CommonHook::CommonHook(HDC hdc)
 	: m_hdc(hdc)
@@ -36,8 +39,21 @@ CommonHook::CommonHook(HDC hdc)
 	, m_isCapturing(false)
 	, m_isAdvertised(false)
 	, m_capShm(NULL)
-	, m_captureUsecOrigin(0)
-	, m_prevCaptureFrameNum(0)
+	, m_pacer()
+	, m_damageLost(false)
+	, m_readerJoins(0)
+	, m_isRepeating(false)
+	, m_badFrameLogged(false)
+	, m_roi()
+	, m_outWidth(0)
+	, m_outHeight(0)
+	, m_compressFrames(false)
+	, m_frameWidth(0)
+	, m_frameHeight(0)
+	, m_dedup()
+	, m_tileMap()
+	, m_dedupBytesCopied(0)
+	, m_dedupBytesSaved(0)
 {
 }
 
@@ -91,9 +107,9 @@ void CommonHook::initialize()
 			}
 		}
 		if(m_fillsWindow == true) {
-			HookLog(stringf(
+			HookLogf(
 				"Fuzzy context window capture triggered on %d x %d context in %d x %d window",
-				m_width, m_height, winWidth, winHeight));
+				m_width, m_height, winWidth, winHeight);
 		}
 	}
 
@@ -102,9 +118,9 @@ void CommonHook::initialize()
 	advertiseWindow();
 
 	// Debugging
-	//HookLog(stringf(
+	//HookLogf(
 	//	"Back buffer size: %d x %d; Fills window: %d; Capturable: %d",
-	//	m_width, m_height, m_fillsWindow ? 1 : 0, isCapturable() ? 1 : 0));
+	//	m_width, m_height, m_fillsWindow ? 1 : 0, isCapturable() ? 1 : 0);
 }
 
 /// <summary>
@@ -159,7 +175,7 @@ void CommonHook::processBufferSwap()
 		m_height = height;
 		if(prevIsCapturable == isCapturable()) {
 			if(m_isCapturing)
-				resetCapturing();
+				resizeCapturing();
 		} else {
 			if(isCapturable()) {
 				// Window is now capturable
@@ -173,13 +189,16 @@ void CommonHook::processBufferSwap()
 		}
 	}
 
-	// Test if the main application wants this window captured or not
+	// Test if the main application wants this window captured or not. This
+	// is done every frame so we read the registry without locking it.
 	MainSharedSegment *shm = HookMain::s_instance->getShm();
-	shm->lockHookRegistry();
-	HookRegEntry *entry = shm->findWindowInHookRegistry((uint32_t)m_topHwnd);
-	if(entry != NULL) {
-		bool reqCapture = (entry->flags & HookRegEntry::CaptureFlag);
-		shm->unlockHookRegistry();
+	HookRegEntry entry;
+	if(shm->readHookRegistry((uint32_t)m_topHwnd, &entry)) {
+		updateRoi(entry);
+		updateOutputSize(entry);
+		updateFramePeriod(entry);
+		updateCompression(entry);
+		bool reqCapture = (entry.flags & HookRegEntry::CaptureFlag);
 		if(reqCapture != m_isCapturing) {
 			if(reqCapture) {
 				// Application requested that we start capturing
@@ -189,8 +208,7 @@ void CommonHook::processBufferSwap()
 				endCapturing();
 			}
 		}
-	} else
-		shm->unlockHookRegistry();
+	}
 
 	// Do nothing if we're not capturing this context
 	if(!m_isCapturing)
@@ -198,39 +216,24 @@ void CommonHook::processBufferSwap()
 
 	//-------------------------------------------------------------------------
 	// Capture the buffer making sure that we only capture one frame per video
-	// frame period. We need to take into account jitter and we must capture at
-	// EXACTLY the same frequency as the main application so all frame times
-	// should be relative to an origin. We still need to call
-	// `captureBackBuffer()` though as we want to read back any previous frames
-	// as quickly as possible
-
-	uint64_t now = HookMain::s_instance->getUsecSinceExec();
-
-	// HACK: As there is jitter between each call to this method there is a
-	// chance that our origin will be inside of this jitter region and will
-	// result in us missing some frames that appear to be "too early" for us to
-	// capture. Attempt to reduce the chance of this by moving the origin
-	// slightly away from the timestamp of the first captured frame. As our
-	// maximum supported framerate is 60fps (16.7 msec period) we move the
-	// origin 5 msec ahead as that's approximately 1/3 of the period.
-	const int JITTER_PREVENTION_USEC = 5000; // 5 msec
-	if(m_prevCaptureFrameNum == 0 && m_captureUsecOrigin == 0)
-		m_captureUsecOrigin = now - JITTER_PREVENTION_USEC;
-
-	// Determine the number of the current frame is relative to our origin
-	uint64_t usec = now - m_captureUsecOrigin;
+	// frame tick of the main application, or fewer if every consumer wants a
+	// lower frame rate. The pacer follows the ticks that the main application
+	// publishes so that each tick receives the freshest swap that can be read
+	// back in time. Swaps that we don't capture are never read back from the
+	// GPU. We still need to call
+	// `captureBackBuffer()` though as we want to read back any previous
+	// frames as quickly as possible
+
+	uint64_t now = HookMain::s_instance->getCaptureUsec();
 	uint64_t freqNum = (uint64_t)shm->getVideoFrequencyNum();
 	uint64_t freqDenom = (uint64_t)shm->getVideoFrequencyDenom();
-	uint64_t frameNum = usec * freqNum / freqDenom / 1000000ULL;
-	if(frameNum > m_prevCaptureFrameNum) {
-		// This is a frame that we should capture
-		captureBackBuffer(true, now);
-		m_prevCaptureFrameNum = frameNum;
-	} else {
-		// The game is rendering frames faster than our video framerate, skip
-		// this frame as it's not required
-		captureBackBuffer(false, now);
-	}
+	if(freqNum > 0)
+		m_pacer.setNominalPeriod(freqDenom * 1000000000ULL / freqNum);
+	ConsumerTickState ticks;
+	bool hasTicks = shm->readConsumerTicks(&ticks);
+	bool capture = m_pacer.shouldCapture(
+		getMonotonicUsec(), hasTicks ? &ticks : NULL);
+	captureBackBuffer(capture, now);
 }
 
 /// <summary>
@@ -258,7 +261,7 @@ void CommonHook::processResetAfter()
 	m_height = height;
 	if(prevIsCapturable == isCapturable()) {
 		if(m_isCapturing)
-			resetCapturing();
+			resizeCapturing();
 	} else {
 		if(isCapturable()) {
 			// Window is now capturable
@@ -282,29 +285,42 @@ void CommonHook::processDeleteContext()
 	endCapturing();
 }
 
+/// <summary>
+/// Copies a tightly packed frame into the next free frame of our shared
+/// memory segment. If the caller knows which parts of the frame changed since
+/// the previous call then it can pass them in `dirtyRects`, otherwise the
+/// entire frame is marked as changed.
+/// </summary>
 void CommonHook::writeRawPixelsToShm(
-	uint frameNum, uint64_t timestamp, void *srcData, size_t srcSize)
+	uint64_t timestamp, void *srcData, size_t srcSize,
+	const CaptureSharedSegment::DirtyRect *dirtyRects, uint numDirtyRects)
 {
 	// Sanity check inputs
 #ifdef _DEBUG
 	assert(srcSize == m_width * m_height * m_bbBpp);
 #endif
-	size_t size = min(srcSize, m_width * m_height * m_bbBpp);
+	uint srcStride = m_width * m_bbBpp;
+	if(srcSize < (size_t)srcStride * m_height)
+		return;
 
-	m_capShm->lock();
-	if(!m_capShm->isFrameUsed(frameNum)) {
-		m_capShm->setFrameTimestamp(frameNum, timestamp);
-		void *dstData = m_capShm->getFrameDataPtr(frameNum);
-		memcpy(dstData, srcData, size);
-		m_capShm->setFrameUsed(frameNum, true);
-	}
-	m_capShm->unlock();
+	writeRawPixelsToShmWithStride(timestamp, srcData, srcStride, srcStride,
+		m_height, dirtyRects, numDirtyRects);
 }
 
+/// <summary>
+/// Same as `writeRawPixelsToShm()` except that the source rows can be padded.
+/// Only the region of interest of the main application is copied and it is
+/// downscaled if the main application requested a smaller output size.
+/// `dirtyRects` are in back buffer coordinates and are only used when
+/// downscaling as otherwise the damage is found by comparing tiles.
+/// </summary>
 void CommonHook::writeRawPixelsToShmWithStride(
-	uint frameNum, uint64_t timestamp, void *srcData, uint srcStride,
-	int widthBytes, int heightRows)
+	uint64_t timestamp, void *srcData, uint srcStride, int widthBytes,
+	int heightRows,
+	const CaptureSharedSegment::DirtyRect *dirtyRects, uint numDirtyRects)
 {
+	typedef CaptureSharedSegment::DirtyRect DirtyRect;
+
 	// Sanity check inputs
 #ifdef _DEBUG
 	assert(widthBytes == m_width * m_bbBpp);
@@ -312,55 +328,504 @@ void CommonHook::writeRawPixelsToShmWithStride(
 #endif
 	widthBytes = min(widthBytes, (int)(m_width * m_bbBpp));
 	heightRows = min(heightRows, (int)(m_height));
+	if(isDownscaling() && (widthBytes < (int)(m_width * m_bbBpp) ||
+		heightRows < (int)m_height))
+	{
+		return; // Scaling always requires the entire back buffer
+	}
 
-	m_capShm->lock();
-	if(!m_capShm->isFrameUsed(frameNum)) {
-		m_capShm->setFrameTimestamp(frameNum, timestamp);
-		void *dstData = m_capShm->getFrameDataPtr(frameNum);
-		imgDataCopy(dstData, srcData, m_width * m_bbBpp, srcStride, widthBytes,
-			heightRows);
-		m_capShm->setFrameUsed(frameNum, true);
+	CaptureSharedSegment::DirtyRect rect = getCaptureRect();
+	if(isDownscaling()) {
+		int frameNum = m_capShm->beginWriteFrame();
+		if(frameNum < 0) {
+			if(dirtyRects != NULL)
+				m_damageLost = true;
+			return;
+		}
+		uchar *dstData = (uchar *)m_capShm->getFrameDataPtr(frameNum);
+		uint dstStride = m_frameWidth * m_bbBpp;
+		DirtyRect srcRect = getSourceRect(rect);
+		dstData += rect.y * dstStride + rect.x * m_bbBpp;
+		uchar *src =
+			(uchar *)srcData + srcRect.y * srcStride + srcRect.x * m_bbBpp;
+		imgScale(dstData, src, dstStride, srcStride, m_width, m_height,
+			m_frameWidth, m_frameHeight, rect, srcRect);
+
+		// Damage is in back buffer coordinates
+		DirtyRect scaled[CaptureSharedSegment::MAX_DIRTY_RECTS];
+		if(dirtyRects != NULL &&
+			numDirtyRects <= CaptureSharedSegment::MAX_DIRTY_RECTS)
+		{
+			for(uint i = 0; i < numDirtyRects; i++) {
+				scaled[i] = imgScaleDstRect(m_width, m_height, m_frameWidth,
+					m_frameHeight, dirtyRects[i]);
+			}
+			dirtyRects = scaled;
+		}
+		m_dedup.invalidateSlot(frameNum);
+		publishRawFrame(
+			frameNum, timestamp, dstStride, dirtyRects, numDirtyRects, rect);
+		return;
 	}
-	m_capShm->unlock();
+
+	// Only copy the region of interest
+	rect.width = min(rect.width, (uint)widthBytes / m_bbBpp - rect.x);
+	rect.height = min(rect.height, (uint)heightRows - rect.y);
+	uchar *srcRect = (uchar *)srcData + rect.y * srcStride + rect.x * m_bbBpp;
+	copyAndPublishRawFrame(timestamp, srcRect, srcStride, rect);
 }
 
-void CommonHook::writeSharedTexToShm(uint frameNum, uint64_t timestamp)
+/// <summary>
+/// Copies a rectangle of pixels into the next free frame of our shared memory
+/// segment. `rect` is in frame data coordinates and is usually the one that
+/// was returned by `getCaptureRect()` when the pixels were read back. If we
+/// are downscaling then `srcData` contains the back buffer pixels of
+/// `getSourceRect(rect)` instead. The rest of the frame is not modified.
+/// </summary>
+void CommonHook::writeRawPixelsRectToShm(
+	uint64_t timestamp, void *srcData, uint srcStride,
+	const CaptureSharedSegment::DirtyRect &rect)
 {
-	m_capShm->lock();
-	if(!m_capShm->isFrameUsed(frameNum)) {
-		m_capShm->setFrameTimestamp(frameNum, timestamp);
-		m_capShm->setFrameUsed(frameNum, true);
+	// The window may have been resized since the pixels were read back
+	if(rect.x >= m_frameWidth || rect.y >= m_frameHeight)
+		return;
+	CaptureSharedSegment::DirtyRect clipped = rect;
+	clipped.width = min(clipped.width, m_frameWidth - rect.x);
+	clipped.height = min(clipped.height, m_frameHeight - rect.y);
+	if(isDownscaling() && (clipped.width != rect.width ||
+		clipped.height != rect.height))
+	{
+		return; // Source rectangle no longer matches
 	}
-	m_capShm->unlock();
+
+	if(!isDownscaling()) {
+		copyAndPublishRawFrame(timestamp, srcData, srcStride, clipped);
+		return;
+	}
+
+	// Frames always contain the entire region of interest so there is no
+	// damage to track if we drop this one
+	int frameNum = m_capShm->beginWriteFrame();
+	if(frameNum < 0)
+		return;
+	uint dstStride = m_frameWidth * m_bbBpp;
+	uchar *dstData = (uchar *)m_capShm->getFrameDataPtr(frameNum);
+	dstData += clipped.y * dstStride + clipped.x * m_bbBpp;
+	imgScale(dstData, srcData, dstStride, srcStride, m_width, m_height,
+		m_frameWidth, m_frameHeight, clipped, getSourceRect(clipped));
+	m_dedup.invalidateSlot(frameNum);
+	publishRawFrame(frameNum, timestamp, dstStride, NULL, 0, clipped);
 }
 
 /// <summary>
-/// Finds the first frame in our shared memory segment that is free.
+/// Copies `rect` of an unscaled frame into the next free frame of our shared
+/// segment and publishes it. `srcData` points to the top-left pixel of
+/// `rect`. Only the tiles that the frame slot doesn't already contain are
+/// copied and the consumers are told exactly which tiles differ from the
+/// previous frame.
+///
+/// A frame that is identical to the previous one isn't published at all as
+/// the consumers keep the newest frame until they receive another one. While
+/// the content stays static we only hash each frame without claiming a slot
+/// for it. If the deduplicator is bypassing content that changes every frame
+/// then the frame is copied directly at the native pitch of the source
+/// instead. If every consumer accepts compressed frames then entire frames
+/// are compressed instead of being deduplicated.
 /// </summary>
-/// <returns>-1 if all frames are used</returns>
-int CommonHook::findUnusedFrameNum() const
+void CommonHook::copyAndPublishRawFrame(
+	uint64_t timestamp, const void *srcData, uint srcStride,
+	const CaptureSharedSegment::DirtyRect &rect)
+{
+	typedef CaptureSharedSegment::DirtyRect DirtyRect;
+
+	// Full frames that are still owed to the consumers are always published,
+	// see `publishRawFrame()`
+	bool mustPublish = m_damageLost ||
+		m_capShm->getNumReaderJoins() != m_readerJoins;
+	uint64_t rectBytes = (uint64_t)rect.width * m_bbBpp * rect.height;
+	if(m_isRepeating && !mustPublish && !m_dedup.isBypassing() &&
+		m_dedup.isUnchanged(srcData, srcStride, rect))
+	{
+		m_capShm->addCopyStats(0, rectBytes);
+		m_dedupBytesSaved += rectBytes;
+		addCaptureLatency(timestamp);
+		return;
+	}
+	m_isRepeating = false;
+
+	// Frames always contain the entire region of interest so there is no
+	// damage to track if we drop this one
+	int frameNum = m_capShm->beginWriteFrame();
+	if(frameNum < 0)
+		return;
+	if(compressAndPublishRawFrame(
+		frameNum, timestamp, srcData, srcStride, rect))
+	{
+		return;
+	}
+	mustPublish = mustPublish || m_damageLost;
+	uchar *dstData = (uchar *)m_capShm->getFrameDataPtr(frameNum);
+
+	if(m_dedup.isBypassing()) {
+		// Keep the source's native pitch if the frame has room for it as it
+		// allows the entire frame to be copied in a single operation
+		uint dstStride = m_frameWidth * m_bbBpp;
+		if(srcStride >= dstStride &&
+			srcStride <= m_capShm->getMaxFrameStride())
+		{
+			dstStride = srcStride;
+		}
+		imgDataCopy(dstData + rect.y * dstStride + rect.x * m_bbBpp,
+			(void *)srcData, dstStride, srcStride, rect.width * m_bbBpp,
+			rect.height);
+		m_dedup.bypassFrame(frameNum);
+		m_capShm->addCopyStats(rectBytes, 0);
+		m_dedupBytesCopied += rectBytes;
+		publishRawFrame(frameNum, timestamp, dstStride, NULL, 0, rect);
+		return;
+	}
+
+	uint dstStride = m_frameWidth * m_bbBpp;
+	uint numChanged = m_dedup.copyFrame(
+		frameNum, dstData, srcData, dstStride, srcStride, rect);
+	m_capShm->addCopyStats(
+		m_dedup.getBytesCopied(), m_dedup.getBytesSaved());
+	m_dedupBytesCopied += m_dedup.getBytesCopied();
+	m_dedupBytesSaved += m_dedup.getBytesSaved();
+	if(numChanged == 0 && !mustPublish) {
+		// The slot still contains what the deduplicator thinks it does so
+		// it can be returned unused
+		m_capShm->abortWriteFrame(frameNum);
+		addCaptureLatency(timestamp);
+		m_isRepeating = true;
+		return;
+	}
+
+	// Tiles that changed while frames were being dropped are still reported
+	// as they are compared to the last published frame but the region of
+	// interest or frame size may have changed as well
+	if(m_damageLost) {
+		publishRawFrame(frameNum, timestamp, dstStride, NULL, 0, rect);
+		return;
+	}
+	uint tileMapSize = m_capShm->getTileMapSize();
+	if(tileMapSize > 0) {
+		m_tileMap.resize(tileMapSize);
+		m_dedup.writeTileMap(
+			&m_tileMap[0], tileMapSize, m_capShm->getTilesPerRow());
+		m_capShm->setFrameChangedTiles(frameNum, &m_tileMap[0]);
+	}
+	DirtyRect rects[CaptureSharedSegment::MAX_DIRTY_RECTS];
+	uint numRects = m_dedup.calcDirtyRects(
+		rects, CaptureSharedSegment::MAX_DIRTY_RECTS);
+	publishRawFrame(frameNum, timestamp, dstStride, rects, numRects, rect);
+}
+
+/// <summary>
+/// Losslessly compresses an entire unscaled BGRA frame into the frame slot
+/// `frameNum` and publishes it if every consumer accepts compressed frames.
+/// The deduplicator no longer knows what the slot contains and as the
+/// consumers decode compressed frames in full there is no damage to report.
+/// </summary>
+/// <returns>False if the frame must be written uncompressed instead</returns>
+bool CommonHook::compressAndPublishRawFrame(
+	uint frameNum, uint64_t timestamp, const void *srcData, uint srcStride,
+	const CaptureSharedSegment::DirtyRect &rect)
+{
+	if(!m_compressFrames || getBackBufferPixelFormat() != BGRAPixelFormat)
+		return false;
+	if(rect.x != 0 || rect.y != 0 || rect.width != m_frameWidth ||
+		rect.height != m_frameHeight)
+	{
+		return false; // Compressed frames always contain the entire frame
+	}
+	m_dedup.invalidateSlot(frameNum);
+	uint64_t size = encodeFrame(m_capShm->getFrameDataPtr(frameNum),
+		m_capShm->getFrameDataSize(), srcData, srcStride, rect.width,
+		rect.height);
+	if(size == 0) {
+		// Didn't fit. If we published compressed frames before this one
+		// then the deduplicator's previous frame is also out of date.
+		m_damageLost = true;
+		return false;
+	}
+	m_capShm->setFrameCompressed(frameNum, (uint)size);
+	uint64_t rectBytes = (uint64_t)rect.width * m_bbBpp * rect.height;
+	m_capShm->addCopyStats(size, rectBytes - min(size, rectBytes));
+	publishRawFrame(frameNum, timestamp, rect.width * m_bbBpp, NULL, 0, rect);
+	return true;
+}
+
+/// <summary>
+/// Queues a raw pixel frame for the main application. As the consumer only
+/// copies what changed since the previous published frame the damage of any
+/// frame that we dropped is unknown and we must send a full frame instead.
+/// The same applies to consumers that have just become readers of the
+/// segment. `rect` is the area of the frame that was written, any damage
+/// outside of it is discarded as the main application doesn't need it.
+/// </summary>
+void CommonHook::publishRawFrame(
+	uint frameNum, uint64_t timestamp, uint stride,
+	const CaptureSharedSegment::DirtyRect *dirtyRects, uint numDirtyRects,
+	const CaptureSharedSegment::DirtyRect &rect)
+{
+	typedef CaptureSharedSegment::DirtyRect DirtyRect;
+
+	addCaptureLatency(timestamp);
+	uint32_t readerJoins = m_capShm->getNumReaderJoins();
+	if(m_damageLost || readerJoins != m_readerJoins) {
+		dirtyRects = NULL;
+		m_damageLost = false;
+		m_readerJoins = readerJoins;
+	}
+	if(isDownscaling())
+		m_capShm->setFrameSourceSize(frameNum, m_width, m_height);
+	bool published;
+	if(rect.x == 0 && rect.y == 0 &&
+		rect.width == m_frameWidth && rect.height == m_frameHeight)
+	{
+		// Entire frame was written
+		published = m_capShm->publishFrame(frameNum, timestamp,
+			m_frameWidth, m_frameHeight, stride, dirtyRects, numDirtyRects);
+	} else {
+		// Clip the damage to the area that was written
+		DirtyRect clipped[CaptureSharedSegment::MAX_DIRTY_RECTS];
+		uint numClipped = 0;
+		if(dirtyRects == NULL ||
+			numDirtyRects > CaptureSharedSegment::MAX_DIRTY_RECTS)
+		{
+			clipped[0] = rect;
+			numClipped = 1;
+		} else {
+			for(uint i = 0; i < numDirtyRects; i++) {
+				const DirtyRect &dirty = dirtyRects[i];
+				uint left = max(dirty.x, rect.x);
+				uint top = max(dirty.y, rect.y);
+				uint right =
+					min(dirty.x + dirty.width, rect.x + rect.width);
+				uint bottom =
+					min(dirty.y + dirty.height, rect.y + rect.height);
+				if(left >= right || top >= bottom)
+					continue;
+				clipped[numClipped++] =
+					DirtyRect(left, top, right - left, bottom - top);
+			}
+		}
+		published = m_capShm->publishFrame(frameNum, timestamp,
+			m_frameWidth, m_frameHeight, stride, clipped, numClipped);
+	}
+	if(published)
+		return;
+
+	// The segment returned the frame unpublished so the main application
+	// never saw its damage
+	m_damageLost = true;
+	if(!m_badFrameLogged) {
+		HookLogf("Dropping %u x %u frames with a row stride of %u bytes "
+			"that don't fit the shared segment",
+			m_frameWidth, m_frameHeight, stride);
+		m_badFrameLogged = true;
+	}
+}
+
+/// <summary>
+/// Returns the part of the frame that the main application needs in frame
+/// data coordinates. This is the entire frame unless every consumer
+/// specified a region of interest. If we are downscaling then the frame is
+/// smaller than the back buffer, use `getSourceRect()` to find the part of
+/// the back buffer that must be read.
+/// </summary>
+CaptureSharedSegment::DirtyRect CommonHook::getCaptureRect()
+{
+	CaptureSharedSegment::DirtyRect rect(0, 0, m_frameWidth, m_frameHeight);
+	if(m_roi.width == 0 || m_roi.height == 0)
+		return rect;
+	if(m_roi.x >= m_width || m_roi.y >= m_height)
+		return rect; // Outside of the window, should never happen
+	CaptureSharedSegment::DirtyRect roi = m_roi;
+	roi.width = min(m_roi.width, m_width - m_roi.x);
+	roi.height = min(m_roi.height, m_height - m_roi.y);
+
+	// The region is top-down but the frame data may not be
+	if(isBackBufferFlipped())
+		roi.y = m_height - roi.y - roi.height;
+
+	if(!isDownscaling())
+		return roi;
+	return imgScaleDstRect(
+		m_width, m_height, m_frameWidth, m_frameHeight, roi);
+}
+
+/// <summary>
+/// Returns the part of the back buffer that must be read in order to write
+/// `frameRect` of the frame data.
+/// </summary>
+CaptureSharedSegment::DirtyRect CommonHook::getSourceRect(
+	const CaptureSharedSegment::DirtyRect &frameRect)
+{
+	if(!isDownscaling())
+		return frameRect;
+	return imgScaleSrcRect(
+		m_width, m_height, m_frameWidth, m_frameHeight, frameRect);
+}
+
+/// <summary>
+/// Updates the region of interest from our hook registry entry. Areas that
+/// are added to the region have never been sent to the main application so
+/// the next frame must contain the entire region.
+/// </summary>
+void CommonHook::updateRoi(const HookRegEntry &entry)
+{
+	CaptureSharedSegment::DirtyRect roi;
+	if(entry.hasRoi()) {
+		roi = CaptureSharedSegment::DirtyRect(
+			entry.roiX, entry.roiY, entry.roiWidth, entry.roiHeight);
+	}
+	if(roi.x == m_roi.x && roi.y == m_roi.y &&
+		roi.width == m_roi.width && roi.height == m_roi.height)
+	{
+		return; // No change
+	}
+	m_roi = roi;
+	m_damageLost = true;
+}
+
+/// <summary>
+/// Updates the requested output size from our hook registry entry. Frames of
+/// a different size require new scene objects and possibly a new shared
+/// segment.
+/// </summary>
+void CommonHook::updateOutputSize(const HookRegEntry &entry)
+{
+	uint outWidth = 0, outHeight = 0;
+	if(entry.hasOutputSize()) {
+		outWidth = entry.outWidth;
+		outHeight = entry.outHeight;
+	}
+	if(outWidth == m_outWidth && outHeight == m_outHeight)
+		return; // No change
+	m_outWidth = outWidth;
+	m_outHeight = outHeight;
+	if(!m_isCapturing)
+		return;
+	uint frameWidth, frameHeight;
+	calcFrameSize(&frameWidth, &frameHeight);
+	if(frameWidth != m_frameWidth || frameHeight != m_frameHeight)
+		resizeCapturing();
+}
+
+/// <summary>
+/// Updates the frame period that our consumers want from our hook registry
+/// entry. Changing it only affects which swaps the pacer selects.
+/// </summary>
+void CommonHook::updateFramePeriod(const HookRegEntry &entry)
+{
+	m_pacer.setTargetPeriod((uint64_t)entry.framePeriodUsec * 1000ULL);
+}
+
+/// <summary>
+/// Updates if every consumer accepts compressed frames from our hook
+/// registry entry. The deduplicator doesn't track compressed frames so the
+/// first uncompressed frame after them must be a full frame.
+/// </summary>
+void CommonHook::updateCompression(const HookRegEntry &entry)
+{
+	bool compress = (entry.compressFrames != 0);
+	if(compress == m_compressFrames)
+		return; // No change
+	m_compressFrames = compress;
+	if(!compress)
+		m_damageLost = true;
+}
+
+/// <summary>
+/// Calculates the size of the frames that we write to our shared segment.
+/// The back buffer is downscaled to fit within the requested output size
+/// while keeping its aspect ratio. We never upscale and only raw pixel
+/// formats with 8-bit channels can be scaled.
+/// </summary>
+void CommonHook::calcFrameSize(uint *width, uint *height)
 {
-	// There is no need to lock the registry as we're the only process to ever
-	// create new frames
-#define IGNORE_UNUSED_TIMESTAMPS 0
-#if IGNORE_UNUSED_TIMESTAMPS
-	for(uint i = 0; i < m_capShm->getNumFrames(); i++) {
-		if(!m_capShm->isFrameUsed(i))
-			return i;
+	*width = m_width;
+	*height = m_height;
+	if(m_outWidth == 0 || m_outHeight == 0)
+		return; // No output size requested
+	if(m_outWidth >= m_width && m_outHeight >= m_height)
+		return; // Already small enough
+	if(getCaptureType() != RawPixelsShmType ||
+		!canScalePixelFormat(getBackBufferPixelFormat()))
+	{
+		return;
 	}
-	return -1;
-#else
-	// HACK: In order to reduce the chance of stuttering we use the first
-	// unused frame that has the lowest previous timestamp.
-	return m_capShm->findEarliestFrame(false);
-#endif // IGNORE_UNUSED_TIMESTAMPS
+
+	// Whichever dimension is the most constrained decides the scale factor
+	uint64_t w = m_width, h = m_height;
+	if((uint64_t)m_outWidth * h <= (uint64_t)m_outHeight * w) {
+		*width = m_outWidth;
+		*height = (uint)((h * m_outWidth + w / 2) / w);
+	} else {
+		*width = (uint)((w * m_outHeight + h / 2) / h);
+		*height = m_outHeight;
+	}
+	*width = max(*width, 1U);
+	*height = max(*height, 1U);
 }
 
-bool CommonHook::isFrameNumUsed(uint frameNum) const
+/// <summary>
+/// Recalculates the frame size. Must only be called when our scene objects
+/// and shared segment are about to be recreated.
+/// </summary>
+void CommonHook::updateFrameSize()
 {
-	// There is no need to lock the registry as we're the only process to ever
-	// create new frames
-	return m_capShm->isFrameUsed(frameNum);
+	uint prevWidth = m_frameWidth;
+	uint prevHeight = m_frameHeight;
+	calcFrameSize(&m_frameWidth, &m_frameHeight);
+	if(m_frameWidth == prevWidth && m_frameHeight == prevHeight)
+		return;
+	if(isDownscaling()) {
+		bool isBox = isImgScaleBox(
+			m_width, m_height, m_frameWidth, m_frameHeight);
+		HookLogf("Downscaling %u x %u frames to %u x %u with a %s filter",
+			m_width, m_height, m_frameWidth, m_frameHeight,
+			isBox ? "box" : "bilinear");
+	}
+}
+
+/// <summary>
+/// Queues a shared texture frame that was previously reserved with
+/// `reserveFrameNum()` for the main application.
+/// </summary>
+void CommonHook::writeSharedTexToShm(uint frameNum, uint64_t timestamp)
+{
+	addCaptureLatency(timestamp);
+	m_capShm->publishFrame(frameNum, timestamp, m_width, m_height);
+}
+
+/// <summary>
+/// Lets the pacer know how long it took to read back the swap at `timestamp`
+/// so that it captures early enough for the main application.
+/// </summary>
+void CommonHook::addCaptureLatency(uint64_t timestamp)
+{
+	uint64_t now = HookMain::s_instance->getCaptureUsec();
+	if(now >= timestamp)
+		m_pacer.addCaptureLatency(now - timestamp);
+}
+
+/// <summary>
+/// Reserves the next frame in our shared memory segment so that its shared
+/// texture can be written to. The frame must be queued with
+/// `writeSharedTexToShm()` or returned with `unreserveFrameNum()`.
+/// </summary>
+/// <returns>-1 if all frames are used</returns>
+int CommonHook::reserveFrameNum()
+{
+	return m_capShm->beginWriteFrame();
+}
+
+void CommonHook::unreserveFrameNum(uint frameNum)
+{
+	m_capShm->abortWriteFrame(frameNum);
 }
 
 /// <summary>
@@ -382,8 +847,13 @@ void CommonHook::advertiseWindow()
 	entry.shmSize = 0;
 	entry.flags = 0;
 	shm->lockHookRegistry();
-	shm->addHookRegistry(entry);
+	bool added = shm->addHookRegistry(entry);
 	shm->unlockHookRegistry();
+	if(!added) {
+		HookLog2(InterprocessLog::Warning,
+			"Hook registry is full, window cannot be captured");
+		return;
+	}
 
 	m_isAdvertised = true;
 }
@@ -411,6 +881,10 @@ void CommonHook::deadvertiseWindow()
 /// <returns>True if the object is valid</returns>
 bool CommonHook::createCaptureSharedSegment()
 {
+	// Creating large segments used to cause tens of thousands of page faults
+	// so keep track of how many we take
+	uint64_t faultsBefore = ManagedSharedMemory::getPageFaultCount();
+
 	do {
 		if(m_capShm != NULL) {
 			// We had a collision last iteration
@@ -419,12 +893,16 @@ bool CommonHook::createCaptureSharedSegment()
 		}
 
 		if(getCaptureType() == RawPixelsShmType) {
+			// Leave room for the window to grow so that we don't need to
+			// recreate the segment every time that the user resizes it
+			uint maxWidth, maxHeight;
+			calcSegmentCapacity(&maxWidth, &maxHeight);
 			CaptureSharedSegment::RawPixelsExtraData extra;
 			extra.bpp = m_bbBpp;
 			extra.format = getBackBufferPixelFormat();
 			extra.isFlipped = isBackBufferFlipped() ? 1 : 0;
 			m_capShm = new CaptureSharedSegment(
-				rand(), m_width, m_height, MAX_BUFFERED_FRAMES, extra);
+				rand(), maxWidth, maxHeight, MAX_BUFFERED_FRAMES, extra);
 		} else { // Shared DX10 textures
 			uint numFrames = 0;
 			HANDLE *handles = getSharedTexHandles(&numFrames);
@@ -435,11 +913,10 @@ bool CommonHook::createCaptureSharedSegment()
 				rand(), m_width, m_height, numFrames, extra);
 
 			if(m_capShm->isValid()) {
-				// Write handles to shared memory and zero timestamps
+				// Write handles to shared memory
 				for(uint i = 0; i < numFrames; i++) {
 					HANDLE *data = (HANDLE *)m_capShm->getFrameDataPtr(i);
 					*data = handles[i];
-					m_capShm->setFrameTimestamp(i, 0);
 				}
 			}
 		}
@@ -451,9 +928,87 @@ bool CommonHook::createCaptureSharedSegment()
 		m_capShm = NULL;
 		return false;
 	}
+
+	uint64_t faultsAfter = ManagedSharedMemory::getPageFaultCount();
+	HookLogf(
+		"Created %llu byte capture segment with %u page faults",
+		m_capShm->getSegmentSize(), (uint)(faultsAfter - faultsBefore));
+
+	// We know nothing about the contents of the new frame slots
+	if(getCaptureType() == RawPixelsShmType) {
+		m_dedup.reset(m_frameWidth, m_frameHeight, m_bbBpp,
+			m_capShm->getNumFrames());
+	}
+
 	return true;
 }
 
+/// <summary>
+/// Calculates the capacity of a new raw pixel segment for the current frame
+/// size. The headroom is limited to the size of the virtual desktop
+/// as windows are rarely resized larger than that.
+/// </summary>
+void CommonHook::calcSegmentCapacity(uint *maxWidth, uint *maxHeight) const
+{
+	*maxWidth = CaptureSharedSegment::calcCapacity(m_frameWidth);
+	*maxHeight = CaptureSharedSegment::calcCapacity(m_frameHeight);
+	uint deskWidth = (uint)max(GetSystemMetrics(SM_CXVIRTUALSCREEN), 0);
+	uint deskHeight = (uint)max(GetSystemMetrics(SM_CYVIRTUALSCREEN), 0);
+	if(*maxWidth > deskWidth)
+		*maxWidth = max(m_frameWidth, deskWidth);
+	if(*maxHeight > deskHeight)
+		*maxHeight = max(m_frameHeight, deskHeight);
+}
+
+/// <summary>
+/// Returns true if our existing `CaptureSharedSegment` object can hold frames
+/// of the current frame size and back buffer format.
+/// </summary>
+bool CommonHook::canReuseCaptureSharedSegment()
+{
+	if(m_capShm == NULL || !m_capShm->isValid())
+		return false;
+
+	// Shared textures always have the exact size of the back buffer so they
+	// must be recreated whenever it changes
+	if(getCaptureType() != RawPixelsShmType ||
+		m_capShm->getCaptureType() != RawPixelsShmType)
+	{
+		return false;
+	}
+
+	// The pixel format can change after a reset
+	CaptureSharedSegment::RawPixelsExtraData *extra =
+		m_capShm->getRawPixelsExtraDataPtr();
+	if(extra->bpp != m_bbBpp ||
+		extra->format != (uint32_t)getBackBufferPixelFormat() ||
+		extra->isFlipped != (isBackBufferFlipped() ? 1 : 0))
+	{
+		return false;
+	}
+
+	return m_capShm->canFitFrame(m_frameWidth, m_frameHeight);
+}
+
+/// <summary>
+/// Removes and destroys our `CaptureSharedSegment` object if it exists.
+/// </summary>
+void CommonHook::destroyCaptureSharedSegment()
+{
+	if(m_capShm == NULL)
+		return;
+	if(m_capShm->isPrefaultComplete() &&
+		m_capShm->getPrefaultPageFaults() > 0)
+	{
+		HookLogf(
+			"Capture segment prefault thread took %u page faults",
+			(uint)m_capShm->getPrefaultPageFaults());
+	}
+	m_capShm->remove();
+	delete m_capShm;
+	m_capShm = NULL;
+}
+
 /// <summary>
 /// Called exactly once when we begin capturing the window.
 /// </summary>
@@ -466,6 +1021,9 @@ void CommonHook::beginCapturing()
 
 	HookLog("Preparing to begin context capture...");
 
+	// Determine if the frames need to be downscaled
+	updateFrameSize();
+
 	// Create our scene objects if we haven't already
 	createSceneObjects();
 
@@ -477,24 +1035,54 @@ void CommonHook::beginCapturing()
 	shm->lockHookRegistry();
 	HookRegEntry *entry = shm->findWindowInHookRegistry((uint32_t)m_topHwnd);
 	if(entry != NULL) {
-		entry->shmName = m_capShm->getSegmentName();
-		entry->shmSize = m_capShm->getSegmentSize();
-		entry->flags |= HookRegEntry::ShmValidFlag;
+		shm->setHookRegistryShm(
+			entry, m_capShm->getSegmentName(), m_capShm->getSegmentSize());
+		shm->setHookRegistryFlags(entry, HookRegEntry::ShmValidFlag, 0);
 	}
 	shm->unlockHookRegistry();
 
-	// Prepare to set the origin for frame capturing to prevent us from
-	// capturing more frames that we can use. We actually set the origin when
-	// we receive the first frame to capture.
-	m_captureUsecOrigin = 0;
-	m_prevCaptureFrameNum = 0;
+	// Forget the timing of any previous capture
+	m_pacer.reset();
+	m_damageLost = false;
+	m_readerJoins = 0;
+	m_isRepeating = false;
+	m_badFrameLogged = false;
+	m_dedupBytesCopied = 0;
+	m_dedupBytesSaved = 0;
 
 	HookLog("Begun context capture");
 	m_isCapturing = true;
 }
 
 /// <summary>
-/// Called whenever the window size changes.
+/// Called whenever the window size or the requested output size changes or
+/// the graphics context is reset. Our scene objects always match the back
+/// buffer and must be recreated but
+/// if the frames still fit in our existing shared segment then we keep using
+/// it so that the main application sees the new size as an ordinary frame.
+/// </summary>
+void CommonHook::resizeCapturing()
+{
+	if(!m_isCapturing)
+		return; // Not capturing
+	updateFrameSize();
+	if(!canReuseCaptureSharedSegment()) {
+		resetCapturing();
+		return;
+	}
+
+	destroySceneObjects();
+	createSceneObjects();
+
+	// Frames of the old size that are still being read back were discarded
+	// with the scene objects
+	m_damageLost = true;
+	m_dedup.reset(
+		m_frameWidth, m_frameHeight, m_bbBpp, m_capShm->getNumFrames());
+}
+
+/// <summary>
+/// Called whenever our shared segment can no longer hold our frames.
 /// </summary>
 void CommonHook::resetCapturing()
 {
@@ -512,11 +1100,7 @@ void CommonHook::resetCapturing()
 	createSceneObjects();
 
 	// Recreate our `CaptureSharedSegment` object with the new settings
-	if(m_capShm != NULL) {
-		m_capShm->remove();
-		delete m_capShm;
-		m_capShm = NULL;
-	}
+	destroyCaptureSharedSegment();
 	createCaptureSharedSegment();
 
 	// Find our old hook registry entry and update its settings
@@ -526,9 +1110,10 @@ void CommonHook::resetCapturing()
 		shm->unlockHookRegistry();
 		return;
 	}
-	entry->shmName = m_capShm->getSegmentName();
-	entry->shmSize = m_capShm->getSegmentSize();
-	entry->flags |= HookRegEntry::ShmResetFlag; // Notify that SHM changed
+	shm->setHookRegistryShm(
+		entry, m_capShm->getSegmentName(), m_capShm->getSegmentSize());
+	shm->setHookRegistryFlags(
+		entry, HookRegEntry::ShmResetFlag, 0); // Notify that SHM changed
 	shm->unlockHookRegistry();
 
 	HookLog("Finished context capture reset");
@@ -551,10 +1136,9 @@ void CommonHook::endCapturing(bool contextValid)
 	shm->lockHookRegistry();
 	HookRegEntry *entry = shm->findWindowInHookRegistry((uint32_t)m_topHwnd);
 	if(entry != NULL) {
-		entry->shmName = 0;
-		entry->shmSize = 0;
+		shm->setHookRegistryShm(entry, 0, 0);
 		// TODO: Do we need to use the reset flag as well?
-		entry->flags &= ~HookRegEntry::ShmValidFlag;
+		shm->setHookRegistryFlags(entry, 0, HookRegEntry::ShmValidFlag);
 	}
 	shm->unlockHookRegistry();
 
@@ -563,16 +1147,36 @@ void CommonHook::endCapturing(bool contextValid)
 		destroySceneObjects();
 
 	// Remove and destroy the shared memory segment
-	if(m_capShm != NULL) {
-		m_capShm->remove();
-		delete m_capShm;
-		m_capShm = NULL;
+	destroyCaptureSharedSegment();
+
+	uint64_t dedupTotal = m_dedupBytesCopied + m_dedupBytesSaved;
+	if(dedupTotal > 0) {
+		HookLogf("Tile deduplication skipped %llu of %llu frame bytes",
+			m_dedupBytesSaved, dedupTotal);
 	}
+	logPacingStats();
 
 	HookLog("Finished context capture");
 	m_isCapturing = false;
 }
 
+void CommonHook::logPacingStats()
+{
+	const FramePacingStats &stats = m_pacer.getStats();
+	if(stats.numSwaps == 0)
+		return;
+	HookLogf("Captured %llu of %llu swaps, missed %llu frames, resynced %llu "
+		"times", stats.numCaptured, stats.numSwaps, stats.numMissedTicks,
+		stats.numResyncs);
+	HookLogf("Capture latency %u usec, swap interval %u usec",
+		stats.latencyUsec, stats.swapIntervalUsec);
+	if(stats.isUsingConsumerTicks) {
+		HookLogf("Main application tick jitter %u usec, drift %d ppm",
+			stats.consumerJitterUsec, stats.consumerDriftPpm);
+	} else
+		HookLog("Main application ticks were not available");
+}
+
 HANDLE *CommonHook::getSharedTexHandles(uint *numTex)
 {
 	if(numTex != NULL)
@@ -20,9 +20,12 @@
 
 #include "../Common/stlincludes.h"
 #include "../Common/capturesharedsegment.h"
+#include "../Common/framededup.h"
+#include "../Common/framepacer.h"
 #include <windows.h>
 
 class CaptureSharedSegment;
+struct HookRegEntry;
 
 //=============================================================================
 /// <summary>
@@ -56,8 +59,21 @@ private:
 	bool		m_isCapturing;
 	bool		m_isAdvertised;
 	CaptureSharedSegment *	m_capShm;
-	uint64_t	m_captureUsecOrigin;
-	uint64_t	m_prevCaptureFrameNum; // The frame number of the previous captured frame
+	CapturePacer	m_pacer; // Decides which swaps to capture
+	bool		m_damageLost; // A frame with partial damage was dropped
+	uint32_t	m_readerJoins; // See `getNumReaderJoins()`
+	bool		m_isRepeating; // The last frame was identical and skipped
+	bool		m_badFrameLogged;
+	CaptureSharedSegment::DirtyRect	m_roi; // Top-down, empty = everything
+	uint		m_outWidth; // Requested output size, zero = back buffer size
+	uint		m_outHeight;
+	bool		m_compressFrames; // Every consumer accepts compressed frames
+	uint		m_frameWidth; // Size of the frames in our shared segment
+	uint		m_frameHeight;
+	FrameDeduplicator	m_dedup;
+	vector<uchar>	m_tileMap;
+	uint64_t	m_dedupBytesCopied; // Totals of the current capture
+	uint64_t	m_dedupBytesSaved;
 
 public: // Constructor/destructor ---------------------------------------------
 	CommonHook(HDC hdc);
@@ -78,19 +94,52 @@ public: // Methods ------------------------------------------------------------
 
 protected:
 	void	writeRawPixelsToShm(
-		uint frameNum, uint64_t timestamp, void *srcData, size_t srcSize);
+		uint64_t timestamp, void *srcData, size_t srcSize,
+		const CaptureSharedSegment::DirtyRect *dirtyRects = NULL,
+		uint numDirtyRects = 0);
 	void	writeRawPixelsToShmWithStride(
-		uint frameNum, uint64_t timestamp, void *srcData, uint srcStride,
-		int widthBytes, int heightRows);
+		uint64_t timestamp, void *srcData, uint srcStride, int widthBytes,
+		int heightRows,
+		const CaptureSharedSegment::DirtyRect *dirtyRects = NULL,
+		uint numDirtyRects = 0);
+	void	writeRawPixelsRectToShm(
+		uint64_t timestamp, void *srcData, uint srcStride,
+		const CaptureSharedSegment::DirtyRect &rect);
 	void	writeSharedTexToShm(uint frameNum, uint64_t timestamp);
-	int		findUnusedFrameNum() const;
-	bool	isFrameNumUsed(uint frameNum) const;
+	CaptureSharedSegment::DirtyRect	getCaptureRect();
+	CaptureSharedSegment::DirtyRect	getSourceRect(
+		const CaptureSharedSegment::DirtyRect &frameRect);
+	bool	isDownscaling() const;
+	int		reserveFrameNum();
+	void	unreserveFrameNum(uint frameNum);
 
 private:
+	void	copyAndPublishRawFrame(
+		uint64_t timestamp, const void *srcData, uint srcStride,
+		const CaptureSharedSegment::DirtyRect &rect);
+	bool	compressAndPublishRawFrame(
+		uint frameNum, uint64_t timestamp, const void *srcData,
+		uint srcStride, const CaptureSharedSegment::DirtyRect &rect);
+	void	publishRawFrame(
+		uint frameNum, uint64_t timestamp, uint stride,
+		const CaptureSharedSegment::DirtyRect *dirtyRects,
+		uint numDirtyRects, const CaptureSharedSegment::DirtyRect &rect);
+	void	addCaptureLatency(uint64_t timestamp);
+	void	logPacingStats();
+	void	updateRoi(const HookRegEntry &entry);
+	void	updateOutputSize(const HookRegEntry &entry);
+	void	updateFramePeriod(const HookRegEntry &entry);
+	void	updateCompression(const HookRegEntry &entry);
+	void	calcFrameSize(uint *width, uint *height);
+	void	updateFrameSize();
 	void	advertiseWindow();
 	void	deadvertiseWindow();
 	bool	createCaptureSharedSegment();
+	void	calcSegmentCapacity(uint *maxWidth, uint *maxHeight) const;
+	bool	canReuseCaptureSharedSegment();
+	void	destroyCaptureSharedSegment();
 	void	beginCapturing();
+	void	resizeCapturing();
 	void	resetCapturing();
 protected: // HACK
 	void	endCapturing(bool contextValid = true);
@@ -122,4 +171,13 @@ inline bool CommonHook::isCapturing() const
 	return m_isCapturing;
 }
 
+/// <summary>
+/// Returns true if the back buffer is downscaled before it is written to our
+/// shared memory segment.
+/// </summary>
+inline bool CommonHook::isDownscaling() const
+{
+	return m_frameWidth != m_width || m_frameHeight != m_height;
+}
+
 #endif // COMMONHOOK_H
@@ -40,7 +40,6 @@ D3D9Hook::D3D9Hook(HDC hdc, IDirect3DDevice9 *device, uint swapChainId)
 	//, m_dx9Tex(NULL)
 	//, m_dx10Texs() // Zeroed below
 	//, m_dx10TexHandles() // Zeroed below
-	, m_nextDx10Tex(0)
 {
 	memset(m_plainSurfaces, 0, sizeof(m_plainSurfaces));
 	memset(m_plainSurfacePending, 0, sizeof(m_plainSurfacePending));
@@ -129,17 +128,17 @@ void D3D9Hook::cpuCreateSceneObjects()
 	// 3) Lock and read the offscreen plain surface pixel data to shared
 	//    memory.
 
-	HookLog(stringf("Creating D3D9 scene objects for window of size %d x %d",
-		m_width, m_height));
+	HookLogf("Creating D3D9 scene objects for window of size %d x %d",
+		m_width, m_height);
 
 	// Create render target surface
 	HRESULT res = m_device->CreateRenderTarget(
 		m_width, m_height, m_bbD3D9Format, D3DMULTISAMPLE_NONE, 0, FALSE,
 		&m_rtSurface, NULL);
 	if(FAILED(res)) {
-		HookLog2(InterprocessLog::Warning, stringf(
+		HookLog2f(InterprocessLog::Warning,
 			"Failed to create render target. Reason = %s",
-			getD3D9ErrorCode(res).data()));
+			getD3D9ErrorCode(res).data());
 		goto cpuCreateSceneObjectsFailed1;
 	}
 
@@ -149,9 +148,9 @@ void D3D9Hook::cpuCreateSceneObjects()
 			m_width, m_height, m_bbD3D9Format, D3DPOOL_SYSTEMMEM,
 			&m_plainSurfaces[i], NULL);
 		if(FAILED(res)) {
-			HookLog2(InterprocessLog::Warning, stringf(
+			HookLog2f(InterprocessLog::Warning,
 				"Failed to create offscreen plain surface. Reason = %s",
-				getD3D9ErrorCode(res).data()));
+				getD3D9ErrorCode(res).data());
 			goto cpuCreateSceneObjectsFailed1;
 		}
 	}
@@ -255,8 +254,8 @@ void D3D9Hook::cpuCaptureBackBuffer(bool captureFrame, uint64_t timestamp)
 #define TEST_PBO_PIXEL(x, y, r, g, b) \
 	test = &((uchar *)rect.pBits)[(x)*m_bbBpp+(y)*rect.Pitch]; \
 	if(test[0] != (b) || test[1] != (g) || test[2] != (r)) \
-	HookLog2(InterprocessLog::Warning, stringf( \
-	"(%u, %u, %u) != (%u, %u, %u)", test[0], test[1], test[2], (b), (g), (r)))
+	HookLog2f(InterprocessLog::Warning, \
+	"(%u, %u, %u) != (%u, %u, %u)", test[0], test[1], test[2], (b), (g), (r))
 
 		// Dustforce game screen at start (Window size: 1184x762)
 		TEST_PBO_PIXEL(27, 66, 64, 65, 60);
@@ -267,12 +266,9 @@ void D3D9Hook::cpuCaptureBackBuffer(bool captureFrame, uint64_t timestamp)
 
 		// Copy data to shared memory. TODO: We should probably keep the same
 		// stride to improve copy performance
-		int frameNum = findUnusedFrameNum();
-		if(frameNum >= 0) {
-			writeRawPixelsToShmWithStride(
-				frameNum, timestamp, rect.pBits, rect.Pitch,
-				m_bbWidth * m_bbBpp, m_bbHeight);
-		}
+		writeRawPixelsToShmWithStride(
+			timestamp, rect.pBits, rect.Pitch, m_bbWidth * m_bbBpp,
+			m_bbHeight);
 
 		// Unmap buffer
 		readSurface->UnlockRect();
@@ -306,17 +302,17 @@ void D3D9Hook::gdiCreateSceneObjects()
 		return;
 	}
 
-	HookLog(stringf("Creating D3D9 scene objects for window of size %d x %d",
-		m_width, m_height));
+	HookLogf("Creating D3D9 scene objects for window of size %d x %d",
+		m_width, m_height);
 
 	// Create D3D9 render target surface
 	HRESULT res = m_device->CreateRenderTarget(
 		m_width, m_height, m_bbD3D9Format, D3DMULTISAMPLE_NONE, 0, TRUE,
 		&m_rtSurface, NULL);
 	if(FAILED(res)) {
-		HookLog2(InterprocessLog::Warning, stringf(
+		HookLog2f(InterprocessLog::Warning,
 			"Failed to create shared D3D9 render target. Reason = %s",
-			getD3D9ErrorCode(res).data()));
+			getD3D9ErrorCode(res).data());
 		goto gdiCreateSceneObjectsFailed1;
 	}
 
@@ -337,13 +333,12 @@ void D3D9Hook::gdiCreateSceneObjects()
 	for(int i = 0; i < NUM_SHARED_TEXTURES; i++) {
 		res = m_dx10Device->CreateTexture2D(&desc, NULL, &m_dx10Texs[i]);
 		if(FAILED(res)) {
-			HookLog2(InterprocessLog::Warning, stringf(
+			HookLog2f(InterprocessLog::Warning,
 				"Failed to create shared DX10 target. Reason = %s",
-				getDX10ErrorCode(res).data()));
+				getDX10ErrorCode(res).data());
 			goto gdiCreateSceneObjectsFailed1;
 		}
 	}
-	m_nextDx10Tex = 0;
 
 	// Get DXGI shared handles from the textures
 	for(int i = 0; i < NUM_SHARED_TEXTURES; i++) {
@@ -351,18 +346,18 @@ void D3D9Hook::gdiCreateSceneObjects()
 		res = m_dx10Texs[i]->QueryInterface(
 			__uuidof(IDXGIResource), (void **)&dxgiRes);
 		if(FAILED(res)) {
-			HookLog2(InterprocessLog::Warning, stringf(
+			HookLog2f(InterprocessLog::Warning,
 				"Failed to get DXGI resource. Reason = %s",
-				getDX10ErrorCode(res).data()));
+				getDX10ErrorCode(res).data());
 			goto gdiCreateSceneObjectsFailed1;
 		}
 		m_dx10TexHandles[i] = NULL;
 		res = dxgiRes->GetSharedHandle(&m_dx10TexHandles[i]);
 		dxgiRes->Release();
 		if(FAILED(res)) {
-			HookLog2(InterprocessLog::Warning, stringf(
+			HookLog2f(InterprocessLog::Warning,
 				"Failed to get DXGI shared handle. Reason = %s",
-				getDX10ErrorCode(res).data()));
+				getDX10ErrorCode(res).data());
 			goto gdiCreateSceneObjectsFailed1;
 		}
 	}
@@ -373,9 +368,9 @@ void D3D9Hook::gdiCreateSceneObjects()
 		m_width, m_height, m_bbD3D9Format, D3DMULTISAMPLE_NONE, 0, FALSE,
 		&m_rtSurface, NULL);
 	if(FAILED(res)) {
-		HookLog2(InterprocessLog::Warning, stringf(
+		HookLog2f(InterprocessLog::Warning,
 			"Failed to create shared D3D9 render target. Reason = %s",
-			getD3D9ErrorCode(res).data()));
+			getD3D9ErrorCode(res).data());
 		return; // TODO: Not safe to return here
 	}
 
@@ -385,9 +380,9 @@ void D3D9Hook::gdiCreateSceneObjects()
 		m_width, m_height, 1, D3DUSAGE_RENDERTARGET, m_bbD3D9Format,
 		D3DPOOL_DEFAULT, &m_dx9Tex, &sharedHandle);
 	if(FAILED(res)) {
-		HookLog2(InterprocessLog::Warning, stringf(
+		HookLog2f(InterprocessLog::Warning,
 			"Failed to create D3D9 texture. Reason = %s",
-			getD3D9ErrorCode(res).data()));
+			getD3D9ErrorCode(res).data());
 		return; // TODO: Not safe to return here
 	}
 
@@ -396,17 +391,17 @@ void D3D9Hook::gdiCreateSceneObjects()
 	res = m_dx10Device->OpenSharedResource(
 		sharedHandle, __uuidof(ID3D10Resource), (void **)(&resource));
 	if(FAILED(res)) {
-		HookLog2(InterprocessLog::Warning, stringf(
+		HookLog2f(InterprocessLog::Warning,
 			"Failed to open D3D9 surface as a DX10 resource. Reason = %s",
-			getDX10ErrorCode(res).data()));
+			getDX10ErrorCode(res).data());
 		return; // TODO: Not safe to return here
 	}
 	res = resource->QueryInterface(
 		__uuidof(ID3D10Texture2D), (void **)(&m_dx10Tex));
 	if(FAILED(res)) {
-		HookLog2(InterprocessLog::Warning, stringf(
+		HookLog2f(InterprocessLog::Warning,
 			"Failed to query DX10 texture interface. Reason = %s",
-			getDX10ErrorCode(res).data()));
+			getDX10ErrorCode(res).data());
 		return; // TODO: Not safe to return here
 	}
 	resource->Release();
@@ -428,9 +423,9 @@ void D3D9Hook::gdiCreateSceneObjects()
 	desc.MiscFlags = D3D10_RESOURCE_MISC_SHARED;
 	HRESULT res = m_dx10Device->CreateTexture2D(&desc, NULL, &m_dx10Tex);
 	if(FAILED(res)) {
-		HookLog2(InterprocessLog::Warning, stringf(
+		HookLog2f(InterprocessLog::Warning,
 			"Failed to create DX10 target. Reason = %s",
-			getDX10ErrorCode(res).data()));
+			getDX10ErrorCode(res).data());
 		// TODO: Don't continue
 	}
 
@@ -439,17 +434,17 @@ void D3D9Hook::gdiCreateSceneObjects()
 	res = m_dx10Tex->QueryInterface(
 		__uuidof(IDXGIResource), (void **)&dxgiRes);
 	if(FAILED(res)) {
-		HookLog2(InterprocessLog::Warning, stringf(
+		HookLog2f(InterprocessLog::Warning,
 			"Failed to get DXGI resource. Reason = %s",
-			getDX10ErrorCode(res).data()));
+			getDX10ErrorCode(res).data());
 		// TODO: Don't continue
 	}
 	HANDLE sharedHandle = NULL;
 	res = dxgiRes->GetSharedHandle(&sharedHandle);
 	if(FAILED(res)) {
-		HookLog2(InterprocessLog::Warning, stringf(
+		HookLog2f(InterprocessLog::Warning,
 			"Failed to get DXGI shared handle. Reason = %s",
-			getDX10ErrorCode(res).data()));
+			getDX10ErrorCode(res).data());
 		// TODO: Don't continue
 	}
 	dxgiRes->Release();
@@ -459,9 +454,9 @@ void D3D9Hook::gdiCreateSceneObjects()
 		m_width, m_height, m_bbD3D9Format, D3DMULTISAMPLE_NONE, 0, TRUE,
 		&m_rtSurface, &sharedHandle);
 	if(FAILED(res)) {
-		HookLog2(InterprocessLog::Warning, stringf(
+		HookLog2f(InterprocessLog::Warning,
 			"Failed to create shared D3D9 render target. Reason = %s",
-			getD3D9ErrorCode(res).data()));
+			getD3D9ErrorCode(res).data());
 		// TODO: Don't continue
 	}
 #endif // 0
@@ -507,7 +502,6 @@ void D3D9Hook::gdiDestroySceneObjects()
 	//m_dx9Tex = NULL;
 	memset(m_dx10Texs, 0, sizeof(m_dx10Texs));
 	memset(m_dx10TexHandles, 0, sizeof(m_dx10TexHandles));
-	m_nextDx10Tex = 0;
 	m_dx10Device = NULL;
 
 	m_sceneObjectsCreated = false;
@@ -519,14 +513,10 @@ void D3D9Hook::gdiCaptureBackBuffer(bool captureFrame, uint64_t timestamp)
 		return; // Nothing to do
 
 	// Get the next shared texture to write to
-	ID3D10Texture2D *dx10Tex = m_dx10Texs[m_nextDx10Tex];
-	HANDLE dx10TexHandle = m_dx10TexHandles[m_nextDx10Tex];
-	if(isFrameNumUsed(m_nextDx10Tex))
+	int frameNum = reserveFrameNum();
+	if(frameNum < 0)
 		return; // Frame queue is full, cannot do anything right now
-	uint frameNum = m_nextDx10Tex;
-	m_nextDx10Tex++;
-	if(m_nextDx10Tex >= NUM_SHARED_TEXTURES)
-		m_nextDx10Tex = 0;
+	ID3D10Texture2D *dx10Tex = m_dx10Texs[frameNum];
 
 	// Copy the back buffer to our temporary render target surface so it's
 	// available to be read by GDI. TODO: We assume that there is only a single
@@ -554,9 +544,9 @@ void D3D9Hook::gdiCaptureBackBuffer(bool captureFrame, uint64_t timestamp)
 	HDC d3d9Hdc = NULL;
 	res = m_rtSurface->GetDC(&d3d9Hdc);
 	if(FAILED(res)) {
-		HookLog2(InterprocessLog::Warning, stringf(
+		HookLog2f(InterprocessLog::Warning,
 			"Failed to get HDC of D3D9 render target. Reason = %s",
-			getD3D9ErrorCode(res).data()));
+			getD3D9ErrorCode(res).data());
 		goto gdiCaptureBackBufferFailed0;
 	}
 
@@ -566,16 +556,16 @@ void D3D9Hook::gdiCaptureBackBuffer(bool captureFrame, uint64_t timestamp)
 	res = dx10Tex->QueryInterface(
 		__uuidof(IDXGISurface1), (void **)&dx10Surface);
 	if(FAILED(res)) {
-		HookLog2(InterprocessLog::Warning, stringf(
+		HookLog2f(InterprocessLog::Warning,
 			"Failed to get DXGI 1.1 surface of DX10 texture. Reason = %s",
-			getDX10ErrorCode(res).data()));
+			getDX10ErrorCode(res).data());
 		goto gdiCaptureBackBufferFailed1;
 	}
 	res = dx10Surface->GetDC(TRUE, &dx10Hdc);
 	if(FAILED(res)) {
-		HookLog2(InterprocessLog::Warning, stringf(
+		HookLog2f(InterprocessLog::Warning,
 			"Failed to get HDC of DX10 texture. Reason = %s",
-			getDX10ErrorCode(res).data()));
+			getDX10ErrorCode(res).data());
 		goto gdiCaptureBackBufferFailed2;
 	}
 
@@ -589,16 +579,16 @@ void D3D9Hook::gdiCaptureBackBuffer(bool captureFrame, uint64_t timestamp)
 	// Clean up
 	res = dx10Surface->ReleaseDC(NULL);
 	if(FAILED(res)) {
-		HookLog2(InterprocessLog::Warning, stringf(
+		HookLog2f(InterprocessLog::Warning,
 			"Failed to release HDC of DX10 texture. Reason = %s",
-			getDX10ErrorCode(res).data()));
+			getDX10ErrorCode(res).data());
 	}
 	dx10Surface->Release();
 	res = m_rtSurface->ReleaseDC(d3d9Hdc);
 	if(FAILED(res)) {
-		HookLog2(InterprocessLog::Warning, stringf(
+		HookLog2f(InterprocessLog::Warning,
 			"Failed to release HDC of D3D9 render target. "
-			"Reason = %s", getD3D9ErrorCode(res).data()));
+			"Reason = %s", getD3D9ErrorCode(res).data());
 	}
 
 	//-------------------------------------------------------------------------
@@ -612,24 +602,21 @@ void D3D9Hook::gdiCaptureBackBuffer(bool captureFrame, uint64_t timestamp)
 gdiCaptureBackBufferFailed3:
 	res = dx10Surface->ReleaseDC(NULL);
 	if(FAILED(res)) {
-		HookLog2(InterprocessLog::Warning, stringf(
+		HookLog2f(InterprocessLog::Warning,
 			"Failed to release HDC of DX10 texture. Reason = %s",
-			getDX10ErrorCode(res).data()));
+			getDX10ErrorCode(res).data());
 	}
 gdiCaptureBackBufferFailed2:
 	dx10Surface->Release();
 gdiCaptureBackBufferFailed1:
 	res = m_rtSurface->ReleaseDC(d3d9Hdc);
 	if(FAILED(res)) {
-		HookLog2(InterprocessLog::Warning, stringf(
+		HookLog2f(InterprocessLog::Warning,
 			"Failed to release HDC of D3D9 render target. "
-			"Reason = %s", getD3D9ErrorCode(res).data()));
+			"Reason = %s", getD3D9ErrorCode(res).data());
 	}
 gdiCaptureBackBufferFailed0:
-	if(m_nextDx10Tex > 0)
-		m_nextDx10Tex--;
-	else
-		m_nextDx10Tex = NUM_SHARED_TEXTURES - 1;
+	unreserveFrameNum(frameNum);
 }
 
 ShmCaptureType D3D9Hook::getCaptureType()
@@ -56,7 +56,6 @@ private: // Members -----------------------------------------------------------
 	//IDirect3DTexture9 *	m_dx9Tex;
 	ID3D10Texture2D *	m_dx10Texs[NUM_SHARED_TEXTURES];
 	HANDLE				m_dx10TexHandles[NUM_SHARED_TEXTURES];
-	uint				m_nextDx10Tex;
 
 public: // Constructor/destructor ---------------------------------------------
 	D3D9Hook(HDC hdc, IDirect3DDevice9 *device, uint swapChainId);
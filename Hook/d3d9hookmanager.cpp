@@ -243,9 +243,9 @@ void D3D9HookManager::attemptToHook()
 				// Release dummy device
 				deviceEx->Release();
 			} else {
-				HookLog2(InterprocessLog::Warning, stringf(
+				HookLog2f(InterprocessLog::Warning,
 					"d3d9Ex->CreateDeviceEx() failed. Reason = %s",
-					getD3D9ErrorCode(res).data()));
+					getD3D9ErrorCode(res).data());
 			}
 
 			// Release Direct3D object
@@ -287,9 +287,9 @@ void D3D9HookManager::attemptToHook()
 				// Release dummy device
 				device->Release();
 			} else {
-				HookLog2(InterprocessLog::Warning, stringf(
+				HookLog2f(InterprocessLog::Warning,
 					"d3d9->CreateDevice() failed. Reason = %s",
-					getD3D9ErrorCode(res).data()));
+					getD3D9ErrorCode(res).data());
 			}
 
 			// Release Direct3D object
@@ -382,9 +382,9 @@ void D3D9HookManager::displayDriverInfo(IDirect3D9 *d3d9)
 		HookLog2(InterprocessLog::Warning, "Failed to get adapter identifier");
 		return;
 	}
-	HookLog(stringf("D3D9 driver: %s", ident.Driver));
-	HookLog(stringf("D3D9 description: %s", ident.Description));
-	HookLog(stringf("D3D9 device name: %s", ident.DeviceName));
+	HookLogf("D3D9 driver: %s", ident.Driver);
+	HookLogf("D3D9 description: %s", ident.Description);
+	HookLogf("D3D9 device name: %s", ident.DeviceName);
 }
 
 D3D9HookManager::D3D9HookData *D3D9HookManager::findDataForDevice(
@@ -411,7 +411,7 @@ HRESULT D3D9HookManager::DevicePresentHooked(
 	const RECT *pDestRect, HWND hDestWindowOverride,
 	const RGNDATA *pDirtyRegion)
 {
-	//HookLog(stringf("IDirect3DDevice9::Present(%p)", device));
+	//HookLogf("IDirect3DDevice9::Present(%p)", device);
 	m_hookMutex.lock();
 
 	// Forward to the context handler
@@ -431,7 +431,7 @@ HRESULT D3D9HookManager::DevicePresentHooked(
 
 HRESULT D3D9HookManager::DeviceEndSceneHooked(IDirect3DDevice9 *device)
 {
-	//HookLog(stringf("IDirect3DDevice9::EndScene(%p)", device));
+	//HookLogf("IDirect3DDevice9::EndScene(%p)", device);
 	m_hookMutex.lock();
 
 	// Every Direct3D 9 application must call `IDirect3DDevice9::EndScene()`
@@ -444,7 +444,7 @@ HRESULT D3D9HookManager::DeviceEndSceneHooked(IDirect3DDevice9 *device)
 	D3D9CommonHook *hook = findHookForDevice(device);
 	if(hook == NULL) {
 		// This is a brand new context! Track it
-		//HookLog(stringf("IDirect3DDevice9::EndScene(%p)", device));
+		//HookLogf("IDirect3DDevice9::EndScene(%p)", device);
 
 		// Is this a D3D9 or D3D9Ex device? Just because the library supports
 		// D3D9Ex doesn't mean that the application actually created a D3D9Ex
@@ -462,7 +462,7 @@ HRESULT D3D9HookManager::DeviceEndSceneHooked(IDirect3DDevice9 *device)
 		uint numChains = device->GetNumberOfSwapChains();
 		uint chainId = 0;
 		if(numChains > 1)
-			HookLog(stringf("Device has %d swap chains", numChains));
+			HookLogf("Device has %d swap chains", numChains);
 		for(; chainId < numChains; chainId++) {
 			res = device->GetSwapChain(chainId, &chain);
 			if(SUCCEEDED(res))
@@ -524,7 +524,7 @@ HRESULT D3D9HookManager::DeviceResetHooked(
 	IDirect3DDevice9 *device,
 	D3DPRESENT_PARAMETERS *pPresentationParameters)
 {
-	//HookLog(stringf("IDirect3DDevice9::Reset(%p)", device));
+	//HookLogf("IDirect3DDevice9::Reset(%p)", device);
 	m_hookMutex.lock();
 
 	// Forward to the context handler (Part 1)
@@ -547,7 +547,7 @@ HRESULT D3D9HookManager::DeviceResetHooked(
 
 ULONG D3D9HookManager::DeviceReleaseHooked(IUnknown *unknown)
 {
-	//HookLog(stringf("IDirect3DDevice9::Release(%p)", unknown));
+	//HookLogf("IDirect3DDevice9::Release(%p)", unknown);
 	m_hookMutex.lock();
 
 	// Will the device be deleted this call?
@@ -557,7 +557,7 @@ ULONG D3D9HookManager::DeviceReleaseHooked(IUnknown *unknown)
 	HRESULT ret;
 	if(refs == 1) {
 		// Device is about to be deleted, clean up
-		//HookLog(stringf("IDirect3DDevice9::Release(%p)", unknown));
+		//HookLogf("IDirect3DDevice9::Release(%p)", unknown);
 
 		// Get the `IDirect3DDevice9` from the `IUnknown`
 		IDirect3DDevice9 *device = NULL;
@@ -624,7 +624,7 @@ HRESULT D3D9HookManager::DeviceExPresentExHooked(
 	const RECT *pDestRect, HWND hDestWindowOverride,
 	const RGNDATA *pDirtyRegion, DWORD dwFlags)
 {
-	//HookLog(stringf("IDirect3DDevice9Ex::PresentEx(%p)", deviceEx));
+	//HookLogf("IDirect3DDevice9Ex::PresentEx(%p)", deviceEx);
 	m_hookMutex.lock();
 
 	// Get device object and forward to the context handler
@@ -650,7 +650,7 @@ HRESULT D3D9HookManager::DeviceExPresentExHooked(
 	m_DeviceExPresentExHook->install();
 
 	m_hookMutex.unlock();
-	//HookLog(stringf("IDirect3DDevice9Ex::PresentEx(%p) exit", deviceEx));
+	//HookLogf("IDirect3DDevice9Ex::PresentEx(%p) exit", deviceEx);
 	return ret;
 }
 
@@ -659,7 +659,7 @@ HRESULT D3D9HookManager::DeviceExResetExHooked(
 	D3DPRESENT_PARAMETERS *pPresentationParameters,
 	D3DDISPLAYMODEEX *pFullscreenDisplayMode)
 {
-	//HookLog(stringf("IDirect3DDevice9Ex::ResetEx(%p)", deviceEx));
+	//HookLogf("IDirect3DDevice9Ex::ResetEx(%p)", deviceEx);
 	m_hookMutex.lock();
 
 	// Get device object and forward to the context handler (Part 1)
@@ -698,7 +698,7 @@ HRESULT D3D9HookManager::SwapChainPresentHooked(
 	const RECT *pDestRect, HWND hDestWindowOverride,
 	const RGNDATA *pDirtyRegion, DWORD dwFlags)
 {
-	//HookLog(stringf("IDirect3DSwapChain9::Present(%p)", chain));
+	//HookLogf("IDirect3DSwapChain9::Present(%p)", chain);
 	m_hookMutex.lock();
 
 	// Get device object and forward to the context handler
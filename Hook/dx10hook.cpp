@@ -45,8 +45,8 @@ void *DX10Hook::getDevice() const
 
 bool DX10Hook::createSharedResources()
 {
-	HookLog(stringf("Creating DX10 scene objects for window of size %d x %d",
-		m_width, m_height));
+	HookLogf("Creating DX10 scene objects for window of size %d x %d",
+		m_width, m_height);
 
 	// Create shared DX10 textures
 	D3D10_TEXTURE2D_DESC desc;
@@ -65,9 +65,9 @@ bool DX10Hook::createSharedResources()
 	for(int i = 0; i < NUM_SHARED_RESOURCES; i++) {
 		res = m_device->CreateTexture2D(&desc, NULL, sharedTexPtr(i));
 		if(FAILED(res)) {
-			HookLog2(InterprocessLog::Warning, stringf(
+			HookLog2f(InterprocessLog::Warning,
 				"Failed to create shared DX10 texture. Reason = %s",
-				getDX10ErrorCode(res).data()));
+				getDX10ErrorCode(res).data());
 			goto createResourcesFailed1;
 		}
 	}
@@ -78,18 +78,18 @@ bool DX10Hook::createSharedResources()
 		res = sharedTex(i)->QueryInterface(
 			__uuidof(IDXGIResource), (void **)&dxgiRes);
 		if(FAILED(res)) {
-			HookLog2(InterprocessLog::Warning, stringf(
+			HookLog2f(InterprocessLog::Warning,
 				"Failed to get DXGI resource. Reason = %s",
-				getDX10ErrorCode(res).data()));
+				getDX10ErrorCode(res).data());
 			goto createResourcesFailed1;
 		}
 		m_sharedResHandles[i] = NULL;
 		res = dxgiRes->GetSharedHandle(&m_sharedResHandles[i]);
 		dxgiRes->Release();
 		if(FAILED(res)) {
-			HookLog2(InterprocessLog::Warning, stringf(
+			HookLog2f(InterprocessLog::Warning,
 				"Failed to get DXGI shared handle. Reason = %s",
-				getDX10ErrorCode(res).data()));
+				getDX10ErrorCode(res).data());
 			goto createResourcesFailed1;
 		}
 	}
@@ -126,9 +126,9 @@ bool DX10Hook::copyBackBufferToResource(int resId)
 	HRESULT res =
 		m_swapChain->GetBuffer(0, __uuidof(ID3D10Resource), (void **)&bufRes);
 	if(FAILED(res)) {
-		HookLog2(InterprocessLog::Warning, stringf(
+		HookLog2f(InterprocessLog::Warning,
 			"Failed to get back buffer surface. Reason = %s",
-			getDX10ErrorCode(res).data()));
+			getDX10ErrorCode(res).data());
 		return false;
 	}
 
@@ -45,8 +45,8 @@ void *DX11Hook::getDevice() const
 
 bool DX11Hook::createSharedResources()
 {
-	HookLog(stringf("Creating DX11 scene objects for window of size %d x %d",
-		m_width, m_height));
+	HookLogf("Creating DX11 scene objects for window of size %d x %d",
+		m_width, m_height);
 
 	// Create shared DX11 textures
 	D3D11_TEXTURE2D_DESC desc;
@@ -65,9 +65,9 @@ bool DX11Hook::createSharedResources()
 	for(int i = 0; i < NUM_SHARED_RESOURCES; i++) {
 		res = m_device->CreateTexture2D(&desc, NULL, sharedTexPtr(i));
 		if(FAILED(res)) {
-			HookLog2(InterprocessLog::Warning, stringf(
+			HookLog2f(InterprocessLog::Warning,
 				"Failed to create shared DX11 texture. Reason = %s",
-				getDX11ErrorCode(res).data()));
+				getDX11ErrorCode(res).data());
 			goto createResourcesFailed1;
 		}
 	}
@@ -78,18 +78,18 @@ bool DX11Hook::createSharedResources()
 		res = sharedTex(i)->QueryInterface(
 			__uuidof(IDXGIResource), (void **)&dxgiRes);
 		if(FAILED(res)) {
-			HookLog2(InterprocessLog::Warning, stringf(
+			HookLog2f(InterprocessLog::Warning,
 				"Failed to get DXGI resource. Reason = %s",
-				getDX11ErrorCode(res).data()));
+				getDX11ErrorCode(res).data());
 			goto createResourcesFailed1;
 		}
 		m_sharedResHandles[i] = NULL;
 		res = dxgiRes->GetSharedHandle(&m_sharedResHandles[i]);
 		dxgiRes->Release();
 		if(FAILED(res)) {
-			HookLog2(InterprocessLog::Warning, stringf(
+			HookLog2f(InterprocessLog::Warning,
 				"Failed to get DXGI shared handle. Reason = %s",
-				getDX11ErrorCode(res).data()));
+				getDX11ErrorCode(res).data());
 			goto createResourcesFailed1;
 		}
 	}
@@ -126,9 +126,9 @@ bool DX11Hook::copyBackBufferToResource(int resId)
 	HRESULT res =
 		m_swapChain->GetBuffer(0, __uuidof(ID3D11Resource), (void **)&bufRes);
 	if(FAILED(res)) {
-		HookLog2(InterprocessLog::Warning, stringf(
+		HookLog2f(InterprocessLog::Warning,
 			"Failed to get back buffer surface. Reason = %s",
-			getDX11ErrorCode(res).data()));
+			getDX11ErrorCode(res).data());
 		return false;
 	}
 
@@ -18,6 +18,7 @@
 #include "dxgicommonhook.h"
 #include "hookmain.h"
 #include "../Common/interprocesslog.h"
+#include "../Common/pixelconvert.h"
 #include "../Common/stlhelpers.h"
 
 DXGICommonHook::DXGICommonHook(HDC hdc, IDXGISwapChain *chain)
@@ -68,7 +69,9 @@ void DXGICommonHook::calcBackBufferPixelFormat()
 	}
 
 	m_bbFormat = desc.BufferDesc.Format;
-	m_bbBpp = 4; // FIXME
+	m_bbBpp = getPixelFormatBpp(getBackBufferPixelFormat());
+	if(m_bbBpp == 0)
+		m_bbBpp = 4; // Unknown format, only used for shared textures
 	m_bbIsValidFormat = true;
 	m_bbWidth = desc.BufferDesc.Width;
 	m_bbHeight = desc.BufferDesc.Height;
@@ -144,13 +147,15 @@ void DXGICommonHook::captureBackBuffer(bool captureFrame, uint64_t timestamp)
 		return; // Nothing to do
 
 	// Get the next shared resource to write to
-	int resId = findUnusedFrameNum();
+	int resId = reserveFrameNum();
 	if(resId < 0)
 		return;
 
 	// Copy the back buffer to one of our shared textures
-	if(!copyBackBufferToResource(resId))
+	if(!copyBackBufferToResource(resId)) {
+		unreserveFrameNum(resId);
 		return; // Failed to copy
+	}
 
 	// Remember the texture and timestamp so we can mark it as used next frame
 	m_prevCapResource = resId;
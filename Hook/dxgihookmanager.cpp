@@ -226,9 +226,9 @@ void DXGIHookManager::attemptToHook()
 
 					chain->Release();
 				} else {
-					HookLog2(InterprocessLog::Warning, stringf(
+					HookLog2f(InterprocessLog::Warning,
 						"Failed to create DX10 swap chain. Reason = %s",
-						getDX10ErrorCode(res).data()));
+						getDX10ErrorCode(res).data());
 				}
 			}
 
@@ -286,9 +286,9 @@ void DXGIHookManager::attemptToHook()
 			context->Release();
 			device->Release();
 		} else {
-			HookLog2(InterprocessLog::Warning, stringf(
+			HookLog2f(InterprocessLog::Warning,
 				"Failed to create DX11 device and swap chain. Reason = %s",
-				getDX11ErrorCode(res).data()));
+				getDX11ErrorCode(res).data());
 		}
 	}
 
@@ -392,17 +392,17 @@ ULONG DXGIHookManager::DeviceReleaseHooked(IUnknown *unknown, bool isDX11)
 
 	// Debugging
 	//if(isDX11)
-	//	HookLog(stringf("ID3D11Device::Release(%p, %d)", unknown, refs));
+	//	HookLogf("ID3D11Device::Release(%p, %d)", unknown, refs);
 	//else
-	//	HookLog(stringf("ID3D10Device::Release(%p, %d)", unknown, refs));
+	//	HookLogf("ID3D10Device::Release(%p, %d)", unknown, refs);
 
 	HRESULT ret = E_FAIL;
 	if(refs == 1) {
 		// Device is about to be deleted, clean up
 		if(isDX11)
-			HookLog(stringf("ID3D11Device::Release(%p)", unknown));
+			HookLogf("ID3D11Device::Release(%p)", unknown);
 		else
-			HookLog(stringf("ID3D10Device::Release(%p)", unknown));
+			HookLogf("ID3D10Device::Release(%p)", unknown);
 
 		// Get the `ID3D10Device` from the `IUnknown`
 		void *device = NULL;
@@ -479,12 +479,12 @@ ULONG DXGIHookManager::SwapChainReleaseHooked(IUnknown *unknown)
 	ULONG refs = unknown->Release();
 
 	// Debugging
-	//HookLog(stringf("IDXGISwapChain::Release(%p, %d)", unknown, refs));
+	//HookLogf("IDXGISwapChain::Release(%p, %d)", unknown, refs);
 
 	HRESULT ret = E_FAIL;
 	if(refs == 1) {
 		// Swap chain is about to be deleted, clean up
-		//HookLog(stringf("IDXGISwapChain::Release(%p)", unknown));
+		//HookLogf("IDXGISwapChain::Release(%p)", unknown);
 
 		// Get the `IDXGISwapChain` from the `IUnknown`
 		IDXGISwapChain *chain = NULL;
@@ -544,7 +544,7 @@ ULONG DXGIHookManager::SwapChainReleaseHooked(IUnknown *unknown)
 HRESULT DXGIHookManager::SwapChainPresentHooked(
 	IDXGISwapChain *chain, UINT SyncInterval, UINT Flags)
 {
-	//HookLog(stringf("IDXGISwapChain::Present(%p)", chain));
+	//HookLogf("IDXGISwapChain::Present(%p)", chain);
 	m_hookMutex.lock();
 
 	// Create a new `DXGICommonHook` instance for every unique device so we can
@@ -552,7 +552,7 @@ HRESULT DXGIHookManager::SwapChainPresentHooked(
 	DXGICommonHook *hook = findHookForSwapChain(chain);
 	if(hook == NULL) {
 		// This is a brand new context! Track it
-		//HookLog(stringf("IDXGISwapChain::Present(%p)", chain));
+		//HookLogf("IDXGISwapChain::Present(%p)", chain);
 
 		// Is this a DX10 or DX11 device?
 		ID3D10Device *device10 = NULL;
@@ -562,9 +562,9 @@ HRESULT DXGIHookManager::SwapChainPresentHooked(
 		res = chain->GetDevice(
 			__uuidof(ID3D11Device), (void**)&device11);
 		if(device10 == NULL && device11 == NULL) {
-			HookLog2(InterprocessLog::Warning, stringf(
+			HookLog2f(InterprocessLog::Warning,
 				"Failed to get device from swap chain. Reason = %s",
-				getDX10ErrorCode(res).data()));
+				getDX10ErrorCode(res).data());
 			goto swapChainPresentFailed1;
 		}
 
@@ -636,7 +636,7 @@ HRESULT DXGIHookManager::SwapChainResizeBuffersHooked(
 	// NOTE: We treat this the same way as we treat a Direct3D 9 "reset" which
 	// is not actually required but it does allow reusing existing code.
 
-	//HookLog(stringf("IDXGISwapChain::ResizeBuffers(%p)", chain));
+	//HookLogf("IDXGISwapChain::ResizeBuffers(%p)", chain);
 	m_hookMutex.lock();
 
 	// Forward to the context handler (Part 1)
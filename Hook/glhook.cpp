@@ -37,6 +37,7 @@ GLHook::GLHook(HDC hdc, HGLRC hglrc)
 	, m_sceneObjectsCreated(false)
 	//, m_pbos() // Zeroed below
 	//, m_pboPending() // Zeroed below
+	//, m_pboRects()
 	, m_nextPbo(0)
 {
 	memset(m_pbos, 0, sizeof(m_pbos));
@@ -89,6 +90,16 @@ void GLHook::calcBackBufferPixelFormat()
 	}
 }
 
+/// <summary>
+/// Returns the size in bytes of a row of `width` pixels in a PBO. We always
+/// read back with a `GL_PACK_ALIGNMENT` of `PACK_ALIGNMENT` so 24-bit rows
+/// can be padded.
+/// </summary>
+uint GLHook::calcPboStride(uint width) const
+{
+	return (width * m_bbBpp + PACK_ALIGNMENT - 1) & ~(PACK_ALIGNMENT - 1);
+}
+
 RawPixelFormat GLHook::getBackBufferPixelFormat()
 {
 	switch(m_bbGLFormat) {
@@ -120,19 +131,20 @@ void GLHook::createSceneObjects()
 	if(!isCapturable())
 		return; // Not capturable
 
-	HookLog(stringf("Creating OpenGL scene objects for window of size %d x %d",
-		m_width, m_height));
+	HookLogf("Creating OpenGL scene objects for window of size %d x %d",
+		m_width, m_height);
 
 	// Reset OpenGL error code so we can detect if any of the following failed
 	glGetError_mishira();
 
-	// Create and configure PBOs
+	// Create and configure PBOs. They must be large enough for the padded
+	// rows of the entire back buffer.
+	GLsizeiptr pboSize = (GLsizeiptr)calcPboStride(m_width) * m_height;
 	glGenBuffers(NUM_PBOS, m_pbos);
 	for(int i = 0; i < NUM_PBOS; i++) {
 		GLuint pbo = m_pbos[i];
 		glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
-		glBufferData(GL_PIXEL_PACK_BUFFER, m_width * m_height * m_bbBpp, NULL,
-			GL_STREAM_READ);
+		glBufferData(GL_PIXEL_PACK_BUFFER, pboSize, NULL, GL_STREAM_READ);
 	}
 	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
 	memset(m_pboPending, 0, sizeof(m_pboPending));
@@ -170,11 +182,13 @@ void GLHook::captureBackBuffer(bool captureFrame, uint64_t timestamp)
 	// Get PBO to read from and write to
 	GLuint writePbo = m_pbos[m_nextPbo];
 	bool *writePending = &m_pboPending[m_nextPbo];
+	CaptureSharedSegment::DirtyRect *writeRect = &m_pboRects[m_nextPbo];
 	m_nextPbo++;
 	if(m_nextPbo >= NUM_PBOS)
 		m_nextPbo = 0;
 	GLuint readPbo = m_pbos[m_nextPbo];
 	bool *readPending = &m_pboPending[m_nextPbo];
+	const CaptureSharedSegment::DirtyRect &readRect = m_pboRects[m_nextPbo];
 
 	// Reset OpenGL error code so we can detect if any of the following failed
 	glGetError_mishira();
@@ -190,12 +204,40 @@ void GLHook::captureBackBuffer(bool captureFrame, uint64_t timestamp)
 		glGetIntegerv_mishira(GL_READ_BUFFER, &prevReadBuf);
 		glReadBuffer_mishira(GL_BACK);
 
-		// Queue the pixels to be copied to system memory
-		glReadPixels_mishira(
-			0, 0, m_width, m_height, m_bbGLFormat, m_bbGLType, NULL);
+		// The application can change how pixels are packed into the PBO. Use
+		// tightly packed rows that are aligned to `PACK_ALIGNMENT` bytes so
+		// that we know the stride of the data when we read it back.
+		const GLenum PACK_PARAMS[] = {
+			GL_PACK_ALIGNMENT, GL_PACK_ROW_LENGTH, GL_PACK_SKIP_ROWS,
+			GL_PACK_SKIP_PIXELS, GL_PACK_SWAP_BYTES, GL_PACK_LSB_FIRST
+		};
+		const GLint PACK_VALUES[] = {
+			(GLint)PACK_ALIGNMENT, 0, 0, 0, GL_FALSE, GL_FALSE
+		};
+		const int NUM_PACK_PARAMS = sizeof(PACK_PARAMS) / sizeof(GLenum);
+		GLint prevPack[NUM_PACK_PARAMS];
+		for(int i = 0; i < NUM_PACK_PARAMS; i++) {
+			prevPack[i] = PACK_VALUES[i];
+			glGetIntegerv_mishira(PACK_PARAMS[i], &prevPack[i]);
+			if(prevPack[i] != PACK_VALUES[i])
+				glPixelStorei_mishira(PACK_PARAMS[i], PACK_VALUES[i]);
+		}
+
+		// Queue the pixels to be copied to system memory. Only the region of
+		// interest is read back. OpenGL rows are bottom-up just like our
+		// frame data so the rectangle can be used as-is. When downscaling we
+		// read the part of the back buffer that the rectangle is made from.
+		*writeRect = getCaptureRect();
+		CaptureSharedSegment::DirtyRect srcRect = getSourceRect(*writeRect);
+		glReadPixels_mishira(srcRect.x, srcRect.y, srcRect.width,
+			srcRect.height, m_bbGLFormat, m_bbGLType, NULL);
 		*writePending = true; // Mark PBO as used
 
 		// Restore previous state
+		for(int i = 0; i < NUM_PACK_PARAMS; i++) {
+			if(prevPack[i] != PACK_VALUES[i])
+				glPixelStorei_mishira(PACK_PARAMS[i], prevPack[i]);
+		}
 		glReadBuffer_mishira(prevReadBuf);
 		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
 	}
@@ -215,10 +257,10 @@ void GLHook::captureBackBuffer(bool captureFrame, uint64_t timestamp)
 #if DO_PIXEL_DEBUG_TEST
 		uchar *test = NULL;
 #define TEST_PBO_PIXEL(x, y, r, g, b) \
-	test = &ptr[((x)+(y)*m_width)*m_bbBpp]; \
+	test = &ptr[(x)*m_bbBpp+(y)*calcPboStride(readRect.width)]; \
 	if(test[0] != (b) || test[1] != (g) || test[2] != (r)) \
-	HookLog2(InterprocessLog::Warning, stringf( \
-	"(%u, %u, %u) != (%u, %u, %u)", test[0], test[1], test[2], (b), (g), (r)))
+	HookLog2f(InterprocessLog::Warning, \
+	"(%u, %u, %u) != (%u, %u, %u)", test[0], test[1], test[2], (b), (g), (r))
 
 		// Minecraft main menu (Window size: 854x480)
 		//TEST_PBO_PIXEL(4, 6, 255, 255, 255);
@@ -232,12 +274,12 @@ void GLHook::captureBackBuffer(bool captureFrame, uint64_t timestamp)
 #undef TEST_PBO_PIXEL
 #endif // DO_PIXEL_DEBUG_TEST
 
-		// Copy data to shared memory
-		int frameNum = findUnusedFrameNum();
-		if(frameNum >= 0) {
-			writeRawPixelsToShm(frameNum, timestamp, ptr,
-				m_width * m_height * m_bbBpp);
-		}
+		// Copy data to shared memory, downscaling it if required. Rows were
+		// packed with our own `GL_PACK_ALIGNMENT`.
+		uint srcWidth = getSourceRect(readRect).width;
+		uint srcStride = calcPboStride(srcWidth);
+		if(ptr != NULL)
+			writeRawPixelsRectToShm(timestamp, ptr, srcStride, readRect);
 
 		// Unmap buffer
 		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
@@ -279,9 +321,9 @@ void GLHook::destructorEndCapturing()
 	if(doSwitch) {
 		if(wglMakeCurrent_mishira(m_hdc, m_hglrc) == FALSE) {
 			DWORD err = GetLastError();
-			HookLog2(InterprocessLog::Warning, stringf(
+			HookLog2f(InterprocessLog::Warning,
 				"Failed to properly clean up scene objects on destruction. Reason = %u",
-				err));
+				err);
 			doDestroy = false;
 			doSwitch = false;
 		}
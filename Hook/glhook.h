@@ -31,6 +31,7 @@ class GLHook : public CommonHook
 {
 private: // Constants ---------------------------------------------------------
 	static const int NUM_PBOS = 2;
+	static const uint PACK_ALIGNMENT = 4; // Row alignment of PBO data
 
 private: // Members -----------------------------------------------------------
 	HGLRC	m_hglrc;
@@ -41,6 +42,7 @@ private: // Members -----------------------------------------------------------
 	bool	m_sceneObjectsCreated;
 	GLuint	m_pbos[NUM_PBOS];
 	bool	m_pboPending[NUM_PBOS]; // `true` if PBO contains valid data
+	CaptureSharedSegment::DirtyRect	m_pboRects[NUM_PBOS]; // Area read back
 	uint	m_nextPbo;
 
 public: // Constructor/destructor ---------------------------------------------
@@ -53,6 +55,7 @@ public: // Methods ------------------------------------------------------------
 
 private:
 	bool	testForGLError();
+	uint	calcPboStride(uint width) const;
 
 protected: // Interface -------------------------------------------------------
 	virtual void			calcBackBufferPixelFormat();
@@ -297,9 +297,9 @@ int GLHookManager::createGLEWContext(
 	}
 
 	// Debugging stuff
-	HookLog(stringf("OpenGL version: %s", glGetString_mishira(GL_VERSION)));
-	//HookLog(stringf("OpenGL vender: %s", glGetString_mishira(GL_VENDOR)));
-	//HookLog(stringf("OpenGL renderer: %s", glGetString_mishira(GL_RENDERER)));
+	HookLogf("OpenGL version: %s", glGetString_mishira(GL_VERSION));
+	//HookLogf("OpenGL vender: %s", glGetString_mishira(GL_VENDOR));
+	//HookLogf("OpenGL renderer: %s", glGetString_mishira(GL_RENDERER));
 
 	// Clean up OpenGL-related stuff
 	wglMakeCurrent_mishira(prevDC, prevGLRC);
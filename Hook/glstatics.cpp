@@ -26,6 +26,7 @@
 typedef const GLubyte *(WINAPI *glGetString_t)(GLenum);
 typedef GLenum (WINAPI *glGetError_t)();
 typedef void (WINAPI *glGetIntegerv_t)(GLenum, GLint *);
+typedef void (WINAPI *glPixelStorei_t)(GLenum, GLint);
 typedef void (WINAPI *glReadBuffer_t)(GLenum);
 typedef void (WINAPI *glReadPixels_t)(
 	GLint, GLint, GLsizei, GLsizei, GLenum, GLenum, GLvoid *);
@@ -41,6 +42,7 @@ typedef BOOL (WINAPI *wglSwapLayerBuffers_t)(HDC, UINT);
 static glGetError_t glGetErrorPtr = NULL;
 static glGetString_t glGetStringPtr = NULL;
 static glGetIntegerv_t glGetIntegervPtr = NULL;
+static glPixelStorei_t glPixelStoreiPtr = NULL;
 static glReadBuffer_t glReadBufferPtr = NULL;
 static glReadPixels_t glReadPixelsPtr = NULL;
 static wglGetProcAddress_t wglGetProcAddressPtr = NULL;
@@ -88,6 +90,8 @@ bool linkGLLibrary(bool allowLoad)
 		(glGetError_t)GetProcAddress(module, "glGetError");
 	glGetIntegervPtr =
 		(glGetIntegerv_t)GetProcAddress(module, "glGetIntegerv");
+	glPixelStoreiPtr =
+		(glPixelStorei_t)GetProcAddress(module, "glPixelStorei");
 	glReadBufferPtr =
 		(glReadBuffer_t)GetProcAddress(module, "glReadBuffer");
 	glReadPixelsPtr =
@@ -121,6 +125,7 @@ void unlinkGLLibrary()
 	glGetStringPtr = NULL;
 	glGetErrorPtr = NULL;
 	glGetIntegervPtr = NULL;
+	glPixelStoreiPtr = NULL;
 	glReadBufferPtr = NULL;
 	glReadPixelsPtr = NULL;
 	wglGetProcAddressPtr = NULL;
@@ -151,6 +156,11 @@ extern "C" void WINAPI glGetIntegerv_mishira(GLenum pname, GLint *params)
 	(*glGetIntegervPtr)(pname, params);
 }
 
+extern "C" void WINAPI glPixelStorei_mishira(GLenum pname, GLint param)
+{
+	(*glPixelStoreiPtr)(pname, param);
+}
+
 extern "C" void WINAPI glReadBuffer_mishira(GLenum mode)
 {
 	(*glReadBufferPtr)(mode);
@@ -73,6 +73,7 @@ extern "C"
 	extern const GLubyte * WINAPI glGetString_mishira(GLenum);
 	extern GLenum WINAPI glGetError_mishira();
 	extern void WINAPI glGetIntegerv_mishira(GLenum, GLint *);
+	extern void WINAPI glPixelStorei_mishira(GLenum, GLint);
 	extern void WINAPI glReadBuffer_mishira(GLenum);
 	extern void WINAPI glReadPixels_mishira(
 		GLint, GLint, GLsizei, GLsizei, GLenum, GLenum, GLvoid *);
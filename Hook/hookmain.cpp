@@ -21,9 +21,11 @@
 #include "dxgihookmanager.h"
 #include "glhookmanager.h"
 #include "../Common/boostincludes.h"
+#include "../Common/cpuinfo.h"
 #include "../Common/datatypes.h"
 #include "../Common/interprocesslog.h"
 #include "../Common/stlhelpers.h"
+#include "../Common/workerpool.h"
 #include <d3d10_1.h>
 #include <psapi.h>
 
@@ -48,13 +50,7 @@ HookMain::HookMain()
 	, m_dummyDX10(NULL)
 	, m_dummyDX10Ref(0)
 	, m_exeFilename()
-
-	// Performance timer
-	//, m_startTick()
-	//, m_lastTime()
-	//, m_startTime()
-	//, m_frequency()
-	, m_timerMask(0)
+	, m_clock(&m_shm)
 
 	// Hook managers
 	, m_d3d9Manager(NULL)
@@ -95,6 +91,10 @@ HookMain::~HookMain()
 	m_dxgiManager = NULL;
 	m_glManager = NULL;
 
+	// Must be destroyed after the hooks have been removed as the callbacks
+	// use it to copy frames
+	WorkerPool::destroyShared();
+
 	s_instance = NULL;
 }
 
@@ -115,9 +115,19 @@ int HookMain::exec(void *param)
 	}
 
 	HookLog("Successfully hooked");
-
-	// Begin performance timer
-	beginPerformanceTimer();
+	HookLogf("CPU features: %s", getCpuFeaturesString().data());
+
+	// Large frame copies are split across a pool of worker threads. The pool
+	// must be created here instead of in `DllMain()`. We share the CPUs with
+	// the application that we are hooked into so the threads are only pinned
+	// if the main application asks for it.
+	uint numThreads = m_shm.getHookPoolThreads();
+	if(numThreads == 0)
+		numThreads = WorkerPool::getDefaultNumThreads();
+	bool pinThreads = m_shm.getHookPoolPinned();
+	WorkerPool *pool = WorkerPool::initializeShared(numThreads, pinThreads);
+	HookLogf("Frame copy threads: %u%s", pool->getNumThreads(),
+		pinThreads ? " (Pinned)" : "");
 
 	// Register dummy window class
 	WNDCLASS wc;
@@ -281,9 +291,9 @@ ID3D10Device *HookMain::refDummyDX10Device()
 				D3D10_1_SDK_VERSION, // _In_ UINT SDKVersion,
 				&d3d101Dev); // _Out_ ID3D10Device1 **ppDevice
 			if(FAILED(res)) {
-				HookLog2(InterprocessLog::Warning, stringf(
+				HookLog2f(InterprocessLog::Warning,
 					"Failed to create DirectX 10.1 device. Reason = 0x%x",
-					res));
+					res);
 				m_dummyDX10Ref--;
 				return NULL;
 			}
@@ -292,16 +302,16 @@ ID3D10Device *HookMain::refDummyDX10Device()
 			res = d3d101Dev->QueryInterface(
 				__uuidof(ID3D10Device), (void **)&m_dummyDX10);
 			if(FAILED(res)) {
-				HookLog2(InterprocessLog::Warning, stringf(
+				HookLog2f(InterprocessLog::Warning,
 					"Failed to create DirectX 10 device from DirectX 10.1 device. "
-					"Reason = 0x%x", res));
+					"Reason = 0x%x", res);
 				m_dummyDX10Ref--;
 				return NULL;
 			}
 			d3d101Dev->Release(); // `QueryInterface()` adds a reference
 		} else {
-			HookLog2(InterprocessLog::Warning, stringf(
-				"Failed to create DirectX 10 device. Reason = 0x%x", res));
+			HookLog2f(InterprocessLog::Warning,
+				"Failed to create DirectX 10 device. Reason = 0x%x", res);
 			m_dummyDX10Ref--;
 			return NULL;
 		}
@@ -321,106 +331,6 @@ void HookMain::derefDummyDX10Device()
 	m_dummyDX10 = NULL;
 }
 
-/// <summary>
-/// Begins the high-performance timer for the main loop. Also sets thread
-/// affinity for timer stability if it is required.
-/// </summary>
-/// <returns>True if a timer was successfully created.</returns>
-bool HookMain::beginPerformanceTimer()
-{
-	// This method is based on `Ogre::Timer`
-
-	DWORD_PTR	procMask;
-	DWORD_PTR	sysMask;
-
-	// Get the current process core mask
-	GetProcessAffinityMask(GetCurrentProcess(), &procMask, &sysMask);
-	if(procMask == 0)
-		procMask = 1; // Assume there is only one core available
-
-	// Find the highest core that this process uses
-	if(m_timerMask == 0) {
-		m_timerMask = (DWORD_PTR)1 << (sizeof(m_timerMask) * 8 - 1);
-		while((m_timerMask & procMask) == 0) {
-			m_timerMask >>= 1;
-			if(m_timerMask == 0) {
-				//HookLog2(InterprocessLog::Warning,
-				//	"Cannot determine process affinity");
-				return false;
-			}
-		}
-	}
-
-#define SET_THREAD_AFFINITY 0
-#if SET_THREAD_AFFINITY
-	// Set current thread affinity to the highest core
-	oldMask = SetThreadAffinityMask(GetCurrentThread(), m_timerMask);
-#endif
-
-	// Get the frequency of the performance counter
-	QueryPerformanceFrequency(&m_frequency);
-	if(m_frequency.QuadPart == 0) {
-		// System doesn't has a performance timer
-		//HookLog2(InterprocessLog::Warning,
-		//	"No performance timer available on system");
-		return false;
-	}
-	//HookLog(stringf("Performance timer frequency = %d Hz",
-	//	m_frequency.QuadPart));
-	if(m_frequency.QuadPart < 200) {
-		// Performance timer has a resolution of less than 5ms
-		//HookLog2(InterprocessLog::Warning,
-		//	"Performance timer isn't performant enough to use");
-		return false;
-	}
-
-	// Query the timer
-	QueryPerformanceCounter(&m_startTime);
-	m_startTick = GetTickCount();
-	m_lastTime = 0;
-
-	return true;
-}
-
-/// <summary>
-/// Returns the number of microseconds that have passed since the main loop
-/// began.
-/// </summary>
-uint64_t HookMain::getUsecSinceExec()
-{
-	// This method is based on `Ogre::Timer`
-
-	LARGE_INTEGER	curTime;
-	LONGLONG		timeSinceStart;
-
-	if(m_timerMask == 0)
-		return 0; // Haven't started timer yet
-
-	// Query the timer
-	QueryPerformanceCounter(&curTime);
-	timeSinceStart = curTime.QuadPart - m_startTime.QuadPart;
-
-	// Convert to milliseconds for `GetTickCount()` comparison
-	unsigned long newTicks =
-		(unsigned long)(1000LL * timeSinceStart / m_frequency.QuadPart);
-
-	// Compensate for performance counter leaps (See Microsoft KB: Q274323)
-	unsigned long check = GetTickCount() - m_startTick;
-	signed long msecOff = (signed long)(newTicks - check);
-	if(msecOff < -100 || msecOff > 100) {
-		// Anomaly detected, compensate
-		LONGLONG adjust = min(
-			msecOff * m_frequency.QuadPart / 1000,
-			timeSinceStart - m_lastTime);
-		m_startTime.QuadPart += adjust;
-		timeSinceStart -= adjust;
-	}
-	m_lastTime = timeSinceStart;
-
-	// Convert to microseconds and return
-	return (uint64_t)(1000000LL * timeSinceStart / m_frequency.QuadPart);
-}
-
 void HookMain::attemptToHook()
 {
 	m_d3d9Manager->attemptToHook();
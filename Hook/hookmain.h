@@ -18,13 +18,14 @@
 #ifndef HOOKMAIN_H
 #define HOOKMAIN_H
 
+#include "../Common/captureclock.h"
+#include "../Common/interprocesslog.h"
 #include "../Common/mainsharedsegment.h"
 #include <windows.h>
 
 class D3D9HookManager;
 class DXGIHookManager;
 class GLHookManager;
-class InterprocessLog;
 struct ID3D10Device;
 
 #define HookLog(msg) \
@@ -34,6 +35,17 @@ struct ID3D10Device;
 	if(HookMain::s_instance->getLog() != NULL) \
 	HookMain::s_instance->getLog()->log((lvl), (msg))
 
+// Same as the above except that the message is a `printf()`-style format
+// string that is only formatted by the main application. Use these instead
+// of `stringf()` as they never allocate memory in the hooked process.
+#define HookLogf(fmt, ...) \
+	if(HookMain::s_instance->getLog() != NULL) \
+	HookMain::s_instance->getLog()->logf( \
+	InterprocessLog::Notice, (fmt), __VA_ARGS__)
+#define HookLog2f(lvl, fmt, ...) \
+	if(HookMain::s_instance->getLog() != NULL) \
+	HookMain::s_instance->getLog()->logf((lvl), (fmt), __VA_ARGS__)
+
 //=============================================================================
 class HookMain
 {
@@ -50,12 +62,7 @@ private: // Members -----------------------------------------------------------
 	int					m_dummyDX10Ref;
 	string				m_exeFilename;
 
-	// Performance timer
-	DWORD				m_startTick;
-	LONGLONG			m_lastTime;
-	LARGE_INTEGER		m_startTime;
-	LARGE_INTEGER		m_frequency;
-	DWORD_PTR			m_timerMask;
+	CaptureClock		m_clock;
 
 	// Hook managers
 	D3D9HookManager *	m_d3d9Manager;
@@ -78,10 +85,7 @@ public: // Methods ------------------------------------------------------------
 	ID3D10Device *		refDummyDX10Device();
 	void				derefDummyDX10Device();
 
-	// Performance timer
-	uint64_t	getUsecSinceExec();
-private:
-	bool		beginPerformanceTimer();
+	uint64_t	getCaptureUsec();
 
 private:
 	void		attemptToHook();
@@ -93,6 +97,15 @@ inline MainSharedSegment *HookMain::getShm()
 	return &m_shm;
 }
 
+/// <summary>
+/// Returns the current time of the main application's capture clock. Every
+/// frame timestamp must be in this clock.
+/// </summary>
+inline uint64_t HookMain::getCaptureUsec()
+{
+	return m_clock.now();
+}
+
 inline InterprocessLog *HookMain::getLog() const
 {
 	return m_log;
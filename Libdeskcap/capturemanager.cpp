@@ -21,8 +21,10 @@
 #ifdef Q_OS_WIN
 #include "wincapturemanager.h"
 #endif
+#include "../Common/captureclock.h"
 #include "../Common/datatypes.h"
 #include "../Common/mainsharedsegment.h"
+#include "../Common/workerpool.h"
 #include <QtCore/QCoreApplication>
 #include <QtCore/QDir>
 
@@ -123,12 +125,21 @@ CaptureManager::~CaptureManager()
 	delete m_hookManager;
 	m_hookManager = NULL;
 
+	// Destroy the frame copy worker pool
+	WorkerPool::destroyShared();
+
 	// Make sure that the helpers are always terminated
 	terminateHelpers();
 }
 
 bool CaptureManager::initialize()
 {
+	// Large frame copies are split across a pool of worker threads
+	WorkerPool *pool = WorkerPool::initializeShared(
+		WorkerPool::getDefaultNumThreads(), true);
+	capLog() << QStringLiteral("Frame copy threads: %1")
+		.arg(pool->getNumThreads());
+
 	// Create hook manager
 	m_hookManager = new HookManager();
 	if(!m_hookManager->initialize())
@@ -220,6 +231,21 @@ void CaptureManager::setFuzzyCapture(bool useFuzzyCap)
 	shm->setFuzzyCapture(useFuzzyCap);
 }
 
+/// <summary>
+/// Sets the size of the frame copy worker pool that hooks create inside every
+/// hooked application and whether its threads are pinned to CPUs. By default
+/// hooks use `WorkerPool::getDefaultNumThreads()` unpinned threads as they
+/// share the CPUs with the application. A size of zero restores the default.
+/// Only affects applications that are hooked afterwards.
+/// </summary>
+void CaptureManager::setHookWorkerPool(uint numThreads, bool pinThreads)
+{
+	MainSharedSegment *shm = m_hookManager->getMainSharedSegment();
+	if(shm == NULL)
+		return;
+	shm->setHookPool((uint32_t)numThreads, pinThreads);
+}
+
 uint CaptureManager::getVideoFrequencyNum()
 {
 	MainSharedSegment *shm = m_hookManager->getMainSharedSegment();
@@ -244,6 +270,33 @@ void CaptureManager::setVideoFrequency(uint numerator, uint denominator)
 	shm->setVideoFrequency((uint32_t)numerator, (uint32_t)denominator);
 }
 
+/// <summary>
+/// Returns the current time of the clock that every frame timestamp is in.
+/// See `CaptureObject::getFrameTimestamp()`.
+/// </summary>
+quint64 CaptureManager::getCaptureClockUsec() const
+{
+	CaptureClock *clock = m_hookManager->getCaptureClock();
+	if(clock == NULL)
+		return 0;
+	return (quint64)clock->now();
+}
+
+/// <summary>
+/// Steers the capture clock towards an external clock, such as the audio
+/// clock of the application, that currently reads `refUsec` so that frame
+/// timestamps can be aligned with it. Should be called regularly. The first
+/// call steps the capture clock to the external clock, afterwards small
+/// differences are slewed away without the capture clock ever jumping.
+/// </summary>
+void CaptureManager::calibrateCaptureClock(quint64 refUsec)
+{
+	CaptureClock *clock = m_hookManager->getCaptureClock();
+	if(clock == NULL)
+		return;
+	clock->calibrate((uint64_t)refUsec);
+}
+
 void CaptureManager::refLowJitterMode()
 {
 	m_lowJitterModeRef++;
@@ -25,3 +25,20 @@ CaptureObject::CaptureObject()
 CaptureObject::~CaptureObject()
 {
 }
+
+/// <summary>
+/// Returns the smallest rectangle that contains every region of interest in
+/// `rois`. An empty region means that the entire source is required so if any
+/// of the regions are empty then so is the result.
+/// </summary>
+QRect CaptureObject::unionRegionsOfInterest(const QVector<QRect> &rois)
+{
+	QRect ret;
+	for(int i = 0; i < rois.size(); i++) {
+		const QRect &roi = rois.at(i);
+		if(roi.isEmpty())
+			return QRect();
+		ret |= roi;
+	}
+	return ret;
+}
@@ -18,8 +18,12 @@
 #include "hookmanager.h"
 #include "include/caplog.h"
 #include "include/capturemanager.h"
+#include "include/captureobject.h"
+#include "../Common/captureclock.h"
+#include "../Common/framepacer.h"
 #include "../Common/interprocesslog.h"
 #include "../Common/mainsharedsegment.h"
+#include "../Common/stlhelpers.h"
 
 const QString LOG_CAT = QStringLiteral("Hooking");
 
@@ -72,8 +76,13 @@ HookManager::HookManager()
 	: QObject()
 	, m_shm(NULL)
 	, m_interprocessLog(NULL)
+	, m_captureClock(NULL)
 	, m_knownWindows()
 	, m_capturingWindows()
+	, m_registryGeneration(0)
+	, m_registryScanned(false)
+	, m_tickEstimator(new TickEstimator())
+	, m_tickTimestamp(0)
 {
 	m_knownWindows.reserve(16);
 	m_capturingWindows.reserve(16);
@@ -105,6 +114,8 @@ HookManager::~HookManager()
 	}
 
 	// Delete memory segment
+	delete m_captureClock;
+	m_captureClock = NULL;
 	if(m_shm != NULL) {
 		// Notify hooks that they should terminate
 		m_shm->setProcessRunning(false);
@@ -112,6 +123,9 @@ HookManager::~HookManager()
 		delete m_shm;
 		m_shm = NULL;
 	}
+
+	delete m_tickEstimator;
+	m_tickEstimator = NULL;
 }
 
 bool HookManager::initialize()
@@ -155,6 +169,12 @@ bool HookManager::initialize()
 		return false;
 	}
 
+	// Create the clock domain that hooks timestamp their frames in. If
+	// another instance is already running then we share its domain and only
+	// take it over once that instance stops refreshing it.
+	m_captureClock = new CaptureClock(m_shm);
+	m_captureClock->createDomain();
+
 	// Notify hooks that we are now managing the shared memory
 	m_shm->setProcessRunning(true);
 
@@ -181,17 +201,177 @@ bool HookManager::isWindowCapturing(WinId win) const
 	return false;
 }
 
-void HookManager::refWindowHooked(WinId win)
+/// <summary>
+/// Adds a capture reference to a window. `roi` is the region of the window
+/// that the referencing object needs in top-down client coordinates, an empty
+/// rectangle means the entire window. The hook only reads back the union of
+/// the regions of every consumer. `outSize` is the size that the referencing
+/// object wants the window downscaled to, an empty size means the full size.
+/// The hook downscales to the largest size that any consumer requested.
+/// `framePeriodUsec` is the interval that the referencing object wants frames
+/// at, zero means every video frame. The hook captures at the shortest
+/// period that any consumer requested. `compress` allows the hook to
+/// losslessly compress frames, it only does so if every consumer allowed it.
+/// </summary>
+void HookManager::refWindowHooked(
+	WinId win, const QRect &roi, const QSize &outSize, uint framePeriodUsec,
+	bool compress)
+{
+	refDerefWindowHooked(
+		win, true, roi, outSize, framePeriodUsec, compress);
+}
+
+/// <summary>
+/// Removes a capture reference from a window. `roi`, `outSize`,
+/// `framePeriodUsec` and `compress` must be the same as what the reference
+/// was added or last changed with.
+/// </summary>
+void HookManager::derefWindowHooked(
+	WinId win, const QRect &roi, const QSize &outSize, uint framePeriodUsec,
+	bool compress)
 {
-	refDerefWindowHooked(win, true);
+	refDerefWindowHooked(
+		win, false, roi, outSize, framePeriodUsec, compress);
+}
+
+/// <summary>
+/// Changes the region of interest of an existing capture reference.
+/// </summary>
+void HookManager::changeWindowRoi(
+	WinId win, const QRect &oldRoi, const QRect &newRoi)
+{
+	if(oldRoi == newRoi)
+		return;
+	m_shm->lockHookRegistry();
+
+	HookRegEntry *entry =
+		m_shm->findWindowInHookRegistry(reinterpret_cast<uint32_t>(win));
+	KnownWin *known = findKnownWindow(win);
+	if(entry == NULL || known == NULL) {
+		// Not found in registry or unknown window
+		m_shm->unlockHookRegistry();
+		return;
+	}
+	int index = known->rois.indexOf(oldRoi);
+	if(index < 0) {
+		// Not referenced
+		m_shm->unlockHookRegistry();
+		return;
+	}
+	known->rois[index] = newRoi;
+	updateRegistryRoi(entry, known);
+
+	m_shm->unlockHookRegistry();
 }
 
-void HookManager::derefWindowHooked(WinId win)
+/// <summary>
+/// Returns the union of the regions of interest of every capture reference
+/// that our process has to the window.
+/// </summary>
+/// <returns>An empty rectangle if the entire window is required</returns>
+QRect HookManager::getWindowRoi(WinId win) const
 {
-	refDerefWindowHooked(win, false);
+	for(int i = 0; i < m_knownWindows.size(); i++) {
+		const KnownWin &known = m_knownWindows.at(i);
+		if(known.winId == win)
+			return CaptureObject::unionRegionsOfInterest(known.rois);
+	}
+	return QRect();
 }
 
-void HookManager::refDerefWindowHooked(WinId win, bool capture)
+/// <summary>
+/// Changes the requested output size of an existing capture reference.
+/// </summary>
+void HookManager::changeWindowOutputSize(
+	WinId win, const QSize &oldSize, const QSize &newSize)
+{
+	if(oldSize == newSize)
+		return;
+	m_shm->lockHookRegistry();
+
+	HookRegEntry *entry =
+		m_shm->findWindowInHookRegistry(reinterpret_cast<uint32_t>(win));
+	KnownWin *known = findKnownWindow(win);
+	if(entry == NULL || known == NULL) {
+		// Not found in registry or unknown window
+		m_shm->unlockHookRegistry();
+		return;
+	}
+	int index = known->outSizes.indexOf(oldSize);
+	if(index < 0) {
+		// Not referenced
+		m_shm->unlockHookRegistry();
+		return;
+	}
+	known->outSizes[index] = newSize;
+	updateRegistryOutputSize(entry, known);
+
+	m_shm->unlockHookRegistry();
+}
+
+/// <summary>
+/// Changes the requested frame period of an existing capture reference.
+/// </summary>
+void HookManager::changeWindowFramePeriod(
+	WinId win, uint oldPeriodUsec, uint newPeriodUsec)
+{
+	if(oldPeriodUsec == newPeriodUsec)
+		return;
+	m_shm->lockHookRegistry();
+
+	HookRegEntry *entry =
+		m_shm->findWindowInHookRegistry(reinterpret_cast<uint32_t>(win));
+	KnownWin *known = findKnownWindow(win);
+	if(entry == NULL || known == NULL) {
+		// Not found in registry or unknown window
+		m_shm->unlockHookRegistry();
+		return;
+	}
+	int index = known->framePeriods.indexOf(oldPeriodUsec);
+	if(index < 0) {
+		// Not referenced
+		m_shm->unlockHookRegistry();
+		return;
+	}
+	known->framePeriods[index] = newPeriodUsec;
+	updateRegistryFramePeriod(entry, known);
+
+	m_shm->unlockHookRegistry();
+}
+
+/// <summary>
+/// Changes if an existing capture reference allows compressed frames.
+/// </summary>
+void HookManager::changeWindowCompression(
+	WinId win, bool oldCompress, bool newCompress)
+{
+	if(oldCompress == newCompress)
+		return;
+	m_shm->lockHookRegistry();
+
+	HookRegEntry *entry =
+		m_shm->findWindowInHookRegistry(reinterpret_cast<uint32_t>(win));
+	KnownWin *known = findKnownWindow(win);
+	if(entry == NULL || known == NULL) {
+		// Not found in registry or unknown window
+		m_shm->unlockHookRegistry();
+		return;
+	}
+	int index = known->compressions.indexOf(oldCompress);
+	if(index < 0) {
+		// Not referenced
+		m_shm->unlockHookRegistry();
+		return;
+	}
+	known->compressions[index] = newCompress;
+	updateRegistryCompression(entry, known);
+
+	m_shm->unlockHookRegistry();
+}
+
+void HookManager::refDerefWindowHooked(
+	WinId win, bool capture, const QRect &roi, const QSize &outSize,
+	uint framePeriodUsec, bool compress)
 {
 	m_shm->lockHookRegistry();
 
@@ -205,29 +385,60 @@ void HookManager::refDerefWindowHooked(WinId win, bool capture)
 	}
 
 	// Get known structure
-	KnownWin *known = NULL;
-	for(int i = 0; i < m_knownWindows.size(); i++) {
-		if(m_knownWindows.at(i).winId == win) {
-			known = &m_knownWindows[i];
-			break;
-		}
-	}
+	KnownWin *known = findKnownWindow(win);
 	if(known == NULL) {
 		// Unknown window
 		m_shm->unlockHookRegistry();
 		return;
 	}
 
+	// Other processes may also be capturing the same window so the registry
+	// holds a single reference for our entire process. Our region of
+	// interest, output size, frame period and compression must be removed
+	// before we release the reference.
 	if(capture) {
 		known->captureRef++;
+		known->rois.append(roi);
+		known->outSizes.append(outSize);
+		known->framePeriods.append(framePeriodUsec);
+		known->compressions.append(compress);
 		if(known->captureRef == 1) {
 			// Begin capturing
-			entry->flags |= HookRegEntry::CaptureFlag;
+			m_shm->refHookRegistryCapture(entry, true);
 		}
+		updateRegistryRoi(entry, known);
+		updateRegistryOutputSize(entry, known);
+		updateRegistryFramePeriod(entry, known);
+		updateRegistryCompression(entry, known);
 	} else {
+		int index = known->rois.indexOf(roi);
+		if(index >= 0)
+			known->rois.remove(index);
+		index = known->outSizes.indexOf(outSize);
+		if(index >= 0)
+			known->outSizes.remove(index);
+		index = known->framePeriods.indexOf(framePeriodUsec);
+		if(index >= 0)
+			known->framePeriods.remove(index);
+		index = known->compressions.indexOf(compress);
+		if(index >= 0)
+			known->compressions.remove(index);
 		if(known->captureRef == 1) {
 			// End capturing
-			entry->flags &= ~HookRegEntry::CaptureFlag;
+			known->rois.clear();
+			known->outSizes.clear();
+			known->framePeriods.clear();
+			known->compressions.clear();
+			updateRegistryRoi(entry, known);
+			updateRegistryOutputSize(entry, known);
+			updateRegistryFramePeriod(entry, known);
+			updateRegistryCompression(entry, known);
+			m_shm->refHookRegistryCapture(entry, false);
+		} else {
+			updateRegistryRoi(entry, known);
+			updateRegistryOutputSize(entry, known);
+			updateRegistryFramePeriod(entry, known);
+			updateRegistryCompression(entry, known);
 		}
 		if(known->captureRef > 0)
 			known->captureRef--;
@@ -236,6 +447,98 @@ void HookManager::refDerefWindowHooked(WinId win, bool capture)
 	m_shm->unlockHookRegistry();
 }
 
+HookManager::KnownWin *HookManager::findKnownWindow(WinId win)
+{
+	for(int i = 0; i < m_knownWindows.size(); i++) {
+		if(m_knownWindows.at(i).winId == win)
+			return &m_knownWindows[i];
+	}
+	return NULL;
+}
+
+/// <summary>
+/// Publishes the union of our regions of interest of a window to the hook
+/// registry.
+///
+/// WARNING: The hook registry must be locked before calling this method!
+/// </summary>
+void HookManager::updateRegistryRoi(
+	HookRegEntry *entry, const KnownWin *known)
+{
+	QRect roi = CaptureObject::unionRegionsOfInterest(known->rois);
+	if(roi.isEmpty()) {
+		m_shm->setHookRegistryRoi(entry, getProcessId(), 0, 0, 0, 0);
+		return;
+	}
+	m_shm->setHookRegistryRoi(entry, getProcessId(), roi.x(), roi.y(),
+		roi.width(), roi.height());
+}
+
+/// <summary>
+/// Publishes the largest of our requested output sizes of a window to the
+/// hook registry. If any of our capture references needs the full size then
+/// so does our process.
+///
+/// WARNING: The hook registry must be locked before calling this method!
+/// </summary>
+void HookManager::updateRegistryOutputSize(
+	HookRegEntry *entry, const KnownWin *known)
+{
+	QSize size;
+	for(int i = 0; i < known->outSizes.size(); i++) {
+		const QSize &outSize = known->outSizes.at(i);
+		if(outSize.isEmpty()) {
+			size = QSize();
+			break;
+		}
+		size = size.expandedTo(outSize);
+	}
+	if(size.isEmpty()) {
+		m_shm->setHookRegistryOutputSize(entry, getProcessId(), 0, 0);
+		return;
+	}
+	m_shm->setHookRegistryOutputSize(
+		entry, getProcessId(), size.width(), size.height());
+}
+
+/// <summary>
+/// Publishes the shortest of our requested frame periods of a window to the
+/// hook registry. If any of our capture references needs every video frame
+/// then so does our process.
+///
+/// WARNING: The hook registry must be locked before calling this method!
+/// </summary>
+void HookManager::updateRegistryFramePeriod(
+	HookRegEntry *entry, const KnownWin *known)
+{
+	uint period = 0;
+	for(int i = 0; i < known->framePeriods.size(); i++) {
+		uint framePeriod = known->framePeriods.at(i);
+		if(framePeriod == 0) {
+			period = 0;
+			break;
+		}
+		if(period == 0 || framePeriod < period)
+			period = framePeriod;
+	}
+	m_shm->setHookRegistryFramePeriod(entry, getProcessId(), period);
+}
+
+/// <summary>
+/// Publishes if the hook may compress frames of a window to the hook
+/// registry. Our process only allows it if every one of our capture
+/// references does.
+///
+/// WARNING: The hook registry must be locked before calling this method!
+/// </summary>
+void HookManager::updateRegistryCompression(
+	HookRegEntry *entry, const KnownWin *known)
+{
+	bool compress = !known->compressions.isEmpty() &&
+		!known->compressions.contains(false);
+	m_shm->setHookRegistryCompression(entry, getProcessId(), compress);
+}
+
 /// <summary>
 /// Check the interprocess log for messages and process them if there is any.
 /// </summary>
@@ -244,6 +547,19 @@ void HookManager::processInterprocessLog(bool output)
 	if(m_interprocessLog == NULL)
 		return;
 	vector<InterprocessLog::LogData> msgs = m_interprocessLog->emptyLog();
+
+	// Hooks never block on the log so messages are dropped if we don't empty
+	// it fast enough
+	for(int i = 0; i < InterprocessLog::NUM_LOG_LEVELS; i++) {
+		uint32_t numDropped = m_interprocessLog->takeNumDropped(
+			(InterprocessLog::LogLevel)i);
+		if(numDropped == 0 || !output)
+			continue;
+		capLog(LOG_CAT, CapLog::Warning)
+			<< QStringLiteral("Interprocess log was full, dropped %1 messages of level %2")
+			.arg(numDropped).arg(i);
+	}
+
 	if(msgs.empty() || !output)
 		return;
 	for(uint i = 0; i < msgs.size(); i++) {
@@ -262,9 +578,9 @@ void HookManager::processInterprocessLog(bool output)
 			break;
 		}
 
-		// Convert C-strings to QStrings
-		QString cat = QString::fromUtf8(msgs[i].cat);
-		QString msg = QString::fromUtf8(msgs[i].msg);
+		// Convert to QStrings
+		QString cat = QString::fromUtf8(msgs[i].cat.data());
+		QString msg = QString::fromUtf8(msgs[i].msg.data());
 
 		// Output to our log
 		capLog(cat, lvl) << msg;
@@ -276,6 +592,14 @@ void HookManager::processInterprocessLog(bool output)
 /// </summary>
 void HookManager::processRegistry()
 {
+	// Every modification to the registry increments its generation so if it
+	// hasn't changed since our last scan then there is nothing to do
+	if(m_registryScanned &&
+		m_shm->getHookRegistryGeneration() == m_registryGeneration)
+	{
+		return;
+	}
+
 	CaptureManager *capMgr = CaptureManager::getManager();
 
 	// To reduce the chance of interprocess deadlocks we emit our signals
@@ -292,11 +616,14 @@ void HookManager::processRegistry()
 		return;
 	}
 
-	// Find new windows
-	uint numEntries = 0;
-	HookRegEntry *entries = m_shm->iterateHookRegistry(numEntries);
-	for(uint i = 0; i < numEntries; i++) {
+	// Find new windows. The registry is a hash table so not every slot in it
+	// contains a window.
+	uint tableSize = 0;
+	HookRegEntry *entries = m_shm->iterateHookRegistry(tableSize);
+	for(uint i = 0; i < tableSize; i++) {
 		HookRegEntry *entry = &entries[i];
+		if(!entry->isUsed())
+			continue;
 		WinId winId = reinterpret_cast<WinId>(entry->winId);
 		bool found = false;
 		for(int j = 0; j < m_knownWindows.size(); j++) {
@@ -312,6 +639,7 @@ void HookManager::processRegistry()
 			KnownWin known;
 			known.winId = winId;
 			known.captureRef = 0;
+			known.shmName = 0;
 			m_knownWindows.append(known);
 			emitHooked.append(winId);
 		}
@@ -321,13 +649,7 @@ void HookManager::processRegistry()
 	for(int i = 0; i < m_knownWindows.size(); i++) {
 		WinId winId = m_knownWindows.at(i).winId;
 		uint32_t winId32 = reinterpret_cast<uint32_t>(winId);
-		bool found = false;
-		for(uint j = 0; j < numEntries; j++) {
-			if(winId32 == entries[j].winId) {
-				found = true;
-				break;
-			}
-		}
+		bool found = (m_shm->findWindowInHookRegistry(winId32) != NULL);
 		if(!found) {
 			if(isWindowCapturing(winId)) {
 				// Must be emitted before `windowUnhooked()`
@@ -349,16 +671,31 @@ void HookManager::processRegistry()
 
 	// Detect when windows have begun or stopped capturing or when an existing
 	// window capture has been reset (Most likely due to changing size)
-	for(uint i = 0; i < numEntries; i++) {
+	for(uint i = 0; i < tableSize; i++) {
 		HookRegEntry *entry = &entries[i];
+		if(!entry->isUsed())
+			continue;
 		WinId winId = reinterpret_cast<WinId>(entry->winId);
 
-		// SHM reset signal
-		if(entry->flags & HookRegEntry::ShmResetFlag) {
+		// SHM reset signal. If another consumer process already acknowledged
+		// the reset flag then we detect the reset by the segment changing.
+		KnownWin *known = NULL;
+		for(int j = 0; j < m_knownWindows.size(); j++) {
+			if(m_knownWindows.at(j).winId == winId) {
+				known = &m_knownWindows[j];
+				break;
+			}
+		}
+		bool shmChanged = (known != NULL && known->shmName != 0 &&
+			entry->shmName != 0 && known->shmName != entry->shmName);
+		if(known != NULL)
+			known->shmName = entry->shmName;
+		if((entry->flags & HookRegEntry::ShmResetFlag) || shmChanged) {
 			capLog(LOG_CAT)
 				<< QStringLiteral("Window \"%1\" has reset capturing")
 				.arg(capMgr->getWindowDebugString(winId));
-			entry->flags &= ~HookRegEntry::ShmResetFlag; // Clear flag
+			m_shm->setHookRegistryFlags(
+				entry, 0, HookRegEntry::ShmResetFlag); // Clear flag
 			emitReset.append(winId);
 		}
 
@@ -385,6 +722,11 @@ void HookManager::processRegistry()
 		}
 	}
 
+	// Nobody else can modify the registry while we have it locked so this
+	// includes our own modifications above
+	m_registryGeneration = m_shm->getHookRegistryGeneration();
+	m_registryScanned = true;
+
 	m_shm->unlockHookRegistry();
 
 	// Emit signals outside of the lock to help prevent deadlocks
@@ -400,8 +742,48 @@ void HookManager::processRegistry()
 		emit windowStoppedCapturing(emitStoppedCapturing.at(i));
 }
 
+/// <summary>
+/// Measures the time of the current video frame tick and publishes our
+/// estimate of the tick grid so that hooks can time their captures.
+/// `lateByUsec` is how late this tick was processed which we remove as hooks
+/// only need to be ready by the time that the tick was scheduled. The
+/// scheduled time is also remembered so that capture objects can select the
+/// frame that is closest to it.
+/// </summary>
+void HookManager::publishTick(int lateByUsec)
+{
+	m_tickTimestamp = 0;
+	if(m_shm == NULL)
+		return;
+	uint64_t freqNum = (uint64_t)m_shm->getVideoFrequencyNum();
+	uint64_t freqDenom = (uint64_t)m_shm->getVideoFrequencyDenom();
+	if(freqNum == 0)
+		return; // Not ticking
+	uint64_t periodNsec = freqDenom * 1000000000ULL / freqNum;
+	if(periodNsec != m_tickEstimator->getNominalPeriodNsec())
+		m_tickEstimator->reset(periodNsec);
+
+	uint64_t tickUsec = getMonotonicUsec();
+	if(lateByUsec > 0 && (uint64_t)lateByUsec < tickUsec)
+		tickUsec -= (uint64_t)lateByUsec;
+	m_tickEstimator->addTick(tickUsec);
+	if(m_tickEstimator->isLocked())
+		tickUsec = m_tickEstimator->getTickUsec(); // Without jitter
+	if(m_captureClock != NULL)
+		m_tickTimestamp = (quint64)m_captureClock->fromMonotonic(tickUsec);
+	if(!m_tickEstimator->isLocked())
+		return; // Hooks use their own timing until we are stable
+
+	ConsumerTickState state;
+	m_tickEstimator->getState(&state);
+	m_shm->publishConsumerTicks(state);
+}
+
 void HookManager::realTimeFrameEvent(int numDropped, int lateByUsec)
 {
+	publishTick(lateByUsec);
+	if(m_captureClock != NULL)
+		m_captureClock->heartbeat();
 	processRegistry();
 	processInterprocessLog();
 }
@@ -23,8 +23,11 @@
 #include <QtCore/QObject>
 #include <QtCore/QVector>
 
+class CaptureClock;
 class InterprocessLog;
 class MainSharedSegment;
+class TickEstimator;
+struct HookRegEntry;
 
 //=============================================================================
 class HookManager : public QObject
@@ -33,15 +36,25 @@ class HookManager : public QObject
 
 private: // Datatypes ---------------------------------------------------------
 	struct KnownWin {
-		WinId	winId;
-		int		captureRef;
+		WinId		winId;
+		int			captureRef;
+		uint32_t	shmName; // Used to detect resets by other processes
+		QVector<QRect>	rois; // One per capture reference, empty = everything
+		QVector<QSize>	outSizes; // One per capture reference, empty = full
+		QVector<uint>	framePeriods; // One per reference in usec, 0 = all
+		QVector<bool>	compressions; // One per reference
 	};
 
 protected: // Members ---------------------------------------------------------
 	MainSharedSegment *	m_shm;
 	InterprocessLog *	m_interprocessLog;
+	CaptureClock *		m_captureClock;
 	QVector<KnownWin>	m_knownWindows;
 	QVector<WinId>		m_capturingWindows;
+	uint32_t			m_registryGeneration;
+	bool				m_registryScanned;
+	TickEstimator *		m_tickEstimator;
+	quint64				m_tickTimestamp;
 
 public: // Static methods -----------------------------------------------------
 	static void		doGraphicsContextInitialized(VidgfxContext *gfx);
@@ -54,18 +67,47 @@ public: // Methods ------------------------------------------------------------
 	bool	initialize();
 
 	MainSharedSegment *	getMainSharedSegment() const;
+	CaptureClock *		getCaptureClock() const;
+	const TickEstimator *	getTickEstimator() const;
+	quint64				getTickTimestamp() const;
 
 	bool	isWindowKnown(WinId win) const;
 	bool	isWindowCapturing(WinId win) const;
 
-	void	refWindowHooked(WinId win);
-	void	derefWindowHooked(WinId win);
+	void	refWindowHooked(
+		WinId win, const QRect &roi = QRect(),
+		const QSize &outSize = QSize(), uint framePeriodUsec = 0,
+		bool compress = false);
+	void	derefWindowHooked(
+		WinId win, const QRect &roi = QRect(),
+		const QSize &outSize = QSize(), uint framePeriodUsec = 0,
+		bool compress = false);
+	void	changeWindowRoi(
+		WinId win, const QRect &oldRoi, const QRect &newRoi);
+	QRect	getWindowRoi(WinId win) const;
+	void	changeWindowOutputSize(
+		WinId win, const QSize &oldSize, const QSize &newSize);
+	void	changeWindowFramePeriod(
+		WinId win, uint oldPeriodUsec, uint newPeriodUsec);
+	void	changeWindowCompression(
+		WinId win, bool oldCompress, bool newCompress);
 
 	void	processInterprocessLog(bool output = true);
 
 private:
-	void	refDerefWindowHooked(WinId win, bool capture);
+	void	refDerefWindowHooked(
+		WinId win, bool capture, const QRect &roi, const QSize &outSize,
+		uint framePeriodUsec, bool compress);
+	KnownWin *	findKnownWindow(WinId win);
+	void	updateRegistryRoi(HookRegEntry *entry, const KnownWin *known);
+	void	updateRegistryOutputSize(
+		HookRegEntry *entry, const KnownWin *known);
+	void	updateRegistryFramePeriod(
+		HookRegEntry *entry, const KnownWin *known);
+	void	updateRegistryCompression(
+		HookRegEntry *entry, const KnownWin *known);
 	void	processRegistry();
+	void	publishTick(int lateByUsec);
 
 	public
 Q_SLOTS: // Slots -------------------------------------------------------------
@@ -91,4 +133,32 @@ inline MainSharedSegment *HookManager::getMainSharedSegment() const
 	return m_shm;
 }
 
+/// <summary>
+/// Returns the clock that every frame timestamp is in or NULL if we failed to
+/// initialize.
+/// </summary>
+inline CaptureClock *HookManager::getCaptureClock() const
+{
+	return m_captureClock;
+}
+
+/// <summary>
+/// Returns the estimator of our video frame ticks which contains their
+/// jitter, drift and number of dropped ticks.
+/// </summary>
+inline const TickEstimator *HookManager::getTickEstimator() const
+{
+	return m_tickEstimator;
+}
+
+/// <summary>
+/// Returns the time that the current video frame tick was scheduled at in
+/// the capture clock so that it can be compared to frame timestamps.
+/// </summary>
+/// <returns>Zero if we are not ticking</returns>
+inline quint64 HookManager::getTickTimestamp() const
+{
+	return m_tickTimestamp;
+}
+
 #endif // HOOKMANAGER_H
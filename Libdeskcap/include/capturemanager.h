@@ -74,11 +74,16 @@ public: // Methods ------------------------------------------------------------
 	bool					getFuzzyCapture() const;
 	void					setFuzzyCapture(bool useFuzzyCap);
 
+	void					setHookWorkerPool(uint numThreads, bool pinThreads);
+
 	uint					getVideoFrequencyNum();
 	uint					getVideoFrequencyDenom();
 	void					setVideoFrequency(
 		uint numerator, uint denominator);
 
+	quint64					getCaptureClockUsec() const;
+	void					calibrateCaptureClock(quint64 refUsec);
+
 	bool					isInLowJitterMode() const;
 	// Ref/deref is for Libdeskcap internal use only, TODO
 	void					refLowJitterMode();
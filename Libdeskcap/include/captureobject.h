@@ -21,12 +21,16 @@
 #include "libdeskcap.h"
 #include <Libvidgfx/libvidgfx.h>
 #include <QtCore/QObject>
+#include <QtCore/QVector>
 
 //=============================================================================
 class LDC_EXPORT CaptureObject : public QObject
 {
 	Q_OBJECT
 
+public: // Static methods -----------------------------------------------------
+	static QRect	unionRegionsOfInterest(const QVector<QRect> &rois);
+
 protected: // Constructor/destructor ------------------------------------------
 	CaptureObject();
 public:
@@ -43,6 +47,18 @@ public: // Interface ----------------------------------------------------------
 	virtual VidgfxTex *	getTexture() const = 0;
 	virtual bool		isTextureValid() const = 0;
 	virtual bool		isFlipped() const = 0;
+	virtual quint64		getFrameTimestamp() const = 0;
+	virtual void		setForceTopDown(bool force) = 0;
+	virtual bool		getForceTopDown() const = 0;
+	virtual void		setRegionOfInterest(const QRect &rect) = 0;
+	virtual QRect		getRegionOfInterest() const = 0;
+	virtual void		setOutputSize(const QSize &size) = 0;
+	virtual QSize		getOutputSize() const = 0;
+	virtual void		setFrameRate(uint numerator, uint denominator) = 0;
+	virtual uint		getFrameRateNum() const = 0;
+	virtual uint		getFrameRateDenom() const = 0;
+	virtual void		setFrameCompression(bool compress) = 0;
+	virtual bool		getFrameCompression() const = 0;
 	virtual QPoint		mapScreenPosToLocal(const QPoint &pos) const = 0;
 };
 //=============================================================================
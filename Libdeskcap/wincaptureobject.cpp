@@ -34,6 +34,12 @@ WinCaptureObject::WinCaptureObject(HWND hwnd, CptrMethod method)
 	, m_hookCapture(NULL)
 	, m_dupCapture(NULL)
 	, m_hookIsReffed(false)
+	, m_forceTopDown(false)
+	, m_roi()
+	, m_outSize()
+	, m_frameRateNum(0)
+	, m_frameRateDenom(1)
+	, m_compressFrames(false)
 {
 	construct();
 }
@@ -49,6 +55,12 @@ WinCaptureObject::WinCaptureObject(HMONITOR hMonitor, CptrMethod method)
 	, m_hookCapture(NULL)
 	, m_dupCapture(NULL)
 	, m_hookIsReffed(false)
+	, m_forceTopDown(false)
+	, m_roi()
+	, m_outSize()
+	, m_frameRateNum(0)
+	, m_frameRateDenom(1)
+	, m_compressFrames(false)
 {
 	construct();
 }
@@ -77,15 +89,15 @@ WinCaptureObject::~WinCaptureObject()
 	if(m_hookIsReffed) {
 		HookManager *hookMgr = CaptureManager::getManager()->getHookManager();
 		WinId winId = static_cast<WinId>(m_hwnd);
-		if(hookMgr->isWindowKnown(winId))
-			hookMgr->derefWindowHooked(winId);
+		if(hookMgr->isWindowKnown(winId)) {
+			hookMgr->derefWindowHooked(winId, m_roi, m_outSize,
+				getFramePeriodUsec(), m_compressFrames);
+		}
 		m_hookIsReffed = false;
 	}
 
-	if(m_gdiCapture != NULL)
-		m_gdiCapture->release();
-	if(m_hookCapture != NULL)
-		m_hookCapture->release();
+	releaseGdiCapture();
+	releaseHookCapture();
 	if(m_dupCapture != NULL)
 		m_dupCapture->release();
 }
@@ -112,7 +124,8 @@ CptrMethod WinCaptureObject::determineBestMethod()
 			}
 			// Issue the command to start accelerated capture ASAP
 			if(!m_hookIsReffed) {
-				hookMgr->refWindowHooked(winId);
+				hookMgr->refWindowHooked(winId, m_roi, m_outSize,
+					getFramePeriodUsec(), m_compressFrames);
 				m_hookIsReffed = true;
 			}
 		} else {
@@ -165,27 +178,24 @@ void WinCaptureObject::resetCaptureObjects()
 		break;
 	case CptrStandardMethod:
 		// Destroy other objects if required
-		if(m_hookCapture != NULL)
-			m_hookCapture->release();
+		releaseHookCapture();
 		if(m_dupCapture != NULL)
 			m_dupCapture->release();
-		m_hookCapture = NULL;
 		m_dupCapture = NULL;
 
 		// Create GDI object if required
-		if(m_gdiCapture == NULL)
+		if(m_gdiCapture == NULL) {
 			m_gdiCapture = mgr->createGdiCapture(m_hwnd, m_hMonitor);
+			if(m_gdiCapture != NULL)
+				m_gdiCapture->refRoi(m_roi);
+		}
 		break;
 	case CptrCompositorMethod:
 		// Destroy other objects if required
-		if(m_gdiCapture != NULL)
-			m_gdiCapture->release();
-		if(m_hookCapture != NULL)
-			m_hookCapture->release();
+		releaseGdiCapture();
+		releaseHookCapture();
 		if(m_dupCapture != NULL)
 			m_dupCapture->release();
-		m_gdiCapture = NULL;
-		m_hookCapture = NULL;
 		m_dupCapture = NULL;
 
 		// Create DWM object if required
@@ -193,22 +203,21 @@ void WinCaptureObject::resetCaptureObjects()
 		break;
 	case CptrHookMethod:
 		// Destroy other objects if required
-		if(m_gdiCapture != NULL)
-			m_gdiCapture->release();
+		releaseGdiCapture();
 		if(m_dupCapture != NULL)
 			m_dupCapture->release();
-		m_gdiCapture = NULL;
 		m_dupCapture = NULL;
 
 		// Create hook object if required
-		if(m_hookCapture == NULL)
+		if(m_hookCapture == NULL) {
 			m_hookCapture = mgr->createHookCapture(m_hwnd);
+			if(m_hookCapture != NULL && m_forceTopDown)
+				m_hookCapture->refTopDown();
+		}
 		break;
 	case CptrDuplicatorMethod:
 		// Destroy other objects if required
-		if(m_gdiCapture != NULL)
-			m_gdiCapture->release();
-		m_gdiCapture = NULL;
+		releaseGdiCapture();
 
 		// Create hook object if required
 		if(m_dupCapture == NULL)
@@ -217,6 +226,33 @@ void WinCaptureObject::resetCaptureObjects()
 	}
 }
 
+/// <summary>
+/// Releases our reference to the GDI capture object including our region of
+/// interest.
+/// </summary>
+void WinCaptureObject::releaseGdiCapture()
+{
+	if(m_gdiCapture == NULL)
+		return;
+	m_gdiCapture->derefRoi(m_roi);
+	m_gdiCapture->release();
+	m_gdiCapture = NULL;
+}
+
+/// <summary>
+/// Releases our reference to the hook capture object including our request
+/// for top-down frames.
+/// </summary>
+void WinCaptureObject::releaseHookCapture()
+{
+	if(m_hookCapture == NULL)
+		return;
+	if(m_forceTopDown)
+		m_hookCapture->derefTopDown();
+	m_hookCapture->release();
+	m_hookCapture = NULL;
+}
+
 CptrType WinCaptureObject::getType() const
 {
 	return m_type;
@@ -327,6 +363,185 @@ bool WinCaptureObject::isFlipped() const
 	}
 }
 
+/// <summary>
+/// Returns the capture time at which the captured application presented the
+/// contents of the texture or zero if it is unknown. Compare it with
+/// `CaptureManager::getCaptureClockUsec()` to measure the capture latency.
+/// Only hooked windows are timestamped as every other method captures when
+/// the texture is requested.
+/// </summary>
+quint64 WinCaptureObject::getFrameTimestamp() const
+{
+	if(m_actualMethod != CptrHookMethod || m_hookCapture == NULL)
+		return 0;
+	return m_hookCapture->getFrameTimestamp();
+}
+
+/// <summary>
+/// If `force` is true then the texture is always top-down and `isFlipped()`
+/// always returns false. Bottom-up frames are flipped while they are copied
+/// to the texture which costs nothing extra. The hook capture object is
+/// shared between every capture object of the same window so the texture is
+/// top-down as long as at least one of them forces it.
+/// </summary>
+void WinCaptureObject::setForceTopDown(bool force)
+{
+	if(m_forceTopDown == force)
+		return;
+	m_forceTopDown = force;
+	if(m_hookCapture == NULL)
+		return;
+	if(force)
+		m_hookCapture->refTopDown();
+	else
+		m_hookCapture->derefTopDown();
+}
+
+bool WinCaptureObject::getForceTopDown() const
+{
+	return m_forceTopDown;
+}
+
+/// <summary>
+/// Limits capturing to the specified area of the window or monitor in
+/// top-down texture coordinates. The texture keeps its full size but only
+/// the pixels inside of the region are kept up-to-date. An empty rectangle
+/// captures everything. Hooks and standard capture objects are shared between
+/// capture objects of the same window so they capture the union of all
+/// regions, this includes capture objects of other processes when hooking.
+/// </summary>
+void WinCaptureObject::setRegionOfInterest(const QRect &rect)
+{
+	QRect roi = (rect.isEmpty() ? QRect() : rect);
+	if(m_roi == roi)
+		return;
+	if(m_hookIsReffed) {
+		HookManager *hookMgr = CaptureManager::getManager()->getHookManager();
+		hookMgr->changeWindowRoi(static_cast<WinId>(m_hwnd), m_roi, roi);
+	}
+	if(m_gdiCapture != NULL)
+		m_gdiCapture->changeRoi(m_roi, roi);
+	m_roi = roi;
+}
+
+QRect WinCaptureObject::getRegionOfInterest() const
+{
+	return m_roi;
+}
+
+/// <summary>
+/// Requests that hooked windows are downscaled to fit within `size` before
+/// they are transferred from the hooked process while keeping their aspect
+/// ratio. This greatly reduces the amount of memory bandwidth used when the
+/// capture is going to be scaled down anyway. The texture has the downscaled
+/// size but the region of interest remains in window coordinates. Hooks are
+/// shared so the largest size requested by any capture object of any process
+/// is used and the texture may be larger than requested. Windows are never
+/// upscaled and other capture methods ignore the output size. An empty size
+/// captures at the full size.
+/// </summary>
+void WinCaptureObject::setOutputSize(const QSize &size)
+{
+	QSize outSize = (size.isEmpty() ? QSize() : size);
+	if(m_outSize == outSize)
+		return;
+	if(m_hookIsReffed) {
+		HookManager *hookMgr = CaptureManager::getManager()->getHookManager();
+		hookMgr->changeWindowOutputSize(
+			static_cast<WinId>(m_hwnd), m_outSize, outSize);
+	}
+	m_outSize = outSize;
+}
+
+QSize WinCaptureObject::getOutputSize() const
+{
+	return m_outSize;
+}
+
+/// <summary>
+/// Requests that hooked windows only transfer frames at the specified rate
+/// instead of the video frequency. Frames that no capture object needs are
+/// never read back from the GPU which saves a significant amount of memory
+/// bandwidth when the capture is only shown as a small or slowly updating
+/// part of the scene. Hooks are shared so the highest rate requested by any
+/// capture object of any process is used and frames may arrive more often
+/// than requested. Rates above the video frequency and other capture
+/// methods have no effect. A rate of zero captures every video frame.
+/// </summary>
+void WinCaptureObject::setFrameRate(uint numerator, uint denominator)
+{
+	if(numerator == 0 || denominator == 0) {
+		numerator = 0;
+		denominator = 1;
+	}
+	if(m_frameRateNum == numerator && m_frameRateDenom == denominator)
+		return;
+	uint oldPeriod = getFramePeriodUsec();
+	m_frameRateNum = numerator;
+	m_frameRateDenom = denominator;
+	if(m_hookIsReffed) {
+		HookManager *hookMgr = CaptureManager::getManager()->getHookManager();
+		hookMgr->changeWindowFramePeriod(
+			static_cast<WinId>(m_hwnd), oldPeriod, getFramePeriodUsec());
+	}
+}
+
+uint WinCaptureObject::getFrameRateNum() const
+{
+	return m_frameRateNum;
+}
+
+uint WinCaptureObject::getFrameRateDenom() const
+{
+	return m_frameRateDenom;
+}
+
+/// <summary>
+/// Allows hooked windows to losslessly compress their frames before they are
+/// transferred from the hooked process. Screen content such as desktops and
+/// remote applications compresses extremely well which reduces the amount of
+/// memory that needs to be read when staging the frame but content that
+/// changes every frame such as games only costs the hooked process time to
+/// encode. Hooks are shared so frames are only compressed if every capture
+/// object of every process allowed it. Frames that are downscaled, limited
+/// to a region of interest or not in BGRA format are never compressed and
+/// other capture methods ignore this setting.
+/// </summary>
+void WinCaptureObject::setFrameCompression(bool compress)
+{
+	if(m_compressFrames == compress)
+		return;
+	if(m_hookIsReffed) {
+		HookManager *hookMgr = CaptureManager::getManager()->getHookManager();
+		hookMgr->changeWindowCompression(
+			static_cast<WinId>(m_hwnd), m_compressFrames, compress);
+	}
+	m_compressFrames = compress;
+}
+
+bool WinCaptureObject::getFrameCompression() const
+{
+	return m_compressFrames;
+}
+
+/// <summary>
+/// Returns the requested frame rate as the period that is published to the
+/// hook registry.
+/// </summary>
+/// <returns>Zero if every video frame is required</returns>
+uint WinCaptureObject::getFramePeriodUsec() const
+{
+	if(m_frameRateNum == 0)
+		return 0;
+	quint64 period = ((quint64)m_frameRateDenom * 1000000ULL +
+		(quint64)(m_frameRateNum / 2)) / (quint64)m_frameRateNum;
+	if(period == 0)
+		return 1;
+	if(period > UINT_MAX)
+		return UINT_MAX;
+	return (uint)period;
+}
+
 QPoint WinCaptureObject::mapScreenPosToLocal(const QPoint &pos) const
 {
 	if(m_type == CptrMonitorType) {
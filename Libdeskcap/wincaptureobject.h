@@ -40,6 +40,12 @@ private: // Members -----------------------------------------------------------
 	WinHookCapture *	m_hookCapture;
 	WinDupCapture *		m_dupCapture;
 	bool				m_hookIsReffed;
+	bool				m_forceTopDown;
+	QRect				m_roi;
+	QSize				m_outSize;
+	uint				m_frameRateNum;
+	uint				m_frameRateDenom;
+	bool				m_compressFrames;
 
 public: // Constructor/destructor ---------------------------------------------
 	WinCaptureObject(HWND hwnd, CptrMethod method); // Window
@@ -50,6 +56,9 @@ public: // Constructor/destructor ---------------------------------------------
 private: // Methods -----------------------------------------------------------
 	CptrMethod			determineBestMethod();
 	void				resetCaptureObjects();
+	void				releaseGdiCapture();
+	void				releaseHookCapture();
+	uint				getFramePeriodUsec() const;
 
 public: // Interface ----------------------------------------------------------
 	virtual CptrType	getType() const;
@@ -62,6 +71,18 @@ public: // Interface ----------------------------------------------------------
 	virtual VidgfxTex *	getTexture() const;
 	virtual bool		isTextureValid() const;
 	virtual bool		isFlipped() const;
+	virtual quint64		getFrameTimestamp() const;
+	virtual void		setForceTopDown(bool force);
+	virtual bool		getForceTopDown() const;
+	virtual void		setRegionOfInterest(const QRect &rect);
+	virtual QRect		getRegionOfInterest() const;
+	virtual void		setOutputSize(const QSize &size);
+	virtual QSize		getOutputSize() const;
+	virtual void		setFrameRate(uint numerator, uint denominator);
+	virtual uint		getFrameRateNum() const;
+	virtual uint		getFrameRateDenom() const;
+	virtual void		setFrameCompression(bool compress);
+	virtual bool		getFrameCompression() const;
 	virtual QPoint		mapScreenPosToLocal(const QPoint &pos) const;
 
 	public
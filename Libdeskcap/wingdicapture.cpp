@@ -35,6 +35,7 @@ WinGDICapture::WinGDICapture(HWND hwnd, HMONITOR hMonitor)
 	, m_resourcesInitialized(false)
 	, m_useDxgi11BgraMethod(false)
 	, m_failedOnce(false)
+	, m_rois()
 {
 	if(m_hMonitor != NULL) {
 		// Monitor capture
@@ -109,13 +110,36 @@ void WinGDICapture::release()
 	mgr->releaseGdiCapture(this);
 }
 
+/// <summary>
+/// Adds the region of interest of a capture object that uses us. Only the
+/// union of every region is copied from the window, an empty region means
+/// the entire window.
+/// </summary>
+void WinGDICapture::refRoi(const QRect &roi)
+{
+	m_rois.append(roi);
+}
+
+void WinGDICapture::derefRoi(const QRect &roi)
+{
+	int index = m_rois.indexOf(roi);
+	if(index >= 0)
+		m_rois.remove(index);
+}
+
+void WinGDICapture::changeRoi(const QRect &oldRoi, const QRect &newRoi)
+{
+	int index = m_rois.indexOf(oldRoi);
+	if(index >= 0)
+		m_rois[index] = newRoi;
+}
+
 void WinGDICapture::lowJitterRealTimeFrameEvent(int numDropped, int lateByUsec)
 {
 	// Update texture size if required
 	updateTexture();
 
 	// Determine the position and size of the source texture to copy from
-	// TODO: Forward cropping regions from layers to here so we copy less data?
 	int srcX = 0, srcY = 0;
 	int srcWidth = 0, srcHeight = 0;
 	if(m_hMonitor != NULL) {
@@ -136,6 +160,17 @@ void WinGDICapture::lowJitterRealTimeFrameEvent(int numDropped, int lateByUsec)
 	// Update texture contents
 	if(m_texture == NULL)
 		return; // No texture to paint on
+
+	// Only copy the area that our capture objects are interested in
+	QRect texRect(QPoint(0, 0), vidgfx_tex_get_size(m_texture));
+	QRect copyRect = CaptureObject::unionRegionsOfInterest(m_rois);
+	if(copyRect.isEmpty())
+		copyRect = texRect;
+	else
+		copyRect &= texRect;
+	if(copyRect.isEmpty())
+		return; // Region is outside of the window
+
 	if(m_useDxgi11BgraMethod) {
 		// DXGI 1.1 is available and BGRA textures are supported
 		VidgfxD3DTex *tex = vidgfx_tex_get_d3dtex(m_texture);
@@ -143,8 +178,9 @@ void WinGDICapture::lowJitterRealTimeFrameEvent(int numDropped, int lateByUsec)
 		// TODO: We should clear the destination first as the source may
 		// contain pixels with transparency
 		if(BitBlt(
-			texDC, 0, 0, vidgfx_tex_get_width(m_texture),
-			vidgfx_tex_get_height(m_texture), m_hdc, srcX, srcY, SRCCOPY) == 0)
+			texDC, copyRect.x(), copyRect.y(), copyRect.width(),
+			copyRect.height(), m_hdc, srcX + copyRect.x(),
+			srcY + copyRect.y(), SRCCOPY) == 0)
 		{
 			// Don't log failure as it'll spam the log file
 		}
@@ -183,7 +219,9 @@ void WinGDICapture::lowJitterRealTimeFrameEvent(int numDropped, int lateByUsec)
 			return;
 		}
 		HGDIOBJ prevObj = SelectObject(hdc, hbmp);
-		BitBlt(hdc, 0, 0, width, height, m_hdc, srcX, srcY, SRCCOPY);
+		BitBlt(hdc, copyRect.x(), copyRect.y(), copyRect.width(),
+			copyRect.height(), m_hdc, srcX + copyRect.x(),
+			srcY + copyRect.y(), SRCCOPY);
 
 		// Convert the bitmap to a QImage
 		QImage img = qt_imageFromWinHBITMAP(hdc, hbmp, width, height);
@@ -22,6 +22,7 @@
 #include <Libvidgfx/libvidgfx.h>
 #include <QtCore/QSize>
 #include <QtCore/QObject>
+#include <QtCore/QVector>
 #include <windows.h>
 
 //=============================================================================
@@ -38,6 +39,7 @@ private: // Members -----------------------------------------------------------
 	bool		m_resourcesInitialized;
 	bool		m_useDxgi11BgraMethod;
 	bool		m_failedOnce;
+	QVector<QRect>	m_rois; // One per capture object, empty = everything
 
 public: // Constructor/destructor ---------------------------------------------
 	WinGDICapture(HWND hwnd, HMONITOR hMonitor = NULL);
@@ -48,6 +50,9 @@ public: // Methods ------------------------------------------------------------
 	HWND		getHwnd() const;
 	HMONITOR	getHmonitor() const;
 	void		release();
+	void		refRoi(const QRect &roi);
+	void		derefRoi(const QRect &roi);
+	void		changeRoi(const QRect &oldRoi, const QRect &newRoi);
 
 	void		lowJitterRealTimeFrameEvent(int numDropped, int lateByUsec);
 	void		initializeResources(VidgfxContext *gfx);
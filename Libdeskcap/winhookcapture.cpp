@@ -20,8 +20,9 @@
 #include "hookmanager.h"
 #include "wincapturemanager.h"
 #include "../Common/capturesharedsegment.h"
-#include "../Common/imghelpers.h"
+#include "../Common/framestager.h"
 #include "../Common/mainsharedsegment.h"
+#include "../Common/pixelconvert.h"
 
 const QString LOG_CAT = QStringLiteral("WinCapture");
 
@@ -32,20 +33,6 @@ const QString LOG_CAT = QStringLiteral("WinCapture");
 // buffer after every queued frame event fixed the issue.
 #define COPY_SHARED_TEX_TO_CACHE 0
 
-//=============================================================================
-// Helpers
-
-/// <summary>
-/// An overload of `imgDataCopy()` that uses Qt datatypes. `size` is the width
-/// in bytes and the height in rows.
-/// </summary>
-static void imgDataCopy(
-	quint8 *dst, quint8 *src, uint dstStride, uint srcStride,
-	const QSize &size)
-{
-	imgDataCopy(dst, src, dstStride, srcStride, size.width(), size.height());
-}
-
 //=============================================================================
 // WinHookCapture class
 
@@ -58,10 +45,25 @@ WinHookCapture::WinHookCapture(HWND hwnd)
 	, m_activeFrameNum(-1)
 	, m_numSharedTexs(0)
 	, m_isFlipped(false)
+	, m_texIsFlipped(false)
+	, m_topDownRef(0)
 	, m_ref(1)
 	, m_resourcesInitialized(false)
 	, m_capShm(NULL)
+	, m_frameSize()
+	, m_frameSrcSize()
+	, m_frameTimestamp(0)
+	, m_stager(NULL)
+	//, m_stagingTexs() // Zeroed below
+	//, m_stagingMapped()
+	, m_badFormatLogged(false)
+	, m_numDecodeFailures(0)
 {
+	for(int i = 0; i < NUM_STAGING_TEXS; i++) {
+		m_stagingTexs[i] = NULL;
+		m_stagingMapped[i] = false;
+	}
+
 	WinCaptureManager *mgr =
 		static_cast<WinCaptureManager *>(CaptureManager::getManager());
 	QString title = mgr->getWindowDebugString(static_cast<WinId>(m_hwnd));
@@ -86,6 +88,8 @@ WinHookCapture::~WinHookCapture()
 	VidgfxContext *gfx = mgr->getGraphicsContext();
 	if(vidgfx_context_is_valid(gfx))
 		destroyResources(gfx);
+	delete m_stager;
+	m_stager = NULL;
 }
 
 void WinHookCapture::incrementRef()
@@ -103,122 +107,93 @@ void WinHookCapture::release()
 	mgr->releaseHookCapture(this);
 }
 
+/// <summary>
+/// Requests that our texture is always top-down. Bottom-up frames are then
+/// flipped while they are copied to the texture. As the texture contents are
+/// only updated when the next frame is copied `isFlipped()` keeps describing
+/// the existing contents until then.
+/// </summary>
+void WinHookCapture::refTopDown()
+{
+	m_topDownRef++;
+	if(m_topDownRef == 1 && m_stager != NULL)
+		m_stager->setTopDown(true); // Orientation changes
+}
+
+void WinHookCapture::derefTopDown()
+{
+	if(m_topDownRef <= 0)
+		return;
+	m_topDownRef--;
+	if(m_topDownRef == 0 && m_stager != NULL)
+		m_stager->setTopDown(false); // Orientation changes
+}
+
 void WinHookCapture::queuedFrameEvent(uint fNum, int numDropped)
 {
 	// Update texture size if required
 	updateTexture();
 
-	// Sanity check
-	if(!(m_texture != NULL || (m_sharedTexs != NULL && m_numSharedTexs > 0 &&
-		m_sharedTexs[0] != NULL)))
-	{
-		return;
-	}
+	// Sanity check. Raw pixel textures are only created once we know the
+	// size of the first frame.
 	VidgfxContext *gfx = CaptureManager::getManager()->getGraphicsContext();
 	if(!vidgfx_context_is_valid(gfx))
 		return;
 	if(m_capShm == NULL || !m_capShm->isValid())
 		return;
-
-	//-------------------------------------------------------------------------
-	// Update texture contents
-
-	m_capShm->lock();
-
-	// Mark dropped frames as used so that we main in sync with the hook. If we
-	// don't do this then if we're not broadcasting any captured games will
-	// appear to be delayed. We want to keep at least one frame in the queue
-	// though otherwise there is a chance we'll never render anything.
-	for(int i = 0; i < numDropped; i++) {
-		if(m_capShm->getNumUsedFrames() <= 1)
-			break;
-		int frameNum = m_capShm->findEarliestFrame(true);
-		if(frameNum == -1)
-			break; // No new frames in queue
-		m_capShm->setFrameUsed(frameNum, false);
+	if(m_capShm->getCaptureType() == RawPixelsShmType) {
+		// Raw pixel frames are staged by a worker thread so all that we need
+		// to do is swap in the newest one
+		swapStagedTexture();
+		return;
 	}
-
-	// Fetch the earliest frame to use
-	int frameNum = m_capShm->findEarliestFrame(true);
-	if(frameNum == -1) {
-		// No new frames in queue
-		m_capShm->unlock();
+	if(!(m_sharedTexs != NULL && m_numSharedTexs > 0 &&
+		m_sharedTexs[0] != NULL))
+	{
 		return;
 	}
 
-	if(m_capShm->getCaptureType() == RawPixelsShmType) {
-		quint8 *dataDst = (quint8 *)vidgfx_tex_map(m_texture);
-		if(dataDst == NULL) {
-			// Error message already logged
-			m_capShm->unlock();
-			return;
-		}
-		quint8 *dataSrc = (quint8 *)m_capShm->getFrameDataPtr(frameNum);
-		uint bpp = m_capShm->getRawPixelsExtraDataPtr()->bpp;
-		uint srcStride = vidgfx_tex_get_width(m_texture) * bpp;
-		imgDataCopy(dataDst, dataSrc, vidgfx_tex_get_stride(m_texture),
-			srcStride, QSize(srcStride, vidgfx_tex_get_height(m_texture)));
-		m_capShm->setFrameUsed(frameNum, false); // Frame acknowledged
-		m_capShm->unlock();
-		vidgfx_tex_unmap(m_texture);
-
-		// Debug capturing by testing the colours of specific pixels
-#define DO_PIXEL_DEBUG_TEST 0
-#if DO_PIXEL_DEBUG_TEST
-		quint8 *test = NULL;
-#define TEST_PBO_PIXEL(x, y, r, g, b) \
-	test = &dataSrc[((x)+(y)*vidgfx_tex_get_width(m_texture))*bpp]; \
-	if(test[0] != (b) || test[1] != (g) || test[2] != (r)) \
-	capLog(CapLog::Warning) << QStringLiteral("(%1, %2, %3) != (%4, %5, %6)") \
-	.arg(test[0]).arg(test[1]).arg(test[2]).arg(b).arg(g).arg(r)
-
-		// Minecraft main menu (Window size: 854x480)
-		//TEST_PBO_PIXEL(4, 6, 255, 255, 255);
-		//TEST_PBO_PIXEL(179, 57, 0, 0, 0);
-		//TEST_PBO_PIXEL(199, 73, 90, 185, 51);
-
-		// Osmos title screen with ESC menu open (Window size: 1854x962)
-		TEST_PBO_PIXEL(878, 302, 255, 255, 255);
-		TEST_PBO_PIXEL(876, 391, 125, 141, 160); // Not constant
-
-#undef TEST_PBO_PIXEL
-#endif // DO_PIXEL_DEBUG_TEST
-	} else { // Shared DX10 textures
-		//capLog() << "Shared tex updated";
-		int numUsedFrames = m_capShm->getNumUsedFrames();
-		//capLog() << "Used frame = " << frameNum
-		//	<< "; Num used frames = " << numUsedFrames
-		//	<< "; Num total frames = " << m_capShm->getNumFrames();
-
-		// Use a very quick and easy multiprocess synchronisation system that
-		// simply makes sure there is always at least one more frame buffered
-		// immediately after our current one. This is because the GPU might not
-		// have actually processed our hook's pixel copy commands yet and we do
-		// not use any sort of internal DirectX synchronisation mechanism.
-		if(numUsedFrames >= 3) { // 1 previous + 1 current + 1 next
-			if(m_activeFrameNum != -1) {
-				// Mark the frame that we used last iteration as safe to reuse.
-				m_capShm->setFrameUsed(m_activeFrameNum, false);
-				frameNum = m_capShm->findEarliestFrame(true);
-			}
-			m_activeFrameNum = frameNum;
-			m_activeSharedTex = m_sharedTexs[frameNum];
+	//-------------------------------------------------------------------------
+	// Update texture contents
 
-			// Although this synchronisation works on the CPU it doesn't take
-			// into account GPU synchronisation as we may still be rendering
-			// the previous frame by the time mark it as unused and the hook
-			// starts overriding its pixel data. We rely on the application to
-			// flush the graphics command buffer after every queued frame event
-			// in order to fix this issue.
+	// Use the frame that was swapped closest to the time of the current video
+	// frame tick. Frames that were queued before it are released in a single
+	// pass so that if we fell behind, including when we're not broadcasting,
+	// we jump straight back to the present instead of displaying every
+	// intermediate frame. The timestamps already account for any ticks that
+	// were dropped. If we're not ticking then the newest frame is used.
+	//
+	// Use a very quick and easy multiprocess synchronisation system that
+	// simply makes sure there is always at least one more frame buffered
+	// immediately after our current one. This is because the GPU might not
+	// have actually processed our hook's pixel copy commands yet and we do
+	// not use any sort of internal DirectX synchronisation mechanism.
+	HookManager *hookMgr = CaptureManager::getManager()->getHookManager();
+	int frameNum = m_capShm->findNearestFrame(
+		hookMgr->getTickTimestamp(), 1); // 1 next
+	if(frameNum == -1)
+		return; // No new frames in queue
+	if(frameNum == m_activeFrameNum)
+		return; // Still the best frame
+
+	// Mark the frames that we used previously or skipped over as safe to
+	// reuse. The active frame is always the earliest in the queue.
+	m_capShm->releaseFramesBefore(frameNum);
+	m_activeFrameNum = frameNum;
+	m_activeSharedTex = m_sharedTexs[frameNum];
+	m_frameTimestamp = m_capShm->getFrameTimestamp(frameNum);
+
+	// Although this synchronisation works on the CPU it doesn't take into
+	// account GPU synchronisation as we may still be rendering the previous
+	// frame by the time mark it as unused and the hook starts overriding its
+	// pixel data. We rely on the application to flush the graphics command
+	// buffer after every queued frame event in order to fix this issue.
 
 #if COPY_SHARED_TEX_TO_CACHE
-			vidgfx_context_copy_tex_data(
-				gfx, m_texture, m_activeSharedTex, QPoint(0, 0),
-				QRect(QPoint(0, 0), vidgfx_tex_get_size(m_texture)));
+	vidgfx_context_copy_tex_data(
+		gfx, m_texture, m_activeSharedTex, QPoint(0, 0),
+		QRect(QPoint(0, 0), vidgfx_tex_get_size(m_texture)));
 #endif // COPY_SHARED_TEX_TO_CACHE
-		}
-		m_capShm->unlock();
-	}
 }
 
 void WinHookCapture::initializeResources(VidgfxContext *gfx)
@@ -245,16 +220,26 @@ void WinHookCapture::updateTexture()
 	if(m_capShm == NULL || !m_capShm->isValid())
 		return;
 
-	// Determine the window size
-	QSize size(m_capShm->getWidth(), m_capShm->getHeight());
+	// Determine the window size. Raw pixel frames can be smaller than the
+	// capacity of the segment and each one stores its own size while shared
+	// textures always fill the entire segment.
+	QSize size(m_capShm->getMaxWidth(), m_capShm->getMaxHeight());
+	if(m_capShm->getCaptureType() == RawPixelsShmType && m_stager != NULL) {
+		uint width, height;
+		m_stager->getFrameSize(&width, &height);
+		m_frameSize = QSize(width, height);
+		size = m_frameSize;
+	}
 
-	// Has the window size changed? If so we need to recreate the texture. This
-	// should never happen as we should receive a reset signal first but do it
-	// just in case anyway.
+	// Has the window size changed? If so we need to recreate the texture. For
+	// raw pixels this happens whenever the window is resized within the
+	// capacity of the segment while shared textures should never change as we
+	// should receive a reset signal first but do it just in case anyway.
 	if(m_capShm->getCaptureType() == RawPixelsShmType) {
-		if(m_texture != NULL && vidgfx_tex_get_size(m_texture) != size) {
-			vidgfx_context_destroy_tex(gfx, m_texture);
-			m_texture = NULL;
+		if(m_stagingTexs[0] != NULL &&
+			vidgfx_tex_get_size(m_stagingTexs[0]) != size)
+		{
+			destroyStagingTextures(gfx);
 		}
 	} else { // Shared DX10 textures
 		if(m_sharedTexs != NULL && m_numSharedTexs != 0) {
@@ -277,8 +262,9 @@ void WinHookCapture::updateTexture()
 
 	// Do not create a texture if we failed to get the window size as the
 	// window may no longer exist or if we already have a valid texture
-	if(size.isEmpty() || m_texture != NULL || (m_sharedTexs != NULL &&
-		m_numSharedTexs > 0 && m_sharedTexs[0] != NULL))
+	if(size.isEmpty() || m_texture != NULL || m_stagingTexs[0] != NULL ||
+		(m_sharedTexs != NULL && m_numSharedTexs > 0 &&
+		m_sharedTexs[0] != NULL))
 	{
 		return;
 	}
@@ -288,14 +274,27 @@ void WinHookCapture::updateTexture()
 		CaptureSharedSegment::RawPixelsExtraData *extraData =
 			m_capShm->getRawPixelsExtraDataPtr();
 		RawPixelFormat format = (RawPixelFormat)extraData->format;
-		if(format == UnknownPixelFormat) {
-			//capLog(LOG_CAT, CapLog::Warning)
-			//	<< QStringLiteral("Unknown pixel format");
+		if(format == UnknownPixelFormat)
+			return;
+		if(!canConvertPixelFormat(format, BGRAPixelFormat) ||
+			getPixelFormatBpp(format) != extraData->bpp)
+		{
+			if(!m_badFormatLogged) {
+				capLog(LOG_CAT, CapLog::Warning)
+					<< QStringLiteral("Unsupported pixel format 0x%1")
+					.arg(extraData->format, 0, 16);
+				m_badFormatLogged = true;
+			}
 			return;
 		}
 		m_isFlipped = (extraData->isFlipped > 0 ? true : false);
-		// TODO: We assume BGRA format always
-		m_texture = vidgfx_context_new_tex(gfx, size, true, false, true);
+
+		// Every supported format is converted to BGRA when staging. The
+		// textures are handed to the worker the next time that we swap.
+		for(int i = 0; i < NUM_STAGING_TEXS; i++) {
+			m_stagingTexs[i] =
+				vidgfx_context_new_tex(gfx, size, true, false, true);
+		}
 	} else { // Shared DX10 textures
 		// Reallocate shared texture array
 		m_numSharedTexs = m_capShm->getNumFrames();
@@ -333,12 +332,130 @@ void WinHookCapture::updateTexture()
 	}
 }
 
+/// <summary>
+/// Makes the staging texture that contains the newest frame our visible
+/// texture and hands every other staging texture to the worker thread. The
+/// textures are mapped while the worker owns them and unmapping a texture
+/// uploads its contents.
+/// </summary>
+void WinHookCapture::swapStagedTexture()
+{
+	if(m_stager == NULL)
+		return;
+
+	// Report problems that the worker found without spamming the log
+	uint32_t badFormat = m_stager->getUnsupportedFormat();
+	if(badFormat != 0 && !m_badFormatLogged) {
+		capLog(LOG_CAT, CapLog::Warning)
+			<< QStringLiteral("Unsupported frame pixel format 0x%1")
+			.arg(badFormat, 0, 16);
+		m_badFormatLogged = true;
+	}
+	uint numDecodeFailures = m_stager->getNumDecodeFailures();
+	if(numDecodeFailures != m_numDecodeFailures) {
+		capLog(LOG_CAT, CapLog::Warning)
+			<< QStringLiteral("Failed to decode %1 compressed frames")
+			.arg(numDecodeFailures - m_numDecodeFailures);
+		m_numDecodeFailures = numDecodeFailures;
+	}
+
+	StagedFrameInfo info;
+	int index = m_stager->takeFilledBuffer(&info);
+	if(index >= 0 && m_stagingTexs[index] != NULL) {
+		vidgfx_tex_unmap(m_stagingTexs[index]);
+		m_stagingMapped[index] = false;
+		m_texture = m_stagingTexs[index];
+		m_texIsFlipped = info.isFlipped;
+		m_frameSrcSize = QSize(info.srcWidth, info.srcHeight);
+		m_frameTimestamp = info.timestamp;
+	}
+
+	QRect roi = calcFrameRoi();
+	CaptureSharedSegment::DirtyRect rect;
+	rect.x = roi.x();
+	rect.y = roi.y();
+	rect.width = roi.width();
+	rect.height = roi.height();
+	m_stager->setRegionOfInterest(rect);
+
+	for(int i = 0; i < NUM_STAGING_TEXS; i++) {
+		VidgfxTex *tex = m_stagingTexs[i];
+		if(tex == NULL || tex == m_texture || m_stagingMapped[i])
+			continue;
+		quint8 *data = (quint8 *)vidgfx_tex_map(tex);
+		if(data == NULL)
+			continue; // Error message already logged
+		m_stagingMapped[i] = true;
+		QSize size = vidgfx_tex_get_size(tex);
+		m_stager->provideBuffer(i, data, vidgfx_tex_get_stride(tex),
+			size.width(), size.height());
+	}
+}
+
+/// <summary>
+/// Returns the union of every consumer's region of interest in the
+/// coordinates of the raw pixel frame data. The hook only sends that region
+/// so there is no point copying anything else. Regions are top-down window
+/// coordinates but the frame data may be downscaled and bottom-up.
+/// Downscaled regions are rounded outwards with an extra pixel as bilinear
+/// filtering reads beyond the region.
+/// </summary>
+/// <returns>An empty rectangle if everything is of interest</returns>
+QRect WinHookCapture::calcFrameRoi() const
+{
+	HookManager *hookMgr = CaptureManager::getManager()->getHookManager();
+	QRect roi = hookMgr->getWindowRoi(static_cast<WinId>(m_hwnd));
+	QRect frameRect(QPoint(0, 0), m_frameSize);
+	if(roi.isEmpty() || frameRect.isEmpty())
+		return QRect();
+	int srcW = m_frameSrcSize.width();
+	int srcH = m_frameSrcSize.height();
+	if(srcW > 0 && srcH > 0 && m_frameSrcSize != frameRect.size()) {
+		int tw = frameRect.width();
+		int th = frameRect.height();
+		int left = (int)((qint64)roi.x() * tw / srcW) - 1;
+		int top = (int)((qint64)roi.y() * th / srcH) - 1;
+		int right = (int)(((qint64)(roi.x() + roi.width()) * tw +
+			srcW - 1) / srcW) + 1;
+		int bottom = (int)(((qint64)(roi.y() + roi.height()) * th +
+			srcH - 1) / srcH) + 1;
+		roi = QRect(left, top, right - left, bottom - top);
+	}
+	roi &= frameRect;
+	if(roi.isEmpty())
+		return frameRect;
+	if(m_isFlipped)
+		roi.moveTop(frameRect.height() - roi.y() - roi.height());
+	return roi;
+}
+
+/// <summary>
+/// Takes every staging texture back from the worker thread and destroys it.
+/// </summary>
+void WinHookCapture::destroyStagingTextures(VidgfxContext *gfx)
+{
+	if(m_stager != NULL)
+		m_stager->revokeBuffers();
+	for(int i = 0; i < NUM_STAGING_TEXS; i++) {
+		if(m_stagingTexs[i] == NULL)
+			continue;
+		if(m_stagingMapped[i])
+			vidgfx_tex_unmap(m_stagingTexs[i]);
+		if(m_texture == m_stagingTexs[i])
+			m_texture = NULL;
+		vidgfx_context_destroy_tex(gfx, m_stagingTexs[i]);
+		m_stagingTexs[i] = NULL;
+		m_stagingMapped[i] = false;
+	}
+}
+
 void WinHookCapture::destroyResources(VidgfxContext *gfx)
 {
 	if(!m_resourcesInitialized)
 		return;
 	m_resourcesInitialized = false;
 
+	destroyStagingTextures(gfx);
 	if(m_texture != NULL) {
 		vidgfx_context_destroy_tex(gfx, m_texture);
 		m_texture = NULL;
@@ -374,6 +491,8 @@ VidgfxTex *WinHookCapture::getTexture() const
 
 bool WinHookCapture::isFlipped() const
 {
+	if(m_capShm != NULL && m_capShm->getCaptureType() == RawPixelsShmType)
+		return m_texIsFlipped;
 	return m_isFlipped;
 }
 
@@ -387,6 +506,11 @@ void WinHookCapture::windowReset(WinId winId)
 	if(vidgfx_context_is_valid(gfx))
 		destroyResources(gfx);
 
+	// The worker thread must stop using the shared segment before we delete
+	// it
+	delete m_stager;
+	m_stager = NULL;
+
 	// Destroy existing shared segment. As the hook already called `remove()`
 	// the shared segment will delete itself on OS's that have persistence once
 	// we no longer reference it.
@@ -397,15 +521,10 @@ void WinHookCapture::windowReset(WinId winId)
 	// Fetch information about the new shared segment and connect to it
 	HookManager *hookMgr = CaptureManager::getManager()->getHookManager();
 	MainSharedSegment *shm = hookMgr->getMainSharedSegment();
-	shm->lockHookRegistry();
-	HookRegEntry *entry =
-		shm->findWindowInHookRegistry(reinterpret_cast<uint32_t>(winId));
-	if(entry == NULL) {
-		shm->unlockHookRegistry();
+	HookRegEntry entry;
+	if(!shm->readHookRegistry(reinterpret_cast<uint32_t>(winId), &entry))
 		return;
-	}
-	m_capShm = new CaptureSharedSegment(entry->shmName, entry->shmSize);
-	shm->unlockHookRegistry();
+	m_capShm = new CaptureSharedSegment(entry.shmName, entry.shmSize);
 	if(!m_capShm->isValid()) {
 		delete m_capShm;
 		m_capShm = NULL;
@@ -414,13 +533,19 @@ void WinHookCapture::windowReset(WinId winId)
 
 	// Release all queued frames that have buffered already. If we don't do
 	// this then we'll be out-of-sync.
-	m_capShm->lock();
-	for(uint i = 0; i < m_capShm->getNumFrames(); i++) {
-		if(m_capShm->isFrameUsed(i))
-			m_capShm->setFrameUsed(i, false);
-	}
-	m_capShm->unlock();
+	m_capShm->releaseAllFrames();
 	m_activeFrameNum = -1;
+	m_frameSize = QSize();
+	m_frameSrcSize = QSize();
+	m_frameTimestamp = 0;
+	m_badFormatLogged = false;
+	m_numDecodeFailures = 0;
+
+	// Raw pixel frames are staged by a worker thread from now on
+	if(m_capShm->getCaptureType() == RawPixelsShmType) {
+		m_stager = new FrameStager(m_capShm, NUM_STAGING_TEXS);
+		m_stager->setTopDown(m_topDownRef > 0);
+	}
 
 	// Reinitialize resources
 	if(vidgfx_context_is_valid(gfx))
@@ -20,17 +20,22 @@
 
 #include "include/captureobject.h"
 #include <Libvidgfx/libvidgfx.h>
-#include <QtCore/QSize>
 #include <QtCore/QObject>
+#include <QtCore/QRect>
+#include <QtCore/QSize>
 #include <windows.h>
 
 class CaptureSharedSegment;
+class FrameStager;
 
 //=============================================================================
 class WinHookCapture : public QObject
 {
 	Q_OBJECT
 
+public: // Constants ----------------------------------------------------------
+	static const int	NUM_STAGING_TEXS = 3;
+
 private: // Members -----------------------------------------------------------
 	HWND					m_hwnd;
 	VidgfxTex *				m_texture;
@@ -38,11 +43,33 @@ private: // Members -----------------------------------------------------------
 	VidgfxTex *				m_activeSharedTex;
 	int						m_activeFrameNum;
 	int						m_numSharedTexs;
-	bool					m_isFlipped;
+	bool					m_isFlipped; // Frames from the hook are bottom-up
+	bool					m_texIsFlipped; // Contents of `m_texture`
+	int						m_topDownRef;
 	int						m_ref;
 	bool					m_resourcesInitialized;
 	CaptureSharedSegment *	m_capShm;
 
+	// Size of the most recent raw pixel frame which can change without the
+	// segment being reset and the size of the window that it was downscaled
+	// from
+	QSize					m_frameSize;
+	QSize					m_frameSrcSize;
+	quint64					m_frameTimestamp; // Capture time of `m_texture`
+
+	// Raw pixel frames are copied into our staging textures by a worker
+	// thread while they are mapped so that we never wait for a copy.
+	// `m_texture` is the staging texture that contains the newest frame and
+	// is the only one that is never mapped.
+	FrameStager *			m_stager;
+	VidgfxTex *				m_stagingTexs[NUM_STAGING_TEXS];
+	bool					m_stagingMapped[NUM_STAGING_TEXS];
+
+	// Set once we have warned that the hook uses a format that we can't
+	// convert so that we don't spam the log every frame
+	bool					m_badFormatLogged;
+	uint					m_numDecodeFailures;
+
 public: // Constructor/destructor ---------------------------------------------
 	WinHookCapture(HWND hwnd);
 	~WinHookCapture();
@@ -51,6 +78,8 @@ public: // Methods ------------------------------------------------------------
 	void		incrementRef();
 	HWND		getHwnd() const;
 	void		release();
+	void		refTopDown();
+	void		derefTopDown();
 
 	void		queuedFrameEvent(uint fNum, int numDropped);
 	void		initializeResources(VidgfxContext *gfx);
@@ -59,9 +88,13 @@ public: // Methods ------------------------------------------------------------
 	QSize		getSize() const;
 	VidgfxTex *	getTexture() const;
 	bool		isFlipped() const;
+	quint64		getFrameTimestamp() const;
 
 private:
 	void		updateTexture();
+	void		swapStagedTexture();
+	void		destroyStagingTextures(VidgfxContext *gfx);
+	QRect		calcFrameRoi() const;
 
 	public
 Q_SLOTS: // Slots -------------------------------------------------------------
@@ -74,4 +107,13 @@ inline HWND WinHookCapture::getHwnd() const
 	return m_hwnd;
 }
 
+/// <summary>
+/// Returns the capture time at which the hooked application presented the
+/// contents of our texture or zero if we don't have a frame yet.
+/// </summary>
+inline quint64 WinHookCapture::getFrameTimestamp() const
+{
+	return m_frameTimestamp;
+}
+
 #endif // WINHOOKCAPTURE_H
@@ -0,0 +1,397 @@
+//*****************************************************************************
+// Libdeskcap: A high-performance desktop capture library
+//
+// Copyright (C) 2014 Lucas Murray <lucas@polyflare.com>
+// All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation; either version 2 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//*****************************************************************************
+
+#include "tests.h"
+#include "../Common/cpuinfo.h"
+#include "../Common/framecodec.h"
+
+//=============================================================================
+// Helpers
+
+enum CodecContent {
+	FlatContent = 0, // A single colour
+	DesktopContent, // Windows and text on a flat background
+	NoiseContent, // Every pixel is different, the worst case
+	MixedContent // Random runs of every op
+};
+
+static const char *CONTENT_NAMES[] = {
+	"flat", "desktop", "noise", "mixed"
+};
+
+/// <summary>
+/// Fills a frame of 32-bit pixels with content that exercises the encoder.
+/// Desktop content is similar to what the codec was designed for while noise
+/// can't be compressed at all.
+/// </summary>
+static void fillFrame(
+	uchar *dst, uint stride, uint width, uint height, CodecContent content,
+	uint32_t seed)
+{
+	uint32_t state = seed;
+	for(uint y = 0; y < height; y++) {
+		uint32_t *row = (uint32_t *)(dst + (size_t)y * stride);
+		const uint32_t *up =
+			(y > 0) ? (const uint32_t *)(dst + (size_t)(y - 1) * stride) : NULL;
+		for(uint x = 0; x < width; x++) {
+			uint32_t px = 0xFF3A6EA5;
+			if(content == DesktopContent) {
+				// A window with a title bar and lines of text
+				uint left = width / 8, top = height / 8;
+				if(x >= left && x < width - left &&
+					y >= top && y < height - top)
+				{
+					uint wy = y - top;
+					px = (wy < 24) ? 0xFF202020 : 0xFFFFFFFF;
+					if(wy >= 32 && wy % 18 < 12 && x % 9 < 6 &&
+						(x * 7 + y * 13) % 5 < 3)
+					{
+						px = 0xFF000000 | ((x * 3) & 0x3F);
+					}
+				}
+			} else if(content == NoiseContent) {
+				px = nextRandom(state) ^ (nextRandom(state) << 8);
+			} else if(content == MixedContent) {
+				uint op = nextRandom(state) % 6;
+				if(op < 2 && x > 0)
+					px = row[x - 1];
+				else if(op < 4 && up != NULL)
+					px = up[x];
+				else
+					px = nextRandom(state) % 4;
+			}
+			row[x] = px;
+		}
+	}
+}
+
+/// <summary>
+/// Returns true if both frames contain the same pixels.
+/// </summary>
+static bool framesEqual(
+	const uchar *a, uint aStride, const uchar *b, uint bStride, uint width,
+	uint height)
+{
+	for(uint y = 0; y < height; y++) {
+		if(memcmp(a + (size_t)y * aStride, b + (size_t)y * bStride,
+			width * 4) != 0)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+/// <summary>
+/// Returns a destination buffer of `size` bytes within `storage` that is
+/// surrounded by guard bytes.
+/// </summary>
+static uchar *allocGuarded(vector<uchar> &storage, size_t size)
+{
+	uchar *dst = allocAligned(storage, size + GUARD_SIZE * 2) + GUARD_SIZE;
+	memset(dst - GUARD_SIZE, GUARD_BYTE, size + GUARD_SIZE * 2);
+	return dst;
+}
+
+/// <summary>
+/// Decodes `size` bytes of encoded data into a destination that is
+/// surrounded by guard bytes and verifies that decoding never wrote outside
+/// of it whether it succeeded or not.
+/// </summary>
+/// <returns>True if decoding succeeded</returns>
+static bool decodeGuarded(
+	uchar *dst, uint dstStride, uint maxWidth, uint maxHeight,
+	const uchar *src, uint64_t size, const string &desc)
+{
+	size_t dstSize = (size_t)dstStride * maxHeight;
+	memset(dst - GUARD_SIZE, GUARD_BYTE, dstSize + GUARD_SIZE * 2);
+	bool ret = decodeFrame(dst, dstStride, maxWidth, maxHeight, src, size);
+	check(isFilledWith(dst - GUARD_SIZE, GUARD_SIZE, GUARD_BYTE),
+		desc + ": Wrote before the destination");
+	check(isFilledWith(dst + dstSize, GUARD_SIZE, GUARD_BYTE),
+		desc + ": Wrote after the destination");
+	return ret;
+}
+
+//=============================================================================
+// Tests
+
+/// <summary>
+/// Encodes a frame, decodes it again and verifies that the result is
+/// identical. The encoded size must never exceed `calcFrameCodecBound()` and
+/// an output buffer that is a single byte too small must be rejected.
+/// </summary>
+static void testCodecRoundTrip(
+	uint width, uint height, uint srcPadding, CodecContent content,
+	const string &variant)
+{
+	string desc = stringf("%s, %u x %u %s padding=%u", variant.data(),
+		width, height, CONTENT_NAMES[content], srcPadding);
+	uint srcStride = width * 4 + srcPadding;
+	vector<uchar> src((size_t)srcStride * height);
+	fillFrame(&src[0], srcStride, width, height, content, width * height);
+
+	uint64_t bound = calcFrameCodecBound(width, height);
+	vector<uchar> enc((size_t)bound);
+	uint64_t size =
+		encodeFrame(&enc[0], bound, &src[0], srcStride, width, height);
+	check(size > 0 && size <= bound, desc + ": Encoding failed");
+	if(size == 0)
+		return;
+	check(encodeFrame(
+		&enc[0], size - 1, &src[0], srcStride, width, height) == 0,
+		desc + ": Encoded into a buffer that is too small");
+	size = encodeFrame(&enc[0], bound, &src[0], srcStride, width, height);
+
+	uint decWidth = 0, decHeight = 0;
+	check(getEncodedFrameSize(&enc[0], size, &decWidth, &decHeight) &&
+		decWidth == width && decHeight == height,
+		desc + ": Wrong encoded frame size");
+
+	// Decode into a larger destination with padded rows to make sure that
+	// the stride is respected
+	vector<uchar> storage;
+	uint dstStride = width * 4 + 64;
+	uchar *dst = allocGuarded(storage, (size_t)dstStride * (height + 1));
+	bool decoded = decodeGuarded(
+		dst, dstStride, width + 1, height + 1, &enc[0], size, desc);
+	check(decoded, desc + ": Decoding failed");
+	if(decoded) {
+		check(framesEqual(dst, dstStride, &src[0], srcStride, width, height),
+			desc + ": Data mismatch");
+	}
+}
+
+/// <summary>
+/// Verifies that the decoder rejects every kind of invalid input without
+/// writing outside of the destination. The encoded frame is a small desktop
+/// frame that uses every op.
+/// </summary>
+static void testCodecCorruption()
+{
+	const uint WIDTH = 67;
+	const uint HEIGHT = 23;
+	const uint STRIDE = WIDTH * 4;
+	const size_t HEADER_SIZE = 16;
+
+	vector<uchar> src((size_t)STRIDE * HEIGHT);
+	fillFrame(&src[0], STRIDE, WIDTH, HEIGHT, MixedContent, 1);
+	vector<uchar> enc((size_t)calcFrameCodecBound(WIDTH, HEIGHT));
+	uint64_t size = encodeFrame(
+		&enc[0], enc.size(), &src[0], STRIDE, WIDTH, HEIGHT);
+	enc.resize((size_t)size);
+	vector<uchar> storage;
+	uchar *dst = allocGuarded(storage, (size_t)STRIDE * HEIGHT);
+	check(decodeGuarded(dst, STRIDE, WIDTH, HEIGHT, &enc[0], size,
+		"Codec valid frame"), "Codec valid frame: Decoding failed");
+
+	// Frames that are larger than the destination
+	check(!decodeGuarded(dst, STRIDE, WIDTH - 1, HEIGHT, &enc[0], size,
+		"Codec too wide"), "Codec too wide: Accepted");
+	check(!decodeGuarded(dst, STRIDE, WIDTH, HEIGHT - 1, &enc[0], size,
+		"Codec too tall"), "Codec too tall: Accepted");
+	check(!decodeGuarded(dst, STRIDE - 4, WIDTH, HEIGHT, &enc[0], size,
+		"Codec small stride"), "Codec small stride: Accepted");
+
+	// Every possible truncation and trailing garbage
+	for(uint64_t i = 0; i < size; i++) {
+		string desc = stringf("Codec truncated to %u bytes", (uint)i);
+		check(!decodeGuarded(
+			dst, STRIDE, WIDTH, HEIGHT, &enc[0], i, desc),
+			desc + ": Accepted");
+	}
+	vector<uchar> bad = enc;
+	bad.push_back(0);
+	check(!decodeGuarded(dst, STRIDE, WIDTH, HEIGHT, &bad[0],
+		bad.size(), "Codec trailing data"), "Codec trailing data: Accepted");
+
+	// Header fields
+	const size_t HEADER_OFFSETS[] = {
+		0, // Magic
+		4, // Version
+		6, // Reserved flags
+	};
+	for(int i = 0; i < 3; i++) {
+		bad = enc;
+		bad[HEADER_OFFSETS[i]] ^= 0x01;
+		string desc =
+			stringf("Codec header byte %u", (uint)HEADER_OFFSETS[i]);
+		check(!decodeGuarded(dst, STRIDE, WIDTH, HEIGHT, &bad[0],
+			bad.size(), desc), desc + ": Accepted");
+	}
+	bad = enc;
+	memset(&bad[8], 0, 4);
+	check(!decodeGuarded(dst, STRIDE, WIDTH, HEIGHT, &bad[0],
+		bad.size(), "Codec zero width"), "Codec zero width: Accepted");
+
+	// Individual ops that are never valid. The first op follows the header
+	// and is always a literal that begins with the top-left pixel.
+	const uchar BAD_FIRST_OPS[][6] = {
+		{ 0x40 }, // LEFT at the start of a row
+		{ 0x80 }, // UP in the first row
+		{ 0xC0 }, // Reserved op
+		{ 0x3F, 0x04 }, // Literal of 68 pixels, longer than the row
+		{ 0x3F, 0xFF, 0xFF, 0xFF, 0xFF, 0x7F } // Length varint too long
+	};
+	const int NUM_BAD_FIRST_OPS =
+		sizeof(BAD_FIRST_OPS) / sizeof(BAD_FIRST_OPS[0]);
+	for(int i = 0; i < NUM_BAD_FIRST_OPS; i++) {
+		bad = enc;
+		memcpy(&bad[HEADER_SIZE], BAD_FIRST_OPS[i], 6);
+		string desc = stringf("Codec bad first op %d", i);
+		check(!decodeGuarded(dst, STRIDE, WIDTH, HEIGHT, &bad[0],
+			bad.size(), desc), desc + ": Accepted");
+	}
+
+	// Random bit flips may or may not produce a valid frame but must never
+	// write outside of the destination
+	uint32_t state = 1;
+	for(int i = 0; i < 2000; i++) {
+		bad = enc;
+		size_t offset = HEADER_SIZE + nextRandom(state) % (size - HEADER_SIZE);
+		bad[offset] ^= (uchar)(1 << (nextRandom(state) % 8));
+		decodeGuarded(dst, STRIDE, WIDTH, HEIGHT, &bad[0], bad.size(),
+			stringf("Codec bit flip at %u", (uint)offset));
+	}
+}
+
+/// <summary>
+/// Tests the codec with a variety of frame sizes and content with every
+/// code path of the encoder. Encoding must not depend on the code path.
+/// </summary>
+void testFrameCodec()
+{
+	cout << "Testing the frame codec..." << endl;
+
+	// Sizes around the SIMD width and the short run length limit
+	struct FrameSize {
+		uint	width;
+		uint	height;
+	};
+	const FrameSize SIZES[] = {
+		{ 1, 1 }, { 2, 1 }, { 3, 5 }, { 4, 4 }, { 5, 3 }, { 63, 2 },
+		{ 64, 2 }, { 65, 2 }, { 127, 3 }, { 300, 100 }, { 1921, 7 }
+	};
+	const int NUM_SIZES = sizeof(SIZES) / sizeof(SIZES[0]);
+	const uint PADDINGS[] = { 0, 4, 60 };
+	const int NUM_PADDINGS = sizeof(PADDINGS) / sizeof(PADDINGS[0]);
+
+	for(int i = 0; i < NUM_FEATURE_MASKS; i++) {
+		setCpuFeatureMask(FEATURE_MASKS[i].mask);
+		for(int j = 0; j < NUM_SIZES; j++) {
+			for(int k = 0; k <= MixedContent; k++) {
+				for(int l = 0; l < NUM_PADDINGS; l++) {
+					testCodecRoundTrip(SIZES[j].width, SIZES[j].height,
+						PADDINGS[l], (CodecContent)k, FEATURE_MASKS[i].name);
+				}
+			}
+		}
+	}
+
+	// Every code path must produce exactly the same stream
+	const uint WIDTH = 300;
+	const uint HEIGHT = 100;
+	vector<uchar> src((size_t)WIDTH * 4 * HEIGHT);
+	vector<uchar> ref((size_t)calcFrameCodecBound(WIDTH, HEIGHT));
+	vector<uchar> enc(ref.size());
+	for(int k = 0; k <= MixedContent; k++) {
+		fillFrame(&src[0], WIDTH * 4, WIDTH, HEIGHT, (CodecContent)k, 7);
+		setCpuFeatureMask(0);
+		uint64_t refSize = encodeFrame(
+			&ref[0], ref.size(), &src[0], WIDTH * 4, WIDTH, HEIGHT);
+		for(int i = 0; i < NUM_FEATURE_MASKS; i++) {
+			setCpuFeatureMask(FEATURE_MASKS[i].mask);
+			uint64_t size = encodeFrame(
+				&enc[0], enc.size(), &src[0], WIDTH * 4, WIDTH, HEIGHT);
+			check(size == refSize && memcmp(&enc[0], &ref[0], size) == 0,
+				stringf("Codec %s %s: Stream differs from the scalar "
+				"encoder", FEATURE_MASKS[i].name, CONTENT_NAMES[k]));
+		}
+	}
+	setCpuFeatureMask(~0U);
+
+	testCodecCorruption();
+}
+
+//=============================================================================
+// Benchmarks
+
+/// <summary>
+/// Measures the compression ratio and the encoding and decoding throughput
+/// of full frames. Throughput is of the uncompressed frame so that it can be
+/// compared directly to `imgDataCopy()`.
+/// </summary>
+void benchFrameCodec()
+{
+	struct FrameSize {
+		const char *	name;
+		uint			width;
+		uint			height;
+	};
+	const FrameSize SIZES[] = {
+		{ "1080p", 1920, 1080 }, { "4K", 3840, 2160 }
+	};
+	const int NUM_SIZES = sizeof(SIZES) / sizeof(SIZES[0]);
+
+	cout << endl;
+	cout << "Frame codec compression ratio and throughput in GB/s of "
+		"uncompressed pixels" << endl;
+	cout << stringf("%-8s%-10s%10s%10s%10s", "Size", "Content", "Ratio",
+		"Encode", "Decode") << endl;
+
+	for(int i = 0; i < NUM_SIZES; i++) {
+		uint width = SIZES[i].width;
+		uint height = SIZES[i].height;
+		uint stride = width * 4;
+		size_t frameSize = (size_t)stride * height;
+		vector<uchar> srcStorage;
+		vector<uchar> dstStorage;
+		uchar *src = allocAligned(srcStorage, frameSize);
+		uchar *dst = allocAligned(dstStorage, frameSize);
+		vector<uchar> enc((size_t)calcFrameCodecBound(width, height));
+
+		for(int k = 0; k <= MixedContent; k++) {
+			fillFrame(src, stride, width, height, (CodecContent)k, 1);
+			uint64_t size = 0;
+			uint64_t encUsec = UINT64_MAX;
+			uint64_t startUsec = getMonotonicUsec();
+			uint64_t nowUsec = startUsec;
+			while(nowUsec - startUsec < BENCH_MIN_USEC) {
+				uint64_t before = getMonotonicUsec();
+				size = encodeFrame(
+					&enc[0], enc.size(), src, stride, width, height);
+				nowUsec = getMonotonicUsec();
+				if(nowUsec - before < encUsec)
+					encUsec = nowUsec - before;
+			}
+			uint64_t decUsec = UINT64_MAX;
+			startUsec = getMonotonicUsec();
+			nowUsec = startUsec;
+			while(nowUsec - startUsec < BENCH_MIN_USEC) {
+				uint64_t before = getMonotonicUsec();
+				decodeFrame(dst, stride, width, height, &enc[0], size);
+				nowUsec = getMonotonicUsec();
+				if(nowUsec - before < decUsec)
+					decUsec = nowUsec - before;
+			}
+			double ratio = (size > 0) ? (double)frameSize / (double)size : 0.0;
+			cout << stringf("%-8s%-10s%8.1f:1%10.2f%10.2f", SIZES[i].name,
+				CONTENT_NAMES[k], ratio, calcGBps(frameSize, encUsec),
+				calcGBps(frameSize, decUsec)) << endl;
+		}
+	}
+}
@@ -0,0 +1,493 @@
+//*****************************************************************************
+// Libdeskcap: A high-performance desktop capture library
+//
+// Copyright (C) 2014 Lucas Murray <lucas@polyflare.com>
+// All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation; either version 2 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//*****************************************************************************
+
+#include "tests.h"
+#include "../Common/cpuinfo.h"
+#include "../Common/framededup.h"
+#include "../Common/imghelpers.h"
+
+typedef CaptureSharedSegment::DirtyRect DirtyRect;
+
+//=============================================================================
+// Helpers
+
+static const uint TILE_SIZE = CaptureSharedSegment::TILE_SIZE;
+
+// How each frame of a sequence differs from the one before it
+enum DedupChange {
+	StaticChange = 0, // Identical
+	SmallChange, // A few small rectangles
+	NoiseChange // Every pixel
+};
+
+/// <summary>
+/// Simulates a producer that copies frames into the slots of a frame ring
+/// with `FrameDeduplicator` the same way as `CommonHook` does. Every slot
+/// and the source frame have the full frame size while only `rect` is
+/// copied.
+/// </summary>
+struct DedupRing {
+	uint					width;
+	uint					height;
+	uint					bpp;
+	DirtyRect				rect;
+	vector<uchar>			frame;
+	vector<uchar>			prevFrame; // Last frame given to `copyFrame()`
+	bool					hasPrev;
+	vector<vector<uchar> >	slots;
+	FrameDeduplicator		dedup;
+
+	DedupRing(uint w, uint h, uint bytesPerPixel, uint numSlots,
+		const DirtyRect &r)
+		: width(w)
+		, height(h)
+		, bpp(bytesPerPixel)
+		, rect(r)
+		, frame((size_t)w * h * bytesPerPixel, 0)
+		, prevFrame()
+		, hasPrev(false)
+		, slots(numSlots,
+			vector<uchar>((size_t)w * h * bytesPerPixel, GUARD_BYTE))
+		, dedup()
+	{
+		dedup.reset(w, h, bytesPerPixel, numSlots);
+	}
+
+	uint stride() const
+	{
+		return width * bpp;
+	}
+
+	const uchar *rectSrc() const
+	{
+		return &frame[(size_t)rect.y * stride() + rect.x * bpp];
+	}
+};
+
+/// <summary>
+/// Fills a buffer with random bytes. The low bits of `nextRandom()` repeat
+/// every 64 KB which would make consecutive frames identical so only the
+/// high bits are used.
+/// </summary>
+static void fillNoise(uchar *dst, size_t size, uint32_t &state)
+{
+	for(size_t i = 0; i < size; i++)
+		dst[i] = (uchar)(nextRandom(state) >> 16);
+}
+
+/// <summary>
+/// Changes the frame of `ring` in the way that `change` describes.
+/// </summary>
+static void changeFrame(DedupRing &ring, DedupChange change, uint32_t &state)
+{
+	if(change == NoiseChange) {
+		fillNoise(&ring.frame[0], ring.frame.size(), state);
+		return;
+	}
+	if(change != SmallChange)
+		return;
+	uint numRects = 1 + nextRandom(state) % 3;
+	for(uint i = 0; i < numRects; i++) {
+		uint x = nextRandom(state) % ring.width;
+		uint y = nextRandom(state) % ring.height;
+		uint w = 1 + nextRandom(state) % 24;
+		uint h = 1 + nextRandom(state) % 24;
+		for(uint row = y; row < y + h && row < ring.height; row++) {
+			uint bytes = (x + w <= ring.width ? w : ring.width - x) *
+				ring.bpp;
+			fillNoise(&ring.frame[(size_t)row * ring.stride() + x * ring.bpp],
+				bytes, state);
+		}
+	}
+}
+
+/// <summary>
+/// Returns true if the area of `rect` that `tile` covers differs between two
+/// frames.
+/// </summary>
+static bool tileDiffers(
+	const DedupRing &ring, const vector<uchar> &a, const vector<uchar> &b,
+	uint tx, uint ty)
+{
+	const DirtyRect &rect = ring.rect;
+	uint x0 = tx * TILE_SIZE > rect.x ? tx * TILE_SIZE : rect.x;
+	uint y0 = ty * TILE_SIZE > rect.y ? ty * TILE_SIZE : rect.y;
+	uint x1 = (tx + 1) * TILE_SIZE;
+	uint y1 = (ty + 1) * TILE_SIZE;
+	if(x1 > rect.x + rect.width)
+		x1 = rect.x + rect.width;
+	if(y1 > rect.y + rect.height)
+		y1 = rect.y + rect.height;
+	if(x0 >= x1 || y0 >= y1)
+		return false; // Outside of the rectangle
+	for(uint y = y0; y < y1; y++) {
+		size_t offset = (size_t)y * ring.stride() + x0 * ring.bpp;
+		if(memcmp(&a[offset], &b[offset], (x1 - x0) * ring.bpp) != 0)
+			return true;
+	}
+	return false;
+}
+
+/// <summary>
+/// Returns true if the area `rect` of `slot` is identical to the frame and
+/// nothing outside of it has ever been written.
+/// </summary>
+static bool isSlotComplete(const DedupRing &ring, const vector<uchar> &slot)
+{
+	const DirtyRect &rect = ring.rect;
+	for(uint y = 0; y < ring.height; y++) {
+		const uchar *row = &slot[(size_t)y * ring.stride()];
+		const uchar *src = &ring.frame[(size_t)y * ring.stride()];
+		if(y < rect.y || y >= rect.y + rect.height) {
+			if(!isFilledWith(row, ring.stride(), GUARD_BYTE))
+				return false;
+			continue;
+		}
+		size_t left = rect.x * ring.bpp;
+		size_t right = (rect.x + rect.width) * ring.bpp;
+		if(!isFilledWith(row, left, GUARD_BYTE) ||
+			!isFilledWith(row + right, ring.stride() - right, GUARD_BYTE) ||
+			memcmp(row + left, src + left, right - left) != 0)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+/// <summary>
+/// Returns true if pixel `x`, `y` is inside of one of `rects`.
+/// </summary>
+static bool rectsContain(
+	const DirtyRect *rects, uint numRects, uint x, uint y)
+{
+	for(uint i = 0; i < numRects; i++) {
+		const DirtyRect &r = rects[i];
+		if(x >= r.x && x < r.x + r.width && y >= r.y && y < r.y + r.height)
+			return true;
+	}
+	return false;
+}
+
+/// <summary>
+/// Copies the current frame of `ring` into `slot` and verifies the slot, the
+/// changed tiles and the dirty rectangles. If the deduplicator is bypassing
+/// then the frame is copied directly instead.
+/// </summary>
+/// <returns>True if the frame was bypassed</returns>
+static bool copyAndVerify(DedupRing &ring, uint slot, const string &desc)
+{
+	const uint MAX_RECTS = CaptureSharedSegment::MAX_DIRTY_RECTS;
+	const DirtyRect &rect = ring.rect;
+	uint stride = ring.stride();
+	vector<uchar> &dst = ring.slots[slot];
+	if(ring.dedup.isBypassing()) {
+		// `CommonHook` uses `imgDataCopy()` which may also write the row
+		// padding that we verify
+		for(uint y = rect.y; y < rect.y + rect.height; y++) {
+			size_t offset = (size_t)y * stride + rect.x * ring.bpp;
+			memcpy(&dst[offset], &ring.frame[offset], rect.width * ring.bpp);
+		}
+		ring.dedup.bypassFrame(slot);
+		ring.hasPrev = false;
+		return true;
+	}
+
+	uint numChanged = ring.dedup.copyFrame(
+		slot, &dst[0], ring.rectSrc(), stride, stride, rect);
+	check(isSlotComplete(ring, dst), desc + ": Slot is incomplete");
+	check(ring.dedup.getBytesCopied() + ring.dedup.getBytesSaved() ==
+		(uint64_t)rect.width * rect.height * ring.bpp,
+		desc + ": Copied and saved bytes don't add up");
+
+	// The tile map must contain exactly the tiles that changed. Segments
+	// can have more tiles per row than the frame needs.
+	uint tilesX = (ring.width + TILE_SIZE - 1) / TILE_SIZE;
+	uint tilesY = (ring.height + TILE_SIZE - 1) / TILE_SIZE;
+	uint tilesPerRow = tilesX + 3;
+	vector<uchar> tileMap((tilesPerRow * tilesY + 7) / 8 + 1, 0xFF);
+	ring.dedup.writeTileMap(&tileMap[0], (uint)tileMap.size(), tilesPerRow);
+	bool tilesMatch = true;
+	uint numExpected = 0;
+	for(uint ty = 0; ty < tilesY; ty++) {
+		for(uint tx = 0; tx < tilesPerRow; tx++) {
+			bool expected = false;
+			if(tx < tilesX) {
+				// Without a previous frame every tile in the rectangle
+				// changed
+				if(!ring.hasPrev) {
+					expected = rect.x < (tx + 1) * TILE_SIZE &&
+						rect.x + rect.width > tx * TILE_SIZE &&
+						rect.y < (ty + 1) * TILE_SIZE &&
+						rect.y + rect.height > ty * TILE_SIZE;
+				} else {
+					expected = tileDiffers(
+						ring, ring.frame, ring.prevFrame, tx, ty);
+				}
+			}
+			uint bit = ty * tilesPerRow + tx;
+			bool actual = (tileMap[bit >> 3] & (1 << (bit & 7))) != 0;
+			if(actual != expected)
+				tilesMatch = false;
+			if(expected)
+				numExpected++;
+		}
+	}
+	check(tilesMatch, desc + ": Wrong changed tiles");
+	check(numChanged == numExpected, desc + ": Wrong number of tiles");
+
+	// Every pixel that changed must be covered by the dirty rectangles
+	// whether or not they had to be merged into a single one
+	const uint MAX_RECTS_LIST[] = { MAX_RECTS, 2 };
+	for(int i = 0; i < 2; i++) {
+		DirtyRect rects[MAX_RECTS];
+		uint numRects = ring.dedup.calcDirtyRects(rects, MAX_RECTS_LIST[i]);
+		bool covered = (numRects <= MAX_RECTS_LIST[i]);
+		for(uint j = 0; j < numRects; j++) {
+			if(rects[j].x + rects[j].width > ring.width ||
+				rects[j].y + rects[j].height > ring.height)
+			{
+				covered = false;
+			}
+		}
+		for(uint y = rect.y; y < rect.y + rect.height && covered; y++) {
+			for(uint x = rect.x; x < rect.x + rect.width; x++) {
+				size_t offset = (size_t)y * stride + x * ring.bpp;
+				bool changed = !ring.hasPrev || memcmp(&ring.frame[offset],
+					&ring.prevFrame[offset], ring.bpp) != 0;
+				if(changed && !rectsContain(rects, numRects, x, y)) {
+					covered = false;
+					break;
+				}
+			}
+		}
+		check(covered, desc + stringf(": Dirty rectangles with at most %u "
+			"don't cover every change", MAX_RECTS_LIST[i]));
+	}
+
+	ring.prevFrame = ring.frame;
+	ring.hasPrev = true;
+	return false;
+}
+
+//=============================================================================
+// Tests
+
+/// <summary>
+/// The hash must be identical with every kernel and change when any bit of
+/// the hashed area changes, but not when the row padding changes.
+/// </summary>
+static void testImgHashRows()
+{
+	const uint MAX_WIDTH = 67;
+	const uint NUM_ROWS = 5;
+	const uint STRIDE = MAX_WIDTH + 13;
+	vector<uchar> data(STRIDE * NUM_ROWS);
+	uint32_t state = 1;
+	fillNoise(&data[0], data.size(), state);
+
+	for(uint width = 1; width <= MAX_WIDTH; width++) {
+		for(uint rows = 1; rows <= NUM_ROWS; rows++) {
+			string desc = stringf("imgHashRows() %ux%u", width, rows);
+			setCpuFeatureMask(0U);
+			uint64_t scalar = imgHashRows(&data[0], STRIDE, width, rows);
+			for(int i = 0; i < NUM_FEATURE_MASKS; i++) {
+				setCpuFeatureMask(FEATURE_MASKS[i].mask);
+				check(imgHashRows(&data[0], STRIDE, width, rows) == scalar,
+					desc + stringf(" %s: Differs from the scalar path",
+					FEATURE_MASKS[i].name));
+			}
+			setCpuFeatureMask(~0U);
+
+			// Every bit of the first and last row
+			bool sensitive = true;
+			uint lastRow = (rows - 1) * STRIDE;
+			for(uint j = 0; j < width * 8 * 2; j++) {
+				uint row = (j < width * 8) ? 0 : lastRow;
+				uint offset = row + j % (width * 8) / 8;
+				data[offset] ^= (uchar)(1 << (j % 8));
+				if(imgHashRows(&data[0], STRIDE, width, rows) == scalar)
+					sensitive = false;
+				data[offset] ^= (uchar)(1 << (j % 8));
+			}
+			check(sensitive, desc + ": Missed a changed bit");
+
+			// The padding after the first and last row
+			data[width] ^= 0xFF;
+			data[lastRow + STRIDE - 1] ^= 0xFF;
+			check(imgHashRows(&data[0], STRIDE, width, rows) == scalar,
+				desc + ": Hashed the row padding");
+			data[width] ^= 0xFF;
+			data[lastRow + STRIDE - 1] ^= 0xFF;
+		}
+	}
+
+	// Identical bytes in a different shape
+	check(imgHashRows(&data[0], 16, 16, 2) !=
+		imgHashRows(&data[0], 32, 32, 1),
+		"imgHashRows(): Ignored the shape of the area");
+}
+
+/// <summary>
+/// Copies a random sequence of static, slightly changed and entirely
+/// changed frames into random slots of a ring and verifies every copy.
+/// </summary>
+static void testDedupSequence(
+	uint width, uint height, uint bpp, const DirtyRect &rect,
+	uint numFrames, const string &variant)
+{
+	const uint NUM_SLOTS = 3;
+	string desc = stringf("FrameDeduplicator %s, %ux%u bpp=%u rect=(%u,%u "
+		"%ux%u)", variant.data(), width, height, bpp, rect.x, rect.y,
+		rect.width, rect.height);
+	DedupRing ring(width, height, bpp, NUM_SLOTS, rect);
+	uint32_t state = width + height + bpp;
+	fillNoise(&ring.frame[0], ring.frame.size(), state);
+
+	DedupChange change = StaticChange;
+	for(uint i = 0; i < numFrames; i++) {
+		// Each kind of change lasts for a random number of frames. Noise
+		// lasts long enough for the deduplicator to start bypassing.
+		if(nextRandom(state) % 8 == 0)
+			change = (DedupChange)(nextRandom(state) % 3);
+		changeFrame(ring, change, state);
+		uint slot = nextRandom(state) % NUM_SLOTS;
+
+		// Something else wrote to the slot, such as a compressed frame
+		if(nextRandom(state) % 16 == 0) {
+			fillNoise(&ring.slots[slot][0], ring.slots[slot].size(), state);
+			ring.dedup.invalidateSlot(slot);
+			memset(&ring.slots[slot][0], GUARD_BYTE, ring.slots[slot].size());
+		}
+		copyAndVerify(ring, slot, desc + stringf(" frame %u", i));
+	}
+}
+
+/// <summary>
+/// Verifies that `isUnchanged()` compares against the frame that was last
+/// copied without changing what the deduplicator knows.
+/// </summary>
+static void testDedupUnchanged()
+{
+	const string desc = "FrameDeduplicator::isUnchanged()";
+	DirtyRect rect(10, 20, 150, 100);
+	DedupRing ring(200, 150, 4, 2, rect);
+	uint32_t state = 7;
+	fillNoise(&ring.frame[0], ring.frame.size(), state);
+
+	check(!ring.dedup.isUnchanged(ring.rectSrc(), ring.stride(), rect),
+		desc + ": Unchanged before the first frame");
+	copyAndVerify(ring, 0, desc);
+	copyAndVerify(ring, 1, desc);
+	check(ring.dedup.isUnchanged(ring.rectSrc(), ring.stride(), rect),
+		desc + ": Changed after copying");
+
+	// Outside of the rectangle doesn't matter
+	ring.frame[0] ^= 0xFF;
+	check(ring.dedup.isUnchanged(ring.rectSrc(), ring.stride(), rect),
+		desc + ": Changed outside of the rectangle");
+	ring.frame[(size_t)(rect.y + rect.height - 1) * ring.stride() +
+		(rect.x + rect.width - 1) * ring.bpp] ^= 0xFF;
+	check(!ring.dedup.isUnchanged(ring.rectSrc(), ring.stride(), rect),
+		desc + ": Missed the last pixel");
+
+	// Nothing that we know changed so the next copy is still exact
+	copyAndVerify(ring, 0, desc + " after a change");
+	check(ring.dedup.isUnchanged(ring.rectSrc(), ring.stride(), rect),
+		desc + ": Changed after copying again");
+	ring.dedup.invalidatePrevious();
+	check(!ring.dedup.isUnchanged(ring.rectSrc(), ring.stride(), rect),
+		desc + ": Unchanged after invalidating");
+}
+
+/// <summary>
+/// Feeds entirely changing frames until the deduplicator bypasses them and
+/// verifies when it probes and stops bypassing.
+/// </summary>
+static void testDedupBypass()
+{
+	const uint AFTER = FrameDeduplicator::BYPASS_AFTER_FRAMES;
+	const uint PROBE = FrameDeduplicator::BYPASS_PROBE_FRAMES;
+	const string desc = "FrameDeduplicator bypass";
+	DedupRing ring(256, 128, 4, 3, DirtyRect(0, 0, 256, 128));
+	uint32_t state = 3;
+	uint slot = 0;
+
+	// The first frame can't be compared to anything
+	for(uint i = 0; i <= AFTER; i++) {
+		check(!ring.dedup.isBypassing(),
+			desc + stringf(": Bypassing after %u frames", i));
+		changeFrame(ring, NoiseChange, state);
+		copyAndVerify(ring, slot++ % 3, desc);
+	}
+	check(ring.dedup.isBypassing(), desc + ": Not bypassing");
+
+	// Probe after every bypassed frame and start bypassing again after a
+	// single probe that is still mostly changed
+	uint numBypassed = 0;
+	while(numBypassed <= PROBE) {
+		changeFrame(ring, NoiseChange, state);
+		if(!copyAndVerify(ring, slot++ % 3, desc))
+			break;
+		numBypassed++;
+	}
+	check(numBypassed == PROBE,
+		desc + stringf(": Bypassed %u frames", numBypassed));
+	changeFrame(ring, NoiseChange, state);
+	copyAndVerify(ring, slot++ % 3, desc + " probe");
+	check(ring.dedup.isBypassing(), desc + ": Not bypassing after probing");
+
+	// Static content stops bypassing after the next probe
+	for(uint i = 0; i < PROBE; i++) {
+		changeFrame(ring, NoiseChange, state);
+		copyAndVerify(ring, slot++ % 3, desc);
+	}
+	check(!ring.dedup.isBypassing(), desc + ": Still bypassing");
+	changeFrame(ring, SmallChange, state);
+	copyAndVerify(ring, slot++ % 3, desc + " static probe");
+	copyAndVerify(ring, slot++ % 3, desc + " static probe");
+	check(!ring.dedup.isBypassing(), desc + ": Bypassing static content");
+	for(uint i = 0; i < 3; i++)
+		copyAndVerify(ring, slot++ % 3, desc + " static");
+	check(ring.dedup.getBytesCopied() == 0,
+		desc + ": Copied a static frame into a complete slot");
+}
+
+void testFrameDedup()
+{
+	cout << "Testing frame deduplication..." << endl;
+	testImgHashRows();
+	testDedupUnchanged();
+	testDedupBypass();
+
+	// Edge tiles, rectangles that aren't aligned to tiles and 24-bit pixels
+	size_t prevThreshold = getImgThreadingThreshold();
+	setImgThreadingThreshold(0);
+	testDedupSequence(200, 150, 4, DirtyRect(0, 0, 200, 150), 300, "single");
+	testDedupSequence(200, 150, 3, DirtyRect(0, 0, 200, 150), 300, "single");
+	testDedupSequence(200, 150, 4, DirtyRect(37, 21, 150, 100), 300,
+		"single");
+	testDedupSequence(64, 64, 4, DirtyRect(63, 0, 1, 64), 100, "single");
+
+	// Split into tile row stripes
+	setImgThreadingThreshold(1024 * 1024);
+	testDedupSequence(1280, 720, 4, DirtyRect(0, 0, 1280, 720), 60,
+		"threaded");
+	testDedupSequence(1280, 720, 4, DirtyRect(100, 30, 1000, 650), 60,
+		"threaded");
+	setImgThreadingThreshold(prevThreshold);
+}
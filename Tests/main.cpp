@@ -0,0 +1,745 @@
+//*****************************************************************************
+// Libdeskcap: A high-performance desktop capture library
+//
+// Copyright (C) 2014 Lucas Murray <lucas@polyflare.com>
+// All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation; either version 2 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//*****************************************************************************
+
+#include "tests.h"
+#include "../Common/cpuinfo.h"
+#include "../Common/imghelpers.h"
+#include "../Common/memcopy.h"
+#include "../Common/workerpool.h"
+
+//=============================================================================
+// Overview
+/*
+
+A small console program that checks the optimized routines in "Common" such
+as `fastmemcpy()`, `imgDataCopy()` and the frame codec against the C runtime
+or simple reference implementations and measures how fast they are on the
+current machine. Every code path that is selected at runtime is exercised by
+masking out CPU features with `setCpuFeatureMask()` so a single machine with
+the newest instruction set extensions tests all of them. Frame pacing is
+tested with a deterministic simulation of a hooked application and the main
+application. The capture frame ring is stressed with real producer and reader
+threads in a single process and on Linux also with a consumer process.
+
+This file contains the helpers and the copy routines, everything else has a
+file of its own that is declared in "tests.h".
+
+Usage: `MishiraTests [--no-bench]`
+
+The process exits with a non-zero code if any test failed. Benchmarks are
+printed after the tests unless "--no-bench" is given. Build the "Release"
+configuration when benchmarking.
+
+*/
+//=============================================================================
+// Helpers
+
+// Maximum number of failures that are printed in full
+static const int MAX_PRINTED_FAILURES = 20;
+
+// Every kernel that `getStreamCopyFunc()` can select. Masking out a feature
+// that the CPU doesn't have is harmless, that variant just repeats the
+// previous code path.
+const FeatureMask FEATURE_MASKS[] = {
+	{ "All", ~0U },
+	{ "No AVX-512", ~(uint)(AVX512FCpuFeature | AVX512BWCpuFeature) },
+	{ "SSE2 only", (uint)SSE2CpuFeature },
+	{ "None", 0U }
+};
+const int NUM_FEATURE_MASKS =
+	sizeof(FEATURE_MASKS) / sizeof(FEATURE_MASKS[0]);
+
+static int s_numTests = 0;
+static int s_numFailures = 0;
+
+/// <summary>
+/// Records the result of a single check and prints `desc` if it failed.
+/// </summary>
+void check(bool passed, const string &desc)
+{
+	s_numTests++;
+	if(passed)
+		return;
+	s_numFailures++;
+	if(s_numFailures <= MAX_PRINTED_FAILURES)
+		cout << "FAIL: " << desc << endl;
+	else if(s_numFailures == MAX_PRINTED_FAILURES + 1)
+		cout << "Too many failures, no longer printing them" << endl;
+}
+
+/// <summary>
+/// Returns a pointer into `storage` that is aligned to a page boundary and has
+/// at least `size` bytes after it.
+/// </summary>
+uchar *allocAligned(vector<uchar> &storage, size_t size)
+{
+	const uintptr_t PAGE_SIZE = 4096;
+	storage.resize(size + PAGE_SIZE);
+	uintptr_t ptr = (uintptr_t)&storage[0];
+	ptr = (ptr + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	return (uchar *)ptr;
+}
+
+/// <summary>
+/// Fills a buffer with a pattern that never repeats within 251 bytes so that
+/// copies from the wrong offset are detected.
+/// </summary>
+void fillPattern(uchar *buf, size_t size, uint seed)
+{
+	for(size_t i = 0; i < size; i++)
+		buf[i] = (uchar)((i + seed) % 251);
+}
+
+/// <summary>
+/// Returns a pseudo-random number. We don't use `rand()` so that the content
+/// is the same on every platform.
+/// </summary>
+uint32_t nextRandom(uint32_t &state)
+{
+	state = state * 1664525U + 1013904223U;
+	return state >> 8;
+}
+
+/// <summary>
+/// Returns true if every byte in the buffer equals `value`.
+/// </summary>
+bool isFilledWith(const uchar *buf, size_t size, uchar value)
+{
+	for(size_t i = 0; i < size; i++) {
+		if(buf[i] != value)
+			return false;
+	}
+	return true;
+}
+
+/// <summary>
+/// Returns the throughput of a copy in gigabytes per second.
+/// </summary>
+double calcGBps(size_t bytes, uint64_t usec)
+{
+	if(usec == 0)
+		usec = 1;
+	return (double)bytes / (double)usec / 1000.0;
+}
+
+string formatSize(size_t size)
+{
+	if(size >= 1024 * 1024 && size % (1024 * 1024) == 0)
+		return stringf("%u MB", (uint)(size / (1024 * 1024)));
+	if(size >= 1024 && size % 1024 == 0)
+		return stringf("%u KB", (uint)(size / 1024));
+	return stringf("%u B", (uint)size);
+}
+
+//=============================================================================
+// fastmemcpy()
+
+/// <summary>
+/// `memcpy()` with the signature of a copy kernel.
+/// </summary>
+static void memcpyFunc(void *dst, const void *src, size_t size)
+{
+	memcpy(dst, src, size);
+}
+
+/// <summary>
+/// `fastmemcpy()` with the signature of a copy kernel.
+/// </summary>
+static void fastmemcpyFunc(void *dst, const void *src, size_t size)
+{
+	fastmemcpy(dst, src, size);
+}
+
+/// <summary>
+/// Source and destination buffers that are reused between copies so that
+/// large tests aren't dominated by page faults.
+/// </summary>
+struct CopyBuffers {
+	vector<uchar>	srcStorage;
+	vector<uchar>	dstStorage;
+	uchar *			src;
+	uchar *			dst;
+};
+
+static void allocCopyBuffers(CopyBuffers &bufs, size_t maxSize)
+{
+	bufs.src = allocAligned(bufs.srcStorage, maxSize + CACHE_LINE_SIZE);
+	bufs.dst = allocAligned(
+		bufs.dstStorage, maxSize + CACHE_LINE_SIZE + GUARD_SIZE * 2);
+}
+
+/// <summary>
+/// Copies `size` bytes between buffers that are offset from a page boundary by
+/// `srcOffset` and `dstOffset` and verifies both the copied data and the guard
+/// bytes around the destination.
+/// </summary>
+static void testCopy(
+	CopyBuffers &bufs, StreamCopyFunc copy, size_t size, size_t srcOffset,
+	size_t dstOffset, const string &variant)
+{
+	uchar *src = bufs.src + srcOffset;
+	uchar *dst = bufs.dst + dstOffset + GUARD_SIZE;
+	fillPattern(src, size, (uint)(size + srcOffset));
+	memset(dst - GUARD_SIZE, GUARD_BYTE, size + GUARD_SIZE * 2);
+
+	copy(dst, src, size);
+	streamCopyFence();
+
+	string desc = stringf("%s, size=%u srcOffset=%u dstOffset=%u",
+		variant.data(), (uint)size, (uint)srcOffset, (uint)dstOffset);
+	check(memcmp(dst, src, size) == 0, desc + ": Data mismatch");
+	check(isFilledWith(dst - GUARD_SIZE, GUARD_SIZE, GUARD_BYTE),
+		desc + ": Wrote before the destination");
+	check(isFilledWith(dst + size, GUARD_SIZE, GUARD_BYTE),
+		desc + ": Wrote after the destination");
+}
+
+/// <summary>
+/// Tests every size in `sizes` with every combination of source and
+/// destination misalignment. Sizes of at least `largeSize` only test a few
+/// combinations to keep the run time reasonable.
+/// </summary>
+static void testCopySizes(
+	CopyBuffers &bufs, StreamCopyFunc copy, const size_t *sizes, int numSizes,
+	size_t largeSize, const string &variant)
+{
+	const size_t OFFSETS[] = { 0, 1, 7, 32, 63 };
+	const int NUM_OFFSETS = sizeof(OFFSETS) / sizeof(OFFSETS[0]);
+
+	for(int i = 0; i < numSizes; i++) {
+		for(int j = 0; j < NUM_OFFSETS; j++) {
+			for(int k = 0; k < NUM_OFFSETS; k++) {
+				if(sizes[i] >= largeSize && k != (j + 1) % NUM_OFFSETS)
+					continue;
+				testCopy(
+					bufs, copy, sizes[i], OFFSETS[j], OFFSETS[k], variant);
+			}
+		}
+	}
+}
+
+static void testFastMemcpy()
+{
+	cout << "Testing fastmemcpy()..." << endl;
+
+	// The stream threshold depends on the size of the last level cache so we
+	// also test the kernels directly with sizes around their loop strides
+	const size_t KERNEL_SIZES[] = {
+		0, 1, 15, 16, 63, 64, 65, 127, 255, 256, 257, 1000, 4095, 4096, 4097
+	};
+	const int NUM_KERNEL_SIZES = sizeof(KERNEL_SIZES) / sizeof(size_t);
+
+	// Sizes around every threshold and the internal block size
+	size_t streamThreshold = getFastMemcpyStreamThreshold();
+	const size_t SIZES[] = {
+		0, 1, 15, 64, 4095, 4096, 4097,
+		64 * 1024 - 1, 64 * 1024, 64 * 1024 + 1,
+		256 * 1024 + 13, 1024 * 1024 + 255, 8 * 1024 * 1024 + 3,
+		streamThreshold - 1, streamThreshold, streamThreshold + 1,
+		streamThreshold + 4096 * 3 + 129
+	};
+	const int NUM_SIZES = sizeof(SIZES) / sizeof(size_t);
+	const size_t LARGE_SIZE = 1024 * 1024;
+
+	CopyBuffers bufs;
+	allocCopyBuffers(bufs, streamThreshold + 4096 * 4);
+
+	// The return value doesn't depend on the copy path
+	check(fastmemcpy(bufs.dst, bufs.src, 4096) == bufs.dst,
+		"fastmemcpy(): Wrong return value");
+
+	// Single-threaded with every copy kernel
+	for(int i = 0; i < NUM_FEATURE_MASKS; i++) {
+		setCpuFeatureMask(FEATURE_MASKS[i].mask);
+		StreamCopyFunc kernel = getStreamCopyFunc();
+		if(kernel != NULL) {
+			testCopySizes(bufs, kernel, KERNEL_SIZES, NUM_KERNEL_SIZES,
+				LARGE_SIZE, stringf("Stream kernel %s", FEATURE_MASKS[i].name));
+		}
+		testCopySizes(bufs, &fastmemcpyFunc, SIZES, NUM_SIZES, LARGE_SIZE,
+			stringf("fastmemcpy() %s", FEATURE_MASKS[i].name));
+	}
+
+	// Split across the shared pool which always has several threads so that
+	// the stripe boundaries are tested even on small machines
+	size_t prevThreshold = getFastMemcpyThreadingThreshold();
+	setFastMemcpyThreadingThreshold(LARGE_SIZE);
+	for(int i = 0; i < NUM_FEATURE_MASKS; i++) {
+		setCpuFeatureMask(FEATURE_MASKS[i].mask);
+		testCopySizes(bufs, &fastmemcpyFunc, SIZES, NUM_SIZES, LARGE_SIZE,
+			stringf("fastmemcpy() %s threaded", FEATURE_MASKS[i].name));
+	}
+	setFastMemcpyThreadingThreshold(prevThreshold);
+	setCpuFeatureMask(~0U);
+}
+
+/// <summary>
+/// Returns the fastest time in microseconds that `copy` takes to copy `size`
+/// bytes. The fastest iteration is used to filter out scheduling noise.
+/// </summary>
+static uint64_t benchCopy(
+	StreamCopyFunc copy, void *dst, const void *src, size_t size)
+{
+	uint64_t bestUsec = UINT64_MAX;
+	uint64_t startUsec = getMonotonicUsec();
+	uint64_t nowUsec = startUsec;
+	while(nowUsec - startUsec < BENCH_MIN_USEC) {
+		uint64_t before = getMonotonicUsec();
+		copy(dst, src, size);
+		streamCopyFence();
+		nowUsec = getMonotonicUsec();
+		if(nowUsec - before < bestUsec)
+			bestUsec = nowUsec - before;
+	}
+	return bestUsec;
+}
+
+/// <summary>
+/// Measures `memcpy()`, `fastmemcpy()` and every stream kernel on its own for
+/// sizes from a small fraction of the last level cache to an entire 8K frame.
+/// Whether `fastmemcpy()` streams depends on the size of the last level cache.
+/// </summary>
+static void benchFastMemcpy()
+{
+	const size_t SIZES[] = {
+		256 * 1024, 1024 * 1024, 4 * 1024 * 1024,
+		1920 * 1080 * 4, 3840 * 2160 * 4, 7680 * 4320 * 4
+	};
+	const int NUM_SIZES = sizeof(SIZES) / sizeof(SIZES[0]);
+	size_t maxSize = SIZES[NUM_SIZES - 1];
+
+	CopyBuffers bufs;
+	allocCopyBuffers(bufs, maxSize);
+	fillPattern(bufs.src, maxSize, 0);
+	memset(bufs.dst, 0, maxSize);
+
+	cout << endl << "Copy throughput in GB/s, fastmemcpy() streams from "
+		<< formatSize(getFastMemcpyStreamThreshold()) << endl;
+	cout << stringf("%-12s%10s%12s", "Size", "memcpy", "fastmemcpy");
+	for(int i = 0; i < NUM_FEATURE_MASKS; i++) {
+		setCpuFeatureMask(FEATURE_MASKS[i].mask);
+		if(getStreamCopyFunc() != NULL)
+			cout << stringf("%12s", FEATURE_MASKS[i].name);
+	}
+	cout << endl;
+	setCpuFeatureMask(~0U);
+
+	for(int i = 0; i < NUM_SIZES; i++) {
+		size_t size = SIZES[i];
+		cout << stringf("%-12s", formatSize(size).c_str());
+		cout << stringf("%10.2f", calcGBps(
+			size, benchCopy(&memcpyFunc, bufs.dst, bufs.src, size)));
+		cout << stringf("%12.2f", calcGBps(
+			size, benchCopy(&fastmemcpyFunc, bufs.dst, bufs.src, size)));
+		for(int j = 0; j < NUM_FEATURE_MASKS; j++) {
+			setCpuFeatureMask(FEATURE_MASKS[j].mask);
+			StreamCopyFunc kernel = getStreamCopyFunc();
+			if(kernel == NULL)
+				continue;
+			cout << stringf("%12.2f", calcGBps(
+				size, benchCopy(kernel, bufs.dst, bufs.src, size)));
+		}
+		cout << endl;
+		setCpuFeatureMask(~0U);
+	}
+}
+
+//=============================================================================
+// imgDataCopy()
+
+/// <summary>
+/// Copies a `widthBytes` by `height` image between buffers with the specified
+/// strides and verifies every row, the row padding of the destination and the
+/// guard bytes after it. Rows are only contiguous when copying between
+/// identical strides which is also the only case where `imgDataCopy()` may
+/// overwrite the row padding of the destination.
+/// </summary>
+static void testImgCopy(
+	uint widthBytes, uint height, uint srcStride, uint dstStride, bool flip,
+	const string &variant)
+{
+	size_t srcSize = (size_t)srcStride * height;
+	size_t dstSize = (size_t)dstStride * height;
+	vector<uchar> srcStorage;
+	vector<uchar> dstStorage;
+	uchar *src = allocAligned(srcStorage, srcSize);
+	uchar *dst = allocAligned(dstStorage, dstSize + GUARD_SIZE);
+	fillPattern(src, srcSize, widthBytes + height);
+	memset(dst, GUARD_BYTE, dstSize + GUARD_SIZE);
+
+	imgDataCopy(dst, src, dstStride, srcStride, widthBytes, height, flip);
+
+	string desc = stringf(
+		"imgDataCopy() %s, %ux%u srcStride=%u dstStride=%u flip=%d",
+		variant.data(), widthBytes, height, srcStride, dstStride,
+		flip ? 1 : 0);
+	bool rowsMatch = true;
+	bool paddingIntact = true;
+	bool mayWritePadding = (!flip && srcStride == dstStride);
+	for(uint y = 0; y < height; y++) {
+		const uchar *srcRow = src + (size_t)srcStride * y;
+		uint dstY = flip ? height - 1 - y : y;
+		const uchar *dstRow = dst + (size_t)dstStride * dstY;
+		if(memcmp(dstRow, srcRow, widthBytes) != 0)
+			rowsMatch = false;
+		if(mayWritePadding && y + 1 < height)
+			continue;
+		if(!isFilledWith(
+			dstRow + widthBytes, dstStride - widthBytes, GUARD_BYTE))
+		{
+			paddingIntact = false;
+		}
+	}
+	check(rowsMatch, desc + ": Data mismatch");
+	check(paddingIntact, desc + ": Wrote to row padding");
+	check(isFilledWith(dst + dstSize, GUARD_SIZE, GUARD_BYTE),
+		desc + ": Wrote after the destination");
+}
+
+/// <summary>
+/// Tests small and large images with tight, padded and mismatched strides.
+/// </summary>
+static void testImgDataCopySizes(const string &variant)
+{
+	struct ImgSize {
+		uint	widthBytes;
+		uint	height;
+	};
+	const ImgSize SIZES[] = {
+		{ 1, 1 }, { 3, 7 }, { 17 * 3, 5 }, { 64, 64 },
+		{ 1280 * 4, 720 }, // Above the non-temporal threshold
+		{ 1366 * 3, 768 } // Odd row size in bytes
+	};
+	const int NUM_SIZES = sizeof(SIZES) / sizeof(SIZES[0]);
+	const uint PADDINGS[] = { 0, 1, 64, 256 };
+	const int NUM_PADDINGS = sizeof(PADDINGS) / sizeof(PADDINGS[0]);
+
+	for(int i = 0; i < NUM_SIZES; i++) {
+		uint width = SIZES[i].widthBytes;
+		uint height = SIZES[i].height;
+		for(int j = 0; j < NUM_PADDINGS; j++) {
+			for(int k = 0; k < NUM_PADDINGS; k++) {
+				uint srcStride = width + PADDINGS[j];
+				uint dstStride = width + PADDINGS[k];
+				testImgCopy(
+					width, height, srcStride, dstStride, false, variant);
+				testImgCopy(
+					width, height, srcStride, dstStride, true, variant);
+			}
+		}
+	}
+}
+
+static void testImgDataCopy()
+{
+	cout << "Testing imgDataCopy()..." << endl;
+
+	// Single-threaded with every copy kernel
+	size_t prevThreshold = getImgThreadingThreshold();
+	setImgThreadingThreshold(0);
+	for(int i = 0; i < NUM_FEATURE_MASKS; i++) {
+		setCpuFeatureMask(FEATURE_MASKS[i].mask);
+		testImgDataCopySizes(FEATURE_MASKS[i].name);
+	}
+
+	// Split into row stripes
+	setImgThreadingThreshold(1024 * 1024);
+	for(int i = 0; i < NUM_FEATURE_MASKS; i++) {
+		setCpuFeatureMask(FEATURE_MASKS[i].mask);
+		testImgDataCopySizes(
+			stringf("%s threaded", FEATURE_MASKS[i].name));
+	}
+	setImgThreadingThreshold(prevThreshold);
+	setCpuFeatureMask(~0U);
+}
+
+/// <summary>
+/// Returns the fastest time in microseconds that `imgDataCopy()` takes for a
+/// single copy.
+/// </summary>
+static uint64_t benchImgCopy(
+	uchar *dst, uchar *src, uint dstStride, uint srcStride, uint widthBytes,
+	uint height)
+{
+	uint64_t bestUsec = UINT64_MAX;
+	uint64_t startUsec = getMonotonicUsec();
+	uint64_t nowUsec = startUsec;
+	while(nowUsec - startUsec < BENCH_MIN_USEC) {
+		uint64_t before = getMonotonicUsec();
+		imgDataCopy(dst, src, dstStride, srcStride, widthBytes, height);
+		nowUsec = getMonotonicUsec();
+		if(nowUsec - before < bestUsec)
+			bestUsec = nowUsec - before;
+	}
+	return bestUsec;
+}
+
+/// <summary>
+/// Measures `imgDataCopy()` of 32-bit frames from 720p to 8K with every copy
+/// kernel on a single thread. The source has the padded pitch of a mapped
+/// texture while the destination is tightly packed like a shared memory frame
+/// so the entire frame can't be copied with a single operation.
+/// </summary>
+static void benchImgDataCopy()
+{
+	struct Resolution {
+		const char *	name;
+		uint			width;
+		uint			height;
+	};
+	const Resolution RESOLUTIONS[] = {
+		{ "720p", 1280, 720 },
+		{ "1080p", 1920, 1080 },
+		{ "1440p", 2560, 1440 },
+		{ "4K", 3840, 2160 },
+		{ "8K", 7680, 4320 }
+	};
+	const int NUM_RESOLUTIONS = sizeof(RESOLUTIONS) / sizeof(RESOLUTIONS[0]);
+	const uint BPP = 4;
+	const uint SRC_PADDING = 256;
+
+	const Resolution &maxRes = RESOLUTIONS[NUM_RESOLUTIONS - 1];
+	size_t maxSrcSize =
+		(size_t)(maxRes.width * BPP + SRC_PADDING) * maxRes.height;
+	vector<uchar> srcStorage;
+	vector<uchar> dstStorage;
+	uchar *src = allocAligned(srcStorage, maxSrcSize);
+	uchar *dst = allocAligned(
+		dstStorage, (size_t)maxRes.width * BPP * maxRes.height);
+	fillPattern(src, maxSrcSize, 0);
+
+	cout << endl << stringf("imgDataCopy() throughput in GB/s, 32-bit "
+		"frames, source stride padded by %u bytes", SRC_PADDING) << endl;
+	cout << stringf("%-12s", "Resolution");
+	for(int i = 0; i < NUM_FEATURE_MASKS; i++)
+		cout << stringf("%12s", FEATURE_MASKS[i].name);
+	cout << endl;
+
+	size_t prevThreshold = getImgThreadingThreshold();
+	setImgThreadingThreshold(0);
+	for(int i = 0; i < NUM_RESOLUTIONS; i++) {
+		const Resolution &res = RESOLUTIONS[i];
+		uint widthBytes = res.width * BPP;
+		cout << stringf("%-12s", res.name);
+		for(int j = 0; j < NUM_FEATURE_MASKS; j++) {
+			setCpuFeatureMask(FEATURE_MASKS[j].mask);
+			uint64_t usec = benchImgCopy(dst, src, widthBytes,
+				widthBytes + SRC_PADDING, widthBytes, res.height);
+			cout << stringf("%12.2f",
+				calcGBps((size_t)widthBytes * res.height, usec));
+		}
+		cout << endl;
+	}
+	setImgThreadingThreshold(prevThreshold);
+	setCpuFeatureMask(~0U);
+}
+
+//=============================================================================
+// Thread scaling
+
+struct RowCopyTask {
+	uchar *			dst;
+	const uchar *	src;
+	uint			dstStride;
+	uint			srcStride;
+	uint			rowSize;
+	StreamCopyFunc	copyRow;
+};
+
+/// <summary>
+/// Copies a range of rows the same way that `imgDataCopy()` does.
+/// </summary>
+static void copyTaskRows(void *opaque, uint firstRow, uint numRows)
+{
+	const RowCopyTask *task = (const RowCopyTask *)opaque;
+	for(uint y = firstRow; y < firstRow + numRows; y++) {
+		task->copyRow(task->dst + (size_t)task->dstStride * y,
+			task->src + (size_t)task->srcStride * y, task->rowSize);
+	}
+	streamCopyFence();
+}
+
+/// <summary>
+/// Returns the fastest time in microseconds of either an `imgDataCopy()` or,
+/// if `pool` isn't NULL, the same copy split evenly across every thread of
+/// the pool without a minimum stripe size.
+/// </summary>
+static uint64_t benchRowCopy(
+	WorkerPool *pool, uchar *dst, uchar *src, uint dstStride, uint srcStride,
+	uint rowSize, uint height)
+{
+	RowCopyTask task;
+	task.dst = dst;
+	task.src = src;
+	task.dstStride = dstStride;
+	task.srcStride = srcStride;
+	task.rowSize = rowSize;
+	task.copyRow = getStreamCopyFunc();
+	if(task.copyRow == NULL)
+		task.copyRow = &memcpyFunc;
+
+	uint64_t bestUsec = UINT64_MAX;
+	uint64_t startUsec = getMonotonicUsec();
+	uint64_t nowUsec = startUsec;
+	while(nowUsec - startUsec < BENCH_MIN_USEC) {
+		uint64_t before = getMonotonicUsec();
+		if(pool != NULL)
+			pool->runRows(&copyTaskRows, &task, height, 1);
+		else
+			imgDataCopy(dst, src, dstStride, srcStride, rowSize, height);
+		nowUsec = getMonotonicUsec();
+		if(nowUsec - before < bestUsec)
+			bestUsec = nowUsec - before;
+	}
+	return bestUsec;
+}
+
+/// <summary>
+/// Measures how frame copies scale from 1 to `WorkerPool::MAX_THREADS`
+/// threads. The first table splits every size evenly across all threads and
+/// is used to pick the threading threshold and minimum stripe size of
+/// `imgProcessRows()`: threading is only worthwhile for sizes where two
+/// threads beat one and a stripe should never be smaller than the size at
+/// which adding threads stops helping. The second table shows the resulting
+/// `imgDataCopy()` throughput with the current settings.
+/// </summary>
+static void benchThreadScaling()
+{
+	const uint THREAD_COUNTS[] = { 1, 2, 4, 8, WorkerPool::MAX_THREADS };
+	const int NUM_THREAD_COUNTS =
+		sizeof(THREAD_COUNTS) / sizeof(THREAD_COUNTS[0]);
+
+	// 32-bit frames of up to 4K with the same strides as `benchImgDataCopy()`
+	struct FrameSize {
+		uint	width;
+		uint	height;
+	};
+	const FrameSize SIZES[] = {
+		{ 256, 256 }, { 512, 256 }, { 512, 512 }, { 1024, 512 },
+		{ 1024, 1024 }, { 1920, 1080 }, { 3840, 2160 }
+	};
+	const int NUM_SIZES = sizeof(SIZES) / sizeof(SIZES[0]);
+	const uint BPP = 4;
+	const uint PADDING = 256;
+
+	const FrameSize &maxSize = SIZES[NUM_SIZES - 1];
+	size_t bufSize = (size_t)(maxSize.width * BPP + PADDING) * maxSize.height;
+	vector<uchar> srcStorage;
+	vector<uchar> dstStorage;
+	uchar *src = allocAligned(srcStorage, bufSize);
+	uchar *dst = allocAligned(dstStorage, bufSize);
+	fillPattern(src, bufSize, 0);
+	memset(dst, 0, bufSize);
+
+	// Every column needs a differently sized shared pool
+	uint prevNumThreads = 0;
+	if(WorkerPool::getShared() != NULL)
+		prevNumThreads = WorkerPool::getShared()->getNumThreads();
+	size_t prevThreshold = getImgThreadingThreshold();
+
+	for(int table = 0; table < 2; table++) {
+		cout << endl;
+		if(table == 0) {
+			cout << "Row copy throughput in GB/s by thread count, split "
+				"evenly without a minimum stripe size" << endl;
+		} else {
+			cout << stringf("imgDataCopy() throughput in GB/s by thread "
+				"count, threading from %s",
+				formatSize(prevThreshold).c_str()) << endl;
+		}
+		cout << stringf("%-12s", "Size");
+		for(int i = 0; i < NUM_THREAD_COUNTS; i++)
+			cout << stringf("%8u", THREAD_COUNTS[i]);
+		cout << endl;
+
+		for(int i = 0; i < NUM_SIZES; i++) {
+			uint rowSize = SIZES[i].width * BPP;
+			uint height = SIZES[i].height;
+			size_t frameSize = (size_t)rowSize * height;
+			cout << stringf("%-12s", formatSize(frameSize).c_str());
+			for(int j = 0; j < NUM_THREAD_COUNTS; j++) {
+				WorkerPool::destroyShared();
+				WorkerPool *pool =
+					WorkerPool::initializeShared(THREAD_COUNTS[j], false);
+				uint64_t usec = benchRowCopy(table == 0 ? pool : NULL,
+					dst, src, rowSize, rowSize + PADDING, rowSize, height);
+				cout << stringf("%8.2f", calcGBps(frameSize, usec));
+			}
+			cout << endl;
+		}
+	}
+
+	WorkerPool::destroyShared();
+	if(prevNumThreads > 0)
+		WorkerPool::initializeShared(prevNumThreads, false);
+}
+
+//=============================================================================
+// Entry point
+
+int main(int argc, char *argv[])
+{
+	bool runBenchmarks = true;
+	for(int i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "--no-bench") == 0)
+			runBenchmarks = false;
+		else {
+			cout << "Usage: " << argv[0] << " [--no-bench]" << endl;
+			return 2;
+		}
+	}
+
+	cout << "CPU features: " << getCpuFeaturesString() << endl;
+	cout << "Last level cache: " << formatSize(getLastLevelCacheSize())
+		<< endl;
+
+	// Threaded copies are only tested if the pool exists. The workers aren't
+	// pinned so that results don't depend on which CPUs happen to be busy.
+	WorkerPool::initializeShared(4, false);
+
+	testFastMemcpy();
+	testImgDataCopy();
+	testPixelConvert();
+	testImgScale();
+	testFrameDedup();
+	testCaptureRing();
+#ifdef OS_LINUX
+	testShmTransport();
+#endif
+	testFrameCodec();
+	testFramePacing();
+
+	cout << stringf("%d of %d checks passed", s_numTests - s_numFailures,
+		s_numTests) << endl;
+
+	if(runBenchmarks) {
+		benchFastMemcpy();
+		benchImgDataCopy();
+		benchThreadScaling();
+		benchPixelConvert();
+		benchImgScale();
+		benchCaptureRing();
+#ifdef OS_LINUX
+		benchShmTransport();
+#endif
+		benchFrameCodec();
+		benchFramePacing();
+	}
+
+	WorkerPool::destroyShared();
+	return (s_numFailures > 0) ? 1 : 0;
+}
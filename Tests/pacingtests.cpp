@@ -0,0 +1,415 @@
+//*****************************************************************************
+// Libdeskcap: A high-performance desktop capture library
+//
+// Copyright (C) 2014 Lucas Murray <lucas@polyflare.com>
+// All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation; either version 2 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//*****************************************************************************
+
+#include "tests.h"
+#include "../Common/framepacer.h"
+#include <math.h>
+
+//=============================================================================
+// Simulator
+
+/// <summary>
+/// Describes a scenario for `simulateFramePacing()`. All times are in
+/// microseconds.
+/// </summary>
+struct FramePacingSimParams {
+	uint64_t	durationUsec;
+	uint32_t	seed;
+	double		consumerPeriodUsec; // Nominal tick period
+	double		consumerDriftPpm; // Actual period relative to the nominal
+	double		consumerJitterUsec; // Maximum lateness of a tick
+	bool		consumerKnowsLateness; // Lateness is removed before estimating
+	bool		publishTicks; // Hook can see the consumer ticks
+	double		targetPeriodUsec; // Requested frame period, zero for all
+	double		appPeriodUsec; // Buffer swap period
+	double		appJitterUsec; // Maximum swap error in either direction
+	double		latencyUsec; // Swap to publish
+	double		latencyJitterUsec; // Maximum additional latency
+	bool		useLegacyPacing; // Fixed origin, no pacer
+
+	FramePacingSimParams() : durationUsec(60000000), seed(1)
+		, consumerPeriodUsec(1000000.0 / 60.0), consumerDriftPpm(0.0)
+		, consumerJitterUsec(0.0), consumerKnowsLateness(true)
+		, publishTicks(true), targetPeriodUsec(0.0)
+		, appPeriodUsec(1000000.0 / 60.0)
+		, appJitterUsec(0.0), latencyUsec(0.0), latencyJitterUsec(0.0)
+		, useLegacyPacing(false) {};
+};
+
+struct FramePacingSimResult {
+	uint64_t			numTicks;
+	uint64_t			numFreshTicks; // Tick received a new frame
+	uint64_t			numRepeatedTicks; // Tick reused the previous frame
+	uint64_t			numAvoidableRepeats; // A newer swap was in time
+	uint64_t			numCaptured;
+	uint64_t			numWasted; // Captured but never shown
+	double				avgAgeUsec; // Swap to tick of the shown frame
+	FramePacingStats	stats;
+	uint				estJitterUsec;
+	int					estDriftPpm;
+
+	FramePacingSimResult() : numTicks(0), numFreshTicks(0)
+		, numRepeatedTicks(0), numAvoidableRepeats(0), numCaptured(0)
+		, numWasted(0), avgAgeUsec(0.0), stats(), estJitterUsec(0)
+		, estDriftPpm(0) {};
+};
+
+static uint64_t roundToUInt64(double val)
+{
+	if(val <= 0.0)
+		return 0;
+	return (uint64_t)floor(val + 0.5);
+}
+
+/// <summary>
+/// Deterministic pseudo-random number generator so that simulations are
+/// reproducible on every platform.
+/// </summary>
+class SimRandom
+{
+private: // Members -----------------------------------------------------------
+	uint32_t	m_state;
+
+public: // Constructor/destructor ---------------------------------------------
+	SimRandom(uint32_t seed) : m_state(seed) {};
+
+public: // Methods ------------------------------------------------------------
+	/// <returns>A number in the range [0, 1)</returns>
+	double next() {
+		m_state = m_state * 1664525U + 1013904223U;
+		return (double)(m_state >> 8) / 16777216.0;
+	};
+};
+
+struct SimFrame {
+	double	swapUsec;
+	double	readyUsec;
+	bool	isShown;
+};
+
+/// <summary>
+/// Simulates a hooked application and the main application ticking
+/// independently and counts how many ticks receive a fresh frame. Every
+/// random decision is taken from generators seeded with `params.seed` so
+/// the result only depends on `params` and can be used to test for
+/// regressions. If `params.useLegacyPacing` is set then the fixed origin
+/// pacing that was used before `CapturePacer` is simulated instead.
+/// </summary>
+static void simulateFramePacing(
+	const FramePacingSimParams &params, FramePacingSimResult *result)
+{
+	if(result == NULL)
+		return;
+	*result = FramePacingSimResult();
+	if(params.consumerPeriodUsec <= 0.0 || params.appPeriodUsec <= 0.0)
+		return;
+
+	// Each source of jitter has its own generator that is advanced on every
+	// tick or swap so that capture decisions never change the timing of
+	// anything that follows and pacing methods can be compared directly
+	SimRandom tickRand(params.seed);
+	SimRandom swapRand(params.seed * 0x9E3779B9U + 1U);
+	SimRandom latencyRand(params.seed * 0x85EBCA6BU + 2U);
+	TickEstimator estimator;
+	CapturePacer pacer;
+	uint64_t nominalNsec = roundToUInt64(params.consumerPeriodUsec * 1000.0);
+	estimator.reset(nominalNsec);
+	pacer.setNominalPeriod(nominalNsec);
+	pacer.setTargetPeriod(roundToUInt64(params.targetPeriodUsec * 1000.0));
+
+	// Start well away from zero as zero times have special meaning
+	const double START_USEC = 1000000.0;
+	double endUsec = START_USEC + (double)params.durationUsec;
+	double tickPeriod =
+		params.consumerPeriodUsec * (1.0 + params.consumerDriftPpm * 1e-6);
+
+	vector<SimFrame> frames;
+	vector<double> swaps;
+	frames.reserve(
+		(size_t)(params.durationUsec / params.consumerPeriodUsec) + 16);
+	swaps.reserve((size_t)(params.durationUsec / params.appPeriodUsec) + 16);
+	size_t numFed = 0; // Frames whose latency the pacer knows
+	int shownFrame = -1;
+	size_t newestSwap = 0; // Newest swap that could be ready for a tick
+	double totalAge = 0.0;
+	uint64_t numAged = 0;
+
+	ConsumerTickState ticks;
+	bool hasTicks = false;
+	double legacyOrigin = 0.0;
+	uint64_t legacyPrevFrame = 0;
+	uint64_t tickNum = 0;
+	uint64_t swapNum = 0;
+	double nextTick = START_USEC + tickPeriod; // Scheduled time
+	double tickUsec = nextTick + tickRand.next() * params.consumerJitterUsec;
+	double nextSwap = START_USEC;
+	double prevSwap = 0.0;
+	for(;;) {
+		if(tickUsec > endUsec && nextSwap > endUsec)
+			break;
+
+		if(nextSwap <= tickUsec) {
+			// Hooked application swapped its buffers
+			double now = nextSwap;
+			swaps.push_back(now);
+			for(; numFed < frames.size(); numFed++) {
+				if(frames[numFed].readyUsec > now)
+					break;
+				pacer.addCaptureLatency(roundToUInt64(
+					frames[numFed].readyUsec - frames[numFed].swapUsec));
+			}
+			double latency = params.latencyUsec +
+				latencyRand.next() * params.latencyJitterUsec;
+			bool capture;
+			if(params.useLegacyPacing) {
+				const double JITTER_PREVENTION_USEC = 5000.0;
+				if(legacyPrevFrame == 0 && legacyOrigin == 0.0)
+					legacyOrigin = now - JITTER_PREVENTION_USEC;
+				uint64_t frameNum = (uint64_t)floor(
+					(now - legacyOrigin) / params.consumerPeriodUsec);
+				capture = (frameNum > legacyPrevFrame);
+				if(capture)
+					legacyPrevFrame = frameNum;
+			} else {
+				capture = pacer.shouldCapture(roundToUInt64(now),
+					(params.publishTicks && hasTicks) ? &ticks : NULL);
+			}
+			if(capture) {
+				SimFrame frame;
+				frame.swapUsec = now;
+				frame.readyUsec = now + latency;
+				if(!frames.empty() && frame.readyUsec < frames.back().readyUsec)
+					frame.readyUsec = frames.back().readyUsec; // In order
+				frame.isShown = false;
+				frames.push_back(frame);
+			}
+
+			// Schedule the next swap making sure that time never goes
+			// backwards
+			prevSwap = now;
+			swapNum++;
+			nextSwap = START_USEC + (double)swapNum * params.appPeriodUsec +
+				(swapRand.next() * 2.0 - 1.0) * params.appJitterUsec;
+			if(nextSwap <= prevSwap)
+				nextSwap = prevSwap + 1.0;
+			continue;
+		}
+
+		// Main application ticked. Display the newest published frame.
+		result->numTicks++;
+		int newest = shownFrame;
+		while(newest + 1 < (int)frames.size() &&
+			frames[newest + 1].readyUsec <= tickUsec)
+		{
+			newest++;
+		}
+		while(newestSwap + 1 < swaps.size() &&
+			swaps[newestSwap + 1] + params.latencyUsec <= tickUsec)
+		{
+			newestSwap++;
+		}
+		if(newest > shownFrame) {
+			result->numFreshTicks++;
+			frames[newest].isShown = true;
+			shownFrame = newest;
+		} else if(shownFrame >= 0) {
+			result->numRepeatedTicks++;
+			if(!swaps.empty() &&
+				swaps[newestSwap] + params.latencyUsec <= tickUsec &&
+				swaps[newestSwap] > frames[shownFrame].swapUsec)
+			{
+				result->numAvoidableRepeats++;
+			}
+		}
+		if(shownFrame >= 0) {
+			totalAge += tickUsec - frames[shownFrame].swapUsec;
+			numAged++;
+		}
+
+		// Measure the tick and publish the estimate
+		double measured = params.consumerKnowsLateness ? nextTick : tickUsec;
+		estimator.addTick(roundToUInt64(measured));
+		if(estimator.isLocked()) {
+			estimator.getState(&ticks);
+			ticks.procId = 1;
+			hasTicks = true;
+		}
+		tickNum++;
+		nextTick = START_USEC + (double)(tickNum + 1) * tickPeriod;
+		tickUsec = nextTick + tickRand.next() * params.consumerJitterUsec;
+	}
+
+	result->numCaptured = frames.size();
+	for(size_t i = 0; i < frames.size(); i++) {
+		if(!frames[i].isShown)
+			result->numWasted++;
+	}
+	if(numAged > 0)
+		result->avgAgeUsec = totalAge / (double)numAged;
+	result->stats = pacer.getStats();
+	result->estJitterUsec = estimator.getJitterUsec();
+	result->estDriftPpm = estimator.getDriftPpm();
+}
+
+//=============================================================================
+// Tests
+
+struct PacingScenario {
+	const char *			name;
+	FramePacingSimParams	params;
+	double					minFreshRatio; // Of all ticks, zero for none
+};
+
+/// <summary>
+/// Returns the scenarios that the pacer is tested and measured with. Each
+/// one is simulated for a minute with both the pacer and the legacy fixed
+/// origin pacing.
+/// </summary>
+static vector<PacingScenario> getPacingScenarios()
+{
+	vector<PacingScenario> scenarios;
+	PacingScenario sc;
+
+	// Fast application, every tick can receive a fresh frame
+	sc.name = "144 Hz app vs 60 Hz";
+	sc.params = FramePacingSimParams();
+	sc.params.appPeriodUsec = 1000000.0 / 144.0;
+	sc.minFreshRatio = 0.995;
+	scenarios.push_back(sc);
+
+	sc.name = "144 Hz jittery, 300 ppm drift";
+	sc.params.appJitterUsec = 1500.0;
+	sc.params.latencyUsec = 7000.0;
+	sc.params.latencyJitterUsec = 1000.0;
+	sc.params.consumerDriftPpm = 300.0;
+	sc.params.consumerJitterUsec = 3000.0;
+	sc.minFreshRatio = 0.99;
+	scenarios.push_back(sc);
+
+	// Without published ticks the local grid has an arbitrary phase so we
+	// can only expect to be as good as the legacy pacing
+	sc.name = "no published ticks (fallback)";
+	sc.params.consumerKnowsLateness = false;
+	sc.params.publishTicks = false;
+	sc.minFreshRatio = 0.0;
+	scenarios.push_back(sc);
+
+	sc.name = "75 Hz app, 13 msec latency";
+	sc.params = FramePacingSimParams();
+	sc.params.appPeriodUsec = 1000000.0 / 75.0;
+	sc.params.appJitterUsec = 1000.0;
+	sc.params.consumerJitterUsec = 2000.0;
+	sc.params.latencyUsec = 13000.0;
+	sc.minFreshRatio = 0.99;
+	scenarios.push_back(sc);
+
+	// The application is slightly slower than the ticks so a few ticks
+	// can never receive a fresh frame
+	sc.name = "59.9 Hz app vs 60 Hz";
+	sc.params.appPeriodUsec = 1000000.0 / 59.9;
+	sc.params.latencyUsec = 0.0;
+	sc.minFreshRatio = 0.96;
+	scenarios.push_back(sc);
+
+	// Swaps land on either side of a tick at random so about a quarter of
+	// the ticks have no new swap at all whatever we capture
+	sc.name = "60 Hz vs 60 Hz, +-2 msec jitter";
+	sc.params = FramePacingSimParams();
+	sc.params.appJitterUsec = 2000.0;
+	sc.minFreshRatio = 0.0;
+	scenarios.push_back(sc);
+
+	return scenarios;
+}
+
+/// <summary>
+/// Simulates every pacing scenario and verifies that the pacer delivers at
+/// least as many fresh frames as the legacy pacing and meets the minimum
+/// of the scenario. The simulation is deterministic so any difference is a
+/// change in behaviour.
+/// </summary>
+void testFramePacing()
+{
+	cout << "Testing frame pacing..." << endl;
+
+	vector<PacingScenario> scenarios = getPacingScenarios();
+	for(size_t i = 0; i < scenarios.size(); i++) {
+		const PacingScenario &sc = scenarios[i];
+		FramePacingSimParams params = sc.params;
+		FramePacingSimResult result, legacy, again;
+		simulateFramePacing(params, &result);
+		simulateFramePacing(params, &again);
+		params.useLegacyPacing = true;
+		simulateFramePacing(params, &legacy);
+
+		string desc = stringf("Pacing %s", sc.name);
+		check(result.numTicks > 0 && result.numTicks == legacy.numTicks,
+			desc + ": Wrong number of ticks");
+		check(result.numFreshTicks >= legacy.numFreshTicks,
+			stringf("%s: %u fresh ticks, legacy had %u", desc.data(),
+			(uint)result.numFreshTicks, (uint)legacy.numFreshTicks));
+		check(result.numFreshTicks >=
+			(uint64_t)((double)result.numTicks * sc.minFreshRatio),
+			stringf("%s: Only %u of %u ticks were fresh", desc.data(),
+			(uint)result.numFreshTicks, (uint)result.numTicks));
+		check(result.numFreshTicks == again.numFreshTicks &&
+			result.avgAgeUsec == again.avgAgeUsec,
+			desc + ": Not deterministic");
+	}
+
+	// A target period of exactly two ticks must capture for every other
+	// tick and deliver a fresh frame to every one of them
+	FramePacingSimParams params;
+	params.appPeriodUsec = 1000000.0 / 144.0;
+	params.targetPeriodUsec = 2000000.0 / 60.0;
+	FramePacingSimResult result;
+	simulateFramePacing(params, &result);
+	uint64_t numSlots = result.numTicks / 2;
+	check(result.numFreshTicks + 2 >= numSlots &&
+		result.numFreshTicks <= numSlots + 2 &&
+		result.numCaptured <= numSlots + 4,
+		stringf("Pacing 30 Hz target: %u fresh ticks and %u captures for "
+		"%u slots", (uint)result.numFreshTicks, (uint)result.numCaptured,
+		(uint)numSlots));
+}
+
+//=============================================================================
+// Benchmarks
+
+/// <summary>
+/// Prints how many ticks of each pacing scenario receive a fresh frame and
+/// how old the displayed frames are with the legacy pacing and the pacer.
+/// </summary>
+void benchFramePacing()
+{
+	cout << endl;
+	cout << "Simulated fresh ticks and average frame age in msec of 60 "
+		"second runs (legacy -> new)" << endl;
+	vector<PacingScenario> scenarios = getPacingScenarios();
+	for(size_t i = 0; i < scenarios.size(); i++) {
+		const PacingScenario &sc = scenarios[i];
+		FramePacingSimParams params = sc.params;
+		FramePacingSimResult result, legacy;
+		simulateFramePacing(params, &result);
+		params.useLegacyPacing = true;
+		simulateFramePacing(params, &legacy);
+		cout << stringf("%-34s%5u -> %-5u of %-6u%6.1f -> %.1f", sc.name,
+			(uint)legacy.numFreshTicks, (uint)result.numFreshTicks,
+			(uint)result.numTicks, legacy.avgAgeUsec / 1000.0,
+			result.avgAgeUsec / 1000.0) << endl;
+	}
+}
@@ -0,0 +1,503 @@
+//*****************************************************************************
+// Libdeskcap: A high-performance desktop capture library
+//
+// Copyright (C) 2014 Lucas Murray <lucas@polyflare.com>
+// All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation; either version 2 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//*****************************************************************************
+
+#include "tests.h"
+#include "../Common/cpuinfo.h"
+#include "../Common/imghelpers.h"
+#include "../Common/pixelconvert.h"
+#include <limits>
+#include <math.h>
+
+//=============================================================================
+// Helpers
+
+// Every kernel that `getPixelConvertFunc()` can select. The FP16 kernel needs
+// both AVX2 and F16C, the swizzles SSSE3 and the 10-bit unpacking SSE2.
+static const FeatureMask CONVERT_MASKS[] = {
+	{ "All", ~0U },
+	{ "SSSE3", (uint)(SSE2CpuFeature | SSSE3CpuFeature) },
+	{ "SSE2 only", (uint)SSE2CpuFeature },
+	{ "None", 0U }
+};
+static const int NUM_CONVERT_MASKS =
+	sizeof(CONVERT_MASKS) / sizeof(CONVERT_MASKS[0]);
+
+// `DXGI_FORMAT` values of the raw formats that `imgConvert()` understands
+static const uint32_t DXGI_R16G16B16A16_FLOAT = DXGIBeginPixelFormat + 10;
+static const uint32_t DXGI_R10G10B10A2_UNORM = DXGIBeginPixelFormat + 24;
+static const uint32_t DXGI_R8G8B8A8_UNORM_SRGB = DXGIBeginPixelFormat + 29;
+static const uint32_t DXGI_B8G8R8A8_UNORM = DXGIBeginPixelFormat + 87;
+static const uint32_t DXGI_B8G8R8X8_UNORM = DXGIBeginPixelFormat + 88;
+
+struct ConvertFormat {
+	const char *	name;
+	uint32_t		format;
+};
+
+static const ConvertFormat SRC_FORMATS[] = {
+	{ "BGRA", BGRAPixelFormat },
+	{ "BGR", BGRPixelFormat },
+	{ "RGBA", RGBAPixelFormat },
+	{ "B8G8R8A8_UNORM", DXGI_B8G8R8A8_UNORM },
+	{ "B8G8R8X8_UNORM", DXGI_B8G8R8X8_UNORM },
+	{ "R8G8B8A8_UNORM_SRGB", DXGI_R8G8B8A8_UNORM_SRGB },
+	{ "R10G10B10A2_UNORM", DXGI_R10G10B10A2_UNORM },
+	{ "R16G16B16A16_FLOAT", DXGI_R16G16B16A16_FLOAT }
+};
+static const int NUM_SRC_FORMATS =
+	sizeof(SRC_FORMATS) / sizeof(SRC_FORMATS[0]);
+
+static const ConvertFormat DST_FORMATS[] = {
+	{ "BGRA", BGRAPixelFormat },
+	{ "RGBA", RGBAPixelFormat }
+};
+static const int NUM_DST_FORMATS =
+	sizeof(DST_FORMATS) / sizeof(DST_FORMATS[0]);
+
+static float referenceHalfToFloat(uint16_t half)
+{
+	int exponent = (half >> 10) & 0x1F;
+	int mantissa = half & 0x3FF;
+	float val;
+	if(exponent == 0)
+		val = ldexpf((float)mantissa, -24);
+	else if(exponent == 31)
+		val = (mantissa == 0) ? std::numeric_limits<float>::infinity()
+			: std::numeric_limits<float>::quiet_NaN();
+	else
+		val = ldexpf((float)(mantissa | 0x400), exponent - 25);
+	return (half & 0x8000) ? -val : val;
+}
+
+/// <summary>
+/// Converts a linear value to 8 bits with the exact sRGB transfer function
+/// if `isColor` is true. The kernels approximate the curve so their result
+/// may differ by a single step.
+/// </summary>
+static int referenceToUnorm8(float val, bool isColor)
+{
+	if(val != val || val < 0.0f)
+		val = 0.0f;
+	if(val > 1.0f)
+		val = 1.0f;
+	if(isColor) {
+		if(val <= 0.0031308f)
+			val *= 12.92f;
+		else
+			val = 1.055f * powf(val, 1.0f / 2.4f) - 0.055f;
+	}
+	return (int)(val * 255.0f + 0.5f);
+}
+
+/// <summary>
+/// Decodes a single source pixel into its R, G, B and A channels in 8 bits.
+/// </summary>
+static void decodeReferencePixel(
+	const uchar *src, uint32_t format, int *rgbaOut)
+{
+	switch(format) {
+	default:
+	case BGRAPixelFormat:
+	case DXGI_B8G8R8A8_UNORM:
+		rgbaOut[0] = src[2];
+		rgbaOut[1] = src[1];
+		rgbaOut[2] = src[0];
+		rgbaOut[3] = src[3];
+		break;
+	case BGRPixelFormat:
+	case DXGI_B8G8R8X8_UNORM:
+		rgbaOut[0] = src[2];
+		rgbaOut[1] = src[1];
+		rgbaOut[2] = src[0];
+		rgbaOut[3] = 255;
+		break;
+	case RGBAPixelFormat:
+	case DXGI_R8G8B8A8_UNORM_SRGB:
+		for(int i = 0; i < 4; i++)
+			rgbaOut[i] = src[i];
+		break;
+	case DXGI_R10G10B10A2_UNORM: {
+		uint32_t px = src[0] | (src[1] << 8) | (src[2] << 16) |
+			((uint32_t)src[3] << 24);
+		for(int i = 0; i < 3; i++)
+			rgbaOut[i] = ((px >> (i * 10)) & 0x3FF) >> 2;
+		rgbaOut[3] = (px >> 30) * 255 / 3;
+		break; }
+	case DXGI_R16G16B16A16_FLOAT:
+		for(int i = 0; i < 4; i++) {
+			uint16_t half = (uint16_t)(src[i * 2] | (src[i * 2 + 1] << 8));
+			rgbaOut[i] = referenceToUnorm8(referenceHalfToFloat(half), i < 3);
+		}
+		break;
+	}
+}
+
+/// <summary>
+/// Returns true if a converted row matches the reference decoding of the
+/// source row. Only the sRGB approximation of FP16 may differ by one step.
+/// </summary>
+static bool matchesReference(
+	const uchar *dst, const uchar *src, uint numPixels, uint32_t srcFormat,
+	uint32_t dstFormat)
+{
+	uint srcBpp = getPixelFormatBpp(srcFormat);
+	int tolerance = (srcFormat == DXGI_R16G16B16A16_FLOAT) ? 1 : 0;
+	for(uint i = 0; i < numPixels; i++) {
+		int rgba[4];
+		decodeReferencePixel(src + i * srcBpp, srcFormat, rgba);
+		const uchar *px = dst + i * 4;
+		int actual[4] = { px[2], px[1], px[0], px[3] };
+		if(dstFormat == RGBAPixelFormat) {
+			actual[0] = px[0];
+			actual[2] = px[2];
+		}
+		for(int j = 0; j < 4; j++) {
+			if(abs(actual[j] - rgba[j]) > tolerance)
+				return false;
+		}
+	}
+	return true;
+}
+
+/// <summary>
+/// Returns the kernel that is used when the CPU has no SIMD extensions.
+/// </summary>
+static PixelConvertFunc getScalarConvertFunc(
+	uint32_t srcFormat, uint32_t dstFormat, uint mask)
+{
+	setCpuFeatureMask(0U);
+	PixelConvertFunc func = getPixelConvertFunc(srcFormat, dstFormat);
+	setCpuFeatureMask(mask);
+	return func;
+}
+
+//=============================================================================
+// Tests
+
+/// <summary>
+/// Converts a single row of random pixels at the specified byte offsets so
+/// that every kernel sees unaligned buffers and every tail length. The
+/// result must match the scalar kernel exactly, the reference decoding
+/// within its tolerance and no byte after the row may be written.
+/// </summary>
+static void testConvertRow(
+	PixelConvertFunc func, PixelConvertFunc scalarFunc, uint32_t srcFormat,
+	uint32_t dstFormat, uint numPixels, uint offset, const string &variant)
+{
+	string desc = stringf("%s, %u pixels offset=%u", variant.data(),
+		numPixels, offset);
+	uint srcBpp = getPixelFormatBpp(srcFormat);
+	size_t srcSize = (size_t)numPixels * srcBpp;
+	size_t dstSize = (size_t)numPixels * 4;
+
+	vector<uchar> srcStorage;
+	vector<uchar> dstStorage;
+	vector<uchar> expected(dstSize + 1);
+	uchar *src = allocAligned(srcStorage, srcSize + offset) + offset;
+	uchar *dst = allocAligned(dstStorage, dstSize + offset + GUARD_SIZE) +
+		offset;
+	uint32_t state = numPixels * 7 + offset;
+	for(size_t i = 0; i < srcSize; i++)
+		src[i] = (uchar)nextRandom(state);
+	memset(dst, GUARD_BYTE, dstSize + GUARD_SIZE);
+
+	func(dst, src, numPixels);
+	scalarFunc(&expected[0], src, numPixels);
+
+	check(memcmp(dst, &expected[0], dstSize) == 0,
+		desc + ": Differs from the scalar kernel");
+	check(matchesReference(dst, src, numPixels, srcFormat, dstFormat),
+		desc + ": Differs from the reference");
+	check(isFilledWith(dst + dstSize, GUARD_SIZE, GUARD_BYTE),
+		desc + ": Wrote after the destination");
+}
+
+/// <summary>
+/// Converts FP16 values that must map to exact results: zero, one, values
+/// outside of the range, infinities, NaN and the smallest subnormal.
+/// </summary>
+static void testFP16SpecialValues(const string &variant)
+{
+	struct SpecialValue {
+		uint16_t	half;
+		uchar		expected;
+	};
+	const SpecialValue VALUES[] = {
+		{ 0x0000, 0 }, { 0x3C00, 255 }, { 0xBC00, 0 }, { 0x4000, 255 },
+		{ 0x7C00, 255 }, { 0xFC00, 0 }, { 0x7E00, 0 }, { 0x0001, 0 }
+	};
+	const uint NUM_VALUES = sizeof(VALUES) / sizeof(VALUES[0]);
+
+	uint16_t src[NUM_VALUES * 4];
+	uchar dst[NUM_VALUES * 4];
+	for(uint i = 0; i < NUM_VALUES * 4; i++)
+		src[i] = VALUES[i / 4].half;
+	PixelConvertFunc func =
+		getPixelConvertFunc(DXGI_R16G16B16A16_FLOAT, BGRAPixelFormat);
+	func(dst, src, NUM_VALUES);
+	for(uint i = 0; i < NUM_VALUES; i++) {
+		check(isFilledWith(&dst[i * 4], 4, VALUES[i].expected),
+			stringf("FP16 %s, 0x%04X: Wrong value", variant.data(),
+			VALUES[i].half));
+	}
+}
+
+/// <summary>
+/// Tests every pair of supported formats with the kernels that the current
+/// feature mask selects.
+/// </summary>
+static void testConvertKernels(uint mask, const string &variant)
+{
+	const uint PIXEL_COUNTS[] = { 257, 1923 };
+	const int NUM_PIXEL_COUNTS =
+		sizeof(PIXEL_COUNTS) / sizeof(PIXEL_COUNTS[0]);
+	const uint MAX_SHORT_ROW = 35;
+	const uint OFFSETS[] = { 0, 1, 3 };
+	const int NUM_OFFSETS = sizeof(OFFSETS) / sizeof(OFFSETS[0]);
+
+	for(int i = 0; i < NUM_SRC_FORMATS; i++) {
+		for(int j = 0; j < NUM_DST_FORMATS; j++) {
+			uint32_t srcFormat = SRC_FORMATS[i].format;
+			uint32_t dstFormat = DST_FORMATS[j].format;
+			string desc = stringf("%s to %s %s", SRC_FORMATS[i].name,
+				DST_FORMATS[j].name, variant.data());
+			PixelConvertFunc func = getPixelConvertFunc(srcFormat, dstFormat);
+			PixelConvertFunc scalarFunc =
+				getScalarConvertFunc(srcFormat, dstFormat, mask);
+			check(func != NULL && scalarFunc != NULL,
+				desc + ": Not supported");
+			if(func == NULL || scalarFunc == NULL)
+				continue;
+			for(int k = 0; k < NUM_OFFSETS; k++) {
+				for(uint n = 0; n <= MAX_SHORT_ROW; n++) {
+					testConvertRow(func, scalarFunc, srcFormat, dstFormat, n,
+						OFFSETS[k], desc);
+				}
+				for(int n = 0; n < NUM_PIXEL_COUNTS; n++) {
+					testConvertRow(func, scalarFunc, srcFormat, dstFormat,
+						PIXEL_COUNTS[n], OFFSETS[k], desc);
+				}
+			}
+		}
+	}
+	testFP16SpecialValues(variant);
+}
+
+/// <summary>
+/// Converts an entire image with `imgConvert()` and verifies every row
+/// against the scalar kernel, the row padding of the destination and the
+/// guard bytes after it.
+/// </summary>
+static void testImgConvert(
+	uint32_t srcFormat, uint32_t dstFormat, uint width, uint height,
+	uint padding, bool flip, const string &variant)
+{
+	string desc = stringf("imgConvert() %s, %ux%u padding=%u flip=%d",
+		variant.data(), width, height, padding, flip ? 1 : 0);
+	uint srcBpp = getPixelFormatBpp(srcFormat);
+	uint srcStride = width * srcBpp + padding;
+	uint dstStride = width * 4 + padding;
+	size_t srcSize = (size_t)srcStride * height;
+	size_t dstSize = (size_t)dstStride * height;
+
+	vector<uchar> srcStorage;
+	vector<uchar> dstStorage;
+	vector<uchar> expected(width * 4);
+	uchar *src = allocAligned(srcStorage, srcSize);
+	uchar *dst = allocAligned(dstStorage, dstSize + GUARD_SIZE);
+	fillPattern(src, srcSize, width + height);
+	memset(dst, GUARD_BYTE, dstSize + GUARD_SIZE);
+
+	check(imgConvert(dst, src, dstStride, srcStride, width, height,
+		srcFormat, dstFormat, flip), desc + ": Failed");
+	PixelConvertFunc scalarFunc =
+		getScalarConvertFunc(srcFormat, dstFormat, ~0U);
+
+	// Identical formats with identical strides may be copied as a single
+	// block, see `testImgCopy()` in main.cpp
+	bool mayWritePadding = (!flip && srcStride == dstStride);
+	bool rowsMatch = true;
+	bool paddingIntact = true;
+	for(uint y = 0; y < height; y++) {
+		uint dstY = flip ? height - 1 - y : y;
+		const uchar *dstRow = dst + (size_t)dstStride * dstY;
+		scalarFunc(&expected[0], src + (size_t)srcStride * y, width);
+		if(memcmp(dstRow, &expected[0], width * 4) != 0)
+			rowsMatch = false;
+		if(mayWritePadding && y + 1 < height)
+			continue;
+		if(!isFilledWith(dstRow + width * 4, padding, GUARD_BYTE))
+			paddingIntact = false;
+	}
+	check(rowsMatch, desc + ": Data mismatch");
+	check(paddingIntact, desc + ": Wrote to row padding");
+	check(isFilledWith(dst + dstSize, GUARD_SIZE, GUARD_BYTE),
+		desc + ": Wrote after the destination");
+}
+
+/// <summary>
+/// Tests whole images in row stripes and as a single stripe. Identical
+/// formats are copied with `imgDataCopy()` instead of a kernel.
+/// </summary>
+static void testImgConvertSizes(const string &variant)
+{
+	struct ImgSize {
+		uint	width;
+		uint	height;
+	};
+	const ImgSize SIZES[] = {
+		{ 1, 1 }, { 7, 3 }, { 67, 19 }, { 1280, 720 }
+	};
+	const int NUM_SIZES = sizeof(SIZES) / sizeof(SIZES[0]);
+	const uint PADDINGS[] = { 0, 4, 68 };
+	const int NUM_PADDINGS = sizeof(PADDINGS) / sizeof(PADDINGS[0]);
+	const ConvertFormat FORMATS[] = {
+		{ "BGRA", BGRAPixelFormat },
+		{ "BGR", BGRPixelFormat },
+		{ "R10G10B10A2_UNORM", DXGI_R10G10B10A2_UNORM },
+		{ "R16G16B16A16_FLOAT", DXGI_R16G16B16A16_FLOAT }
+	};
+	const int NUM_FORMATS = sizeof(FORMATS) / sizeof(FORMATS[0]);
+
+	for(int i = 0; i < NUM_FORMATS; i++) {
+		string desc = stringf("%s to BGRA %s", FORMATS[i].name,
+			variant.data());
+		for(int j = 0; j < NUM_SIZES; j++) {
+			for(int k = 0; k < NUM_PADDINGS; k++) {
+				for(int flip = 0; flip < 2; flip++) {
+					testImgConvert(FORMATS[i].format, BGRAPixelFormat,
+						SIZES[j].width, SIZES[j].height, PADDINGS[k],
+						flip != 0, desc);
+				}
+			}
+		}
+	}
+}
+
+void testPixelConvert()
+{
+	cout << "Testing pixel format conversion..." << endl;
+
+	for(int i = 0; i < NUM_CONVERT_MASKS; i++) {
+		setCpuFeatureMask(CONVERT_MASKS[i].mask);
+		testConvertKernels(CONVERT_MASKS[i].mask, CONVERT_MASKS[i].name);
+	}
+	setCpuFeatureMask(~0U);
+
+	// Unknown formats and planar destinations are rejected
+	uchar px[8] = { 0 };
+	check(!canConvertPixelFormat(BGRAPixelFormat, NV12PixelFormat) &&
+		!imgConvert(px, px, 4, 4, 1, 1, BGRAPixelFormat, NV12PixelFormat),
+		"imgConvert(): Converted to a planar format");
+	check(!canConvertPixelFormat(UnknownPixelFormat, BGRAPixelFormat) &&
+		!imgConvert(px, px, 4, 4, 1, 1, UnknownPixelFormat, BGRAPixelFormat),
+		"imgConvert(): Converted from an unknown format");
+
+	// Single-threaded and split into row stripes
+	size_t prevThreshold = getImgThreadingThreshold();
+	setImgThreadingThreshold(0);
+	testImgConvertSizes("single");
+	setImgThreadingThreshold(1024 * 1024);
+	testImgConvertSizes("threaded");
+	setImgThreadingThreshold(prevThreshold);
+}
+
+//=============================================================================
+// Benchmarks
+
+/// <summary>
+/// Returns the fastest time in microseconds that `imgConvert()` takes for a
+/// single image.
+/// </summary>
+static uint64_t benchConvert(
+	uchar *dst, const uchar *src, uint width, uint height, uint32_t srcFormat)
+{
+	uint srcStride = width * getPixelFormatBpp(srcFormat);
+	uint64_t bestUsec = UINT64_MAX;
+	uint64_t startUsec = getMonotonicUsec();
+	uint64_t nowUsec = startUsec;
+	while(nowUsec - startUsec < BENCH_MIN_USEC) {
+		uint64_t before = getMonotonicUsec();
+		imgConvert(dst, src, width * 4, srcStride, width, height, srcFormat,
+			BGRAPixelFormat);
+		nowUsec = getMonotonicUsec();
+		if(nowUsec - before < bestUsec)
+			bestUsec = nowUsec - before;
+	}
+	return bestUsec;
+}
+
+/// <summary>
+/// Measures the conversion of 1080p and 4K frames to BGRA with every kernel
+/// on a single thread. Throughput is in bytes written.
+/// </summary>
+void benchPixelConvert()
+{
+	struct Resolution {
+		const char *	name;
+		uint			width;
+		uint			height;
+	};
+	const Resolution RESOLUTIONS[] = {
+		{ "1080p", 1920, 1080 },
+		{ "4K", 3840, 2160 }
+	};
+	const int NUM_RESOLUTIONS = sizeof(RESOLUTIONS) / sizeof(RESOLUTIONS[0]);
+	const ConvertFormat FORMATS[] = {
+		{ "BGR", BGRPixelFormat },
+		{ "RGBA", RGBAPixelFormat },
+		{ "R10G10B10A2", DXGI_R10G10B10A2_UNORM },
+		{ "FP16", DXGI_R16G16B16A16_FLOAT }
+	};
+	const int NUM_FORMATS = sizeof(FORMATS) / sizeof(FORMATS[0]);
+	const uint MAX_SRC_BPP = 8;
+
+	const Resolution &maxRes = RESOLUTIONS[NUM_RESOLUTIONS - 1];
+	size_t maxPixels = (size_t)maxRes.width * maxRes.height;
+	vector<uchar> srcStorage;
+	vector<uchar> dstStorage;
+	uchar *src = allocAligned(srcStorage, maxPixels * MAX_SRC_BPP);
+	uchar *dst = allocAligned(dstStorage, maxPixels * 4);
+	fillPattern(src, maxPixels * MAX_SRC_BPP, 0);
+
+	cout << endl << "Pixel conversion to BGRA throughput in GB/s"
+		<< endl;
+	cout << stringf("%-20s", "Source");
+	for(int i = 0; i < NUM_CONVERT_MASKS; i++)
+		cout << stringf("%12s", CONVERT_MASKS[i].name);
+	cout << endl;
+
+	size_t prevThreshold = getImgThreadingThreshold();
+	setImgThreadingThreshold(0);
+	for(int i = 0; i < NUM_RESOLUTIONS; i++) {
+		const Resolution &res = RESOLUTIONS[i];
+		for(int j = 0; j < NUM_FORMATS; j++) {
+			cout << stringf("%-20s", stringf("%s %s", res.name,
+				FORMATS[j].name).data());
+			for(int k = 0; k < NUM_CONVERT_MASKS; k++) {
+				setCpuFeatureMask(CONVERT_MASKS[k].mask);
+				uint64_t usec = benchConvert(dst, src, res.width,
+					res.height, FORMATS[j].format);
+				cout << stringf("%12.2f", calcGBps(
+					(size_t)res.width * 4 * res.height, usec));
+			}
+			cout << endl;
+		}
+	}
+	setImgThreadingThreshold(prevThreshold);
+	setCpuFeatureMask(~0U);
+}
@@ -0,0 +1,778 @@
+//*****************************************************************************
+// Libdeskcap: A high-performance desktop capture library
+//
+// Copyright (C) 2014 Lucas Murray <lucas@polyflare.com>
+// All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation; either version 2 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//*****************************************************************************
+
+#include "tests.h"
+#include "../Common/atomicops.h"
+#include "../Common/capturesharedsegment.h"
+#include "../Common/imghelpers.h"
+#include <boost/chrono.hpp>
+#include <boost/interprocess/sync/interprocess_mutex.hpp>
+#include <boost/thread.hpp>
+
+using boost::interprocess::interprocess_mutex;
+typedef CaptureSharedSegment::RawPixelsExtraData RawPixelsExtraData;
+
+//=============================================================================
+// Helpers
+
+// Segment names that are only used by the tests
+static const uint SEQUENCE_SEGMENT_NAME = 0x7E570001;
+static const uint STRESS_SEGMENT_NAME = 0x7E570002;
+static const uint EVICTION_SEGMENT_NAME = 0x7E570003;
+static const uint CHURN_SEGMENT_NAME = 0x7E570004;
+static const uint BENCH_SEGMENT_NAME = 0x7E570005;
+
+// Size of the frames that the tests write, 32-bit pixels
+static const uint RING_WIDTH = 64;
+static const uint RING_HEIGHT = 32;
+
+// Maximum amount of time that a threaded test waits for the other side
+static const uint64_t RING_DEADLINE_USEC = 10000000; // 10 sec
+
+/// <summary>
+/// Creates a segment of 32-bit frames as a producer. A segment that was left
+/// behind by a previous run that crashed is removed and created again. The
+/// caller must `remove()` and delete the returned object.
+/// </summary>
+static CaptureSharedSegment *createRing(
+	uint name, uint width, uint height, uint numFrames)
+{
+	RawPixelsExtraData extra;
+	extra.format = BGRAPixelFormat;
+	extra.bpp = 4;
+	CaptureSharedSegment *ring =
+		new CaptureSharedSegment(name, width, height, numFrames, extra);
+	if(ring->isCollision()) {
+		ring->remove();
+		delete ring;
+		ring = new CaptureSharedSegment(
+			name, width, height, numFrames, extra);
+	}
+	check(ring->isValid(), stringf("Create %ux%u ring of %u frames: %s",
+		width, height, numFrames, ring->getErrorReason().c_str()));
+	return ring;
+}
+
+static void destroyRing(CaptureSharedSegment *ring)
+{
+	ring->remove();
+	delete ring;
+}
+
+/// <summary>
+/// Fills a frame with content that is unique to `seqNum`. The sequence number
+/// is also stamped at both ends of the frame so that a frame that was
+/// overwritten while it was being read is always detected.
+/// </summary>
+static void makeFrame(uchar *buf, size_t size, uint64_t seqNum)
+{
+	fillPattern(buf, size, (uint)seqNum);
+	memcpy(buf, &seqNum, sizeof(seqNum));
+	memcpy(buf + size - sizeof(seqNum), &seqNum, sizeof(seqNum));
+}
+
+/// <summary>
+/// Writes and publishes the next frame of the producer with its sequence
+/// number as the timestamp.
+/// </summary>
+/// <returns>The frame number or -1 if the ring was full</returns>
+static int publishTestFrame(CaptureSharedSegment *ring, uint64_t seqNum)
+{
+	int frameNum = ring->beginWriteFrame();
+	if(frameNum < 0)
+		return -1;
+	makeFrame((uchar *)ring->getFrameDataPtr(frameNum),
+		RING_WIDTH * RING_HEIGHT * 4, seqNum);
+	if(!ring->publishFrame(frameNum, seqNum, RING_WIDTH, RING_HEIGHT))
+		return -1;
+	return frameNum;
+}
+
+/// <summary>
+/// Returns true if a frame that a reader has acquired is exactly the frame
+/// that `publishTestFrame()` wrote for its timestamp.
+/// </summary>
+static bool isTestFrameIntact(
+	CaptureSharedSegment *ring, uint frameNum, vector<uchar> &expected)
+{
+	size_t size = RING_WIDTH * RING_HEIGHT * 4;
+	expected.resize(size);
+	makeFrame(&expected[0], size, ring->getFrameTimestamp(frameNum));
+	return ring->getFrameWidth(frameNum) == RING_WIDTH &&
+		ring->getFrameHeight(frameNum) == RING_HEIGHT &&
+		memcmp(ring->getFrameDataPtr(frameNum), &expected[0], size) == 0;
+}
+
+/// <summary>
+/// Returns true if every slot of the ring can be written to and published
+/// straight away which is only the case if no reader holds a frame.
+/// </summary>
+static bool isRingWritable(CaptureSharedSegment *ring, uint64_t &seqNum)
+{
+	for(uint i = 0; i < ring->getNumFrames(); i++) {
+		if(publishTestFrame(ring, seqNum++) < 0)
+			return false;
+	}
+	return true;
+}
+
+//=============================================================================
+// Tests
+
+/// <summary>
+/// Steps a producer and two readers through the ring on a single thread and
+/// verifies exactly which slot is used and when the ring is full.
+/// </summary>
+static void testRingSequence(uint numFrames)
+{
+	string desc = stringf("Ring sequence, %u frames", numFrames);
+	CaptureSharedSegment *ring = createRing(
+		SEQUENCE_SEGMENT_NAME, RING_WIDTH, RING_HEIGHT, numFrames);
+	if(!ring->isValid()) {
+		destroyRing(ring);
+		return;
+	}
+	uint64_t size = ring->getSegmentSize();
+	CaptureSharedSegment *readers[2];
+	readers[0] = new CaptureSharedSegment(SEQUENCE_SEGMENT_NAME, size);
+	readers[1] = new CaptureSharedSegment(SEQUENCE_SEGMENT_NAME, size);
+	check(readers[0]->isValid() && readers[1]->isValid() &&
+		ring->getNumActiveReaders() == 2, desc + ": open readers");
+
+	// Claiming a slot twice without publishing returns the same slot
+	int frameNum = ring->beginWriteFrame();
+	check(frameNum == 0 && ring->beginWriteFrame() == 0,
+		desc + ": claim the same slot twice");
+	ring->abortWriteFrame(0);
+
+	// Fill the ring. The producer must wait for the slowest reader.
+	uint64_t seqNum = 1;
+	for(uint i = 0; i < numFrames; i++)
+		publishTestFrame(ring, seqNum++);
+	check(ring->beginWriteFrame() == -1 &&
+		readers[0]->getNumQueuedFrames() == (int)numFrames &&
+		readers[1]->getNumQueuedFrames() == (int)numFrames,
+		desc + ": full ring");
+	frameNum = readers[0]->acquireFrame();
+	readers[0]->releaseFrame(frameNum);
+	check(ring->beginWriteFrame() == -1, desc + ": full for slower reader");
+	frameNum = readers[1]->acquireFrame();
+	readers[1]->releaseFrame(frameNum);
+
+	// Wrap around many times with both readers in lockstep
+	vector<uchar> expected;
+	bool inOrder = true;
+	bool intact = true;
+	for(uint i = 0; i < numFrames * 20; i++) {
+		frameNum = publishTestFrame(ring, seqNum);
+		if(frameNum != (int)((seqNum - 1) % numFrames))
+			inOrder = false;
+		seqNum++;
+		for(int j = 0; j < 2; j++) {
+			frameNum = readers[j]->acquireFrame();
+			if(frameNum < 0) {
+				inOrder = false;
+				continue;
+			}
+			uint64_t expectedSeq = seqNum - numFrames;
+			if(ring->getFrameTimestamp(frameNum) != expectedSeq)
+				inOrder = false;
+			if(!isTestFrameIntact(readers[j], frameNum, expected))
+				intact = false;
+			readers[j]->releaseFrame(frameNum);
+		}
+	}
+	check(inOrder, desc + ": wraparound order");
+	check(intact, desc + ": wraparound content");
+
+	// Frames that don't fit are returned unpublished
+	frameNum = ring->beginWriteFrame();
+	check(frameNum < 0 ||
+		!ring->publishFrame(frameNum, seqNum, RING_WIDTH + 1, RING_HEIGHT),
+		desc + ": reject oversized frame");
+
+	// A segment only has room for a limited number of readers
+	vector<CaptureSharedSegment *> extra;
+	for(uint i = 2; i < CaptureSharedSegment::MAX_READERS; i++) {
+		extra.push_back(
+			new CaptureSharedSegment(SEQUENCE_SEGMENT_NAME, size));
+	}
+	CaptureSharedSegment *tooMany =
+		new CaptureSharedSegment(SEQUENCE_SEGMENT_NAME, size);
+	check(!tooMany->isValid() &&
+		ring->getNumActiveReaders() == CaptureSharedSegment::MAX_READERS,
+		desc + ": reader limit");
+	delete tooMany;
+	for(size_t i = 0; i < extra.size(); i++)
+		delete extra[i];
+
+	// Closed readers return their frames immediately
+	delete readers[0];
+	delete readers[1];
+	check(ring->getNumActiveReaders() == 0 &&
+		isRingWritable(ring, seqNum), desc + ": close readers");
+	destroyRing(ring);
+}
+
+/// <summary>
+/// The state of a reader thread of `testRingStress()`.
+/// </summary>
+struct StressReader {
+	CaptureSharedSegment *	ring;
+	uint64_t				lastSeqNum; // Last frame that the producer writes
+	uint					sleepEvery; // Stall every N frames, 0 = never
+	uint64_t				numReceived;
+	uint64_t				numOutOfOrder;
+	uint64_t				numCorrupt;
+
+	StressReader(CaptureSharedSegment *r, uint64_t last, uint sleep)
+		: ring(r)
+		, lastSeqNum(last)
+		, sleepEvery(sleep)
+		, numReceived(0)
+		, numOutOfOrder(0)
+		, numCorrupt(0)
+	{
+	}
+};
+
+static void stressReaderThread(StressReader *reader)
+{
+	vector<uchar> expected;
+	uint64_t prevSeqNum = 0;
+	uint64_t deadline = getMonotonicUsec() + RING_DEADLINE_USEC;
+	while(prevSeqNum < reader->lastSeqNum && getMonotonicUsec() < deadline) {
+		if(!reader->ring->waitForFrame(10000))
+			continue;
+		int frameNum = reader->ring->acquireFrame();
+		if(frameNum < 0)
+			continue;
+		uint64_t seqNum = reader->ring->getFrameTimestamp(frameNum);
+		if(seqNum != prevSeqNum + 1)
+			reader->numOutOfOrder++;
+		prevSeqNum = seqNum;
+
+		// The producer must not be able to touch the frame while we hold it
+		if(reader->sleepEvery > 0 && seqNum % reader->sleepEvery == 0)
+			boost::this_thread::sleep_for(boost::chrono::microseconds(200));
+		if(!isTestFrameIntact(reader->ring, frameNum, expected))
+			reader->numCorrupt++;
+		reader->ring->releaseFrame(frameNum);
+		reader->numReceived++;
+	}
+}
+
+/// <summary>
+/// Streams frames through a small ring to readers on other threads as fast
+/// as possible. The producer never drops a frame so every reader must receive
+/// every frame in order and untouched.
+/// </summary>
+static void testRingStress(uint numFrames, uint numReaders)
+{
+	const uint64_t NUM_SEQ = 20000;
+	string desc = stringf("Ring stress, %u frames and %u readers", numFrames,
+		numReaders);
+	CaptureSharedSegment *ring = createRing(
+		STRESS_SEGMENT_NAME, RING_WIDTH, RING_HEIGHT, numFrames);
+	if(!ring->isValid()) {
+		destroyRing(ring);
+		return;
+	}
+
+	// Readers register when they are opened so they receive every frame
+	vector<StressReader> readers;
+	for(uint i = 0; i < numReaders; i++) {
+		CaptureSharedSegment *reader = new CaptureSharedSegment(
+			STRESS_SEGMENT_NAME, ring->getSegmentSize());
+		readers.push_back(StressReader(reader, NUM_SEQ, i * 997));
+	}
+	vector<boost::thread *> threads;
+	for(uint i = 0; i < numReaders; i++)
+		threads.push_back(new boost::thread(stressReaderThread, &readers[i]));
+
+	uint64_t numFull = 0;
+	uint64_t seqNum = 1;
+	uint64_t deadline = getMonotonicUsec() + RING_DEADLINE_USEC;
+	while(seqNum <= NUM_SEQ && getMonotonicUsec() < deadline) {
+		if(publishTestFrame(ring, seqNum) >= 0)
+			seqNum++;
+		else {
+			numFull++;
+			boost::this_thread::yield();
+		}
+	}
+	for(uint i = 0; i < numReaders; i++) {
+		threads[i]->join();
+		delete threads[i];
+	}
+
+	check(seqNum > NUM_SEQ, desc + ": producer finished");
+	for(uint i = 0; i < numReaders; i++) {
+		const StressReader &reader = readers[i];
+		check(reader.numReceived == NUM_SEQ && reader.numOutOfOrder == 0 &&
+			reader.numCorrupt == 0, desc + stringf(": reader %u received "
+			"%u, %u out of order, %u corrupt", i, (uint)reader.numReceived,
+			(uint)reader.numOutOfOrder, (uint)reader.numCorrupt));
+		delete reader.ring;
+	}
+	check(numFull > 0, desc + ": producer waited for the readers");
+	check(isRingWritable(ring, seqNum), desc + ": writable afterwards");
+	destroyRing(ring);
+}
+
+/// <summary>
+/// A reader that stops responding while it holds frames must be dropped once
+/// the producer needs its slots and must register again as a new reader the
+/// next time that it looks for a frame.
+/// </summary>
+static void testRingEviction()
+{
+	const uint64_t TIMEOUT_USEC = 20000;
+	string desc = "Ring eviction";
+	CaptureSharedSegment *ring = createRing(
+		EVICTION_SEGMENT_NAME, RING_WIDTH, RING_HEIGHT, 2);
+	if(!ring->isValid()) {
+		destroyRing(ring);
+		return;
+	}
+	ring->setReaderTimeout(TIMEOUT_USEC);
+	uint64_t size = ring->getSegmentSize();
+	CaptureSharedSegment stale(EVICTION_SEGMENT_NAME, size);
+	CaptureSharedSegment alive(EVICTION_SEGMENT_NAME, size);
+	uint32_t prevJoins = ring->getNumReaderJoins();
+	uint prevRegistrations = stale.getNumRegistrations();
+
+	uint64_t seqNum = 1;
+	publishTestFrame(ring, seqNum++);
+	publishTestFrame(ring, seqNum++);
+	alive.releaseAllFrames();
+	check(ring->beginWriteFrame() == -1, desc + ": full before timeout");
+
+	// The responsive reader keeps looking for frames while we wait
+	uint64_t deadline = getMonotonicUsec() + TIMEOUT_USEC * 5;
+	while(getMonotonicUsec() < deadline) {
+		alive.findEarliestFrame();
+		boost::this_thread::sleep_for(boost::chrono::microseconds(1000));
+	}
+	int frameNum = publishTestFrame(ring, seqNum++);
+	check(frameNum >= 0 && ring->getNumActiveReaders() == 1,
+		desc + ": stale reader dropped");
+	check(alive.acquireFrame() == frameNum &&
+		alive.getNumRegistrations() == 1, desc + ": live reader kept");
+	alive.releaseAllFrames();
+
+	// The dropped reader doesn't see anything from before it came back
+	check(stale.findEarliestFrame() == -1 &&
+		stale.getNumRegistrations() == prevRegistrations + 1 &&
+		ring->getNumReaderJoins() == prevJoins + 1 &&
+		ring->getNumActiveReaders() == 2, desc + ": stale reader rejoins");
+	frameNum = publishTestFrame(ring, seqNum++);
+	vector<uchar> expected;
+	int staleFrame = stale.acquireFrame();
+	check(frameNum >= 0 && staleFrame == frameNum &&
+		isTestFrameIntact(&stale, staleFrame, expected),
+		desc + ": rejoined reader receives frames");
+	stale.releaseAllFrames();
+	alive.releaseAllFrames();
+	destroyRing(ring);
+}
+
+/// <summary>
+/// The state of the producer thread of `testRingChurn()`.
+/// </summary>
+struct ChurnProducer {
+	CaptureSharedSegment *	ring;
+	volatile uint32_t		stop;
+	volatile uint32_t		numPublished;
+
+	ChurnProducer(CaptureSharedSegment *r)
+		: ring(r)
+		, stop(0)
+		, numPublished(0)
+	{
+	}
+};
+
+static void churnProducerThread(ChurnProducer *producer)
+{
+	uint64_t seqNum = 1;
+	while(atomicLoad32(&producer->stop) == 0) {
+		if(publishTestFrame(producer->ring, seqNum++) >= 0) {
+			atomicStore32(&producer->numPublished,
+				atomicLoad32(&producer->numPublished) + 1);
+		} else
+			boost::this_thread::yield();
+	}
+}
+
+/// <summary>
+/// Waits until the producer of `testRingChurn()` has published enough frames
+/// to wrap around the ring, it can't if any slot is wedged.
+/// </summary>
+static bool waitForChurnProgress(ChurnProducer &producer)
+{
+	const uint64_t TIMEOUT_USEC = 1000000; // 1 sec
+	uint32_t target = atomicLoad32(&producer.numPublished) +
+		producer.ring->getNumFrames() + 1;
+	uint64_t deadline = getMonotonicUsec() + TIMEOUT_USEC;
+	while(atomicLoad32(&producer.numPublished) < target) {
+		if(getMonotonicUsec() >= deadline)
+			return false;
+
+		// Sleep instead of yielding so that the producer also gets the CPU
+		// on machines with a single core
+		boost::this_thread::sleep_for(boost::chrono::microseconds(100));
+	}
+	return true;
+}
+
+/// <summary>
+/// Readers attach and detach while the producer publishes as fast as it can,
+/// some of them while they hold a frame. Neither registering nor leaving may
+/// put a reader bit on a slot that nobody will clear, this used to wedge the
+/// producer every time that it wrapped back to that slot. The ring must keep
+/// moving while each reader is attached and after it left.
+/// </summary>
+static void testRingChurn()
+{
+	const uint NUM_CHURNS = 3000;
+	string desc = "Ring attach and detach churn";
+	CaptureSharedSegment *ring = createRing(
+		CHURN_SEGMENT_NAME, RING_WIDTH, RING_HEIGHT, 3);
+	if(!ring->isValid()) {
+		destroyRing(ring);
+		return;
+	}
+	uint64_t size = ring->getSegmentSize();
+	ChurnProducer producer(ring);
+	boost::thread thread(churnProducerThread, &producer);
+
+	uint numInvalid = 0;
+	uint numWedged = 0;
+	for(uint i = 0; i < NUM_CHURNS && numWedged == 0; i++) {
+		CaptureSharedSegment *reader =
+			new CaptureSharedSegment(CHURN_SEGMENT_NAME, size);
+		if(!reader->isValid())
+			numInvalid++;
+		else if(i % 3 != 0) {
+			// Receive a few frames, keep the last one if odd
+			for(uint j = 0; j < 4; j++) {
+				if(!reader->waitForFrame(1000000) ||
+					reader->acquireFrame() < 0)
+				{
+					numWedged++;
+					break;
+				}
+				if(j < 3 || i % 3 == 2)
+					reader->releaseAllFrames();
+			}
+		}
+		delete reader;
+		if(!waitForChurnProgress(producer))
+			numWedged++;
+	}
+	atomicStore32(&producer.stop, 1);
+	thread.join();
+
+	uint64_t seqNum = 1;
+	check(numInvalid == 0, desc + ": open readers");
+	check(numWedged == 0, desc + ": producer keeps publishing");
+	check(ring->getNumActiveReaders() == 0 && isRingWritable(ring, seqNum),
+		desc + ": every slot writable afterwards");
+	destroyRing(ring);
+}
+
+void testCaptureRing()
+{
+	cout << "Testing capture frame ring..." << endl;
+	testRingSequence(1);
+	testRingSequence(3);
+	testRingSequence(8);
+	testRingStress(2, 1);
+	testRingStress(3, 3);
+	testRingEviction();
+	testRingChurn();
+}
+
+//=============================================================================
+// Benchmarks
+
+// Each scheme streams frames for this long
+static const uint64_t RING_BENCH_USEC = BENCH_MIN_USEC * 5;
+
+static const uint RING_BENCH_FRAMES = 3;
+
+/// <summary>
+/// Returns the current time with a higher resolution than
+/// `getMonotonicUsec()` as the ring operations take far less than a
+/// microsecond.
+/// </summary>
+static uint64_t getNsec()
+{
+	using namespace boost::chrono;
+	return (uint64_t)duration_cast<nanoseconds>(
+		steady_clock::now().time_since_epoch()).count();
+}
+
+struct RingBenchResult {
+	uint64_t	writeHoldNsec; // Total time holding the lock while writing
+	uint64_t	readHoldNsec; // Total time holding the lock while reading
+	uint64_t	numFrames; // Frames that the consumer received
+
+	RingBenchResult()
+		: writeHoldNsec(0)
+		, readHoldNsec(0)
+		, numFrames(0)
+	{
+	}
+};
+
+/// <summary>
+/// The frame queue of the original design where the producer and the
+/// consumer take a single interprocess mutex and copy a whole frame while
+/// they hold it.
+/// </summary>
+struct MutexFrameQueue {
+	interprocess_mutex	lock;
+	uint				width;
+	uint				height;
+	vector<uchar *>		frames;
+	vector<uint64_t>	timestamps; // 0 = unused
+	volatile uint32_t	stop;
+	RingBenchResult		result;
+	vector<uchar>		storage;
+
+	MutexFrameQueue(uint w, uint h)
+		: lock()
+		, width(w)
+		, height(h)
+		, frames(RING_BENCH_FRAMES, NULL)
+		, timestamps(RING_BENCH_FRAMES, 0)
+		, stop(0)
+		, result()
+		, storage()
+	{
+		size_t frameSize = (size_t)w * h * 4;
+		uchar *data = allocAligned(storage, frameSize * RING_BENCH_FRAMES);
+		memset(data, 0, frameSize * RING_BENCH_FRAMES);
+		for(uint i = 0; i < RING_BENCH_FRAMES; i++)
+			frames[i] = data + frameSize * i;
+	}
+};
+
+static void mutexConsumerThread(MutexFrameQueue *queue, uchar *texture)
+{
+	uint stride = queue->width * 4;
+	while(atomicLoad32(&queue->stop) == 0) {
+		queue->lock.lock();
+		uint64_t startNsec = getNsec();
+		int earliest = -1;
+		for(uint i = 0; i < RING_BENCH_FRAMES; i++) {
+			if(queue->timestamps[i] == 0)
+				continue;
+			if(earliest < 0 ||
+				queue->timestamps[i] < queue->timestamps[earliest])
+			{
+				earliest = (int)i;
+			}
+		}
+		if(earliest >= 0) {
+			imgDataCopy(texture, queue->frames[earliest], stride, stride,
+				stride, queue->height);
+			queue->timestamps[earliest] = 0;
+			queue->result.numFrames++;
+			queue->result.readHoldNsec += getNsec() - startNsec;
+		}
+		queue->lock.unlock();
+		if(earliest < 0)
+			boost::this_thread::yield();
+	}
+}
+
+static void benchMutexQueue(
+	uint width, uint height, uchar *src, uchar *texture,
+	RingBenchResult &resultOut)
+{
+	MutexFrameQueue queue(width, height);
+	boost::thread thread(mutexConsumerThread, &queue, texture);
+	uint stride = width * 4;
+	uint64_t timestamp = 1;
+	uint64_t endUsec = getMonotonicUsec() + RING_BENCH_USEC;
+	while(getMonotonicUsec() < endUsec) {
+		queue.lock.lock();
+		uint64_t startNsec = getNsec();
+		int frameNum = -1;
+		for(uint i = 0; i < RING_BENCH_FRAMES; i++) {
+			if(queue.timestamps[i] == 0) {
+				frameNum = (int)i;
+				break;
+			}
+		}
+		if(frameNum >= 0) {
+			imgDataCopy(queue.frames[frameNum], src, stride, stride, stride,
+				height);
+			queue.timestamps[frameNum] = timestamp++;
+			queue.result.writeHoldNsec += getNsec() - startNsec;
+		}
+		queue.lock.unlock();
+		if(frameNum < 0)
+			boost::this_thread::yield();
+	}
+	atomicStore32(&queue.stop, 1);
+	thread.join();
+	resultOut = queue.result;
+}
+
+/// <summary>
+/// The consumer side of `benchCaptureRing()`. Only the ring operations are
+/// timed as the frame is copied without holding anything that the producer
+/// waits for.
+/// </summary>
+struct RingConsumer {
+	CaptureSharedSegment *	ring;
+	uchar *					texture;
+	volatile uint32_t		stop;
+	uint64_t				holdNsec;
+	uint64_t				numFrames;
+
+	RingConsumer(CaptureSharedSegment *r, uchar *tex)
+		: ring(r)
+		, texture(tex)
+		, stop(0)
+		, holdNsec(0)
+		, numFrames(0)
+	{
+	}
+};
+
+static void ringConsumerThread(RingConsumer *consumer)
+{
+	CaptureSharedSegment *ring = consumer->ring;
+	while(atomicLoad32(&consumer->stop) == 0) {
+		uint64_t startNsec = getNsec();
+		int frameNum = ring->acquireFrame();
+		uint64_t acquireNsec = getNsec() - startNsec;
+		if(frameNum < 0) {
+			boost::this_thread::yield();
+			continue;
+		}
+		uint stride = ring->getFrameStride(frameNum);
+		imgDataCopy(consumer->texture, ring->getFrameDataPtr(frameNum),
+			stride, stride, stride, ring->getFrameHeight(frameNum));
+		startNsec = getNsec();
+		ring->releaseFrame(frameNum);
+		consumer->holdNsec += acquireNsec + getNsec() - startNsec;
+		consumer->numFrames++;
+	}
+}
+
+static void benchRing(
+	uint width, uint height, uchar *src, uchar *texture,
+	RingBenchResult &resultOut)
+{
+	CaptureSharedSegment *ring =
+		createRing(BENCH_SEGMENT_NAME, width, height, RING_BENCH_FRAMES);
+	if(!ring->isValid()) {
+		destroyRing(ring);
+		return;
+	}
+
+	// Don't measure the page faults of the first write to each frame
+	uint64_t deadline = getMonotonicUsec() + RING_DEADLINE_USEC;
+	while(!ring->isPrefaultComplete() && getMonotonicUsec() < deadline)
+		boost::this_thread::sleep_for(boost::chrono::microseconds(1000));
+
+	CaptureSharedSegment *reader = new CaptureSharedSegment(
+		BENCH_SEGMENT_NAME, ring->getSegmentSize());
+	RingConsumer consumer(reader, texture);
+	boost::thread thread(ringConsumerThread, &consumer);
+	uint stride = width * 4;
+	uint64_t timestamp = 1;
+	uint64_t endUsec = getMonotonicUsec() + RING_BENCH_USEC;
+	while(getMonotonicUsec() < endUsec) {
+		uint64_t startNsec = getNsec();
+		int frameNum = ring->beginWriteFrame();
+		uint64_t beginNsec = getNsec() - startNsec;
+		if(frameNum < 0) {
+			boost::this_thread::yield();
+			continue;
+		}
+		imgDataCopy(ring->getFrameDataPtr(frameNum), src, stride, stride,
+			stride, height);
+		startNsec = getNsec();
+		ring->publishFrame(frameNum, timestamp++, width, height);
+		resultOut.writeHoldNsec += beginNsec + getNsec() - startNsec;
+	}
+	atomicStore32(&consumer.stop, 1);
+	thread.join();
+	resultOut.readHoldNsec = consumer.holdNsec;
+	resultOut.numFrames = consumer.numFrames;
+	delete reader;
+	destroyRing(ring);
+}
+
+/// <summary>
+/// Compares the lock-free ring against the mutex scheme that it replaced. The
+/// hold time is how long one side keeps the other waiting for each frame that
+/// the consumer receives.
+/// </summary>
+void benchCaptureRing()
+{
+	struct RingBench {
+		const char *	name;
+		uint			width;
+		uint			height;
+	};
+	const RingBench BENCHES[] = {
+		{ "1080p", 1920, 1080 },
+		{ "4K", 3840, 2160 }
+	};
+	const int NUM_BENCHES = sizeof(BENCHES) / sizeof(BENCHES[0]);
+	const size_t MAX_SIZE = (size_t)3840 * 2160 * 4;
+
+	vector<uchar> srcStorage;
+	vector<uchar> texStorage;
+	uchar *src = allocAligned(srcStorage, MAX_SIZE);
+	uchar *texture = allocAligned(texStorage, MAX_SIZE);
+	fillPattern(src, MAX_SIZE, 0);
+	memset(texture, 0, MAX_SIZE);
+
+	cout << endl << stringf("Capture ring against the legacy mutex queue, "
+		"%u frames of 32-bit pixels", RING_BENCH_FRAMES) << endl;
+	cout << stringf("%-8s%-8s%12s%12s%12s", "Size", "Scheme", "Write usec",
+		"Read usec", "Frames/s") << endl;
+	for(int i = 0; i < NUM_BENCHES; i++) {
+		const RingBench &bench = BENCHES[i];
+		for(int scheme = 0; scheme < 2; scheme++) {
+			RingBenchResult result;
+			if(scheme == 0) {
+				benchMutexQueue(
+					bench.width, bench.height, src, texture, result);
+			} else
+				benchRing(bench.width, bench.height, src, texture, result);
+			uint64_t numFrames = result.numFrames;
+			if(numFrames == 0)
+				numFrames = 1;
+			cout << stringf("%-8s%-8s%12.2f%12.2f%12.1f", bench.name,
+				scheme == 0 ? "Mutex" : "Ring",
+				(double)result.writeHoldNsec / numFrames / 1000.0,
+				(double)result.readHoldNsec / numFrames / 1000.0,
+				(double)result.numFrames * 1000000.0 /
+				(double)RING_BENCH_USEC) << endl;
+		}
+	}
+}
@@ -0,0 +1,428 @@
+//*****************************************************************************
+// Libdeskcap: A high-performance desktop capture library
+//
+// Copyright (C) 2014 Lucas Murray <lucas@polyflare.com>
+// All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation; either version 2 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//*****************************************************************************
+
+#include "tests.h"
+#include "../Common/cpuinfo.h"
+#include "../Common/imghelpers.h"
+#include "../Common/imgscale.h"
+#include <math.h>
+
+//=============================================================================
+// Helpers
+
+struct ScaleSize {
+	uint	srcWidth;
+	uint	srcHeight;
+	uint	dstWidth;
+	uint	dstHeight;
+};
+
+// Box filtered sizes first, the 2x2 box has a SIMD kernel of its own
+static const ScaleSize SCALE_SIZES[] = {
+	{ 2, 2, 1, 1 },
+	{ 64, 48, 32, 24 },
+	{ 90, 60, 30, 20 },
+	{ 96, 64, 32, 32 },
+	{ 1920, 1080, 960, 540 },
+	{ 100, 75, 64, 48 },
+	{ 33, 17, 80, 41 },
+	{ 1, 9, 3, 4 },
+	{ 7, 1, 3, 2 },
+	{ 1920, 1080, 1280, 720 }
+};
+static const int NUM_SCALE_SIZES =
+	sizeof(SCALE_SIZES) / sizeof(SCALE_SIZES[0]);
+
+// Images with 32-bit pixels and tightly packed rows
+struct ScaleImage {
+	vector<uchar>	data;
+	uint			width;
+	uint			height;
+
+	ScaleImage(uint w, uint h)
+		: data((size_t)w * h * 4, GUARD_BYTE), width(w), height(h)
+	{
+	}
+
+	uchar *pixel(uint x, uint y)
+	{
+		return &data[((size_t)y * width + x) * 4];
+	}
+};
+
+static void fillRandom(ScaleImage &img, uint32_t seed)
+{
+	uint32_t state = seed;
+	for(size_t i = 0; i < img.data.size(); i++)
+		img.data[i] = (uchar)nextRandom(state);
+}
+
+static string rectString(const ImgRect &rect)
+{
+	return stringf("(%u,%u %ux%u)", rect.x, rect.y, rect.width, rect.height);
+}
+
+static bool rectContains(const ImgRect &outer, const ImgRect &inner)
+{
+	return inner.x >= outer.x && inner.y >= outer.y &&
+		inner.x + inner.width <= outer.x + outer.width &&
+		inner.y + inner.height <= outer.y + outer.height;
+}
+
+/// <summary>
+/// Calculates the source position of destination pixel `i` in floating
+/// point with the pixel centres aligned.
+/// </summary>
+static void calcReferencePos(
+	uint i, uint srcSize, uint dstSize, uint *posOut, double *weightOut)
+{
+	double centre = ((double)i + 0.5) * srcSize / dstSize - 0.5;
+	if(centre < 0.0)
+		centre = 0.0;
+	uint pos = (uint)floor(centre);
+	double weight = centre - pos;
+	if(srcSize < 2) {
+		pos = 0;
+		weight = 0.0;
+	} else if(pos >= srcSize - 1) {
+		pos = srcSize - 2;
+		weight = 1.0;
+	}
+	*posOut = pos;
+	*weightOut = weight;
+}
+
+/// <summary>
+/// Scales an entire image with a straightforward box or bilinear filter. The
+/// box filter must match exactly while bilinear weights are rounded to 7 bits
+/// by `imgScale()` so the result may differ by a few steps.
+/// </summary>
+static void scaleReference(ScaleImage &dst, ScaleImage &src, bool isBox)
+{
+	for(uint y = 0; y < dst.height; y++) {
+		for(uint x = 0; x < dst.width; x++) {
+			uchar *out = dst.pixel(x, y);
+			if(isBox) {
+				uint fx = src.width / dst.width;
+				uint fy = src.height / dst.height;
+				for(int c = 0; c < 4; c++) {
+					uint sum = 0;
+					for(uint by = 0; by < fy; by++) {
+						for(uint bx = 0; bx < fx; bx++)
+							sum += src.pixel(x * fx + bx, y * fy + by)[c];
+					}
+					out[c] = (uchar)((sum + fx * fy / 2) / (fx * fy));
+				}
+				continue;
+			}
+			uint px, py;
+			double wx, wy;
+			calcReferencePos(x, src.width, dst.width, &px, &wx);
+			calcReferencePos(y, src.height, dst.height, &py, &wy);
+			uint nx = (src.width > 1 ? px + 1 : px);
+			uint ny = (src.height > 1 ? py + 1 : py);
+			for(int c = 0; c < 4; c++) {
+				double top = src.pixel(px, py)[c] * (1.0 - wx) +
+					src.pixel(nx, py)[c] * wx;
+				double bot = src.pixel(px, ny)[c] * (1.0 - wx) +
+					src.pixel(nx, ny)[c] * wx;
+				out[c] = (uchar)(top * (1.0 - wy) + bot * wy + 0.5);
+			}
+		}
+	}
+}
+
+static bool imagesMatch(
+	const ScaleImage &a, const ScaleImage &b, int tolerance)
+{
+	for(size_t i = 0; i < a.data.size(); i++) {
+		if(abs((int)a.data[i] - (int)b.data[i]) > tolerance)
+			return false;
+	}
+	return true;
+}
+
+//=============================================================================
+// Tests
+
+/// <summary>
+/// Scales only `dstRect` from a copy of the source that contains nothing but
+/// `imgScaleSrcRect(dstRect)` surrounded by a border of different pixels.
+/// The result must be identical to the same area of the full image and no
+/// destination pixel outside of the rectangle may be written.
+/// </summary>
+static void testScaleSubRect(
+	ScaleImage &src, const ScaleImage &full, const ImgRect &dstRect,
+	const string &variant)
+{
+	string desc = stringf("%s, dstRect=%s", variant.data(),
+		rectString(dstRect).data());
+	ImgRect srcRect = imgScaleSrcRect(src.width, src.height, full.width,
+		full.height, dstRect);
+	check(rectContains(ImgRect(0, 0, src.width, src.height), srcRect),
+		desc + ": Source rectangle outside of the image");
+
+	// The border is inverted so that reading it changes the result
+	ScaleImage window(srcRect.width + 2, srcRect.height + 2);
+	for(uint y = 0; y < window.height; y++) {
+		for(uint x = 0; x < window.width; x++) {
+			uint sx = srcRect.x + x - 1;
+			uint sy = srcRect.y + y - 1;
+			bool inside = (x > 0 && y > 0 && x <= srcRect.width &&
+				y <= srcRect.height);
+			uchar *px = window.pixel(x, y);
+			if(inside) {
+				memcpy(px, src.pixel(sx, sy), 4);
+				continue;
+			}
+			sx = (sx < src.width ? sx : (x == 0 ? 0 : src.width - 1));
+			sy = (sy < src.height ? sy : (y == 0 ? 0 : src.height - 1));
+			for(int c = 0; c < 4; c++)
+				px[c] = (uchar)~src.pixel(sx, sy)[c];
+		}
+	}
+
+	ScaleImage dst(full.width, full.height);
+	uint dstStride = dst.width * 4;
+	imgScale(dst.pixel(dstRect.x, dstRect.y), window.pixel(1, 1), dstStride,
+		window.width * 4, src.width, src.height, dst.width, dst.height,
+		dstRect, srcRect);
+
+	bool rectMatches = true;
+	bool outsideIntact = true;
+	for(uint y = 0; y < dst.height; y++) {
+		for(uint x = 0; x < dst.width; x++) {
+			ImgRect px(x, y, 1, 1);
+			const uchar *actual = &dst.data[((size_t)y * dst.width + x) * 4];
+			const uchar *expected =
+				&full.data[((size_t)y * full.width + x) * 4];
+			if(rectContains(dstRect, px)) {
+				if(memcmp(actual, expected, 4) != 0)
+					rectMatches = false;
+			} else if(!isFilledWith(actual, 4, GUARD_BYTE))
+				outsideIntact = false;
+		}
+	}
+	check(rectMatches, desc + ": Differs from the full image");
+	check(outsideIntact, desc + ": Wrote outside of the rectangle");
+}
+
+/// <summary>
+/// Changes every pixel of `srcRect` and verifies that every destination
+/// pixel that changed is inside of `imgScaleDstRect(srcRect)`. Dirty
+/// rectangles of scaled frames depend on this.
+/// </summary>
+static void testScaleDirtyRect(
+	const ScaleImage &src, const ScaleImage &full, const ImgRect &srcRect,
+	const string &variant)
+{
+	string desc = stringf("%s, srcRect=%s", variant.data(),
+		rectString(srcRect).data());
+	ImgRect dstRect = imgScaleDstRect(src.width, src.height, full.width,
+		full.height, srcRect);
+	check(rectContains(ImgRect(0, 0, full.width, full.height), dstRect),
+		desc + ": Destination rectangle outside of the image");
+
+	ScaleImage changed = src;
+	for(uint y = srcRect.y; y < srcRect.y + srcRect.height; y++) {
+		for(uint x = srcRect.x; x < srcRect.x + srcRect.width; x++) {
+			uchar *px = changed.pixel(x, y);
+			for(int c = 0; c < 4; c++)
+				px[c] = (uchar)~px[c];
+		}
+	}
+	ScaleImage dst(full.width, full.height);
+	imgScale(&dst.data[0], &changed.data[0], dst.width * 4, src.width * 4,
+		src.width, src.height, dst.width, dst.height);
+
+	bool covered = true;
+	for(uint y = 0; y < dst.height; y++) {
+		for(uint x = 0; x < dst.width; x++) {
+			size_t offset = ((size_t)y * dst.width + x) * 4;
+			if(memcmp(&dst.data[offset], &full.data[offset], 4) != 0 &&
+				!rectContains(dstRect, ImgRect(x, y, 1, 1)))
+			{
+				covered = false;
+			}
+		}
+	}
+	check(covered, desc + stringf(": Changed pixels outside of %s",
+		rectString(dstRect).data()));
+}
+
+/// <summary>
+/// Returns a random rectangle of at least a single pixel within an image.
+/// </summary>
+static ImgRect randomRect(uint width, uint height, uint32_t &state)
+{
+	uint x = nextRandom(state) % width;
+	uint y = nextRandom(state) % height;
+	uint w = 1 + nextRandom(state) % (width - x);
+	uint h = 1 + nextRandom(state) % (height - y);
+	return ImgRect(x, y, w, h);
+}
+
+/// <summary>
+/// Tests a single pair of image sizes with the kernels that the current
+/// feature mask selects. `scalar` is the output of the scalar kernels.
+/// </summary>
+static void testScaleSize(
+	const ScaleSize &size, ScaleImage &src, const ScaleImage &scalar,
+	const string &variant)
+{
+	bool isBox = isImgScaleBox(
+		size.srcWidth, size.srcHeight, size.dstWidth, size.dstHeight);
+	string desc = stringf("imgScale() %s, %ux%u to %ux%u %s", variant.data(),
+		size.srcWidth, size.srcHeight, size.dstWidth, size.dstHeight,
+		isBox ? "box" : "bilinear");
+
+	ScaleImage full(size.dstWidth, size.dstHeight);
+	imgScale(&full.data[0], &src.data[0], full.width * 4, src.width * 4,
+		src.width, src.height, full.width, full.height);
+	check(full.data == scalar.data, desc + ": Differs from the scalar path");
+	ScaleImage reference(size.dstWidth, size.dstHeight);
+	scaleReference(reference, src, isBox);
+	check(imagesMatch(full, reference, isBox ? 0 : 2),
+		desc + ": Differs from the reference");
+
+	// Corners, edges and random rectangles
+	const int NUM_RANDOM_RECTS = 12;
+	uint w = full.width;
+	uint h = full.height;
+	vector<ImgRect> rects;
+	rects.push_back(ImgRect(0, 0, w, h));
+	rects.push_back(ImgRect(0, 0, 1, 1));
+	rects.push_back(ImgRect(w - 1, h - 1, 1, 1));
+	rects.push_back(ImgRect(w - 1, 0, 1, h));
+	rects.push_back(ImgRect(0, h - 1, w, 1));
+	uint32_t state = w * h;
+	for(int i = 0; i < NUM_RANDOM_RECTS; i++)
+		rects.push_back(randomRect(w, h, state));
+	for(size_t i = 0; i < rects.size(); i++)
+		testScaleSubRect(src, full, rects[i], desc);
+
+	rects.clear();
+	rects.push_back(ImgRect(0, 0, 1, 1));
+	rects.push_back(ImgRect(src.width - 1, src.height - 1, 1, 1));
+	for(int i = 0; i < NUM_RANDOM_RECTS; i++)
+		rects.push_back(randomRect(src.width, src.height, state));
+	for(size_t i = 0; i < rects.size(); i++)
+		testScaleDirtyRect(src, full, rects[i], desc);
+}
+
+void testImgScale()
+{
+	cout << "Testing imgScale()..." << endl;
+
+	size_t prevThreshold = getImgThreadingThreshold();
+	for(int i = 0; i < NUM_SCALE_SIZES; i++) {
+		const ScaleSize &size = SCALE_SIZES[i];
+		ScaleImage src(size.srcWidth, size.srcHeight);
+		fillRandom(src, i + 1);
+
+		setImgThreadingThreshold(0);
+		setCpuFeatureMask(0U);
+		ScaleImage scalar(size.dstWidth, size.dstHeight);
+		imgScale(&scalar.data[0], &src.data[0], scalar.width * 4,
+			src.width * 4, src.width, src.height, scalar.width,
+			scalar.height);
+
+		// Single-threaded with every kernel and then split into row
+		// stripes
+		for(int j = 0; j < NUM_FEATURE_MASKS; j++) {
+			setCpuFeatureMask(FEATURE_MASKS[j].mask);
+			testScaleSize(size, src, scalar, FEATURE_MASKS[j].name);
+		}
+		setCpuFeatureMask(~0U);
+		setImgThreadingThreshold(64 * 1024);
+		testScaleSize(size, src, scalar, "threaded");
+	}
+	setImgThreadingThreshold(prevThreshold);
+}
+
+//=============================================================================
+// Benchmarks
+
+/// <summary>
+/// Returns the fastest time in microseconds that `imgScale()` takes for a
+/// single image.
+/// </summary>
+static uint64_t benchScale(
+	uchar *dst, const uchar *src, const ScaleSize &size)
+{
+	uint64_t bestUsec = UINT64_MAX;
+	uint64_t startUsec = getMonotonicUsec();
+	uint64_t nowUsec = startUsec;
+	while(nowUsec - startUsec < BENCH_MIN_USEC) {
+		uint64_t before = getMonotonicUsec();
+		imgScale(dst, src, size.dstWidth * 4, size.srcWidth * 4,
+			size.srcWidth, size.srcHeight, size.dstWidth, size.dstHeight);
+		nowUsec = getMonotonicUsec();
+		if(nowUsec - before < bestUsec)
+			bestUsec = nowUsec - before;
+	}
+	return bestUsec;
+}
+
+/// <summary>
+/// Measures the downscales that producers are most likely to be asked for
+/// with every kernel on a single thread. Throughput is in source bytes.
+/// </summary>
+void benchImgScale()
+{
+	struct ScaleBench {
+		const char *	name;
+		ScaleSize		size;
+	};
+	const ScaleBench BENCHES[] = {
+		{ "4K to 1080p", { 3840, 2160, 1920, 1080 } },
+		{ "1080p to 540p", { 1920, 1080, 960, 540 } },
+		{ "1080p to 720p", { 1920, 1080, 1280, 720 } },
+		{ "1440p to 1080p", { 2560, 1440, 1920, 1080 } }
+	};
+	const int NUM_BENCHES = sizeof(BENCHES) / sizeof(BENCHES[0]);
+	const size_t MAX_SIZE = (size_t)3840 * 2160 * 4;
+
+	vector<uchar> srcStorage;
+	vector<uchar> dstStorage;
+	uchar *src = allocAligned(srcStorage, MAX_SIZE);
+	uchar *dst = allocAligned(dstStorage, MAX_SIZE);
+	fillPattern(src, MAX_SIZE, 0);
+
+	cout << endl << "imgScale() throughput in source GB/s, 32-bit frames"
+		<< endl;
+	cout << stringf("%-16s", "Scale");
+	for(int i = 0; i < NUM_FEATURE_MASKS; i++)
+		cout << stringf("%12s", FEATURE_MASKS[i].name);
+	cout << endl;
+
+	size_t prevThreshold = getImgThreadingThreshold();
+	setImgThreadingThreshold(0);
+	for(int i = 0; i < NUM_BENCHES; i++) {
+		const ScaleSize &size = BENCHES[i].size;
+		cout << stringf("%-16s", BENCHES[i].name);
+		for(int j = 0; j < NUM_FEATURE_MASKS; j++) {
+			setCpuFeatureMask(FEATURE_MASKS[j].mask);
+			uint64_t usec = benchScale(dst, src, size);
+			cout << stringf("%12.2f", calcGBps(
+				(size_t)size.srcWidth * 4 * size.srcHeight, usec));
+		}
+		cout << endl;
+	}
+	setImgThreadingThreshold(prevThreshold);
+	setCpuFeatureMask(~0U);
+}
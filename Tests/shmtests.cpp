@@ -0,0 +1,492 @@
+//*****************************************************************************
+// Libdeskcap: A high-performance desktop capture library
+//
+// Copyright (C) 2014 Lucas Murray <lucas@polyflare.com>
+// All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation; either version 2 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//*****************************************************************************
+
+#include "tests.h"
+#include "../Common/capturesharedsegment.h"
+#include "../Common/imghelpers.h"
+#include "../Common/managedsharedmemory.h"
+
+#ifdef OS_LINUX
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+//=============================================================================
+// Helpers
+
+// Segment name that is only used by the tests
+static const uint FORK_SEGMENT_NAME = 0x7E570010;
+
+// Size of the frames that the round trip tests write, 32-bit pixels
+static const uint FORK_WIDTH = 256;
+static const uint FORK_HEIGHT = 128;
+static const uint FORK_NUM_FRAMES = 3;
+static const uint FORK_NUM_SEQ = 200;
+
+// Maximum amount of time that either process waits for the other
+static const uint FORK_TIMEOUT_USEC = 5000000; // 5 sec
+
+// Exit codes of the consumer process
+enum ForkResult {
+	ForkSuccess = 0,
+	ForkOpenFailed,
+	ForkTimedOut,
+	ForkWrongFrame
+};
+
+/// <summary>
+/// Sends a fixed-size value over a socket to the other process.
+/// </summary>
+template <typename T>
+static bool sendValue(int sock, const T &value)
+{
+	return send(sock, &value, sizeof(value), MSG_NOSIGNAL) ==
+		(ssize_t)sizeof(value);
+}
+
+/// <summary>
+/// Receives a value that was sent with `sendValue()`. Fails if the other
+/// process closed the socket, for example because it crashed.
+/// </summary>
+template <typename T>
+static bool receiveValue(int sock, T &valueOut)
+{
+	return recv(sock, &valueOut, sizeof(valueOut), MSG_WAITALL) ==
+		(ssize_t)sizeof(valueOut);
+}
+
+/// <summary>
+/// Creates a segment of 32-bit frames as a producer. A named segment that was
+/// left behind by a previous run that crashed is removed and created again.
+/// </summary>
+static CaptureSharedSegment *createForkRing(
+	uint name, uint width, uint height)
+{
+	CaptureSharedSegment::RawPixelsExtraData extra;
+	extra.format = BGRAPixelFormat;
+	extra.bpp = 4;
+	CaptureSharedSegment *ring = new CaptureSharedSegment(
+		name, width, height, FORK_NUM_FRAMES, extra);
+	if(ring->isCollision()) {
+		ring->remove();
+		delete ring;
+		ring = new CaptureSharedSegment(
+			name, width, height, FORK_NUM_FRAMES, extra);
+	}
+	check(ring->isValid(), stringf("Create %ux%u segment: %s", width,
+		height, ring->getErrorReason().c_str()));
+	return ring;
+}
+
+/// <summary>
+/// Opens the segment in the consumer process, either by name or from a file
+/// descriptor that the producer sends over `sock`.
+/// </summary>
+static CaptureSharedSegment *openForkRing(int sock, uint name, uint64_t size)
+{
+	if(name != CaptureSharedSegment::ANONYMOUS_NAME)
+		return new CaptureSharedSegment(name, size);
+	int fd = ManagedSharedMemory::receiveFd(sock);
+	if(fd < 0)
+		return NULL;
+	return new CaptureSharedSegment(fd);
+}
+
+/// <summary>
+/// Waits for the consumer process to exit and returns its exit code or -1 if
+/// it didn't exit normally.
+/// </summary>
+static int waitForChild(pid_t pid)
+{
+	int status = 0;
+	if(waitpid(pid, &status, 0) != pid || !WIFEXITED(status))
+		return -1;
+	return WEXITSTATUS(status);
+}
+
+//=============================================================================
+// Tests
+
+/// <summary>
+/// Passes an anonymous segment to ourselves over a socket pair and verifies
+/// that both mappings refer to the same memory.
+/// </summary>
+static void testFdPassing()
+{
+	const uint64_t SEGMENT_SIZE = 64 * 1024;
+	const size_t DATA_SIZE = 4096;
+	string desc = "Descriptor passing";
+	int socks[2];
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, socks) < 0) {
+		check(false, desc + ": create socket pair");
+		return;
+	}
+
+	ManagedSharedMemory *shm = NULL;
+	ManagedSharedMemory *received = NULL;
+	try {
+		shm = new ManagedSharedMemory(NULL, SEGMENT_SIZE);
+		bool isNew = false;
+		uchar *data = (uchar *)shm->getAllocation(
+			shm->getStartOffset(), DATA_SIZE, &isNew);
+		check(data != NULL && isNew && shm->getFd() >= 0,
+			desc + ": create anonymous segment");
+		fillPattern(data, DATA_SIZE, 7);
+
+		check(ManagedSharedMemory::sendFd(socks[0], shm->getFd()),
+			desc + ": send");
+		int fd = ManagedSharedMemory::receiveFd(socks[1]);
+		check(fd >= 0 && fd != shm->getFd(), desc + ": receive");
+		received = new ManagedSharedMemory(fd);
+		uchar *recvData = (uchar *)received->getAllocation(
+			received->getStartOffset(), DATA_SIZE, &isNew);
+		check(received->getSize() == shm->getSize() && recvData != NULL &&
+			!isNew && memcmp(recvData, data, DATA_SIZE) == 0,
+			desc + ": same content");
+		recvData[DATA_SIZE - 1] ^= 0xFF;
+		check(memcmp(recvData, data, DATA_SIZE) == 0,
+			desc + ": writes are shared");
+
+		// Data without a descriptor and a closed peer are both errors
+		sendValue(socks[0], (uchar)0);
+		check(ManagedSharedMemory::receiveFd(socks[1]) == -1,
+			desc + ": no descriptor attached");
+		close(socks[1]);
+		socks[1] = -1;
+		check(!ManagedSharedMemory::sendFd(socks[0], shm->getFd()),
+			desc + ": send to closed peer");
+	} catch(interprocess_exception &ex) {
+		check(false, desc + ": " + ex.what());
+	}
+	delete received;
+	delete shm;
+
+	bool threw = false;
+	try {
+		ManagedSharedMemory invalid(-1);
+	} catch(interprocess_exception &) {
+		threw = true;
+	}
+	check(threw, desc + ": reject invalid descriptor");
+	close(socks[0]);
+	if(socks[1] >= 0)
+		close(socks[1]);
+}
+
+/// <summary>
+/// The consumer process of `testForkRoundTrip()`. Every frame must arrive in
+/// order and unmodified.
+/// </summary>
+static int forkConsumerMain(int sock, uint name, uint64_t size)
+{
+	CaptureSharedSegment *ring = openForkRing(sock, name, size);
+	if(ring == NULL || !ring->isValid())
+		return ForkOpenFailed;
+	sendValue(sock, (uint32_t)1); // Registered as a reader
+
+	size_t frameSize = FORK_WIDTH * 4 * FORK_HEIGHT;
+	vector<uchar> expected(frameSize);
+	int result = ForkSuccess;
+	for(uint i = 1; i <= FORK_NUM_SEQ && result == ForkSuccess; i++) {
+		if(!ring->waitForFrame(FORK_TIMEOUT_USEC)) {
+			result = ForkTimedOut;
+			break;
+		}
+		int frameNum = ring->acquireFrame();
+		fillPattern(&expected[0], frameSize, i);
+		if(frameNum < 0 || ring->getFrameTimestamp(frameNum) != i ||
+			ring->getFrameWidth(frameNum) != FORK_WIDTH ||
+			ring->getFrameHeight(frameNum) != FORK_HEIGHT ||
+			memcmp(ring->getFrameDataPtr(frameNum), &expected[0],
+			frameSize) != 0)
+		{
+			result = ForkWrongFrame;
+		}
+		ring->releaseFrame(frameNum);
+	}
+
+	// Leaving must return our frames to the producer
+	delete ring;
+	return result;
+}
+
+/// <summary>
+/// Streams frames to a consumer in a child process that opens the segment
+/// either by name or from a file descriptor that we pass over a socket.
+/// </summary>
+static void testForkRoundTrip(bool anonymous)
+{
+	string desc = stringf("Fork round trip, %s segment",
+		anonymous ? "anonymous" : "named");
+	uint name = anonymous ?
+		CaptureSharedSegment::ANONYMOUS_NAME : FORK_SEGMENT_NAME;
+	CaptureSharedSegment *ring =
+		createForkRing(name, FORK_WIDTH, FORK_HEIGHT);
+	int socks[2];
+	if(!ring->isValid() || socketpair(AF_UNIX, SOCK_STREAM, 0, socks) < 0) {
+		check(false, desc + ": setup");
+		ring->remove();
+		delete ring;
+		return;
+	}
+
+	uint64_t size = ring->getSegmentSize();
+	pid_t pid = fork();
+	if(pid == 0) {
+		// Don't run any of the parent's cleanup in the child
+		close(socks[0]);
+		_exit(forkConsumerMain(socks[1], name, size));
+	}
+	close(socks[1]);
+	check(pid > 0, desc + ": fork");
+	if(pid < 0) {
+		close(socks[0]);
+		ring->remove();
+		delete ring;
+		return;
+	}
+
+	if(anonymous)
+		check(ring->sendFd(socks[0]), desc + ": send descriptor");
+	uint32_t registered = 0;
+	check(receiveValue(socks[0], registered) &&
+		ring->getNumActiveReaders() == 1, desc + ": consumer registered");
+
+	// The ring is much smaller than the sequence so we must wait for the
+	// consumer to release frames
+	uint64_t deadline = getMonotonicUsec() + FORK_TIMEOUT_USEC;
+	size_t frameSize = FORK_WIDTH * 4 * FORK_HEIGHT;
+	for(uint i = 1; i <= FORK_NUM_SEQ && getMonotonicUsec() < deadline;) {
+		int frameNum = ring->beginWriteFrame();
+		if(frameNum < 0) {
+			usleep(100);
+			continue;
+		}
+		fillPattern((uchar *)ring->getFrameDataPtr(frameNum), frameSize, i);
+		ring->publishFrame(frameNum, i, FORK_WIDTH, FORK_HEIGHT);
+		i++;
+	}
+	int result = waitForChild(pid);
+	check(result == ForkSuccess,
+		desc + stringf(": consumer exited with %d", result));
+	check(ring->getNumActiveReaders() == 0, desc + ": consumer left");
+	close(socks[0]);
+
+	// Removing a named segment prevents new consumers from opening it while
+	// anonymous segments were never reachable by name in the first place
+	ring->remove();
+	if(!anonymous) {
+		CaptureSharedSegment *late = new CaptureSharedSegment(name, size);
+		check(!late->isValid(), desc + ": open after remove");
+		late->remove(); // Opening created an empty segment
+		delete late;
+	}
+	delete ring;
+}
+
+void testShmTransport()
+{
+	cout << "Testing shared memory transport..." << endl;
+	testFdPassing();
+	testForkRoundTrip(true);
+	testForkRoundTrip(false);
+}
+
+//=============================================================================
+// Benchmarks
+
+// Frames are streamed for this long
+static const uint64_t TRANSPORT_BENCH_USEC = BENCH_MIN_USEC * 5;
+
+// What the consumer process of `benchShmTransport()` reports back
+struct TransportStats {
+	uint64_t	numFrames;
+	uint64_t	numSleeps; // Times that the thread blocked in the kernel
+};
+
+/// <summary>
+/// Returns the number of voluntary context switches of the calling thread,
+/// i.e. how often it blocked in a system call.
+/// </summary>
+static uint64_t getNumThreadSleeps()
+{
+	struct rusage usage;
+	if(getrusage(RUSAGE_THREAD, &usage) < 0)
+		return 0;
+	return (uint64_t)usage.ru_nvcsw;
+}
+
+/// <summary>
+/// The consumer process of `benchShmTransport()`. Copies every frame into
+/// private memory like a consumer that uploads it to a texture would until
+/// it receives a frame with a timestamp of zero.
+/// </summary>
+static int transportConsumerMain(int sock)
+{
+	CaptureSharedSegment *ring = openForkRing(
+		sock, CaptureSharedSegment::ANONYMOUS_NAME, 0);
+	if(ring == NULL || !ring->isValid())
+		return ForkOpenFailed;
+	sendValue(sock, (uint32_t)1); // Registered as a reader
+
+	vector<uchar> texture(ring->getMaxWidth() * 4 * ring->getMaxHeight());
+	TransportStats stats;
+	stats.numFrames = 0;
+	stats.numSleeps = 0;
+	uint64_t startSleeps = getNumThreadSleeps();
+	int result = ForkSuccess;
+	for(;;) {
+		if(!ring->waitForFrame(FORK_TIMEOUT_USEC)) {
+			result = ForkTimedOut;
+			break;
+		}
+		int frameNum = ring->acquireFrame();
+		if(frameNum < 0)
+			continue;
+		if(ring->getFrameTimestamp(frameNum) == 0)
+			break;
+		uint rowSize = ring->getFrameWidth(frameNum) * 4;
+		uint stride = ring->getFrameStride(frameNum);
+		const uchar *src = (const uchar *)ring->getFrameDataPtr(frameNum);
+		for(uint y = 0; y < ring->getFrameHeight(frameNum); y++)
+			memcpy(&texture[y * rowSize], src + y * stride, rowSize);
+		ring->releaseFrame(frameNum);
+		stats.numFrames++;
+	}
+	stats.numSleeps = getNumThreadSleeps() - startSleeps;
+	sendValue(sock, stats);
+	delete ring;
+	return result;
+}
+
+/// <summary>
+/// Streams frames to a consumer process as fast as it can receive them.
+/// </summary>
+/// <returns>False if the consumer failed</returns>
+static bool benchTransport(
+	uint width, uint height, const uchar *src, TransportStats &producerOut,
+	TransportStats &consumerOut)
+{
+	CaptureSharedSegment *ring = createForkRing(
+		CaptureSharedSegment::ANONYMOUS_NAME, width, height);
+	int socks[2];
+	if(!ring->isValid() || socketpair(AF_UNIX, SOCK_STREAM, 0, socks) < 0) {
+		delete ring;
+		return false;
+	}
+
+	// Don't measure the page faults of the first write to each frame
+	uint64_t deadline = getMonotonicUsec() + FORK_TIMEOUT_USEC;
+	while(!ring->isPrefaultComplete() && getMonotonicUsec() < deadline)
+		usleep(1000);
+
+	pid_t pid = fork();
+	if(pid == 0) {
+		close(socks[0]);
+		_exit(transportConsumerMain(socks[1]));
+	}
+	close(socks[1]);
+	uint32_t registered = 0;
+	if(pid < 0 || !ring->sendFd(socks[0]) ||
+		!receiveValue(socks[0], registered))
+	{
+		close(socks[0]);
+		if(pid > 0)
+			waitForChild(pid);
+		delete ring;
+		return false;
+	}
+
+	uint stride = width * 4;
+	uint64_t timestamp = 1;
+	uint64_t startSleeps = getNumThreadSleeps();
+	uint64_t endUsec = getMonotonicUsec() + TRANSPORT_BENCH_USEC;
+	bool done = false;
+	while(!done) {
+		// Spin instead of yielding so that we never enter the kernel
+		int frameNum = ring->beginWriteFrame();
+		if(frameNum < 0)
+			continue;
+		done = (getMonotonicUsec() >= endUsec);
+		if(!done) {
+			imgDataCopy(ring->getFrameDataPtr(frameNum), (void *)src,
+				stride, stride, stride, height);
+		}
+		ring->publishFrame(frameNum, done ? 0 : timestamp++, width, height);
+	}
+	producerOut.numFrames = timestamp - 1;
+	producerOut.numSleeps = getNumThreadSleeps() - startSleeps;
+
+	bool received = receiveValue(socks[0], consumerOut);
+	int result = waitForChild(pid);
+	close(socks[0]);
+	delete ring;
+	return received && result == ForkSuccess &&
+		consumerOut.numFrames == producerOut.numFrames;
+}
+
+/// <summary>
+/// Measures the frame rate between two processes and how often each side
+/// blocks in the kernel per frame. Frames are transported without any locks
+/// so the producer never blocks and the consumer only sleeps in
+/// `waitForFrame()` when it has caught up.
+/// </summary>
+void benchShmTransport()
+{
+	struct TransportBench {
+		const char *	name;
+		uint			width;
+		uint			height;
+	};
+	const TransportBench BENCHES[] = {
+		{ "1080p", 1920, 1080 },
+		{ "4K", 3840, 2160 }
+	};
+	const int NUM_BENCHES = sizeof(BENCHES) / sizeof(BENCHES[0]);
+	const size_t MAX_SIZE = (size_t)3840 * 2160 * 4;
+
+	vector<uchar> srcStorage;
+	uchar *src = allocAligned(srcStorage, MAX_SIZE);
+	fillPattern(src, MAX_SIZE, 0);
+
+	cout << endl << stringf("Frame transport to a consumer process over an "
+		"anonymous segment of %u frames", FORK_NUM_FRAMES) << endl;
+	cout << stringf("%-8s%12s%12s%16s%16s", "Size", "Frames/s", "GB/s",
+		"Producer sleeps", "Consumer sleeps") << endl;
+	for(int i = 0; i < NUM_BENCHES; i++) {
+		const TransportBench &bench = BENCHES[i];
+		TransportStats producer;
+		TransportStats consumer;
+		bool ok = benchTransport(
+			bench.width, bench.height, src, producer, consumer);
+		check(ok, stringf("Transport %s frames", bench.name));
+		if(!ok)
+			continue;
+		uint64_t numFrames = (producer.numFrames > 0) ?
+			producer.numFrames : 1;
+		size_t frameSize = (size_t)bench.width * 4 * bench.height;
+		cout << stringf("%-8s%12.1f%12.2f%16.2f%16.2f", bench.name,
+			(double)producer.numFrames * 1000000.0 /
+			(double)TRANSPORT_BENCH_USEC,
+			calcGBps(frameSize * producer.numFrames, TRANSPORT_BENCH_USEC),
+			(double)producer.numSleeps / numFrames,
+			(double)consumer.numSleeps / numFrames) << endl;
+	}
+}
+
+#endif // OS_LINUX
@@ -0,0 +1,92 @@
+//*****************************************************************************
+// Libdeskcap: A high-performance desktop capture library
+//
+// Copyright (C) 2014 Lucas Murray <lucas@polyflare.com>
+// All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation; either version 2 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+//*****************************************************************************
+
+#ifndef TESTS_TESTS_H
+#define TESTS_TESTS_H
+
+#include "../Common/stlhelpers.h"
+
+//=============================================================================
+// Helpers that are shared by every test file, see main.cpp
+
+// Bytes before and after every destination buffer that must never be written
+static const size_t GUARD_SIZE = 64;
+static const uchar GUARD_BYTE = 0xCD;
+
+// Minimum amount of time that each benchmark is repeated for
+static const uint64_t BENCH_MIN_USEC = 200000;
+
+struct FeatureMask {
+	const char *	name;
+	uint			mask;
+};
+
+extern const FeatureMask	FEATURE_MASKS[];
+extern const int			NUM_FEATURE_MASKS;
+
+void		check(bool passed, const string &desc);
+uchar *		allocAligned(vector<uchar> &storage, size_t size);
+void		fillPattern(uchar *buf, size_t size, uint seed);
+uint32_t	nextRandom(uint32_t &state);
+bool		isFilledWith(const uchar *buf, size_t size, uchar value);
+double		calcGBps(size_t bytes, uint64_t usec);
+string		formatSize(size_t size);
+
+//=============================================================================
+// Pixel format conversion, see pixeltests.cpp
+
+void	testPixelConvert();
+void	benchPixelConvert();
+
+//=============================================================================
+// Image scaling, see scaletests.cpp
+
+void	testImgScale();
+void	benchImgScale();
+
+//=============================================================================
+// Frame deduplication, see deduptests.cpp
+
+void	testFrameDedup();
+
+//=============================================================================
+// Capture frame ring, see ringtests.cpp
+
+void	testCaptureRing();
+void	benchCaptureRing();
+
+//=============================================================================
+// Shared memory transport between processes, see shmtests.cpp
+
+#ifdef OS_LINUX
+void	testShmTransport();
+void	benchShmTransport();
+#endif
+
+//=============================================================================
+// Frame codec, see codectests.cpp
+
+void	testFrameCodec();
+void	benchFrameCodec();
+
+//=============================================================================
+// Frame pacing, see pacingtests.cpp
+
+void	testFramePacing();
+void	benchFramePacing();
+
+#endif // TESTS_TESTS_H